@@ -0,0 +1,327 @@
+#include "Config.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+Config		g_config;
+ConfigStore	g_config_store;
+
+// Config file layout:
+//   header: char magic[4] = "QMXC", uint16_t version, uint16_t number of slots
+//   slots:  uint16_t field id, uint8_t payload length, uint8_t payload checksum, payload[capacity]
+// Numbers are stored in the native (little endian) byte order, in 8 byte slots.
+static constexpr char		CONFIG_MAGIC[4]		= { 'Q', 'M', 'X', 'C' };
+// Bump when the layout of the existing slots changes, the file is then recreated with defaults.
+static constexpr uint16_t	CONFIG_VERSION		= 1;
+static constexpr size_t		CONFIG_HEADER_SIZE	= 8;
+static constexpr size_t		SLOT_HEADER_SIZE	= 4;
+static constexpr size_t		NUMBER_CAPACITY		= 8;
+static constexpr size_t		STRING_CAPACITY		= 64;
+
+struct ConfigFieldInfo
+{
+	ConfigField	id;
+	const char *key;
+	size_t		capacity;
+};
+
+// Indexed by ConfigField - 1, defines the order of the slots in the config file.
+static constexpr ConfigFieldInfo g_config_fields[] = {
+	{ ConfigField::TxIQBalanceAmplitudeCorrection,	"tx_iq_balance_amplitude_correction",	NUMBER_CAPACITY },
+	{ ConfigField::TxIQBalancePhaseCorrection,		"tx_iq_balance_phase_correction",		NUMBER_CAPACITY },
+	{ ConfigField::TxPower,							"tx_power",								NUMBER_CAPACITY },
+	{ ConfigField::KeyerMode,						"keyer_mode",							NUMBER_CAPACITY },
+	{ ConfigField::KeyerWpm,						"keyer_wpm",							NUMBER_CAPACITY },
+	{ ConfigField::AmpEnabled,						"amp_enabled",							NUMBER_CAPACITY },
+	{ ConfigField::TxDelay,							"tx_delay",								NUMBER_CAPACITY },
+	{ ConfigField::TxHang,							"tx_hang",								NUMBER_CAPACITY },
+	{ ConfigField::NetworkClient,					"network_client",						NUMBER_CAPACITY },
+	{ ConfigField::NetworkServerName,				"network_server_name",					STRING_CAPACITY },
+	{ ConfigField::NetworkServerPort,				"network_server_port",					NUMBER_CAPACITY },
+};
+static constexpr size_t NUM_CONFIG_FIELDS = sizeof(g_config_fields) / sizeof(g_config_fields[0]);
+static_assert(NUM_CONFIG_FIELDS == size_t(ConfigField::Count) - 1, "g_config_fields out of sync with ConfigField");
+
+static size_t config_slot_offset(size_t idx)
+{
+	size_t offset = CONFIG_HEADER_SIZE;
+	for (size_t i = 0; i < idx; ++ i)
+		offset += SLOT_HEADER_SIZE + g_config_fields[i].capacity;
+	return offset;
+}
+
+static uint8_t config_checksum(const uint8_t *data, size_t len)
+{
+	uint8_t sum = 0x5a;
+	for (size_t i = 0; i < len; ++ i)
+		sum = uint8_t((sum << 1) | (sum >> 7)) ^ data[i];
+	return sum;
+}
+
+template<typename T>
+static size_t encode_number(T value, uint8_t *out)
+{
+	static_assert(sizeof(T) <= NUMBER_CAPACITY, "");
+	memcpy(out, &value, sizeof(T));
+	return sizeof(T);
+}
+
+template<typename T>
+static bool decode_number(const uint8_t *in, size_t len, T &value)
+{
+	if (len != sizeof(T))
+		return false;
+	memcpy(&value, in, sizeof(T));
+	return true;
+}
+
+// Encode a field into out, which is at least the field capacity long. Returns the encoded length.
+static size_t encode_config_field(const Config &config, ConfigField field, uint8_t *out)
+{
+	switch (field) {
+	case ConfigField::TxIQBalanceAmplitudeCorrection:	return encode_number(config.tx_iq_balance_amplitude_correction, out);
+	case ConfigField::TxIQBalancePhaseCorrection:		return encode_number(config.tx_iq_balance_phase_correction, out);
+	case ConfigField::TxPower:							return encode_number(config.tx_power, out);
+	case ConfigField::KeyerMode:						return encode_number(int32_t(config.keyer_mode), out);
+	case ConfigField::KeyerWpm:							return encode_number(int32_t(config.keyer_wpm), out);
+	case ConfigField::AmpEnabled:						return encode_number(uint8_t(config.amp_enabled), out);
+	case ConfigField::TxDelay:							return encode_number(int32_t(config.tx_delay), out);
+	case ConfigField::TxHang:							return encode_number(int32_t(config.tx_hang), out);
+	case ConfigField::NetworkClient:					return encode_number(uint8_t(config.network_client), out);
+	case ConfigField::NetworkServerName:
+	{
+		size_t len = std::min(config.network_server_name.size(), STRING_CAPACITY);
+		memcpy(out, config.network_server_name.data(), len);
+		return len;
+	}
+	case ConfigField::NetworkServerPort:				return encode_number(int32_t(config.network_server_port), out);
+	default:											return 0;
+	}
+}
+
+static bool decode_config_field(Config &config, ConfigField field, const uint8_t *in, size_t len)
+{
+	int32_t i32;
+	uint8_t u8;
+	switch (field) {
+	case ConfigField::TxIQBalanceAmplitudeCorrection:	return decode_number(in, len, config.tx_iq_balance_amplitude_correction);
+	case ConfigField::TxIQBalancePhaseCorrection:		return decode_number(in, len, config.tx_iq_balance_phase_correction);
+	case ConfigField::TxPower:							return decode_number(in, len, config.tx_power);
+	case ConfigField::KeyerMode:		if (! decode_number(in, len, i32)) return false; config.keyer_mode = KeyerMode(i32); return true;
+	case ConfigField::KeyerWpm:			if (! decode_number(in, len, i32)) return false; config.keyer_wpm = i32; return true;
+	case ConfigField::AmpEnabled:		if (! decode_number(in, len, u8)) return false; config.amp_enabled = u8 != 0; return true;
+	case ConfigField::TxDelay:			if (! decode_number(in, len, i32)) return false; config.tx_delay = i32; return true;
+	case ConfigField::TxHang:			if (! decode_number(in, len, i32)) return false; config.tx_hang = i32; return true;
+	case ConfigField::NetworkClient:	if (! decode_number(in, len, u8)) return false; config.network_client = u8 != 0; return true;
+	case ConfigField::NetworkServerName:
+		config.network_server_name.assign((const char*)in, len);
+		return true;
+	case ConfigField::NetworkServerPort:if (! decode_number(in, len, i32)) return false; config.network_server_port = i32; return true;
+	default:							return false;
+	}
+}
+
+std::string Config::serialize() const
+{
+	std::string out;
+	uint8_t     buf[STRING_CAPACITY];
+	for (const ConfigFieldInfo &field : g_config_fields) {
+		size_t len = encode_config_field(*this, field.id, buf);
+		out += field.key;
+		out += '=';
+		char num[64];
+		switch (field.id) {
+		case ConfigField::TxIQBalanceAmplitudeCorrection:
+		case ConfigField::TxIQBalancePhaseCorrection:
+		case ConfigField::TxPower:
+		{
+			double d;
+			memcpy(&d, buf, sizeof(d));
+			snprintf(num, sizeof(num), "%.17g", d);
+			out += num;
+			break;
+		}
+		case ConfigField::AmpEnabled:
+		case ConfigField::NetworkClient:
+			out += buf[0] ? "1" : "0";
+			break;
+		case ConfigField::NetworkServerName:
+			out.append((const char*)buf, len);
+			break;
+		default:
+		{
+			int32_t i;
+			memcpy(&i, buf, sizeof(i));
+			snprintf(num, sizeof(num), "%d", int(i));
+			out += num;
+			break;
+		}
+		}
+		out += '\n';
+	}
+	return out;
+}
+
+void Config::deserialize(const char *str)
+{
+	while (str != nullptr && *str != 0) {
+		const char *eol = strchr(str, '\n');
+		const char *end = eol ? eol : str + strlen(str);
+		const char *eq  = (const char*)memchr(str, '=', end - str);
+		if (eq != nullptr) {
+			std::string key(str, eq - str);
+			std::string value(eq + 1, end);
+			if (! value.empty() && value.back() == '\r')
+				value.pop_back();
+			for (const ConfigFieldInfo &field : g_config_fields)
+				if (key == field.key) {
+					switch (field.id) {
+					case ConfigField::TxIQBalanceAmplitudeCorrection:	this->tx_iq_balance_amplitude_correction = atof(value.c_str()); break;
+					case ConfigField::TxIQBalancePhaseCorrection:		this->tx_iq_balance_phase_correction = atof(value.c_str()); break;
+					case ConfigField::TxPower:							this->tx_power = atof(value.c_str()); break;
+					case ConfigField::KeyerMode:						this->keyer_mode = KeyerMode(atoi(value.c_str())); break;
+					case ConfigField::KeyerWpm:							this->keyer_wpm = atoi(value.c_str()); break;
+					case ConfigField::AmpEnabled:						this->amp_enabled = atoi(value.c_str()) != 0; break;
+					case ConfigField::TxDelay:							this->tx_delay = atoi(value.c_str()); break;
+					case ConfigField::TxHang:							this->tx_hang = atoi(value.c_str()); break;
+					case ConfigField::NetworkClient:					this->network_client = atoi(value.c_str()) != 0; break;
+					case ConfigField::NetworkServerName:				this->network_server_name = value; break;
+					case ConfigField::NetworkServerPort:				this->network_server_port = atoi(value.c_str()); break;
+					default: break;
+					}
+					break;
+				}
+		}
+		str = eol ? eol + 1 : nullptr;
+	}
+	this->validate();
+}
+
+void Config::validate()
+{
+	const Config defaults;
+	auto clamp_or_default = [](auto &value, auto min, auto max, auto def) {
+		if (! (value >= min && value <= max))
+			value = def;
+	};
+	clamp_or_default(tx_iq_balance_amplitude_correction, 0.8, 1.2, defaults.tx_iq_balance_amplitude_correction);
+	clamp_or_default(tx_iq_balance_phase_correction, -15., 15., defaults.tx_iq_balance_phase_correction);
+	clamp_or_default(tx_power, 0., 1., defaults.tx_power);
+	if (keyer_mode != KEYER_MODE_SK && keyer_mode != KEYER_MODE_IAMBIC_A && keyer_mode != KEYER_MODE_IAMBIC_B)
+		keyer_mode = defaults.keyer_mode;
+	clamp_or_default(keyer_wpm, 5, 45, defaults.keyer_wpm);
+	clamp_or_default(tx_delay, 0, 15000, defaults.tx_delay);
+	clamp_or_default(tx_hang, 0, 10000000, defaults.tx_hang);
+	if (network_server_name.size() > STRING_CAPACITY)
+		network_server_name.resize(STRING_CAPACITY);
+	clamp_or_default(network_server_port, 1, 65535, defaults.network_server_port);
+}
+
+bool ConfigStore::open(const std::string &path, Config &config)
+{
+	this->close();
+
+	std::vector<uint8_t> data;
+	if (std::FILE *f = fopen(path.c_str(), "rb"); f != nullptr) {
+		uint8_t buf[4096];
+		for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+			data.insert(data.end(), buf, buf + n);
+		fclose(f);
+	}
+
+	m_stored = 0;
+	bool rewrite = true;
+	if (data.size() >= CONFIG_HEADER_SIZE && memcmp(data.data(), CONFIG_MAGIC, 4) == 0) {
+		uint16_t version, num_slots;
+		memcpy(&version,   data.data() + 4, 2);
+		memcpy(&num_slots, data.data() + 6, 2);
+		if (version == CONFIG_VERSION) {
+			// Older files may have fewer slots, the missing fields keep their defaults.
+			size_t num_fields = std::min<size_t>(num_slots, NUM_CONFIG_FIELDS);
+			for (size_t i = 0; i < num_fields; ++ i) {
+				const ConfigFieldInfo &field  = g_config_fields[i];
+				size_t                 offset = config_slot_offset(i);
+				if (offset + SLOT_HEADER_SIZE + field.capacity > data.size())
+					break;
+				const uint8_t *slot = data.data() + offset;
+				uint16_t id;
+				memcpy(&id, slot, 2);
+				uint8_t len = slot[2];
+				if (id != uint16_t(field.id) || len > field.capacity || config_checksum(slot + SLOT_HEADER_SIZE, len) != slot[3])
+					// Torn or corrupted slot, keep the default.
+					continue;
+				if (decode_config_field(config, field.id, slot + SLOT_HEADER_SIZE, len))
+					m_stored |= field_bit(field.id);
+			}
+			rewrite = num_slots != NUM_CONFIG_FIELDS;
+		}
+	}
+	// A stored value replaced by validate() is not the stored one any more.
+	const Config decoded = config;
+	config.validate();
+	for (const ConfigFieldInfo &field : g_config_fields) {
+		uint8_t before[STRING_CAPACITY], after[STRING_CAPACITY];
+		const size_t len = encode_config_field(decoded, field.id, before);
+		if (len != encode_config_field(config, field.id, after) || memcmp(before, after, len) != 0)
+			m_stored &= ~field_bit(field.id);
+	}
+
+	m_file = fopen(path.c_str(), rewrite ? "w+b" : "r+b");
+	if (m_file == nullptr) {
+		printf("Cannot open config file %s for writing\n", path.c_str());
+		return false;
+	}
+	return rewrite ? this->store_all(config) : true;
+}
+
+void ConfigStore::close()
+{
+	if (m_file != nullptr) {
+		fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+bool ConfigStore::store(const Config &config, ConfigField field)
+{
+	return this->write_slot(config, field, true);
+}
+
+bool ConfigStore::write_slot(const Config &config, ConfigField field, bool set)
+{
+	if (m_file == nullptr || field == ConfigField::Count)
+		return false;
+	size_t  idx = size_t(field) - 1;
+	uint8_t slot[SLOT_HEADER_SIZE + STRING_CAPACITY] = {};
+	// An empty slot does not decode, the field keeps its default when loaded.
+	size_t  len = set ? encode_config_field(config, field, slot + SLOT_HEADER_SIZE) : 0;
+	uint16_t id = uint16_t(field);
+	memcpy(slot, &id, 2);
+	slot[2] = uint8_t(len);
+	slot[3] = config_checksum(slot + SLOT_HEADER_SIZE, len);
+	if (fseek(m_file, long(config_slot_offset(idx)), SEEK_SET) != 0 ||
+		fwrite(slot, 1, SLOT_HEADER_SIZE + g_config_fields[idx].capacity, m_file) != SLOT_HEADER_SIZE + g_config_fields[idx].capacity ||
+		fflush(m_file) != 0)
+		return false;
+	if (set)
+		m_stored |= field_bit(field);
+	return true;
+}
+
+bool ConfigStore::store_all(const Config &config)
+{
+	if (m_file == nullptr)
+		return false;
+	uint8_t header[CONFIG_HEADER_SIZE];
+	memcpy(header, CONFIG_MAGIC, 4);
+	uint16_t version = CONFIG_VERSION, num_slots = uint16_t(NUM_CONFIG_FIELDS);
+	memcpy(header + 4, &version, 2);
+	memcpy(header + 6, &num_slots, 2);
+	if (fseek(m_file, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), m_file) != sizeof(header))
+		return false;
+	for (const ConfigFieldInfo &field : g_config_fields)
+		if (! this->write_slot(config, field.id, (m_stored & field_bit(field.id)) != 0))
+			return false;
+	return true;
+}
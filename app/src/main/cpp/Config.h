@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
 
 #define EXTIO_EXPORTS		1
 #define HWNAME				"ExtIO_Omnia-0.3"
@@ -48,3 +51,125 @@ struct Config
 };
 
 extern Config g_config;
+
+// Identifiers of the persistent config fields. The values are stored in the config file,
+// new fields must only be appended.
+enum class ConfigField : uint16_t {
+	TxIQBalanceAmplitudeCorrection = 1,
+	TxIQBalancePhaseCorrection,
+	TxPower,
+	KeyerMode,
+	KeyerWpm,
+	AmpEnabled,
+	TxDelay,
+	TxHang,
+	NetworkClient,
+	NetworkServerName,
+	NetworkServerPort,
+	Count
+};
+
+// Versioned binary config file. Each field has a fixed slot in the file,
+// thus a single field changed by a CAT command is rewritten in place.
+class ConfigStore
+{
+public:
+	~ConfigStore() { close(); }
+
+	// Open the config file and load it into config. Fields missing in the file or with invalid data
+	// keep their defaults and the config is validated. A missing or incompatible file is recreated.
+	// Returns false if the file could not be opened for writing.
+	bool		open(const std::string &path, Config &config);
+	void		close();
+	bool		is_open() const { return m_file != nullptr; }
+	// The field was read from the file with a valid value, or stored since. False for the fields left at
+	// their defaults, and when no file is open.
+	bool		stored(ConfigField field) const { return m_file != nullptr && (m_stored & field_bit(field)) != 0; }
+
+	// Rewrite a single field in place.
+	bool		store(const Config &config, ConfigField field);
+	// Rewrite the whole file, the fields not stored yet are left empty.
+	bool		store_all(const Config &config);
+
+private:
+	static uint32_t field_bit(ConfigField field) { return 1u << uint32_t(field); }
+	// set: false writes an empty slot.
+	bool		write_slot(const Config &config, ConfigField field, bool set);
+
+	std::FILE  *m_file = nullptr;
+	uint32_t	m_stored = 0;
+};
+
+extern ConfigStore g_config_store;
+
+// Per peer adaptive stream quality, see stream_quality.h.
+// A peer steps one tier down once any signal stays above its degrade limit for degrade_hold_ms,
+// and one tier up once all the signals stay below their recover limits for recover_hold_ms.
+struct StreamQualityConfig
+{
+	// Bit mask of (1 << StreamTier) the server may use. The full IQ tier is always enabled.
+	uint32_t	tiers								= 0xf;
+	// Smoothed ENet round trip time in milliseconds.
+	uint32_t	rtt_degrade_ms						= 300;
+	uint32_t	rtt_recover_ms						= 150;
+	// Packet loss in percent.
+	uint32_t	loss_degrade_percent				= 5;
+	uint32_t	loss_recover_percent				= 1;
+	// Packets waiting in the ENet send queue of the peer.
+	uint32_t	queue_degrade_packets				= 24;
+	uint32_t	queue_recover_packets				= 4;
+	uint32_t	degrade_hold_ms						= 500;
+	uint32_t	recover_hold_ms						= 5000;
+};
+
+// Network server configuration, handed over from the Android service through JNI.
+struct ServerConfig
+{
+	// Local addresses to bind to, one ENet host is created for each of them.
+	// An empty list, an empty string or "*" binds a single dual stack IPv6 host to all interfaces.
+	std::vector<std::string> bind_addresses;
+	int			port								= 1234;
+	// Maximum number of peers per ENet host.
+	int			max_peers							= 32;
+	// Channel 0: IQ stream, channel 1: CAT. At least 2.
+	int			max_channels						= 2;
+	// Path of the persistent Config file. Empty: the Config is not persisted.
+	std::string	config_path;
+	// Numeric multicast address of the LAN IQ fan-out. Empty: IQ is only sent over ENet.
+	std::string	multicast_group;
+	// Zero: port + 1.
+	int			multicast_port						= 0;
+	// 1 keeps the multicast on the local network.
+	int			multicast_ttl						= 1;
+	// Name or local IPv4 address of the interface the multicast is sent from.
+	// Empty: the first bind address if any, else the Wi-Fi interface.
+	std::string	multicast_interface;
+	StreamQualityConfig	stream_quality;
+	// Budget of the IQ blocks queued for a single peer and not handed over to ENet yet.
+	// Once exceeded, the oldest blocks are dropped, so that a slow peer does not hold up memory.
+	int			iq_queue_max_ms						= 250;
+	int			iq_queue_max_bytes					= 256 * 1024;
+	// Length of the IQ history a client may have replayed ahead of the live stream, see CatCommandID::Preroll.
+	// Zero disables it.
+	int			preroll_ms							= 5000;
+	// Directory to record the IQ stream to as WAV files with SigMF metadata. Empty: not recording.
+	std::string	record_dir;
+	// A new recording file is started once the current one reaches this size or duration.
+	int			record_rotate_mb					= 512;
+	int			record_rotate_minutes				= 60;
+	// Length of the IQ history the clients can seek back into and replay. Zero disables the time-shift.
+	int			time_shift_minutes					= 0;
+	// Memory-mapped file the time-shift history is spilled to. Empty: the whole history is kept in RAM.
+	std::string	time_shift_path;
+	// Threads servicing the ENet peers, the streaming thread being one of them. With more than one, each thread
+	// binds hosts of its own to the same ports and the kernel spreads the peers over them. max_peers applies per thread.
+	int			network_threads						= 1;
+	// Relay mode: re-broadcast the stream of this upstream server instead of streaming the radio.
+	// Empty: relay only if Config::network_client is persisted.
+	std::string	relay_server;
+	int			relay_port							= 1234;
+	// Abstract Unix socket handing the shared memory IQ ring to the clients on the same host. Empty: no ring.
+	std::string	local_socket;
+	// Decoders of the CW skimmer, that is signals decoded at once. Zero: no skimmer.
+	int			skimmer_signals						= 0;
+};
@@ -18,6 +18,7 @@
 
 #include <vector>
 #include <cfloat>
+#include <cstring>
 #include <cassert>
 #include <exception>
 #include <stdexcept>
@@ -26,10 +27,11 @@
 
 constexpr double pi = 3.14159265358979323846;
 
-bool Cat::init(libusb_device_handle *handle)
+bool Cat::init(libusb_context *context, libusb_device_handle *handle)
 {
     setFreq(33333333); // Default I/Q ordering
 
+    m_libusb_context       = context;
     m_libusb_device_handle = handle;
     
 #if 0
@@ -53,6 +55,11 @@ bool Cat::init(libusb_device_handle *handle)
     return error.empty();
 }
 
+void Cat::close()
+{
+    m_libusb_device_handle = nullptr;
+}
+
 UsbDeviceDetected match_libusb_descriptor(libusb_device_handle *dev_handle, const UsbDeviceDescriptor &descriptor)
 {
     // does not increase reference counter of dev_handle, don't dereference!
@@ -146,6 +153,13 @@ inline void setLongWord(uint32_t value, char *bytes)
 }
 
 bool Cat::set_freq(int64_t frequency)
+{
+    if (m_state.is_valid(CatCommandID::SetFreq) && m_state.freq == frequency)
+        return skip_redundant_write();
+    return write_freq(frequency);
+}
+
+bool Cat::write_freq(int64_t frequency)
 {
 #if 0
     // PE0FKO, Command 0x32:
@@ -173,15 +187,29 @@ bool Cat::set_freq(int64_t frequency)
     m_serial->write(buf);
     return true;
 #else
-	unsigned int timeout_ms = 100;
-	int transferred;
-    libusb_bulk_transfer(m_libusb_device_handle, 0x01, (unsigned char*)buf, l, &transferred, timeout_ms);
-    return transferred == l;
+    if (m_libusb_device_handle != nullptr) {
+        unsigned int timeout_ms = 100;
+        int transferred = 0;
+        libusb_bulk_transfer(m_libusb_device_handle, 0x01, (unsigned char*)buf, l, &transferred, timeout_ms);
+        if (transferred != l)
+            return false;
+    }
+    m_state.freq = frequency;
+    m_state.set_valid(CatCommandID::SetFreq);
+    return true;
 #endif
 #endif
 }
 
-bool Cat::set_cw_tx_freq(int64_t frequency)
+// Vendor specific control request of the OK1IAK firmware.
+struct CatControlRequest
+{
+    CatCommandID            id;
+    uint8_t                 request;
+    std::vector<uint8_t>    data;
+};
+
+static CatControlRequest cw_tx_freq_request(int64_t frequency)
 {
     // OK1IAK, Command 0x60:
     // -------------
@@ -191,30 +219,24 @@ bool Cat::set_cw_tx_freq(int64_t frequency)
     // the "frequency subtract multiply" are all done in this function. (if enabled in the firmware)
     char   buffer[4];
     setLongWord(uint32_t(floor((double(frequency) * 4. * 2.097152 + 0.5))), buffer);  //   2097152=2^21
-    int retval = libusb_control_transfer(m_libusb_device_handle,
-        LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        0x60 /* REQUEST_SET_CW_TX_FREQ */, 0x700 + 0x55, 0,
-        (unsigned char*)buffer, sizeof(buffer), 500);
-    return retval == 4;
+    return { CatCommandID::SetCWTxFreq, 0x60 /* REQUEST_SET_CW_TX_FREQ */, std::vector<uint8_t>(buffer, buffer + 4) };
 }
 
-bool Cat::set_cw_keyer_speed(int wpm)
+static int clamp_keyer_speed(int wpm)
+{
+    return wpm < 5 ? 5 : wpm > 45 ? 45 : wpm;
+}
+
+static CatControlRequest cw_keyer_speed_request(int wpm)
 {
     // OK1IAK, Command 0x65:
     // Set keyer speed, in ms per dot.
-    if (wpm < 5)
-        wpm = 5;
-    else if (wpm > 45)
-        wpm = 45;
+    wpm = clamp_keyer_speed(wpm);
     unsigned char ms_per_dot = (unsigned char)(60000.f / (float(wpm) * 50.f) + 0.5f);
-    int retval = libusb_control_transfer(m_libusb_device_handle,
-        LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        0x65 /* REQUEST_SET_CW_KEYER_SPEED */, 0x700 + 0x55, 0,
-        &ms_per_dot, 1, 500);
-    return retval == 1;
+    return { CatCommandID::SetCWKeyerSpeed, 0x65 /* REQUEST_SET_CW_KEYER_SPEED */, { ms_per_dot } };
 }
 
-bool Cat::set_cw_keyer_mode(KeyerMode keyer_mode)
+static CatControlRequest cw_keyer_mode_request(KeyerMode keyer_mode)
 {
     // OK1IAK, Command 0x66:
     // Set keyer mode.
@@ -224,16 +246,12 @@ bool Cat::set_cw_keyer_mode(KeyerMode keyer_mode)
     case KEYER_MODE_IAMBIC_A:                            break;
     case KEYER_MODE_IAMBIC_B:    umode += IAMBIC_MODE_B; break;
     }
-    int retval = libusb_control_transfer(m_libusb_device_handle,
-        LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        0x66 /* REQUEST_SET_CW_KEYER_MODE */, 0x700 + 0x55, 0,
-        &umode, 1, 500);
-    return retval == 1;
+    return { CatCommandID::SetKeyerMode, 0x66 /* REQUEST_SET_CW_KEYER_MODE */, { umode } };
 }
 
 // Delay of the dit sent after dit played, to avoid hot switching of the AMP relay, in microseconds. Maximum time is 15ms.
 // Relay hang after the last dit, in microseconds. Maximum time is 10 seconds.
-bool Cat::set_amp_control(bool enabled, int delay, int hang)
+static CatControlRequest amp_control_request(bool enabled, int delay, int hang)
 {
     // OK1IAK, Command 0x67: CMD_SET_AMP_SEQUENCING
     // Convert delay value to 0.5ms time intervals.
@@ -249,19 +267,15 @@ bool Cat::set_amp_control(bool enabled, int delay, int hang)
         hang = 10000000;
     hang = (hang + 250) / 500;
     // Form the packet.
-    unsigned char buffer[4];
+    std::vector<uint8_t> buffer(4);
     buffer[0] = enabled;
     buffer[1] = delay;
     buffer[2] = hang >> 8;
     buffer[3] = hang & 0x0ff;
-    int retval = libusb_control_transfer(m_libusb_device_handle,
-        LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        0x67 /* CMD_SET_AMP_SEQUENCING */, 0x700 + 0x55, 0,
-        (unsigned char*)buffer, sizeof(buffer), 500);
-    return retval == 4;
+    return { CatCommandID::SetAMPControl, 0x67 /* CMD_SET_AMP_SEQUENCING */, std::move(buffer) };
 }
 
-bool Cat::setIQBalanceAndPower(double phase_balance_deg, double amplitude_balance, double power)
+static CatControlRequest iq_balance_and_power_request(double phase_balance_deg, double amplitude_balance, double power)
 {
     // Allocate 9ms of 96x IQ samples. This buffer represents 4ms of raise, 1ms of steady and 4ms of fall.
     std::vector<int16_t> buffer(96 * 2 * 9, 0);
@@ -291,11 +305,253 @@ bool Cat::setIQBalanceAndPower(double phase_balance_deg, double amplitude_balanc
     char     *data = (char*)buffer.data();
     for (size_t i = 0; i < len; i += 2)
         std::swap(data[i], data[i + 1]);
+    return { CatCommandID::SetIQBalanceAndPower, 0x69 /* CMD_SET_CW_IQ_WAVEFORM */, std::vector<uint8_t>(data, data + len) };
+}
+
+// Copy a single setting identified by id from src to dst and mark it valid.
+static void copy_cat_state_field(CatState &dst, const CatState &src, CatCommandID id)
+{
+    switch (id) {
+    case CatCommandID::SetFreq:                 dst.freq = src.freq; break;
+    case CatCommandID::SetCWTxFreq:             dst.cw_tx_freq = src.cw_tx_freq; break;
+    case CatCommandID::SetCWKeyerSpeed:         dst.keyer_speed = src.keyer_speed; break;
+    case CatCommandID::SetKeyerMode:            dst.keyer_mode = src.keyer_mode; break;
+    case CatCommandID::SetAMPControl:
+        dst.amp_enabled = src.amp_enabled;
+        dst.amp_delay   = src.amp_delay;
+        dst.amp_hang    = src.amp_hang;
+        break;
+    case CatCommandID::SetIQBalanceAndPower:
+        dst.phase_balance_deg = src.phase_balance_deg;
+        dst.amplitude_balance = src.amplitude_balance;
+        dst.power             = src.power;
+        break;
+    default:
+        return;
+    }
+    dst.set_valid(id);
+}
+
+bool Cat::send_control_request(const CatControlRequest &request)
+{
     int retval = libusb_control_transfer(m_libusb_device_handle,
         LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
-        0x69 /* CMD_SET_CW_IQ_WAVEFORM */, 0x700 + 0x55, 0,
-        (unsigned char*)data, len, 500);
-    return retval == len;
+        request.request, 0x700 + 0x55, 0,
+        const_cast<unsigned char*>(request.data.data()), uint16_t(request.data.size()), 500);
+    return retval == int(request.data.size());
+}
+
+bool Cat::set_cw_tx_freq(int64_t frequency)
+{
+    if (m_state.is_valid(CatCommandID::SetCWTxFreq) && m_state.cw_tx_freq == frequency)
+        return skip_redundant_write();
+    if (online() && ! send_control_request(cw_tx_freq_request(frequency)))
+        return false;
+    m_state.cw_tx_freq = frequency;
+    m_state.set_valid(CatCommandID::SetCWTxFreq);
+    return true;
+}
+
+bool Cat::set_cw_keyer_speed(int wpm)
+{
+    if (m_state.is_valid(CatCommandID::SetCWKeyerSpeed) && m_state.keyer_speed == clamp_keyer_speed(wpm))
+        return skip_redundant_write();
+    if (online() && ! send_control_request(cw_keyer_speed_request(wpm)))
+        return false;
+    m_state.keyer_speed = clamp_keyer_speed(wpm);
+    m_state.set_valid(CatCommandID::SetCWKeyerSpeed);
+    return true;
+}
+
+bool Cat::set_cw_keyer_mode(KeyerMode keyer_mode)
+{
+    if (m_state.is_valid(CatCommandID::SetKeyerMode) && m_state.keyer_mode == keyer_mode)
+        return skip_redundant_write();
+    if (online() && ! send_control_request(cw_keyer_mode_request(keyer_mode)))
+        return false;
+    m_state.keyer_mode = keyer_mode;
+    m_state.set_valid(CatCommandID::SetKeyerMode);
+    return true;
+}
+
+bool Cat::set_amp_control(bool enabled, int delay, int hang)
+{
+    if (m_state.is_valid(CatCommandID::SetAMPControl) && m_state.amp_enabled == enabled &&
+        m_state.amp_delay == delay && m_state.amp_hang == hang)
+        return skip_redundant_write();
+    if (online() && ! send_control_request(amp_control_request(enabled, delay, hang)))
+        return false;
+    m_state.amp_enabled = enabled;
+    m_state.amp_delay   = delay;
+    m_state.amp_hang    = hang;
+    m_state.set_valid(CatCommandID::SetAMPControl);
+    return true;
+}
+
+bool Cat::setIQBalanceAndPower(double phase_balance_deg, double amplitude_balance, double power)
+{
+    if (m_state.is_valid(CatCommandID::SetIQBalanceAndPower) && m_state.phase_balance_deg == phase_balance_deg &&
+        m_state.amplitude_balance == amplitude_balance && m_state.power == power)
+        return skip_redundant_write();
+    if (online() && ! send_control_request(iq_balance_and_power_request(phase_balance_deg, amplitude_balance, power)))
+        return false;
+    m_state.phase_balance_deg = phase_balance_deg;
+    m_state.amplitude_balance = amplitude_balance;
+    m_state.power             = power;
+    m_state.set_valid(CatCommandID::SetIQBalanceAndPower);
+    return true;
+}
+
+// Asynchronous control transfer of a batch, see Cat::push_settings().
+struct CatBatchTransfer
+{
+    CatCommandID            id;
+    std::vector<uint8_t>    buffer;
+    libusb_transfer        *transfer    = nullptr;
+    bool                    ok          = false;
+    // Submitted and the callback did not run yet.
+    bool                    in_flight   = false;
+    // Shared by all transfers of the batch: number of transfers still in flight.
+    int                    *pending     = nullptr;
+    // Shared by all transfers of the batch: set when the last transfer completed.
+    int                    *completed   = nullptr;
+};
+
+static void LIBUSB_CALL cat_batch_transfer_callback(libusb_transfer *transfer)
+{
+    CatBatchTransfer *batch = static_cast<CatBatchTransfer*>(transfer->user_data);
+    batch->in_flight = false;
+    batch->ok = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length == int(batch->buffer.size() - LIBUSB_CONTROL_SETUP_SIZE);
+    if (-- *batch->pending == 0)
+        *batch->completed = 1;
+}
+
+bool Cat::push_settings(const CatState &settings)
+{
+    if (! online()) {
+        // Recorded only, restore_state() applies them once the radio is back.
+        for (CatCommandID id : { CatCommandID::SetFreq, CatCommandID::SetCWTxFreq, CatCommandID::SetCWKeyerSpeed,
+                CatCommandID::SetKeyerMode, CatCommandID::SetAMPControl, CatCommandID::SetIQBalanceAndPower })
+            if (settings.is_valid(id))
+                copy_cat_state_field(m_state, settings, id);
+        return true;
+    }
+
+    std::vector<CatControlRequest> requests;
+    if (settings.is_valid(CatCommandID::SetCWTxFreq))
+        requests.emplace_back(cw_tx_freq_request(settings.cw_tx_freq));
+    if (settings.is_valid(CatCommandID::SetCWKeyerSpeed))
+        requests.emplace_back(cw_keyer_speed_request(settings.keyer_speed));
+    if (settings.is_valid(CatCommandID::SetKeyerMode))
+        requests.emplace_back(cw_keyer_mode_request(settings.keyer_mode));
+    if (settings.is_valid(CatCommandID::SetAMPControl))
+        requests.emplace_back(amp_control_request(settings.amp_enabled, settings.amp_delay, settings.amp_hang));
+    if (settings.is_valid(CatCommandID::SetIQBalanceAndPower))
+        requests.emplace_back(iq_balance_and_power_request(settings.phase_balance_deg, settings.amplitude_balance, settings.power));
+
+    bool ok = true;
+    // The frequency is set through the CAT serial interface, not a control request.
+    // Always written, the radio may have lost its state.
+    if (settings.is_valid(CatCommandID::SetFreq))
+        ok &= write_freq(settings.freq);
+
+    if (m_libusb_context == nullptr) {
+        // No event loop to wait for asynchronous transfers, send one by one.
+        for (const CatControlRequest &request : requests)
+            if (send_control_request(request))
+                copy_cat_state_field(m_state, settings, request.id);
+            else
+                ok = false;
+        return ok;
+    }
+
+    // Submit all control transfers at once, so that the radio receives them back to back
+    // in a single pass instead of one round trip per setting.
+    std::vector<CatBatchTransfer> batch(requests.size());
+    int pending   = 0;
+    int completed = 0;
+    for (size_t i = 0; i < requests.size(); ++ i) {
+        const CatControlRequest &request = requests[i];
+        CatBatchTransfer        &xfr     = batch[i];
+        xfr.id        = request.id;
+        xfr.pending   = &pending;
+        xfr.completed = &completed;
+        xfr.buffer.assign(LIBUSB_CONTROL_SETUP_SIZE, 0);
+        xfr.buffer.insert(xfr.buffer.end(), request.data.begin(), request.data.end());
+        libusb_fill_control_setup(xfr.buffer.data(),
+            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+            request.request, 0x700 + 0x55, 0, uint16_t(request.data.size()));
+        xfr.transfer = libusb_alloc_transfer(0);
+        if (xfr.transfer == nullptr) {
+            ok = false;
+            continue;
+        }
+        libusb_fill_control_transfer(xfr.transfer, m_libusb_device_handle, xfr.buffer.data(), cat_batch_transfer_callback, &xfr, 500);
+        if (libusb_submit_transfer(xfr.transfer) == 0) {
+            xfr.in_flight = true;
+            ++ pending;
+        } else
+            ok = false;
+    }
+    if (pending == 0)
+        completed = 1;
+    // Each transfer times out after 500ms, thus the loop terminates.
+    while (! completed)
+        if (int rc = libusb_handle_events_completed(m_libusb_context, &completed); rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            // The transfers in flight point to the batch and the counters on this stack frame, cancel them and
+            // keep handling the events until all their callbacks ran.
+            printf("Cat::push_settings: handling the USB events failed: %s\n", libusb_error_name(rc));
+            for (CatBatchTransfer &xfr : batch)
+                if (xfr.in_flight)
+                    libusb_cancel_transfer(xfr.transfer);
+            while (! completed)
+                libusb_handle_events_completed(m_libusb_context, &completed);
+        }
+
+    for (CatBatchTransfer &xfr : batch) {
+        if (xfr.ok)
+            copy_cat_state_field(m_state, settings, xfr.id);
+        else
+            ok = false;
+        if (xfr.transfer != nullptr)
+            libusb_free_transfer(xfr.transfer);
+    }
+    return ok;
+}
+
+bool Cat::apply_config(const Config &config, const ConfigStore &store)
+{
+    CatState settings;
+    if (store.stored(ConfigField::KeyerWpm)) {
+        settings.keyer_speed = config.keyer_wpm;
+        settings.set_valid(CatCommandID::SetCWKeyerSpeed);
+    }
+    if (store.stored(ConfigField::KeyerMode)) {
+        settings.keyer_mode = config.keyer_mode;
+        settings.set_valid(CatCommandID::SetKeyerMode);
+    }
+    // A single request sets all the fields of these groups, thus all of them have to be stored.
+    if (store.stored(ConfigField::AmpEnabled) && store.stored(ConfigField::TxDelay) && store.stored(ConfigField::TxHang)) {
+        settings.amp_enabled = config.amp_enabled;
+        settings.amp_delay   = config.tx_delay;
+        settings.amp_hang    = config.tx_hang;
+        settings.set_valid(CatCommandID::SetAMPControl);
+    }
+    if (store.stored(ConfigField::TxIQBalancePhaseCorrection) && store.stored(ConfigField::TxIQBalanceAmplitudeCorrection) &&
+        store.stored(ConfigField::TxPower)) {
+        settings.phase_balance_deg = config.tx_iq_balance_phase_correction;
+        settings.amplitude_balance = config.tx_iq_balance_amplitude_correction;
+        settings.power             = config.tx_power;
+        settings.set_valid(CatCommandID::SetIQBalanceAndPower);
+    }
+    return push_settings(settings);
+}
+
+bool Cat::restore_state()
+{
+    // Copy, push_settings() updates m_state.
+    return push_settings(CatState(m_state));
 }
 
 /*
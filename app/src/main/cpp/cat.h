@@ -30,6 +30,7 @@
 #include <libusb.h>
 
 #include "Config.h"
+#include "cat_protocol.h"
 
 struct UsbDeviceDescriptor {
     std::uint16_t      vendor_id;
@@ -86,34 +87,18 @@ std::vector<UsbDeviceDetected> find_libusb_devices(
 #define IAMBIC_AUTOSPACE    (1 << 2)
 #define IAMBIC_RST_N        (1 << 7)
 
-enum class CatCommandID : uint16_t {
-    // Set local oscillator frequency in Hz.
-    // int64_t frequency
-    SetFreq,
-    // Set the CW TX frequency in Hz.
-    // int64_t frequency
-    SetCWTxFreq,
-    // Set the CW keyer speed in Words per Minute.
-    // Limited to <5, 45>
-    // uint8_t
-    SetCWKeyerSpeed,
-    // KeyerMode mode
-    // uint8_t
-    SetKeyerMode,
-    // Delay of the dit sent after dit played, to avoid hot switching of the AMP relay, in microseconds. Maximum time is 15ms.
-    // Relay hang after the last dit, in microseconds. Maximum time is 10 seconds.
-    // bool enabled, uint32_t delay, uint32_t hang
-    SetAMPControl,
-    // CW phase & amplitude balance and output power.
-    // double phase_balance_deg, double amplitude_balance, double power
-    SetIQBalanceAndPower,
-};
+struct CatControlRequest;
 
 class Cat {
 public:
     Cat() {}
     ~Cat() {}
-    bool init(libusb_device_handle *handle);
+    // The context is used to wait for the batched asynchronous control transfers of push_settings().
+    bool init(libusb_context *context, libusb_device_handle *handle);
+    // The radio was closed. Until init() with the reopened handle, the settings only update the state,
+    // restore_state() applies them to the radio then.
+    void close();
+    bool online() const { return m_libusb_device_handle != nullptr; }
 
     const std::string get_error() const { return error; }
     std::string error;
@@ -133,6 +118,18 @@ public:
 
     bool setIQBalanceAndPower(double phase_balance_deg, double amplitude_balance, double power);
 
+    const CatState& state() const { return m_state; }
+    // Number of client writes skipped, because the value was already applied to the radio.
+    uint64_t redundant_writes_skipped() const { return m_redundant_writes_skipped; }
+    // Send all the valid settings to the radio in a single pass of asynchronous control transfers.
+    // Settings applied successfully are recorded in the state. Returns false if any setting failed.
+    bool push_settings(const CatState &settings);
+    // Send the settings the configuration file holds to the radio, after the radio was opened.
+    // The settings left at their defaults keep the values the radio has.
+    bool apply_config(const Config &config, const ConfigStore &store);
+    // Send all the settings recorded in the state to the radio, after the radio reconnected.
+    bool restore_state();
+
 private:
 //    int findPeaberryDevice();
     std::string readUsbString(struct usb_dev_handle *udh, uint8_t iDesc);
@@ -149,6 +146,13 @@ private:
     int64_t rit = 0;
     bool    transmitOK = false;
 
+    CatState m_state;
+    uint64_t m_redundant_writes_skipped = 0;
+
+    bool skip_redundant_write() { ++ m_redundant_writes_skipped; return true; }
+    // Write the frequency to the radio unconditionally.
+    bool write_freq(int64_t frequency);
+
     void start();
     void stop();
     void setFreq(int64_t f) { freq = f; requestedFreq = f + rit; approveTransmit(); }
@@ -158,6 +162,8 @@ private:
 private:
     void doWork();
     void approveTransmit();
+    // Synchronous vendor control transfer.
+    bool send_control_request(const CatControlRequest &request);
 };
 
 extern Cat g_Cat;
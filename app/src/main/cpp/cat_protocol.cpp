@@ -0,0 +1,55 @@
+#include "cat_protocol.h"
+
+#include <cassert>
+#include <cstring>
+
+// Little endian, packed, see CatCommandID::StateSnapshot.
+void CatState::write_snapshot(uint8_t *data) const
+{
+    uint8_t *p = data;
+    auto put = [&p](const void *src, size_t len) { memcpy(p, src, len); p += len; };
+    const uint8_t  keyer    = uint8_t(keyer_speed);
+    const uint8_t  mode     = uint8_t(keyer_mode);
+    const uint8_t  amp      = amp_enabled;
+    const int32_t  delay    = amp_delay;
+    const int32_t  hang     = amp_hang;
+    put(&valid,             4);
+    put(&freq,              8);
+    put(&cw_tx_freq,        8);
+    put(&keyer,             1);
+    put(&mode,              1);
+    put(&amp,               1);
+    put(&delay,             4);
+    put(&hang,              4);
+    put(&phase_balance_deg, 8);
+    put(&amplitude_balance, 8);
+    put(&power,             8);
+    assert(p == data + snapshot_size);
+}
+
+bool CatState::read_snapshot(const uint8_t *data, size_t len)
+{
+    if (len < snapshot_size)
+        return false;
+    const uint8_t *p = data;
+    auto get = [&p](void *dst, size_t len) { memcpy(dst, p, len); p += len; };
+    uint8_t  keyer, mode, amp;
+    int32_t  delay, hang;
+    get(&valid,             4);
+    get(&freq,              8);
+    get(&cw_tx_freq,        8);
+    get(&keyer,             1);
+    get(&mode,              1);
+    get(&amp,               1);
+    get(&delay,             4);
+    get(&hang,              4);
+    get(&phase_balance_deg, 8);
+    get(&amplitude_balance, 8);
+    get(&power,             8);
+    keyer_speed = keyer;
+    keyer_mode  = KeyerMode(mode);
+    amp_enabled = amp != 0;
+    amp_delay   = delay;
+    amp_hang    = hang;
+    return true;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Config.h"
+
+// Wire protocol of the server, shared by the server and the clients: channel 0 carries the IQ stream,
+// channel 1 carries the CAT commands, each starting with its CatCommandID, followed by the payload, little endian.
+
+enum class CatCommandID : uint16_t {
+    // Set local oscillator frequency in Hz.
+    // int64_t frequency
+    SetFreq,
+    // Set the CW TX frequency in Hz.
+    // int64_t frequency
+    SetCWTxFreq,
+    // Set the CW keyer speed in Words per Minute.
+    // Limited to <5, 45>
+    // uint8_t
+    SetCWKeyerSpeed,
+    // KeyerMode mode
+    // uint8_t
+    SetKeyerMode,
+    // Delay of the dit sent after dit played, to avoid hot switching of the AMP relay, in microseconds. Maximum time is 15ms.
+    // Relay hang after the last dit, in microseconds. Maximum time is 10 seconds.
+    // bool enabled, uint32_t delay, uint32_t hang
+    SetAMPControl,
+    // CW phase & amplitude balance and output power.
+    // double phase_balance_deg, double amplitude_balance, double power
+    SetIQBalanceAndPower,
+
+    // Server to client notifications, sent on channel 1.
+
+    // Radio USB connection went down or came back, the ENet connection is kept meanwhile.
+    // uint8_t online
+    RadioStatus,
+    // Settings last applied to the radio, sent to a newly connected client.
+    // uint32_t valid (bit mask of (1 << CatCommandID)), int64_t freq, int64_t cw_tx_freq,
+    // uint8_t keyer_speed, uint8_t keyer_mode, uint8_t amp_enabled, int32_t amp_delay, int32_t amp_hang,
+    // double phase_balance_deg, double amplitude_balance, double power
+    StateSnapshot,
+
+    // LAN multicast of the IQ stream, see iq_multicast.h.
+
+    // Client to server: receive the IQ stream from the multicast group instead of channel 0, or back.
+    // uint8_t enable
+    MulticastSubscribe,
+    // Server to client, reply to MulticastSubscribe. Session 0: multicast is not available.
+    // uint32_t session, uint16_t port, char group[] (numeric address, up to the end of the packet)
+    MulticastInfo,
+    // Client to server: resend lost multicast datagrams.
+    // uint32_t first_seq, uint16_t count
+    MulticastNak,
+    // Server to client, unsequenced: a multicast datagram resent over ENet.
+    // MulticastIQHeader header, int16_t iq[header.frames * 2]
+    MulticastRepair,
+
+    // Adaptive stream quality, see stream_quality.h.
+
+    // Client to server: receive channel 0 as StreamTierHeader prefixed packets, the server picking the tier
+    // from the link quality, down to lowest_tier. Disabled: plain 48 kHz int16_t I/Q.
+    // uint8_t enable, uint8_t lowest_tier (StreamTier)
+    StreamQuality,
+    // Server to client: the tier of the peer changed, with the link signals that triggered the change.
+    // uint8_t tier, uint32_t rtt_ms, uint32_t packet_loss (ratio to ENET_PEER_PACKET_LOSS_SCALE), uint32_t queued_packets
+    StreamTierChanged,
+
+    // Sample rate of the radio, see sample_rate.h.
+
+    // Server to client, on connect and periodically: the radio sample rate estimated against the server monotonic clock.
+    // uint8_t valid, double rate_hz
+    SampleRate,
+    // Client to server: receive the unicast IQ stream resampled to exactly SAMPLE_RATE. The packets then carry
+    // a varying number of frames, averaging SAMPLE_RATE per second. The multicast stream is not resampled.
+    // uint8_t enable
+    ExactRate,
+
+    // Time-shift playback, see time_shift.h.
+
+    // Client to server: replay channel 0 from the history starting at start_sample_index instead of the live stream,
+    // at speed times real time, and continue live once the replay caught up. start_sample_index < 0: that many frames
+    // before the live stream. speed 0: back to live right away. The replay is the plain 48 kHz int16_t I/Q stream.
+    // int64_t start_sample_index, uint8_t speed
+    TimeShift,
+    // Server to client, reply to TimeShift and once the replay caught up: the blocks queued on channel 0 from now on
+    // start at sample_index, replayed at speed, speed 0: live. The history reaches back to oldest_sample_index.
+    // uint64_t sample_index, uint64_t oldest_sample_index, uint8_t speed
+    TimeShiftStatus,
+
+    // Clock synchronization, see clock_sync.h. Both sent unsequenced, a retransmission would spoil the timing.
+
+    // Client to server, periodically: the client monotonic clock when sent, in microseconds.
+    // uint64_t client_send_us
+    ClockSyncRequest,
+    // Server to client, right away: the request echoed, the server monotonic clock when the request arrived and
+    // when the reply was sent, and the timeline of the stream: the frames up to sample_index had arrived from
+    // the radio at sample_time_us of the server clock, zero if not streaming.
+    // uint64_t client_send_us, uint64_t server_receive_us, uint64_t server_send_us, uint64_t sample_index, uint64_t sample_time_us
+    ClockSyncReply,
+
+    // Client to server: receive the plain radio rate stream of channel 0 in blocks of frames, a power of two
+    // from MIN_BLOCK_FRAMES to MAX_BLOCK_FRAMES, 0: the native blocks of EXT_BLOCKLEN frames. Shorter blocks fit
+    // a single datagram and reach the client sooner, longer blocks save per packet overhead and client wakeups.
+    // The switch to a longer length happens at a multiple of that length. The exact rate, adaptive quality,
+    // pre-roll and time-shift streams keep the native blocks.
+    // uint16_t frames
+    BlockLength,
+
+    // Client to server: receive the IQ stream from the shared memory ring of ServerConfig::local_socket instead of
+    // channel 0, or back, see local_stream.h. Ignored if the server has no ring.
+    // uint8_t enable
+    LocalSubscribe,
+
+    // Client to server: receive the narrowband subchannels of the mask instead of the full band, see channelizer.h.
+    // Channel 0 then carries a SubchannelHeader prefixed packet per subchannel and block. 0: back to the full band.
+    // Subchannel peers are excluded from the pre-roll and time-shift like the adaptive quality ones.
+    // uint32_t mask (bit mask of (1 << subchannel))
+    Subchannels,
+
+    // CW skimmer of the server, see skimmer.h. Ignored if ServerConfig::skimmer_signals is 0.
+
+    // Client to server: receive the CwSpot notifications, or stop. spots_only: stop the IQ stream of channel 0 too,
+    // for a band map client, like a subchannel peer it is excluded from the pre-roll and time-shift.
+    // uint8_t enable, uint8_t spots_only
+    SkimmerSubscribe,
+    // Server to client: a word decoded. frequency: the LO plus offset_hz, 0 if the LO is unknown. sample_index:
+    // the input frame the word ended at. The text fills the rest of the packet, not zero terminated.
+    // int64_t frequency, int16_t offset_hz, uint8_t wpm, int8_t snr_db, uint64_t sample_index, char text[]
+    CwSpot,
+
+    // Pre-roll, the IQ history of ServerConfig::preroll_ms.
+
+    // Client to server: replay the history on channel 0 ahead of the live stream, as fast as the link allows, then
+    // continue live. 0: stop the replay, live from the next block. The blocks already queued are dropped. Like the
+    // time-shift, the replay is the plain native rate stream, a multicast, shared memory, adaptive quality, exact
+    // rate or subchannel peer stays live.
+    // uint8_t enable
+    Preroll,
+    // Server to client, reply to Preroll and once the replay reached the live stream: the blocks queued on channel 0
+    // from now on start at sample_index, live 0: replayed from the history, 1: live. Not sent while time-shifting.
+    // uint64_t sample_index, uint8_t live
+    PrerollStatus,
+};
+
+// Bounds of CatCommandID::BlockLength.
+static constexpr uint16_t MIN_BLOCK_FRAMES = 64;
+static constexpr uint16_t MAX_BLOCK_FRAMES = 4096;
+
+// Shadow of the CAT settings successfully applied to the radio. Restored after the radio reconnects,
+// sent to newly connected clients, and used to skip client writes of values already applied.
+struct CatState {
+    // Bit mask of (1 << CatCommandID) of the settings applied.
+    uint32_t    valid               = 0;
+    int64_t     freq                = 0;
+    int64_t     cw_tx_freq          = 0;
+    int         keyer_speed         = 0;
+    KeyerMode   keyer_mode          = KEYER_MODE_IAMBIC_B;
+    bool        amp_enabled         = false;
+    int         amp_delay           = 0;
+    int         amp_hang            = 0;
+    double      phase_balance_deg   = 0.;
+    double      amplitude_balance   = 1.;
+    double      power               = 1.;
+
+    bool        is_valid(CatCommandID id) const { return (valid & (1u << unsigned(id))) != 0; }
+    void        set_valid(CatCommandID id) { valid |= 1u << unsigned(id); }
+
+    // Size of the StateSnapshot payload following the CatCommandID.
+    static constexpr size_t snapshot_size = 4 + 8 + 8 + 1 + 1 + 1 + 4 + 4 + 8 + 8 + 8;
+    void        write_snapshot(uint8_t *data) const;
+    // Parse a StateSnapshot payload, returns false if it is too short.
+    bool        read_snapshot(const uint8_t *data, size_t len);
+};
@@ -0,0 +1,103 @@
+#include "channelizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "fft.h"
+
+static_assert(PolyphaseChannelizer::DECIMATION * 2 == PolyphaseChannelizer::SUBCHANNELS,
+	"the phase correction below assumes 2x oversampling");
+
+PolyphaseChannelizer::PolyphaseChannelizer()
+{
+	// Windowed sinc prototype, -6 dB at half the subchannel spacing so that the neighbours cross there.
+	// The Blackman window puts the stop band a bit over 2 kHz off the center at 48 kHz, below the 3 kHz Nyquist
+	// of the output rate.
+	const size_t num_taps = SUBCHANNELS * TAPS_PER_BRANCH;
+	const double fc       = 0.5 / SUBCHANNELS;
+	std::vector<double> taps(num_taps);
+	double sum = 0;
+	for (size_t i = 0; i < num_taps; ++ i) {
+		const double x      = double(i) - (num_taps - 1) * 0.5;
+		const double sinc   = x == 0 ? 2. * fc : sin(2. * M_PI * fc * x) / (M_PI * x);
+		const double window = 0.42 - 0.5 * cos(2. * M_PI * i / (num_taps - 1)) + 0.08 * cos(4. * M_PI * i / (num_taps - 1));
+		taps[i] = sinc * window;
+		sum += taps[i];
+	}
+	// Unity gain in the pass band.
+	m_taps.resize(num_taps * 2);
+	for (size_t i = 0; i < num_taps; ++ i)
+		m_taps[i * 2] = m_taps[i * 2 + 1] = float(taps[num_taps - 1 - i] / sum);
+	m_history.assign((num_taps - 1) * 2, 0.f);
+
+	// Twiddles of the inverse FFT, which mixes branch p of subchannel k by exp(+2 pi j k p / SUBCHANNELS).
+	fft_twiddles(m_twiddles, SUBCHANNELS, true);
+	for (size_t i = 0, j = 0; i < SUBCHANNELS; ++ i) {
+		m_bit_reversed[i] = uint8_t(j);
+		size_t bit = SUBCHANNELS >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+	}
+}
+
+void PolyphaseChannelizer::process(const int16_t *iq, size_t frames, uint64_t sample_index)
+{
+	const size_t num_taps = m_taps.size() / 2;
+	const size_t hist     = num_taps - 1;
+	std::vector<float> &x = m_history;
+	if (sample_index != m_next_sample_index)
+		std::fill(x.begin(), x.end(), 0.f);
+	m_next_sample_index = sample_index + frames;
+	x.resize((hist + frames) * 2);
+	for (size_t i = 0; i < frames * 2; ++ i)
+		x[hist * 2 + i] = float(iq[i]);
+
+	// Output frames are aligned with the input frames of the indices divisible by DECIMATION, the same ones
+	// in every shard and after any gap.
+	const uint64_t first = (sample_index + DECIMATION - 1) / DECIMATION * DECIMATION;
+	m_out_sample_index = first;
+	m_out_frames       = first < sample_index + frames ? size_t((sample_index + frames - first + DECIMATION - 1) / DECIMATION) : 0;
+	m_out.resize(SUBCHANNELS * m_out_frames * 2);
+	for (size_t o = 0; o < m_out_frames; ++ o) {
+		const uint64_t t = first + o * DECIMATION;
+		// Oldest input frame of the output, the newest one is frame t.
+		const float *src = x.data() + size_t(t - sample_index) * 2;
+		// Branch p sums the taps p, p + SUBCHANNELS, p + 2 * SUBCHANNELS ..., reversed: the taps
+		// SUBCHANNELS - 1 - p, 2 * SUBCHANNELS - 1 - p ... of m_taps.
+		// A local accumulator, the compiler cannot keep a member in registers next to the float pointers.
+		float branches[SUBCHANNELS * 2] = { 0.f };
+		for (size_t n = 0; n < num_taps * 2; n += SUBCHANNELS * 2)
+			for (size_t i = 0; i < SUBCHANNELS * 2; ++ i)
+				branches[i] += m_taps[n + i] * src[n + i];
+
+		// Radix-2 inverse FFT over the branches, loaded in the bit reversed order.
+		std::complex<float> fft[SUBCHANNELS];
+		for (size_t p = 0; p < SUBCHANNELS; ++ p)
+			fft[m_bit_reversed[p]] = std::complex<float>(branches[(SUBCHANNELS - 1 - p) * 2], branches[(SUBCHANNELS - 1 - p) * 2 + 1]);
+		fft_radix2(fft, SUBCHANNELS, m_twiddles);
+
+		// The mixer of subchannel k restarts every SUBCHANNELS input frames, it is at exp(-2 pi j k t / SUBCHANNELS),
+		// that is (-1)^(k * t / DECIMATION), when the output at t is taken.
+		const bool odd = ((t / DECIMATION) & 1) != 0;
+		for (size_t k = 0; k < SUBCHANNELS; ++ k) {
+			const std::complex<float> y = odd && (k & 1) ? -fft[k] : fft[k];
+			// FFT order to subchannels ordered by frequency.
+			int16_t *dst = m_out.data() + ((k + SUBCHANNELS / 2) % SUBCHANNELS) * m_out_frames * 2 + o * 2;
+			dst[0] = int16_t(std::lrint(std::max(-32768.f, std::min(32767.f, y.real()))));
+			dst[1] = int16_t(std::lrint(std::max(-32768.f, std::min(32767.f, y.imag()))));
+		}
+	}
+	// Keep the last hist frames for the next block.
+	std::copy(x.end() - ptrdiff_t(hist * 2), x.end(), x.begin());
+	x.resize(hist * 2);
+}
+
+void PolyphaseChannelizer::encode(size_t subchannel, std::vector<uint8_t> &out) const
+{
+	const SubchannelHeader header { uint8_t(subchannel), uint8_t(DECIMATION), uint16_t(m_out_frames), m_out_sample_index };
+	out.resize(sizeof(header) + m_out_frames * 4);
+	memcpy(out.data(), &header, sizeof(header));
+	memcpy(out.data() + sizeof(header), m_out.data() + subchannel * m_out_frames * 2, m_out_frames * 4);
+}
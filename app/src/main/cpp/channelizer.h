@@ -0,0 +1,63 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Splits the band into SUBCHANNELS uniform subchannels at once, for the narrowband clients subscribed to a few of them
+// by CatCommandID::Subchannels. A polyphase analysis filter bank: the prototype low pass is applied as SUBCHANNELS
+// branches and a single SUBCHANNELS-point FFT per output frame mixes all of them down, thus the cost per block
+// does not depend on the number of the subchannels used nor of their subscribers.
+//
+// Subchannel u is centered at (u - SUBCHANNELS / 2) * SAMPLE_RATE / SUBCHANNELS off the LO, subchannel
+// SUBCHANNELS / 2 at the LO. The output rate is SAMPLE_RATE / DECIMATION, twice the spacing, so that the pass bands
+// of the neighbours overlap at -6 dB and any signal narrower than a half of the spacing is found whole in one of them.
+#pragma pack(push, 1)
+struct SubchannelHeader
+{
+	uint8_t		subchannel;
+	// Output rate is SAMPLE_RATE / decimation.
+	uint8_t		decimation;
+	// Number of IQ frames following the header, interleaved int16_t I/Q.
+	uint16_t	frames;
+	// Index of the input frame the first output frame is aligned with, see CatCommandID::ClockSyncReply.
+	uint64_t	sample_index;
+};
+#pragma pack(pop)
+
+class PolyphaseChannelizer
+{
+public:
+	static constexpr size_t	SUBCHANNELS		= 16;
+	// 2x oversampled.
+	static constexpr size_t	DECIMATION		= SUBCHANNELS / 2;
+	// Prototype filter length per branch.
+	static constexpr size_t	TAPS_PER_BRANCH	= 16;
+
+	static_assert((SUBCHANNELS & (SUBCHANNELS - 1)) == 0 && SUBCHANNELS <= 32, "subchannel mask");
+
+	PolyphaseChannelizer();
+
+	// Split frames of interleaved int16_t I/Q, the first one of the stream index sample_index.
+	// A gap in the stream restarts the filter.
+	void		process(const int16_t *iq, size_t frames, uint64_t sample_index);
+	// Encode the output of the last process() call for a subchannel into out, header included.
+	void		encode(size_t subchannel, std::vector<uint8_t> &out) const;
+
+private:
+	// Prototype filter reversed, each tap twice, so that a branch is a contiguous dot product with the input frames.
+	std::vector<float>	m_taps;
+	// The last taps - 1 input frames followed by the block, interleaved I/Q.
+	std::vector<float>	m_history;
+	// Index of the next input frame expected.
+	uint64_t			m_next_sample_index	= 0;
+
+	std::complex<float>	m_twiddles[SUBCHANNELS / 2];
+	// Bit reversed FFT input position of each branch.
+	uint8_t				m_bit_reversed[SUBCHANNELS];
+	// Output of the last block, SUBCHANNELS rows of m_out_frames interleaved frames each, and the first frame's index.
+	std::vector<int16_t>	m_out;
+	size_t				m_out_frames		= 0;
+	uint64_t			m_out_sample_index	= 0;
+};
@@ -0,0 +1,144 @@
+#include "clock_sync.h"
+
+#include <algorithm>
+#include <cmath>
+
+void ClockSync::reset()
+{
+	m_valid     = false;
+	m_exchanges = 0;
+	m_rejected  = 0;
+	m_filter.clear();
+	m_last_kept = -1.;
+	m_samples.clear();
+	m_offset    = 0.;
+	m_drift     = 0.;
+	m_residual  = 0.;
+}
+
+void ClockSync::add(uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t rtt_bound_us)
+{
+	// Reordered or corrupted exchanges.
+	if (t3 < t0 || t2 < t1)
+		return;
+	if (m_exchanges == 0 && m_filter.empty())
+		m_origin = t0;
+	if (t0 < m_origin)
+		return;
+	++ m_exchanges;
+	const double delay = double(t3 - t0) - double(t2 - t1);
+	if (delay < 0. || (rtt_bound_us > 0 && delay > double(2 * rtt_bound_us + RTT_MARGIN_US))) {
+		++ m_rejected;
+		return;
+	}
+	const Sample sample {
+		(double(t0 - m_origin) + double(t3 - t0) * 0.5) * 1e-6,
+		((double(t1) - double(t0)) + (double(t2) - double(t3))) * 0.5,
+		delay };
+	m_filter.push_back(sample);
+	if (m_filter.size() > FILTER)
+		m_filter.pop_front();
+	// Keep the shortest round trip of the filter, unless it was kept already.
+	const Sample &best = *std::min_element(m_filter.begin(), m_filter.end(),
+		[](const Sample &a, const Sample &b) { return a.delay < b.delay; });
+	if (best.time <= m_last_kept)
+		return;
+	m_last_kept = best.time;
+	m_samples.push_back(best);
+	if (m_samples.size() > WINDOW)
+		m_samples.pop_front();
+	fit();
+}
+
+void ClockSync::fit()
+{
+	const double span = m_samples.back().time - m_samples.front().time;
+	if (span < MIN_DRIFT_SPAN) {
+		// Too short for the drift, the offset of the shortest round trip.
+		const Sample &best = *std::min_element(m_samples.begin(), m_samples.end(),
+			[](const Sample &a, const Sample &b) { return a.delay < b.delay; });
+		m_time     = best.time;
+		m_offset   = best.offset;
+		m_drift    = 0.;
+		m_residual = 0.;
+		m_valid    = true;
+		return;
+	}
+	// Least squares fit of offset = a + drift * time, refitted once without the outliers. The samples of longer
+	// round trips carry a larger error, they are weighted by the inverse of their excess over the shortest plus 100 us.
+	double min_delay = m_samples.front().delay;
+	for (const Sample &s : m_samples)
+		min_delay = std::min(min_delay, s.delay);
+	double a = 0, b = 0;
+	double threshold = -1.;
+	for (int pass = 0; pass < 2; ++ pass) {
+		double sw = 0, st = 0, so = 0;
+		for (const Sample &s : m_samples)
+			if (threshold < 0 || std::fabs(s.offset - a - b * s.time) <= threshold) {
+				const double w = 1. / (100. + s.delay - min_delay);
+				sw += w;
+				st += w * s.time;
+				so += w * s.offset;
+			}
+		if (sw <= 0)
+			return;
+		const double mt = st / sw, mo = so / sw;
+		double stt = 0, sto = 0;
+		for (const Sample &s : m_samples)
+			if (threshold < 0 || std::fabs(s.offset - a - b * s.time) <= threshold) {
+				const double w = 1. / (100. + s.delay - min_delay);
+				stt += w * (s.time - mt) * (s.time - mt);
+				sto += w * (s.time - mt) * (s.offset - mo);
+			}
+		if (stt <= 0)
+			return;
+		const double b_new = sto / stt;
+		const double a_new = mo - b_new * mt;
+		double sr = 0;
+		for (const Sample &s : m_samples)
+			sr += (s.offset - a_new - b_new * s.time) * (s.offset - a_new - b_new * s.time);
+		m_residual = std::sqrt(sr / double(m_samples.size()));
+		a = a_new;
+		b = b_new;
+		// Outliers: off the fit by more than 3 sigma, the round trip jitter alone is tolerated.
+		threshold = std::max(3. * m_residual, min_delay * 0.5);
+	}
+	m_time   = m_samples.back().time;
+	m_offset = a + b * m_time;
+	m_drift  = b;
+	m_valid  = true;
+}
+
+double ClockSync::offset_us(uint64_t local_us) const
+{
+	return m_offset + m_drift * ((double(local_us) - double(m_origin)) * 1e-6 - m_time);
+}
+
+uint64_t ClockSync::to_remote(uint64_t local_us) const
+{
+	return uint64_t(int64_t(local_us) + int64_t(std::llround(offset_us(local_us))));
+}
+
+uint64_t ClockSync::to_local(uint64_t remote_us) const
+{
+	// remote = local + offset(local), offset being linear in local.
+	const double x = (double(remote_us) - double(m_origin) - m_offset + m_drift * m_time) / (1. + m_drift * 1e-6);
+	return uint64_t(int64_t(m_origin) + int64_t(std::llround(x)));
+}
+
+ClockSyncStats ClockSync::stats() const
+{
+	ClockSyncStats stats;
+	stats.exchanges    = m_exchanges;
+	stats.rejected     = m_rejected;
+	stats.offset_us    = m_offset;
+	stats.drift_ppm    = m_drift;
+	stats.residual_us  = m_residual;
+	stats.min_delay_us = 0.;
+	if (! m_samples.empty()) {
+		stats.min_delay_us = m_samples.front().delay;
+		for (const Sample &s : m_samples)
+			stats.min_delay_us = std::min(stats.min_delay_us, s.delay);
+	}
+	return stats;
+}
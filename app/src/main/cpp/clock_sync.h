@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+// Estimates the offset and the drift of the monotonic clock of a remote host against the local one from NTP-style
+// exchanges: the local send time t0, the remote receive and send times t1 and t2, the local receive time t3.
+// Each exchange measures the offset up to half the asymmetry of its round trip, thus of the last FILTER exchanges
+// only the one of the shortest round trip is kept (the NTP clock filter). The offset and the drift are then fitted
+// over the window of the kept exchanges. Exchanges whose round trip exceeds the smoothed ENet RTT by far waited
+// in a queue on the way, such as behind the IQ stream, and are dropped right away.
+struct ClockSyncStats
+{
+	uint64_t	exchanges			= 0;
+	// Dropped for a round trip over the RTT bound.
+	uint64_t	rejected			= 0;
+	// Remote minus local clock at the time of the last exchange, and its drift.
+	double		offset_us			= 0.;
+	double		drift_ppm			= 0.;
+	// Shortest round trip in the window, half of it bounds the error of the offset.
+	double		min_delay_us		= 0.;
+	// RMS of the kept exchanges against the fit.
+	double		residual_us			= 0.;
+};
+
+class ClockSync
+{
+public:
+	// Exchange period, shorter until the filter is filled.
+	static constexpr uint64_t	PERIOD_US			= 1000000;
+	static constexpr uint64_t	INITIAL_PERIOD_US	= 100000;
+
+	void		reset();
+	// An exchange completed. rtt_bound_us: the smoothed round trip of the connection, zero if not known.
+	void		add(uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t rtt_bound_us);
+
+	bool		valid() const { return m_valid; }
+	// Period of the next exchange.
+	uint64_t	period_us() const { return m_exchanges < FILTER ? INITIAL_PERIOD_US : PERIOD_US; }
+	// Remote minus local clock at the local time.
+	double		offset_us(uint64_t local_us) const;
+	uint64_t	to_remote(uint64_t local_us) const;
+	uint64_t	to_local(uint64_t remote_us) const;
+
+	ClockSyncStats stats() const;
+
+private:
+	// Exchanges of the clock filter, and the window of the kept exchanges.
+	static constexpr size_t		FILTER				= 8;
+	static constexpr size_t		WINDOW				= 128;
+	// The drift is fitted once the kept exchanges span this long, the offset alone until then.
+	static constexpr double		MIN_DRIFT_SPAN		= 10.;
+	// Round trips over twice the RTT bound plus this are dropped.
+	static constexpr uint64_t	RTT_MARGIN_US		= 2000;
+
+	void		fit();
+
+	struct Sample {
+		// Seconds since the origin at the middle of the exchange, microseconds.
+		double	time;
+		double	offset;
+		double	delay;
+	};
+
+	bool		m_valid			= false;
+	uint64_t	m_origin		= 0;
+	uint64_t	m_exchanges		= 0;
+	uint64_t	m_rejected		= 0;
+	// The last FILTER exchanges, and the time of the last one kept.
+	std::deque<Sample>	m_filter;
+	double		m_last_kept		= -1.;
+	std::deque<Sample>	m_samples;
+	// offset = m_offset + m_drift * (time - m_time), time in seconds since the origin, offset in microseconds.
+	double		m_time			= 0.;
+	double		m_offset		= 0.;
+	double		m_drift			= 0.;
+	double		m_residual		= 0.;
+};
@@ -54,6 +54,20 @@
 #define ENET_ENABLE_IPV6_RECVPKTINFO 1
 #endif
 
+// Send the datagrams produced by one service pass with a single sendmmsg() call
+// and receive with recvmmsg(), Linux only.
+#ifndef ENET_ENABLE_SENDMMSG
+#if defined(__linux__)
+#define ENET_ENABLE_SENDMMSG 1
+#else
+#define ENET_ENABLE_SENDMMSG 0
+#endif
+#endif
+
+#ifndef ENET_SOCKET_BATCH_MAXIMUM
+#define ENET_SOCKET_BATCH_MAXIMUM 32
+#endif
+
 #define ENET_TIME_OVERFLOW 86400000
 #define ENET_TIME_LESS(a, b) ((a) - (b) >= ENET_TIME_OVERFLOW)
 #define ENET_TIME_GREATER(a, b) ((b) - (a) >= ENET_TIME_OVERFLOW)
@@ -530,6 +544,7 @@ extern "C" {
 #if ENET_ENABLE_IPV6_RECVPKTINFO
         ENET_SOCKOPT_IPV6_RECVPKTINFO = 12,
 #endif
+        ENET_SOCKOPT_REUSEPORT = 13,
     } ENetSocketOption;
 
     typedef enum _ENetSocketShutdown {
@@ -837,6 +852,12 @@ extern "C" {
         enet_uint32           totalSentPackets;     /**< total UDP packets sent, user should reset to 0 as needed to prevent overflow */
         enet_uint32           totalReceivedData;    /**< total data received, user should reset to 0 as needed to prevent overflow */
         enet_uint32           totalReceivedPackets; /**< total UDP packets received, user should reset to 0 as needed to prevent overflow */
+        enet_uint32           totalSendCalls;       /**< total send system calls, user should reset to 0 as needed to prevent overflow */
+        enet_uint32           totalReceiveCalls;    /**< total receive system calls, user should reset to 0 as needed to prevent overflow */
+#if ENET_ENABLE_SENDMMSG
+        struct _ENetSocketBatch * sendBatch;        /**< datagrams of one service pass, flushed with sendmmsg() */
+        struct _ENetSocketBatch * receiveBatch;     /**< datagrams received with recvmmsg(), processed one by one */
+#endif
         ENetInterceptCallback intercept;            /**< callback the user can set to intercept received raw UDP packets */
         size_t                connectedPeers;
         size_t                bandwidthLimitedPeers;
@@ -945,6 +966,27 @@ extern "C" {
         , ENetAddress *
 #endif
     );
+#if ENET_ENABLE_SENDMMSG
+    typedef struct _ENetSocketBatch ENetSocketBatch;
+    ENET_API ENetSocketBatch * enet_socket_batch_create(void);
+    ENET_API void       enet_socket_batch_destroy(ENetSocketBatch *);
+    ENET_API int        enet_socket_batch_full(const ENetSocketBatch *);
+    /** Copies a datagram into the batch, returns its length. */
+    ENET_API int        enet_socket_batch_append(ENetSocketBatch *, const ENetAddress *, const ENetBuffer *, size_t
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , const ENetAddress *
+#endif
+    );
+    /** Sends and empties the batch, counting the system calls made. */
+    ENET_API int        enet_socket_batch_send(ENetSocket, ENetSocketBatch *, enet_uint32 *);
+    /** Returns the next received datagram, refilling the batch with a single recvmmsg() when empty.
+        Same return values as enet_socket_receive(), the data points into the batch. */
+    ENET_API int        enet_socket_batch_receive(ENetSocket, ENetSocketBatch *, size_t, ENetAddress *, enet_uint8 **, enet_uint32 *
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , ENetAddress *
+#endif
+    );
+#endif
     ENET_API int        enet_socket_wait(ENetSocket, enet_uint32 *, enet_uint64);
     ENET_API int        enet_socket_set_option(ENetSocket, ENetSocketOption, int);
     ENET_API int        enet_socket_get_option(ENetSocket, ENetSocketOption, int *);
@@ -1039,10 +1081,12 @@ extern "C" {
     ENET_API enet_uint32  enet_crc32(const ENetBuffer *, size_t);
 
     ENET_API ENetHost * enet_host_create(const ENetAddress *, size_t, size_t, enet_uint32, enet_uint32);
+    ENET_API ENetHost * enet_host_create_shared_port(const ENetAddress *, size_t, size_t, enet_uint32, enet_uint32);
     ENET_API void       enet_host_destroy(ENetHost *);
     ENET_API ENetPeer * enet_host_connect(ENetHost *, const ENetAddress *, size_t, enet_uint32);
     ENET_API int        enet_host_check_events(ENetHost *, ENetEvent *);
     ENET_API int        enet_host_service(ENetHost *, ENetEvent *, enet_uint32);
+    ENET_API int        enet_host_receive(ENetHost *, ENetEvent *);
     ENET_API int        enet_host_send_raw(ENetHost *, const ENetAddress *, enet_uint8 *, size_t
 #if ENET_ENABLE_IPV6_RECVPKTINFO
         , const ENetAddress *
@@ -2869,16 +2913,29 @@ static int enet_address_has_source(const ENetAddress *address) {
         for (packets = 0; packets < 256; ++packets) {
             int receivedLength;
             ENetBuffer buffer;
+            enet_uint8 *receivedData = host->packetData[0];
 
-            buffer.data       = host->packetData[0];
-            // buffer.dataLength = sizeof (host->packetData[0]);
-            buffer.dataLength = host->mtu;
+#if ENET_ENABLE_SENDMMSG
+            if (host->receiveBatch != NULL) {
+                receivedLength = enet_socket_batch_receive(host->socket, host->receiveBatch, host->mtu, &host->receivedAddress, &receivedData, &host->totalReceiveCalls
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+                    , &host->localAddress
+#endif
+                );
+            } else
+#endif
+            {
+                buffer.data       = host->packetData[0];
+                // buffer.dataLength = sizeof (host->packetData[0]);
+                buffer.dataLength = host->mtu;
 
-            receivedLength    = enet_socket_receive(host->socket, &host->receivedAddress, &buffer, 1
+                receivedLength    = enet_socket_receive(host->socket, &host->receivedAddress, &buffer, 1
 #if ENET_ENABLE_IPV6_RECVPKTINFO
-                , &host->localAddress
+                    , &host->localAddress
 #endif
-            );
+                );
+                ++host->totalReceiveCalls;
+            }
 
             if (receivedLength == -2)
                 continue;
@@ -2891,7 +2948,7 @@ static int enet_address_has_source(const ENetAddress *address) {
                 return 0;
             }
 
-            host->receivedData       = host->packetData[0];
+            host->receivedData       = receivedData;
             host->receivedDataLength = receivedLength;
 
             host->totalReceivedData += receivedLength;
@@ -3205,6 +3262,18 @@ static int enet_address_has_source(const ENetAddress *address) {
         return canPing;
     } /* enet_protocol_send_reliable_outgoing_commands */
 
+    // Send the datagrams batched during a pass of enet_protocol_send_outgoing_commands().
+    static int enet_protocol_flush_send_batch(ENetHost *host) {
+#if ENET_ENABLE_SENDMMSG
+        if (host->sendBatch != NULL) {
+            return enet_socket_batch_send(host->socket, host->sendBatch, &host->totalSendCalls);
+        }
+#else
+        ENET_UNUSED(host);
+#endif
+        return 0;
+    }
+
     static int enet_protocol_send_outgoing_commands(ENetHost *host, ENetEvent *event, int checkForTimeouts) {
         enet_uint8 headerData[
             sizeof(ENetProtocolHeader) 
@@ -3245,7 +3314,8 @@ static int enet_address_has_source(const ENetAddress *address) {
                     enet_protocol_check_timeouts(host, currentPeer, event) == 1
                 ) {
                     if (event != NULL && event->type != ENET_EVENT_TYPE_NONE) {
-                        return 1;
+                        host->buffers[0].data = NULL;
+                        return enet_protocol_flush_send_batch(host) < 0 ? -1 : 1;
                     } else {
                         goto nextPeer;
                     }
@@ -3355,17 +3425,35 @@ static int enet_address_has_source(const ENetAddress *address) {
                 }
 
                 currentPeer->lastSendTime = host->serviceTime;
-                sentLength = enet_socket_send(host->socket, &currentPeer->address, host->buffers, host->bufferCount
+#if ENET_ENABLE_SENDMMSG
+                if (host->sendBatch != NULL) {
+                    // Flushed below, once all the peers were processed or the batch is full.
+                    sentLength = enet_socket_batch_append(host->sendBatch, &currentPeer->address, host->buffers, host->bufferCount
 #if ENET_ENABLE_IPV6_RECVPKTINFO
-                    , &currentPeer->localAddress
+                        , &currentPeer->localAddress
 #endif
-                );
+                    );
+                    if (sentLength >= 0 && enet_socket_batch_full(host->sendBatch) &&
+                        enet_socket_batch_send(host->socket, host->sendBatch, &host->totalSendCalls) < 0) {
+                        sentLength = -1;
+                    }
+                } else
+#endif
+                {
+                    sentLength = enet_socket_send(host->socket, &currentPeer->address, host->buffers, host->bufferCount
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+                        , &currentPeer->localAddress
+#endif
+                    );
+                    ++host->totalSendCalls;
+                }
                 enet_protocol_remove_sent_unreliable_commands(currentPeer, &sentUnreliableCommands);
 
                 if (sentLength < 0) {
                     // The local 'headerData' array (to which 'data' is assigned) goes out
                     // of scope on return from this function, so ensure we no longer point to it.
                     host->buffers[0].data = NULL;
+                    enet_protocol_flush_send_batch(host);
                     return -1;
                 }
 
@@ -3381,7 +3469,7 @@ static int enet_address_has_source(const ENetAddress *address) {
         // of scope on return from this function, so ensure we no longer point to it.
         host->buffers[0].data = NULL;
 
-        return 0;
+        return enet_protocol_flush_send_batch(host);
     } /* enet_protocol_send_outgoing_commands */
 
     /** Sends any queued packets on the host specified to its designated peers.
@@ -3544,6 +3632,50 @@ static int enet_address_has_source(const ENetAddress *address) {
         return 0;
     } /* enet_host_service */
 
+    /** Receives the datagrams waiting on the host socket and dispatches the first resulting event.
+     *  Unlike enet_host_service(), the queued outgoing commands are not sent first, thus commands
+     *  received while a large send backlog is pending are dispatched without waiting for it.
+     *  Acknowledgements are sent by the next enet_host_service() or enet_host_flush() call.
+     *
+     *  @param host    host to receive for
+     *  @param event   an event structure where event details will be placed if one occurs
+     *  @retval > 0 if an event occurred
+     *  @retval 0 if no event occurred
+     *  @retval < 0 on failure
+     *  @ingroup host
+     */
+    int enet_host_receive(ENetHost *host, ENetEvent *event) {
+        event->type   = ENET_EVENT_TYPE_NONE;
+        event->peer   = NULL;
+        event->packet = NULL;
+
+        switch (enet_protocol_dispatch_incoming_commands(host, event)) {
+            case 1:
+                return 1;
+
+            case -1:
+                return -1;
+
+            default:
+                break;
+        }
+
+        host->serviceTime = enet_time_get();
+
+        switch (enet_protocol_receive_incoming_commands(host, event)) {
+            case 1:
+                return 1;
+
+            case -1:
+                return -1;
+
+            default:
+                break;
+        }
+
+        return enet_protocol_dispatch_incoming_commands(host, event);
+    } /* enet_host_receive */
+
 
 // =======================================================================//
 // !
@@ -4612,7 +4744,7 @@ static int enet_address_has_source(const ENetAddress *address) {
      *  the window size of a connection which limits the amount of reliable packets that may be in transit
      *  at any given time.
      */
-    ENetHost * enet_host_create(const ENetAddress *address, size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth) {
+    static ENetHost * enet_host_create_internal(const ENetAddress *address, size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth, int sharedPort) {
         ENetHost *host;
         ENetPeer *currentPeer;
 
@@ -4640,6 +4772,11 @@ static int enet_address_has_source(const ENetAddress *address) {
 #endif
         }
 
+        if (host->socket != ENET_SOCKET_NULL && sharedPort && enet_socket_set_option(host->socket, ENET_SOCKOPT_REUSEPORT, 1) < 0) {
+            enet_socket_destroy(host->socket);
+            host->socket = ENET_SOCKET_NULL;
+        }
+
         if (host->socket == ENET_SOCKET_NULL || (address != NULL && enet_socket_bind(host->socket, address) < 0)) {
             if (host->socket != ENET_SOCKET_NULL) {
                 enet_socket_destroy(host->socket);
@@ -4688,6 +4825,13 @@ static int enet_address_has_source(const ENetAddress *address) {
         host->totalSentPackets              = 0;
         host->totalReceivedData             = 0;
         host->totalReceivedPackets          = 0;
+        host->totalSendCalls                = 0;
+        host->totalReceiveCalls             = 0;
+#if ENET_ENABLE_SENDMMSG
+        // Without the batches the host falls back to one system call per datagram.
+        host->sendBatch                     = enet_socket_batch_create();
+        host->receiveBatch                  = enet_socket_batch_create();
+#endif
         host->totalQueued                   = 0;
         host->connectedPeers                = 0;
         host->bandwidthLimitedPeers         = 0;
@@ -4718,7 +4862,19 @@ static int enet_address_has_source(const ENetAddress *address) {
         }
 
         return host;
-    } /* enet_host_create */
+    } /* enet_host_create_internal */
+
+    ENetHost * enet_host_create(const ENetAddress *address, size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth) {
+        return enet_host_create_internal(address, peerCount, channelLimit, incomingBandwidth, outgoingBandwidth, 0);
+    }
+
+    /** Creates a host sharing its port with other hosts created by this function (SO_REUSEPORT).
+     *  The kernel spreads the remote addresses among the hosts, all the datagrams of a single peer
+     *  reach the same host. Fails where SO_REUSEPORT is not supported.
+     */
+    ENetHost * enet_host_create_shared_port(const ENetAddress *address, size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth) {
+        return enet_host_create_internal(address, peerCount, channelLimit, incomingBandwidth, outgoingBandwidth, 1);
+    }
 
     /** Destroys the host and all resources associated with it.
      *  @param host pointer to the host to destroy
@@ -4740,6 +4896,10 @@ static int enet_address_has_source(const ENetAddress *address) {
             (*host->compressor.destroy)(host->compressor.context);
         }
 
+#if ENET_ENABLE_SENDMMSG
+        enet_socket_batch_destroy(host->sendBatch);
+        enet_socket_batch_destroy(host->receiveBatch);
+#endif
         enet_free(host->peers);
         enet_free(host);
     }
@@ -5721,6 +5881,12 @@ static int enet_address_has_source(const ENetAddress *address) {
                 result = setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (char *)&value, sizeof(int));
                 break;
 
+#ifdef SO_REUSEPORT
+            case ENET_SOCKOPT_REUSEPORT:
+                result = setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, (char *)&value, sizeof(int));
+                break;
+#endif
+
             case ENET_SOCKOPT_RCVBUF:
                 result = setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char *)&value, sizeof(int));
                 break;
@@ -5855,51 +6021,55 @@ static int enet_address_has_source(const ENetAddress *address) {
         }
     }
 
-    int enet_socket_send(ENetSocket socket, const ENetAddress *address, const ENetBuffer *buffers, size_t bufferCount
-#if ENET_ENABLE_IPV6_RECVPKTINFO
-        , const ENetAddress *sourceAddress
-#endif
-    ) {
-        struct msghdr msgHdr;
+    // Storage of the peer address and of the local address control message of a datagram.
+    typedef struct {
         union {
             struct sockaddr_in6 ipv6;
             struct sockaddr_in ipv4;
-        } sin;
-        int sentLength;
+        } name;
 #if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
-        struct cmsghdr *controlMsg;
         union {
             struct cmsghdr header;
             char ipv6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
 #if defined(IP_PKTINFO) && defined(__linux__)
             char ipv4[CMSG_SPACE(sizeof(struct in_pktinfo))];
 #endif
-        } controlBuffer;
+        } control;
+#endif
+    } ENetSocketMessageAddresses;
+
+    static void enet_socket_prepare_send_message(struct msghdr *msgHdr, ENetSocketMessageAddresses *storage, const ENetAddress *address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , const ENetAddress *sourceAddress
+#endif
+    ) {
+#if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
+        struct cmsghdr *controlMsg;
 #endif
 
-        memset(&msgHdr, 0, sizeof(struct msghdr));
+        memset(msgHdr, 0, sizeof(struct msghdr));
 
         if (address != NULL) {
-            memset(&sin, 0, sizeof(sin));
+            memset(&storage->name, 0, sizeof(storage->name));
 
             if (enet_address_is_v4_mapped(address)) {
                 struct in_addr addr4;
 
                 enet_address_extract_v4(address, &addr4);
-                sin.ipv4.sin_family = AF_INET;
-                sin.ipv4.sin_port = ENET_HOST_TO_NET_16(address->port);
-                sin.ipv4.sin_addr = addr4;
+                storage->name.ipv4.sin_family = AF_INET;
+                storage->name.ipv4.sin_port = ENET_HOST_TO_NET_16(address->port);
+                storage->name.ipv4.sin_addr = addr4;
 
-                msgHdr.msg_name = &sin.ipv4;
-                msgHdr.msg_namelen = sizeof(struct sockaddr_in);
+                msgHdr->msg_name = &storage->name.ipv4;
+                msgHdr->msg_namelen = sizeof(struct sockaddr_in);
             } else {
-                sin.ipv6.sin6_family   = AF_INET6;
-                sin.ipv6.sin6_port     = ENET_HOST_TO_NET_16(address->port);
-                sin.ipv6.sin6_addr     = address->host;
-                sin.ipv6.sin6_scope_id = address->sin6_scope_id;
+                storage->name.ipv6.sin6_family   = AF_INET6;
+                storage->name.ipv6.sin6_port     = ENET_HOST_TO_NET_16(address->port);
+                storage->name.ipv6.sin6_addr     = address->host;
+                storage->name.ipv6.sin6_scope_id = address->sin6_scope_id;
 
-                msgHdr.msg_name = &sin.ipv6;
-                msgHdr.msg_namelen = sizeof(struct sockaddr_in6);
+                msgHdr->msg_name = &storage->name.ipv6;
+                msgHdr->msg_namelen = sizeof(struct sockaddr_in6);
             }
         }
 
@@ -5907,15 +6077,15 @@ static int enet_address_has_source(const ENetAddress *address) {
         if (enet_address_has_source(sourceAddress)) {
 #if !defined(IP_PKTINFO) || !defined(__linux__)
             if (enet_address_is_v4_mapped(sourceAddress)) {
-                msgHdr.msg_control = NULL;
-                msgHdr.msg_controllen = 0;
+                msgHdr->msg_control = NULL;
+                msgHdr->msg_controllen = 0;
             } else
 #endif
             {
-                msgHdr.msg_control = controlBuffer.ipv6;
-                msgHdr.msg_controllen = sizeof(controlBuffer);
+                msgHdr->msg_control = storage->control.ipv6;
+                msgHdr->msg_controllen = sizeof(storage->control);
 
-                controlMsg = CMSG_FIRSTHDR(&msgHdr);
+                controlMsg = CMSG_FIRSTHDR(msgHdr);
 #if defined(IP_PKTINFO) && defined(__linux__)
                 if (enet_address_is_v4_mapped(sourceAddress)) {
                     struct in_pktinfo *packet;
@@ -5944,12 +6114,87 @@ static int enet_address_has_source(const ENetAddress *address) {
                     packet->ipi6_addr = sourceAddress->host;
                     packet->ipi6_ifindex = sourceAddress->sin6_scope_id;
                 }
-                msgHdr.msg_controllen = controlMsg->cmsg_len;
+                msgHdr->msg_controllen = controlMsg->cmsg_len;
             }
         }
 #elif ENET_ENABLE_IPV6_RECVPKTINFO
         ENET_UNUSED(sourceAddress);
 #endif
+    }
+
+    static void enet_socket_prepare_receive_message(struct msghdr *msgHdr, ENetSocketMessageAddresses *storage, int wantAddress
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , ENetAddress *destinationAddress
+#endif
+    ) {
+        memset(msgHdr, 0, sizeof(struct msghdr));
+
+        if (wantAddress) {
+            msgHdr->msg_name    = &storage->name.ipv6;
+            msgHdr->msg_namelen = sizeof(struct sockaddr_in6);
+        }
+
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        if (destinationAddress != NULL) {
+            enet_address_set_any(destinationAddress);
+#if defined(IPV6_PKTINFO)
+            msgHdr->msg_control = storage->control.ipv6;
+            msgHdr->msg_controllen = sizeof(storage->control);
+#endif
+        }
+#endif
+    }
+
+    static void enet_socket_parse_received_message(struct msghdr *msgHdr, const ENetSocketMessageAddresses *storage, ENetAddress *address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , ENetAddress *destinationAddress
+#endif
+    ) {
+        if (address != NULL) {
+            address->host           = storage->name.ipv6.sin6_addr;
+            address->port           = ENET_NET_TO_HOST_16(storage->name.ipv6.sin6_port);
+            address->sin6_scope_id  = storage->name.ipv6.sin6_scope_id;
+        }
+
+#if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
+        if (destinationAddress != NULL) {
+            struct cmsghdr *controlMsg;
+            for (controlMsg = CMSG_FIRSTHDR(msgHdr); controlMsg != NULL; controlMsg = CMSG_NXTHDR(msgHdr, controlMsg)) {
+                if (controlMsg->cmsg_level == IPPROTO_IPV6 && controlMsg->cmsg_type == IPV6_PKTINFO) {
+                    struct in6_pktinfo *packet = (struct in6_pktinfo *) CMSG_DATA(controlMsg);
+                    destinationAddress->host = packet->ipi6_addr;
+                    destinationAddress->sin6_scope_id = packet->ipi6_ifindex;
+                    break;
+                }
+#if defined(IP_PKTINFO) && defined(__linux__)
+                if (controlMsg->cmsg_level == IPPROTO_IP && controlMsg->cmsg_type == IP_PKTINFO) {
+                    struct in_pktinfo *packet = (struct in_pktinfo *) CMSG_DATA(controlMsg);
+                    enet_address_set_v4(destinationAddress, &packet->ipi_addr);
+                    destinationAddress->sin6_scope_id = packet->ipi_ifindex;
+                    break;
+                }
+#endif
+            }
+        }
+#elif ENET_ENABLE_IPV6_RECVPKTINFO
+        ENET_UNUSED(destinationAddress);
+#endif
+    }
+
+    int enet_socket_send(ENetSocket socket, const ENetAddress *address, const ENetBuffer *buffers, size_t bufferCount
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , const ENetAddress *sourceAddress
+#endif
+    ) {
+        struct msghdr msgHdr;
+        ENetSocketMessageAddresses storage;
+        int sentLength;
+
+        enet_socket_prepare_send_message(&msgHdr, &storage, address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+            , sourceAddress
+#endif
+        );
 
         msgHdr.msg_iov    = (struct iovec *) buffers;
         msgHdr.msg_iovlen = bufferCount;
@@ -5979,34 +6224,14 @@ static int enet_address_has_source(const ENetAddress *address) {
 #endif
     ) {
         struct msghdr msgHdr;
-        struct sockaddr_in6 sin;
+        ENetSocketMessageAddresses storage;
         int recvLength;
-#if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
-        union {
-            struct cmsghdr header;
-            char ipv6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-#if defined(IP_PKTINFO) && defined(__linux__)
-            char ipv4[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        } controlBuffer;
-#endif
-
-        memset(&msgHdr, 0, sizeof(struct msghdr));
-
-        if (address != NULL) {
-            msgHdr.msg_name    = &sin;
-            msgHdr.msg_namelen = sizeof(struct sockaddr_in6);
-        }
 
+        enet_socket_prepare_receive_message(&msgHdr, &storage, address != NULL
 #if ENET_ENABLE_IPV6_RECVPKTINFO
-        if (destinationAddress != NULL) {
-            enet_address_set_any(destinationAddress);
-#if defined(IPV6_PKTINFO)
-            msgHdr.msg_control = controlBuffer.ipv6;
-            msgHdr.msg_controllen = sizeof(controlBuffer);
-#endif
-        }
+            , destinationAddress
 #endif
+        );
 
         msgHdr.msg_iov    = (struct iovec *) buffers;
         msgHdr.msg_iovlen = bufferCount;
@@ -6025,36 +6250,205 @@ static int enet_address_has_source(const ENetAddress *address) {
             return -2;
         }
 
-        if (address != NULL) {
-            address->host           = sin.sin6_addr;
-            address->port           = ENET_NET_TO_HOST_16(sin.sin6_port);
-            address->sin6_scope_id  = sin.sin6_scope_id;
+        enet_socket_parse_received_message(&msgHdr, &storage, address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+            , destinationAddress
+#endif
+        );
+
+        return recvLength;
+    } /* enet_socket_receive */
+
+#if ENET_ENABLE_SENDMMSG
+    // Datagrams sent with a single sendmmsg() or received with a single recvmmsg() call.
+    struct _ENetSocketBatch {
+        size_t                      count;
+        // Receive: index of the next datagram to be returned.
+        size_t                      next;
+        // Receive: the last recvmmsg() did not fill the batch, the socket is drained.
+        int                         drained;
+        struct mmsghdr              messages[ENET_SOCKET_BATCH_MAXIMUM];
+        struct iovec                iov[ENET_SOCKET_BATCH_MAXIMUM];
+        ENetSocketMessageAddresses  addresses[ENET_SOCKET_BATCH_MAXIMUM];
+        enet_uint8                  data[ENET_SOCKET_BATCH_MAXIMUM][ENET_PROTOCOL_MAXIMUM_MTU];
+    };
+
+    ENetSocketBatch * enet_socket_batch_create(void) {
+        ENetSocketBatch *batch = (ENetSocketBatch *) enet_malloc(sizeof(ENetSocketBatch));
+        if (batch != NULL) {
+            batch->count   = 0;
+            batch->next    = 0;
+            batch->drained = 0;
         }
+        return batch;
+    }
 
-#if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
-        if (destinationAddress != NULL) {
-            struct cmsghdr *controlMsg;
-            for (controlMsg = CMSG_FIRSTHDR(&msgHdr); controlMsg != NULL; controlMsg = CMSG_NXTHDR(&msgHdr, controlMsg)) {
-                if (controlMsg->cmsg_level == IPPROTO_IPV6 && controlMsg->cmsg_type == IPV6_PKTINFO) {
-                    struct in6_pktinfo *packet = (struct in6_pktinfo *) CMSG_DATA(controlMsg);
-                    destinationAddress->host = packet->ipi6_addr;
-                    destinationAddress->sin6_scope_id = packet->ipi6_ifindex;
-                    break;
+    void enet_socket_batch_destroy(ENetSocketBatch *batch) {
+        enet_free(batch);
+    }
+
+    int enet_socket_batch_full(const ENetSocketBatch *batch) {
+        return batch->count == ENET_SOCKET_BATCH_MAXIMUM;
+    }
+
+    int enet_socket_batch_append(ENetSocketBatch *batch, const ENetAddress *address, const ENetBuffer *buffers, size_t bufferCount
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , const ENetAddress *sourceAddress
+#endif
+    ) {
+        size_t length = 0;
+        size_t i;
+        enet_uint8 *data;
+
+        if (batch->count == ENET_SOCKET_BATCH_MAXIMUM) {
+            return -1;
+        }
+
+        // The buffers reference the commands and packets of the host, which are reused or released
+        // before the batch is flushed, thus the datagram is copied.
+        data = batch->data[batch->count];
+        for (i = 0; i < bufferCount; ++i) {
+            if (length + buffers[i].dataLength > ENET_PROTOCOL_MAXIMUM_MTU) {
+                return -2;
+            }
+            memcpy(data + length, buffers[i].data, buffers[i].dataLength);
+            length += buffers[i].dataLength;
+        }
+
+        enet_socket_prepare_send_message(&batch->messages[batch->count].msg_hdr, &batch->addresses[batch->count], address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+            , sourceAddress
+#endif
+        );
+        batch->iov[batch->count].iov_base = data;
+        batch->iov[batch->count].iov_len  = length;
+        batch->messages[batch->count].msg_hdr.msg_iov    = &batch->iov[batch->count];
+        batch->messages[batch->count].msg_hdr.msg_iovlen = 1;
+        ++batch->count;
+
+        return (int) length;
+    }
+
+    int enet_socket_batch_send(ENetSocket socket, ENetSocketBatch *batch, enet_uint32 *systemCalls) {
+        size_t sent = 0;
+
+        while (sent < batch->count) {
+            int result = sendmmsg(socket, &batch->messages[sent], (unsigned int) (batch->count - sent), MSG_NOSIGNAL);
+            ++*systemCalls;
+
+            if (result < 0) {
+                switch (errno)
+                {
+                    case EINTR:
+                        continue;
+                    case EWOULDBLOCK:
+                        // Socket buffer full: drop the rest like enet_socket_send() does,
+                        // ENet resends reliable commands.
+                        sent = batch->count;
+                        continue;
+                    case EMSGSIZE:
+                        // Oversized datagram: drop it and send the rest.
+                        ++sent;
+                        continue;
+                    default:
+                        batch->count = 0;
+                        return -1;
                 }
-#if defined(IP_PKTINFO) && defined(__linux__)
-                if (controlMsg->cmsg_level == IPPROTO_IP && controlMsg->cmsg_type == IP_PKTINFO) {
-                    struct in_pktinfo *packet = (struct in_pktinfo *) CMSG_DATA(controlMsg);
-                    enet_address_set_v4(destinationAddress, &packet->ipi_addr);
-                    destinationAddress->sin6_scope_id = packet->ipi_ifindex;
-                    break;
+            }
+
+            sent += (size_t) result;
+        }
+
+        batch->count = 0;
+        return 0;
+    }
+
+    int enet_socket_batch_receive(ENetSocket socket, ENetSocketBatch *batch, size_t mtu, ENetAddress *address, enet_uint8 **data, enet_uint32 *systemCalls
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        , ENetAddress *destinationAddress
+#endif
+    ) {
+        struct mmsghdr *message;
+
+        if (batch->next == batch->count) {
+            int result;
+            size_t i;
+
+            batch->count = 0;
+            batch->next  = 0;
+
+            if (batch->drained) {
+                // Let the caller return to polling instead of calling recvmmsg() just to see EWOULDBLOCK.
+                batch->drained = 0;
+                return 0;
+            }
+
+            if (mtu > ENET_PROTOCOL_MAXIMUM_MTU) {
+                mtu = ENET_PROTOCOL_MAXIMUM_MTU;
+            }
+
+            for (i = 0; i < ENET_SOCKET_BATCH_MAXIMUM; ++i) {
+                enet_socket_prepare_receive_message(&batch->messages[i].msg_hdr, &batch->addresses[i], address != NULL
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+                    , NULL
+#endif
+                );
+#if ENET_ENABLE_IPV6_RECVPKTINFO && defined(IPV6_PKTINFO)
+                if (destinationAddress != NULL) {
+                    batch->messages[i].msg_hdr.msg_control    = batch->addresses[i].control.ipv6;
+                    batch->messages[i].msg_hdr.msg_controllen = sizeof(batch->addresses[i].control);
                 }
 #endif
+                batch->iov[i].iov_base = batch->data[i];
+                batch->iov[i].iov_len  = mtu;
+                batch->messages[i].msg_hdr.msg_iov    = &batch->iov[i];
+                batch->messages[i].msg_hdr.msg_iovlen = 1;
+                batch->messages[i].msg_len            = 0;
+            }
+
+            do {
+                result = recvmmsg(socket, batch->messages, ENET_SOCKET_BATCH_MAXIMUM, MSG_NOSIGNAL, NULL);
+                ++*systemCalls;
+            } while (result < 0 && errno == EINTR);
+
+            if (result < 0) {
+                if (errno == EWOULDBLOCK) {
+                    return 0;
+                }
+
+                return -1;
             }
+
+            if (result == 0) {
+                return 0;
+            }
+
+            batch->count   = (size_t) result;
+            batch->drained = batch->count < ENET_SOCKET_BATCH_MAXIMUM;
+        }
+
+        message = &batch->messages[batch->next];
+        *data   = batch->data[batch->next];
+        ++batch->next;
+
+        if (message->msg_hdr.msg_flags & MSG_TRUNC) {
+            return -2;
+        }
+
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+        if (destinationAddress != NULL) {
+            enet_address_set_any(destinationAddress);
         }
 #endif
+        enet_socket_parse_received_message(&message->msg_hdr, &batch->addresses[message - batch->messages], address
+#if ENET_ENABLE_IPV6_RECVPKTINFO
+            , destinationAddress
+#endif
+        );
 
-        return recvLength;
-    } /* enet_socket_receive */
+        return (int) message->msg_len;
+    } /* enet_socket_batch_receive */
+#endif // ENET_ENABLE_SENDMMSG
 
     int enet_socketset_select(ENetSocket maxSocket, ENetSocketSet *readSet, ENetSocketSet *writeSet, enet_uint32 timeout) {
         struct timeval timeVal;
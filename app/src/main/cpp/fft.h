@@ -0,0 +1,43 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <utility>
+
+// Radix-2 FFT of n points, n a power of two, for the small transforms of the channelizer and the skimmer.
+
+// Twiddles of the transform, n / 2 factors. inverse: exp(+2 pi j i / n) instead of exp(-2 pi j i / n).
+inline void fft_twiddles(std::complex<float> *twiddles, size_t n, bool inverse)
+{
+	for (size_t i = 0; i < n / 2; ++ i)
+		twiddles[i] = std::polar(1.f, float((inverse ? 2. : -2.) * M_PI * double(i) / double(n)));
+}
+
+// Permute data into the bit reversed order fft_radix2() expects.
+inline void fft_bit_reverse(std::complex<float> *data, size_t n)
+{
+	for (size_t i = 1, j = 0; i < n; ++ i) {
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(data[i], data[j]);
+	}
+}
+
+// In place, data in the bit reversed order, unnormalized.
+inline void fft_radix2(std::complex<float> *data, size_t n, const std::complex<float> *twiddles)
+{
+	for (size_t len = 2; len <= n; len <<= 1) {
+		const size_t stride = n / len;
+		for (size_t i = 0; i < n; i += len)
+			for (size_t k = 0; k < len / 2; ++ k) {
+				// Spelled out, the complex product of the library checks for infinities.
+				const std::complex<float> w = twiddles[k * stride], v = data[i + k + len / 2];
+				const std::complex<float> t(w.real() * v.real() - w.imag() * v.imag(), w.real() * v.imag() + w.imag() * v.real());
+				data[i + k + len / 2] = data[i + k] - t;
+				data[i + k] += t;
+			}
+	}
+}
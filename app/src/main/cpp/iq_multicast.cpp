@@ -0,0 +1,150 @@
+#include "iq_multicast.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Name and IPv4 address of the interface named interface or holding the address interface, of the first Wi-Fi
+// interface if interface is empty. Listed by SIOCGIFCONF, as getifaddrs() needs Android 7.
+static bool find_interface(const std::string &interface, std::string &name, in_addr &address)
+{
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return false;
+	struct ifreq  requests[32];
+	struct ifconf conf;
+	conf.ifc_len = sizeof(requests);
+	conf.ifc_req = requests;
+	const bool listed = ioctl(fd, SIOCGIFCONF, &conf) == 0;
+	::close(fd);
+	if (! listed)
+		return false;
+	for (size_t i = 0; i < size_t(conf.ifc_len) / sizeof(struct ifreq); ++ i) {
+		const char *if_name = requests[i].ifr_name;
+		struct sockaddr_in if_address;
+		memcpy(&if_address, &requests[i].ifr_addr, sizeof(if_address));
+		char address_str[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &if_address.sin_addr, address_str, sizeof(address_str));
+		if (interface.empty() ? strncmp(if_name, "wlan", 4) == 0 : interface == if_name || interface == address_str) {
+			name    = if_name;
+			address = if_address.sin_addr;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool IQMulticast::open(const std::string &group, int port, int ttl, const std::string &interface)
+{
+	close();
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags    = AI_NUMERICHOST;
+	struct addrinfo *result = nullptr;
+	if (getaddrinfo(group.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || result == nullptr) {
+		printf("Invalid multicast group %s\n", group.c_str());
+		return false;
+	}
+
+	// Otherwise the datagrams leave through the interface of the default route, which may be the mobile data.
+	std::string if_name;
+	in_addr     if_address {};
+	const bool  if_found = find_interface(interface, if_name, if_address) ||
+		(! interface.empty() && find_interface(std::string(), if_name, if_address));
+	if (if_found)
+		printf("Multicast sent from %s\n", if_name.c_str());
+	else
+		printf("No interface %s to send the multicast from, using the default route\n", interface.empty() ? "wlan*" : interface.c_str());
+
+	bool ok = false;
+	if (result->ai_addrlen <= sizeof(m_address)) {
+		m_socket = socket(result->ai_family, SOCK_DGRAM, 0);
+		if (m_socket != -1) {
+			if (result->ai_family == AF_INET6) {
+				int hops = ttl;
+				setsockopt(m_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+				unsigned int index = if_found ? if_nametoindex(if_name.c_str()) : 0;
+				if (index != 0)
+					setsockopt(m_socket, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index));
+			} else {
+				unsigned char ttl8 = (unsigned char)ttl;
+				setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl8, sizeof(ttl8));
+				if (if_found)
+					setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_IF, &if_address, sizeof(if_address));
+			}
+			// The streaming thread must never block on a full socket buffer, a lost datagram is repaired on NAK.
+			fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL) | O_NONBLOCK);
+			memcpy(m_address, result->ai_addr, result->ai_addrlen);
+			m_address_len = uint32_t(result->ai_addrlen);
+			ok = true;
+		}
+	}
+	freeaddrinfo(result);
+	if (! ok) {
+		printf("Failed to create the multicast socket for %s\n", group.c_str());
+		return false;
+	}
+
+	m_group    = group;
+	m_port     = port;
+	m_session  = std::random_device{}() | 1;
+	m_next_seq = 0;
+	memset(m_history_len, 0, sizeof(m_history_len));
+	return true;
+}
+
+void IQMulticast::close()
+{
+	if (m_socket != -1) {
+		::close(m_socket);
+		m_socket = -1;
+	}
+}
+
+void IQMulticast::send_block(const void *data, size_t len, uint64_t sample_index)
+{
+	const uint8_t *src = static_cast<const uint8_t*>(data);
+	for (size_t frames_left = len / 4; frames_left > 0;) {
+		const size_t frames = frames_left < FRAMES_PER_DATAGRAM ? frames_left : FRAMES_PER_DATAGRAM;
+		const uint32_t seq = m_next_seq ++;
+		uint8_t *datagram = m_history[seq % HISTORY_SIZE];
+		MulticastIQHeader header;
+		header.session      = m_session;
+		header.seq          = seq;
+		header.sample_index = sample_index;
+		header.frames       = uint16_t(frames);
+		header.format       = 0;
+		memcpy(datagram, &header, sizeof(header));
+		memcpy(datagram + sizeof(header), src, frames * 4);
+		const size_t datagram_len = sizeof(header) + frames * 4;
+		m_history_len[seq % HISTORY_SIZE] = uint16_t(datagram_len);
+		if (sendto(m_socket, datagram, datagram_len, MSG_NOSIGNAL, reinterpret_cast<const sockaddr*>(m_address), m_address_len) == ssize_t(datagram_len))
+			++ m_datagrams_sent;
+		else
+			++ m_send_errors;
+		src          += frames * 4;
+		sample_index += frames;
+		frames_left  -= frames;
+	}
+}
+
+const uint8_t* IQMulticast::find(uint32_t seq, size_t &len) const
+{
+	// Unsigned difference handles the sequence number wrap around.
+	if (uint32_t(m_next_seq - seq - 1) >= HISTORY_SIZE || m_history_len[seq % HISTORY_SIZE] == 0)
+		return nullptr;
+	len = m_history_len[seq % HISTORY_SIZE];
+	return m_history[seq % HISTORY_SIZE];
+}
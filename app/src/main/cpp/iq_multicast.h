@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// LAN multicast fan-out of the IQ stream. Each IQ block is split into datagrams sent once
+// to a UDP multicast group, independently of the number of listeners. Session control, CAT
+// and the repair of lost datagrams (NAK) stay on the ENet connection of each client.
+
+// Header of a multicast IQ datagram, little endian, followed by frames * 4 bytes
+// of interleaved int16_t I/Q samples.
+#pragma pack(push, 1)
+struct MulticastIQHeader
+{
+	// Random per server start, datagrams of another session are to be ignored.
+	uint32_t	session;
+	// Datagram sequence number, contiguous. Gaps are requested by CatCommandID::MulticastNak.
+	uint32_t	seq;
+	// Index of the first IQ frame of this datagram since the start of streaming.
+	uint64_t	sample_index;
+	uint16_t	frames;
+	// 0: int16_t I/Q.
+	uint16_t	format;
+};
+#pragma pack(pop)
+
+class IQMulticast
+{
+public:
+	// IQ frames per datagram, so that a datagram fits the Wi-Fi MTU without IP fragmentation.
+	static constexpr size_t FRAMES_PER_DATAGRAM	= 256;
+	static constexpr size_t MAX_DATAGRAM_SIZE	= sizeof(MulticastIQHeader) + FRAMES_PER_DATAGRAM * 4;
+	// Datagrams kept for repair, about 2.7 seconds at 48 kHz.
+	static constexpr size_t HISTORY_SIZE		= 512;
+	// Maximum number of datagrams repaired by a single NAK.
+	static constexpr size_t MAX_NAK_COUNT		= 64;
+
+	~IQMulticast() { close(); }
+
+	// Group is a numeric IPv4 or IPv6 multicast address. ttl limits the scope, 1 keeps the stream on the LAN.
+	// interface: name or local IPv4 address of the interface to send from. Empty or not found: the Wi-Fi interface.
+	bool		open(const std::string &group, int port, int ttl, const std::string &interface);
+	void		close();
+	bool		is_open() const { return m_socket != -1; }
+
+	const std::string&	group() const { return m_group; }
+	int					port() const { return m_port; }
+	uint32_t			session() const { return m_session; }
+
+	// Split an IQ block into datagrams, send them to the group and keep them for repair.
+	void		send_block(const void *data, size_t len, uint64_t sample_index);
+	// Datagram (header and payload) kept in the history, nullptr if it is too old or not sent yet.
+	const uint8_t*	find(uint32_t seq, size_t &len) const;
+
+	uint64_t	datagrams_sent() const { return m_datagrams_sent; }
+	uint64_t	send_errors() const { return m_send_errors; }
+
+private:
+	int			m_socket	= -1;
+	std::string	m_group;
+	int			m_port		= 0;
+	// Destination, sockaddr_in or sockaddr_in6.
+	uint8_t		m_address[28];
+	uint32_t	m_address_len = 0;
+	uint32_t	m_session	= 0;
+	uint32_t	m_next_seq	= 0;
+
+	uint8_t		m_history[HISTORY_SIZE][MAX_DATAGRAM_SIZE];
+	uint16_t	m_history_len[HISTORY_SIZE] = { 0 };
+
+	uint64_t	m_datagrams_sent	= 0;
+	uint64_t	m_send_errors		= 0;
+};
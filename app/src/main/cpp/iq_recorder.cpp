@@ -0,0 +1,341 @@
+#include "iq_recorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Poll period of the writer thread, the streaming thread never signals it.
+static constexpr auto WRITER_POLL_PERIOD = std::chrono::milliseconds(20);
+
+bool IQRecorder::start(const RecorderConfig &config)
+{
+	stop();
+	if (config.directory.empty())
+		return false;
+	void *staging = nullptr;
+	if (posix_memalign(&staging, RECORDER_HEADER_BYTES, WRITE_SIZE + RECORDER_HEADER_BYTES) != 0)
+		return false;
+	m_config      = config;
+	m_staging     = static_cast<uint8_t*>(staging);
+	m_staging_len = 0;
+	m_ring.assign(RING_SIZE, 0);
+	m_head.store(0);
+	m_tail.store(0);
+	m_blocks_recorded.store(0);
+	m_blocks_dropped.store(0);
+	m_push_ns_max.store(0);
+	m_push_ns_total.store(0);
+	m_bytes_written.store(0);
+	m_write_errors.store(0);
+	m_files.store(0);
+	m_ring_high_water.store(0);
+	m_fd            = -1;
+	m_failed        = false;
+	m_next_index    = 0;
+	m_frequency     = 0;
+	m_rate_estimate = 0;
+	m_stop.store(false);
+	m_thread = std::thread(&IQRecorder::writer_thread, this);
+	printf("Recording IQ to %s\n", m_config.directory.c_str());
+	return true;
+}
+
+void IQRecorder::stop()
+{
+	if (! m_thread.joinable())
+		return;
+	m_stop.store(true, std::memory_order_release);
+	m_thread.join();
+	free(m_staging);
+	m_staging = nullptr;
+}
+
+void IQRecorder::ring_write(uint64_t pos, const void *src, size_t len)
+{
+	const size_t offset = size_t(pos % RING_SIZE);
+	const size_t first  = std::min(len, RING_SIZE - offset);
+	memcpy(m_ring.data() + offset, src, first);
+	memcpy(m_ring.data(), static_cast<const uint8_t*>(src) + first, len - first);
+}
+
+void IQRecorder::ring_read(uint64_t pos, void *dst, size_t len) const
+{
+	const size_t offset = size_t(pos % RING_SIZE);
+	const size_t first  = std::min(len, RING_SIZE - offset);
+	memcpy(dst, m_ring.data() + offset, first);
+	memcpy(static_cast<uint8_t*>(dst) + first, m_ring.data(), len - first);
+}
+
+bool IQRecorder::push(const RecordHeader &header, const void *payload)
+{
+	const size_t   len  = sizeof(header) + header.length;
+	const uint64_t head = m_head.load(std::memory_order_relaxed);
+	const uint64_t tail = m_tail.load(std::memory_order_acquire);
+	if (RING_SIZE - size_t(head - tail) < len)
+		return false;
+	ring_write(head, &header, sizeof(header));
+	ring_write(head + sizeof(header), payload, header.length);
+	m_head.store(head + len, std::memory_order_release);
+	return true;
+}
+
+void IQRecorder::push_block(const int16_t *iq, size_t frames, uint64_t sample_index, uint64_t unix_us)
+{
+	if (! running())
+		return;
+	const auto t0 = std::chrono::steady_clock::now();
+	RecordHeader header { RecordType::IQ, uint32_t(frames * 4), sample_index, unix_us, 0 };
+	if (push(header, iq))
+		m_blocks_recorded.fetch_add(1, std::memory_order_relaxed);
+	else
+		m_blocks_dropped.fetch_add(1, std::memory_order_relaxed);
+	const uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+	// Single producer, a plain load and store is enough.
+	m_push_ns_total.store(m_push_ns_total.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	if (ns > m_push_ns_max.load(std::memory_order_relaxed))
+		m_push_ns_max.store(ns, std::memory_order_relaxed);
+}
+
+void IQRecorder::push_frequency(int64_t freq, uint64_t sample_index)
+{
+	if (! running())
+		return;
+	RecordHeader header { RecordType::Frequency, 0, sample_index, 0, freq };
+	push(header, nullptr);
+}
+
+void IQRecorder::push_sample_rate(double rate, uint64_t sample_index)
+{
+	if (! running())
+		return;
+	RecordHeader header { RecordType::SampleRate, 0, sample_index, 0, 0 };
+	memcpy(&header.value, &rate, sizeof(rate));
+	push(header, nullptr);
+}
+
+RecorderStats IQRecorder::stats() const
+{
+	RecorderStats stats;
+	stats.blocks_recorded = m_blocks_recorded.load();
+	stats.blocks_dropped  = m_blocks_dropped.load();
+	stats.bytes_written   = m_bytes_written.load();
+	stats.write_errors    = m_write_errors.load();
+	stats.files           = m_files.load();
+	stats.push_ns_max     = m_push_ns_max.load();
+	stats.push_ns_total   = m_push_ns_total.load();
+	stats.ring_high_water = m_ring_high_water.load();
+	stats.ring_capacity   = RING_SIZE;
+	return stats;
+}
+
+void IQRecorder::writer_thread()
+{
+	for (;;) {
+		const bool stopping = m_stop.load(std::memory_order_acquire);
+		uint64_t       tail = m_tail.load(std::memory_order_relaxed);
+		const uint64_t head = m_head.load(std::memory_order_acquire);
+		if (size_t(head - tail) > m_ring_high_water.load(std::memory_order_relaxed))
+			m_ring_high_water.store(size_t(head - tail), std::memory_order_relaxed);
+		if (head == tail) {
+			if (stopping)
+				break;
+			std::this_thread::sleep_for(WRITER_POLL_PERIOD);
+			continue;
+		}
+		while (tail != head) {
+			RecordHeader header;
+			ring_read(tail, &header, sizeof(header));
+			switch (header.type) {
+			case RecordType::IQ:
+			{
+				const uint64_t frames = header.length / 4;
+				if (m_fd != -1 && (m_file_offset + m_staging_len >= m_config.rotate_bytes ||
+					m_file_frames >= uint64_t(m_config.rotate_seconds * m_config.nominal_rate)))
+					close_file();
+				if (m_fd == -1 && ! m_failed && ! open_file(header.sample_index, header.unix_us))
+					m_failed = true;
+				if (m_fd == -1)
+					break;
+				if (header.sample_index != m_next_index)
+					// Streaming was interrupted or the ring overflowed, start a new capture segment.
+					m_captures.push_back({ m_file_frames, header.sample_index, m_frequency, header.unix_us });
+				for (size_t done = 0; done < header.length;) {
+					const size_t n = std::min(size_t(header.length) - done, WRITE_SIZE - m_staging_len);
+					ring_read(tail + sizeof(header) + done, m_staging + m_staging_len, n);
+					m_staging_len += n;
+					done          += n;
+					if (m_staging_len == WRITE_SIZE && ! flush_staging(false)) {
+						// The disk is full or gone, keep the file written so far and stop recording.
+						close_file();
+						m_failed = true;
+						break;
+					}
+				}
+				if (m_fd == -1)
+					break;
+				m_file_frames += frames;
+				m_next_index   = header.sample_index + frames;
+				break;
+			}
+			case RecordType::Frequency:
+				m_frequency = header.value;
+				if (m_fd != -1) {
+					// Retuned before any sample of the last capture was written: update the capture.
+					if (! m_captures.empty() && m_captures.back().sample_start == m_file_frames)
+						m_captures.back().frequency = m_frequency;
+					else
+						m_captures.push_back({ m_file_frames, header.sample_index, m_frequency, 0 });
+				}
+				break;
+			case RecordType::SampleRate:
+				memcpy(&m_rate_estimate, &header.value, sizeof(m_rate_estimate));
+				break;
+			}
+			tail += sizeof(header) + header.length;
+			m_tail.store(tail, std::memory_order_release);
+		}
+	}
+	close_file();
+}
+
+static void format_utc(uint64_t unix_us, const char *format, char *buf, size_t len)
+{
+	const time_t seconds = time_t(unix_us / 1000000);
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	strftime(buf, len, format, &tm);
+}
+
+static void put_u16(uint8_t *p, uint16_t v) { memcpy(p, &v, 2); }
+static void put_u32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+
+bool IQRecorder::open_file(uint64_t sample_index, uint64_t unix_us)
+{
+	char time_str[32];
+	format_utc(unix_us, "%Y%m%d_%H%M%SZ", time_str, sizeof(time_str));
+	m_path = m_config.directory + "/qmx_" + time_str + "_" + std::to_string(m_frequency) + "Hz.wav";
+	m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd == -1) {
+		printf("Failed to create the recording %s: %s\n", m_path.c_str(), strerror(errno));
+		m_write_errors.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	// RIFF, fmt and JUNK chunks padding the data chunk header to the end of the first block.
+	// The RIFF and data sizes are filled in by close_file().
+	uint8_t *h = m_staging;
+	memset(h, 0, RECORDER_HEADER_BYTES);
+	const uint32_t rate = uint32_t(m_config.nominal_rate);
+	memcpy(h, "RIFF", 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_u32(h + 16, 16);
+	put_u16(h + 20, 1);		// PCM
+	put_u16(h + 22, 2);		// I, Q
+	put_u32(h + 24, rate);
+	put_u32(h + 28, rate * 4);
+	put_u16(h + 32, 4);
+	put_u16(h + 34, 16);
+	memcpy(h + 36, "JUNK", 4);
+	put_u32(h + 40, uint32_t(RECORDER_HEADER_BYTES - 44 - 8));
+	memcpy(h + RECORDER_HEADER_BYTES - 8, "data", 4);
+	m_staging_len = RECORDER_HEADER_BYTES;
+	m_file_offset = 0;
+	m_file_frames = 0;
+	m_next_index  = sample_index;
+	m_captures.clear();
+	m_captures.push_back({ 0, sample_index, m_frequency, unix_us });
+	m_files.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool IQRecorder::flush_staging(bool final_write)
+{
+	// Whole blocks only, the tail is carried over to the next write.
+	const size_t len = final_write ? m_staging_len : m_staging_len & ~(RECORDER_HEADER_BYTES - 1);
+	bool   ok   = true;
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t n = ::write(m_fd, m_staging + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			printf("Failed to write the recording %s: %s\n", m_path.c_str(), n < 0 ? strerror(errno) : "nothing written");
+			m_write_errors.fetch_add(1, std::memory_order_relaxed);
+			ok = false;
+			break;
+		}
+		done += size_t(n);
+	}
+	// The sizes of the WAV header are set from the offset, count only what reached the file.
+	m_file_offset += done;
+	m_bytes_written.fetch_add(done, std::memory_order_relaxed);
+	if (! ok) {
+		m_staging_len = 0;
+		return false;
+	}
+	memmove(m_staging, m_staging + len, m_staging_len - len);
+	m_staging_len -= len;
+	return ok;
+}
+
+void IQRecorder::close_file()
+{
+	if (m_fd == -1)
+		return;
+	flush_staging(true);
+	// Not even the header was written if the first write failed.
+	if (m_file_offset >= RECORDER_HEADER_BYTES) {
+		uint8_t size[4];
+		put_u32(size, uint32_t(std::min<uint64_t>(m_file_offset - 8, UINT32_MAX)));
+		pwrite(m_fd, size, 4, 4);
+		put_u32(size, uint32_t(std::min<uint64_t>(m_file_offset - RECORDER_HEADER_BYTES, UINT32_MAX)));
+		pwrite(m_fd, size, 4, RECORDER_HEADER_BYTES - 4);
+	}
+	::close(m_fd);
+	m_fd = -1;
+	write_metadata();
+}
+
+// SigMF metadata next to the recording, the WAV header is skipped by core:header_bytes.
+void IQRecorder::write_metadata()
+{
+	const size_t slash   = m_path.find_last_of('/');
+	const std::string dataset = m_path.substr(slash == std::string::npos ? 0 : slash + 1);
+	const std::string meta_path = m_path.substr(0, m_path.size() - 4) + ".sigmf-meta";
+	FILE *f = fopen(meta_path.c_str(), "w");
+	if (f == nullptr) {
+		m_write_errors.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	fprintf(f, "{\n  \"global\": {\n");
+	fprintf(f, "    \"core:datatype\": \"ci16_le\",\n");
+	fprintf(f, "    \"core:sample_rate\": %.0f,\n", m_config.nominal_rate);
+	fprintf(f, "    \"core:version\": \"1.0.0\",\n");
+	fprintf(f, "    \"core:hw\": \"QRP Labs QMX\",\n");
+	fprintf(f, "    \"core:recorder\": \"qmxserver\",\n");
+	fprintf(f, "    \"core:dataset\": \"%s\"", dataset.c_str());
+	if (m_rate_estimate > 0)
+		fprintf(f, ",\n    \"qmx:sample_rate_estimate\": %.4f", m_rate_estimate);
+	fprintf(f, "\n  },\n  \"captures\": [\n");
+	for (size_t i = 0; i < m_captures.size(); ++ i) {
+		const Capture &c = m_captures[i];
+		fprintf(f, "    { \"core:sample_start\": %llu, \"core:global_index\": %llu, \"core:frequency\": %lld",
+			(unsigned long long)c.sample_start, (unsigned long long)c.global_index, (long long)c.frequency);
+		if (i == 0)
+			fprintf(f, ", \"core:header_bytes\": %u", unsigned(RECORDER_HEADER_BYTES));
+		if (c.unix_us != 0) {
+			char time_str[32];
+			format_utc(c.unix_us, "%Y-%m-%dT%H:%M:%S", time_str, sizeof(time_str));
+			fprintf(f, ", \"core:datetime\": \"%s.%06uZ\"", time_str, unsigned(c.unix_us % 1000000));
+		}
+		fprintf(f, " }%s\n", i + 1 < m_captures.size() ? "," : "");
+	}
+	fprintf(f, "  ],\n  \"annotations\": []\n}\n");
+	fclose(f);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Continuous recording of the IQ stream to local storage. The streaming thread copies each block
+// into a single producer / single consumer lock-free ring and never waits: if the ring is full,
+// the block is dropped and counted. A background thread drains the ring into WAV files with
+// a SigMF metadata sidecar, rotating the files by size and by duration.
+//
+// The WAV header is padded by a JUNK chunk to RECORDER_HEADER_BYTES, thus the samples
+// and all the writes but the last one of a file are aligned to the storage block size.
+
+struct RecorderConfig
+{
+	// Directory of the recordings. Empty: recording disabled.
+	std::string	directory;
+	// Rotate to a new file once it reaches this size or duration.
+	uint64_t	rotate_bytes		= 512ull << 20;
+	uint32_t	rotate_seconds		= 3600;
+	double		nominal_rate		= 48000.;
+};
+
+struct RecorderStats
+{
+	uint64_t	blocks_recorded		= 0;
+	// Blocks dropped by the streaming thread because the ring was full.
+	uint64_t	blocks_dropped		= 0;
+	uint64_t	bytes_written		= 0;
+	uint64_t	write_errors		= 0;
+	uint32_t	files				= 0;
+	// Time spent by the streaming thread in push_block().
+	uint64_t	push_ns_max			= 0;
+	uint64_t	push_ns_total		= 0;
+	// Highest ring occupancy seen by the writer.
+	size_t		ring_high_water		= 0;
+	size_t		ring_capacity		= 0;
+};
+
+class IQRecorder
+{
+public:
+	// 4 MiB, about 21 seconds at 48 kHz, to ride out storage stalls.
+	static constexpr size_t	RING_SIZE				= 4u << 20;
+	static constexpr size_t	RECORDER_HEADER_BYTES	= 4096;
+	static constexpr size_t	WRITE_SIZE				= 256u << 10;
+
+	IQRecorder() = default;
+	~IQRecorder() { stop(); }
+
+	bool		start(const RecorderConfig &config);
+	// Flush the ring, finalize the current file and join the writer thread.
+	void		stop();
+	bool		running() const { return m_thread.joinable(); }
+
+	// Streaming thread only. sample_index is the index of the first frame, unix_us the wall clock time of the block.
+	void		push_block(const int16_t *iq, size_t frames, uint64_t sample_index, uint64_t unix_us);
+	// Streaming thread only. The radio was tuned to freq before the frame sample_index.
+	void		push_frequency(int64_t freq, uint64_t sample_index);
+	// Streaming thread only. Estimated sample rate of the radio, stored into the metadata.
+	void		push_sample_rate(double rate, uint64_t sample_index);
+
+	// Safe to call from the streaming thread while running, exact after stop().
+	RecorderStats stats() const;
+
+private:
+	enum class RecordType : uint32_t { IQ, Frequency, SampleRate };
+	struct RecordHeader {
+		RecordType	type;
+		// Payload bytes following the header.
+		uint32_t	length;
+		uint64_t	sample_index;
+		uint64_t	unix_us;
+		// Frequency in Hz or the bits of the sample rate double.
+		int64_t		value;
+	};
+
+	bool		push(const RecordHeader &header, const void *payload);
+	void		ring_write(uint64_t pos, const void *src, size_t len);
+	void		ring_read(uint64_t pos, void *dst, size_t len) const;
+	void		writer_thread();
+
+	// Writer thread: file handling.
+	struct Capture {
+		uint64_t	sample_start;
+		uint64_t	global_index;
+		int64_t		frequency;
+		uint64_t	unix_us;
+	};
+	bool		open_file(uint64_t sample_index, uint64_t unix_us);
+	void		close_file();
+	bool		flush_staging(bool final_write);
+	void		write_metadata();
+
+	RecorderConfig			m_config;
+	std::thread				m_thread;
+	std::atomic<bool>		m_stop { false };
+
+	// Ring of RecordHeader + payload records, head and tail are byte positions modulo RING_SIZE.
+	std::vector<uint8_t>	m_ring;
+	alignas(64) std::atomic<uint64_t> m_head { 0 };
+	alignas(64) std::atomic<uint64_t> m_tail { 0 };
+
+	// Producer side statistics.
+	std::atomic<uint64_t>	m_blocks_recorded { 0 };
+	std::atomic<uint64_t>	m_blocks_dropped { 0 };
+	std::atomic<uint64_t>	m_push_ns_max { 0 };
+	std::atomic<uint64_t>	m_push_ns_total { 0 };
+	// Writer side statistics.
+	std::atomic<uint64_t>	m_bytes_written { 0 };
+	std::atomic<uint64_t>	m_write_errors { 0 };
+	std::atomic<uint32_t>	m_files { 0 };
+	std::atomic<size_t>		m_ring_high_water { 0 };
+
+	// Writer thread state.
+	int						m_fd				= -1;
+	// A file could not be created or written, recording stopped.
+	bool					m_failed			= false;
+	std::string				m_path;
+	uint8_t				   *m_staging			= nullptr;
+	size_t					m_staging_len		= 0;
+	uint64_t				m_file_offset		= 0;
+	uint64_t				m_file_frames		= 0;
+	// Sample index expected next, to start a new capture segment after a discontinuity.
+	uint64_t				m_next_index		= 0;
+	int64_t					m_frequency			= 0;
+	double					m_rate_estimate		= 0;
+	std::vector<Capture>	m_captures;
+};
@@ -0,0 +1,126 @@
+#include "jitter_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+
+void IQJitterBuffer::reset(const JitterBufferConfig &config)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_config          = config;
+	m_frames.clear();
+	m_last_arrival_us = 0;
+	m_last_frames     = 0;
+	m_jitter_us       = 0.;
+	m_boost_frames    = 0.;
+	m_refilling       = true;
+	m_last_block.clear();
+	m_conceal_pos     = 0;
+	m_concealed_run   = 0;
+	m_fade_in         = 0;
+	m_delay_sum       = 0.;
+	m_stats           = JitterBufferStats();
+	m_config.max_delay_ms = std::max(m_config.max_delay_ms, m_config.min_delay_ms);
+}
+
+double IQJitterBuffer::target_frames() const
+{
+	const double block  = double(m_last_frames);
+	const double jitter = m_config.jitter_factor * m_jitter_us * m_config.nominal_rate * 1e-6;
+	const double lo     = m_config.min_delay_ms * m_config.nominal_rate * 1e-3;
+	const double hi     = m_config.max_delay_ms * m_config.nominal_rate * 1e-3;
+	return std::min(hi, std::max(lo, block + jitter + m_boost_frames));
+}
+
+void IQJitterBuffer::push(const int16_t *iq, size_t frames, uint64_t arrival_us)
+{
+	if (frames == 0)
+		return;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_last_arrival_us != 0) {
+		// Deviation of the interarrival time from the duration of the previous block.
+		const double expected_us = double(m_last_frames) * 1e6 / m_config.nominal_rate;
+		const double deviation   = std::fabs(double(arrival_us - m_last_arrival_us) - expected_us);
+		m_jitter_us += (deviation - m_jitter_us) / 16.;
+	}
+	m_last_arrival_us = arrival_us;
+	m_last_frames     = frames;
+	// Relax the underrun boost by relax_percent per second of the stream.
+	m_boost_frames *= std::pow(1. - m_config.relax_percent * 0.01, double(frames) / m_config.nominal_rate);
+	m_frames.insert(m_frames.end(), iq, iq + frames * 2);
+	++ m_stats.blocks_received;
+	m_stats.frames_received += frames;
+	// Over the target by more than a block: a late block arrived on top of its successors, drop the excess.
+	const double target = target_frames();
+	const size_t buffered = m_frames.size() / 2;
+	if (! m_refilling && double(buffered) > target + double(frames)) {
+		const size_t drop = buffered - size_t(target);
+		m_frames.erase(m_frames.begin(), m_frames.begin() + drop * 2);
+		m_stats.frames_dropped += drop;
+	}
+}
+
+void IQJitterBuffer::pop(int16_t *out, size_t frames)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const double target = target_frames();
+	if (m_refilling && double(m_frames.size() / 2) >= target) {
+		m_refilling = false;
+		m_fade_in   = FADE_IN_FRAMES;
+	}
+	size_t played = 0;
+	if (! m_refilling) {
+		played = std::min(frames, m_frames.size() / 2);
+		m_delay_sum += double(m_frames.size() / 2) * double(played);
+		std::copy(m_frames.begin(), m_frames.begin() + played * 2, out);
+		m_frames.erase(m_frames.begin(), m_frames.begin() + played * 2);
+		for (size_t i = 0; i < played && m_fade_in > 0; ++ i, -- m_fade_in) {
+			const double gain = 1. - double(m_fade_in) / double(FADE_IN_FRAMES);
+			out[i * 2]     = int16_t(out[i * 2] * gain);
+			out[i * 2 + 1] = int16_t(out[i * 2 + 1] * gain);
+		}
+		// Keep a block worth of the last frames played for the concealment.
+		if (played > 0) {
+			const size_t keep = std::max<size_t>(m_last_frames, 1) * 2;
+			m_last_block.insert(m_last_block.end(), out, out + played * 2);
+			if (m_last_block.size() > keep)
+				m_last_block.erase(m_last_block.begin(), m_last_block.end() - keep);
+			m_conceal_pos   = 0;
+			m_concealed_run = 0;
+		}
+		m_stats.frames_played += played;
+		if (played < frames) {
+			// Ran dry: conceal and refill to a higher target.
+			++ m_stats.underruns;
+			m_refilling     = true;
+			m_boost_frames += m_config.underrun_step_ms * m_config.nominal_rate * 1e-3;
+		}
+	}
+	// Conceal the rest: the last frames played repeated with a gain fading to silence.
+	const size_t fade = std::max<size_t>(1, m_config.conceal_fade_frames);
+	const size_t last = m_last_block.size() / 2;
+	for (size_t i = played; i < frames; ++ i, ++ m_concealed_run) {
+		if (last == 0 || m_concealed_run >= fade) {
+			out[i * 2] = out[i * 2 + 1] = 0;
+			continue;
+		}
+		const double gain = 1. - double(m_concealed_run) / double(fade);
+		out[i * 2]     = int16_t(m_last_block[m_conceal_pos * 2] * gain);
+		out[i * 2 + 1] = int16_t(m_last_block[m_conceal_pos * 2 + 1] * gain);
+		m_conceal_pos = (m_conceal_pos + 1) % last;
+	}
+	// The initial fill is not a concealment.
+	if (m_stats.frames_played > 0)
+		m_stats.frames_concealed += frames - played;
+}
+
+JitterBufferStats IQJitterBuffer::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	JitterBufferStats stats = m_stats;
+	const double ms_per_frame = 1e3 / m_config.nominal_rate;
+	stats.jitter_ms       = m_jitter_us * 1e-3;
+	stats.target_delay_ms = target_frames() * ms_per_frame;
+	stats.delay_ms        = double(m_frames.size() / 2) * ms_per_frame;
+	stats.mean_delay_ms   = stats.frames_played > 0 ? m_delay_sum / double(stats.frames_played) * ms_per_frame : 0.;
+	return stats;
+}
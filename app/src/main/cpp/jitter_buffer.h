@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "Config.h"
+
+// Client side jitter buffer of the IQ stream. The network thread pushes the blocks as they arrive, the audio
+// thread pops frames at the nominal rate. The playout delay follows the observed arrival jitter: the target is
+// a multiple of the smoothed interarrival jitter (RFC 3550), raised after each underrun and relaxing back slowly.
+// Frames buffered over the target, such as those of a block that arrived late, are dropped to keep the delay down.
+//
+// Channel 0 carries no sequence numbers, thus a lost block and a late block look the same to the player:
+// the buffer runs dry. The missing frames are concealed by replaying the last block with a fading gain,
+// then the buffer refills to the target before the playout resumes with a short fade in.
+struct JitterBufferConfig
+{
+	double		nominal_rate				= SAMPLE_RATE;
+	// Bounds of the target playout delay.
+	uint32_t	min_delay_ms				= 20;
+	uint32_t	max_delay_ms				= 500;
+	// Target delay above one block, in multiples of the smoothed jitter.
+	double		jitter_factor				= 4.;
+	// Target increase after an underrun, relaxed by relax_percent of itself per second.
+	uint32_t	underrun_step_ms			= 10;
+	uint32_t	relax_percent				= 5;
+	// Concealment fades the repeated block out over this many frames.
+	uint32_t	conceal_fade_frames			= 2048;
+};
+
+struct JitterBufferStats
+{
+	uint64_t	blocks_received				= 0;
+	uint64_t	frames_received				= 0;
+	uint64_t	frames_played				= 0;
+	// Frames replaced by concealment, after an underrun or while refilling.
+	uint64_t	frames_concealed			= 0;
+	uint64_t	underruns					= 0;
+	// Frames over the target dropped to keep the delay down.
+	uint64_t	frames_dropped				= 0;
+	// Smoothed interarrival jitter, the current target and the frames buffered, in milliseconds.
+	double		jitter_ms					= 0.;
+	double		target_delay_ms				= 0.;
+	double		delay_ms					= 0.;
+	// Playout delay averaged over the frames played.
+	double		mean_delay_ms				= 0.;
+};
+
+class IQJitterBuffer
+{
+public:
+	IQJitterBuffer() { reset(JitterBufferConfig()); }
+
+	void		reset(const JitterBufferConfig &config);
+	// Network thread. frames interleaved I/Q frames of a block, arrival_us on a monotonic clock.
+	void		push(const int16_t *iq, size_t frames, uint64_t arrival_us);
+	// Audio thread. Always fills frames frames of out, concealing what is missing.
+	void		pop(int16_t *out, size_t frames);
+
+	JitterBufferStats stats() const;
+
+private:
+	double		target_frames() const;
+
+	// Fade in length after a concealment.
+	static constexpr size_t	FADE_IN_FRAMES	= 64;
+
+	JitterBufferConfig		m_config;
+	mutable std::mutex		m_mutex;
+	// Interleaved I/Q of the frames buffered.
+	std::deque<int16_t>		m_frames;
+	// Arrival of the previous block and its length, for the jitter estimate.
+	uint64_t				m_last_arrival_us	= 0;
+	size_t					m_last_frames		= 0;
+	double					m_jitter_us			= 0.;
+	// Target increase after the underruns, frames.
+	double					m_boost_frames		= 0.;
+	// Refilling to the target after an underrun or at the start, the output is concealed meanwhile.
+	bool					m_refilling			= true;
+	// A block worth of the last frames played, replayed by the concealment, and the position in them.
+	std::vector<int16_t>	m_last_block;
+	size_t					m_conceal_pos		= 0;
+	size_t					m_concealed_run		= 0;
+	size_t					m_fade_in			= 0;
+	double					m_delay_sum			= 0.;
+	JitterBufferStats		m_stats;
+};
@@ -1303,11 +1303,34 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+			(transfer->flags & LIBUSB_TRANSFER_KEEP_ISO_URBS)) {
+		/* release the URBs kept by the backend across resubmissions */
+		transfer->flags &= ~LIBUSB_TRANSFER_KEEP_ISO_URBS;
+		usbi_backend->clear_transfer_priv(itransfer);
+	}
 	usbi_mutex_destroy(&itransfer->lock);
 	usbi_mutex_destroy(&itransfer->flags_lock);
 	free(itransfer);
 }
 
+struct libusb_iso_urb_stats usbi_iso_urb_stats;
+
+/** \ingroup asyncio
+ * Retrieve the counters of the isochronous URB allocations done by the
+ * backend. Used to verify that resubmitting transfers flagged with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_KEEP_ISO_URBS
+ * "LIBUSB_TRANSFER_KEEP_ISO_URBS" does not allocate memory.
+ *
+ * \param stats output location for the counters
+ */
+void API_EXPORTED libusb_get_iso_urb_stats(struct libusb_iso_urb_stats *stats)
+{
+	stats->allocations = usbi_stats_load(usbi_iso_urb_stats.allocations);
+	stats->frees = usbi_stats_load(usbi_iso_urb_stats.frees);
+	stats->reuses = usbi_stats_load(usbi_iso_urb_stats.reuses);
+}
+
 #ifdef USBI_TIMERFD_AVAILABLE
 static int disarm_timerfd(struct libusb_context *ctx)
 {
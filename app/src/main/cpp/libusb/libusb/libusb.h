@@ -1171,6 +1171,17 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Keep the backend resources of an isochronous transfer allocated after
+	 * it completes, so that resubmitting the transfer does not allocate any
+	 * memory. The resources are reused as long as the number and lengths of
+	 * the isochronous packets do not change, and they are released by
+	 * libusb_free_transfer().
+	 *
+	 * This flag is currently only supported on Linux. It is ignored on
+	 * other systems and for other transfer types.
+	 */
+	LIBUSB_TRANSFER_KEEP_ISO_URBS = 1 << 4,
 };
 
 /** \ingroup asyncio
@@ -1263,6 +1274,25 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Process wide counters of the isochronous URB allocations of the backend,
+ * retrieved by libusb_get_iso_urb_stats(). With
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_KEEP_ISO_URBS
+ * "LIBUSB_TRANSFER_KEEP_ISO_URBS" set, resubmitting a transfer only
+ * increments the reuses counter.
+ */
+struct libusb_iso_urb_stats {
+	/** Number of heap allocations: the URB array and each of its URBs. */
+	uint64_t allocations;
+
+	/** Number of heap blocks released. */
+	uint64_t frees;
+
+	/** Number of isochronous transfer submissions which reused the URBs
+	 * of the previous submission. */
+	uint64_t reuses;
+};
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1481,6 +1511,7 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_get_iso_urb_stats(struct libusb_iso_urb_stats *stats);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
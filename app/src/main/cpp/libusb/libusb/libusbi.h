@@ -240,6 +240,17 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+/* Isochronous URB allocation counters, see libusb_get_iso_urb_stats().
+ * Updated with relaxed atomics, transfers may be handled by several threads. */
+extern struct libusb_iso_urb_stats usbi_iso_urb_stats;
+#if defined(__GNUC__)
+#define usbi_stats_add(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define usbi_stats_load(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define usbi_stats_add(counter, n) ((counter) += (n))
+#define usbi_stats_load(counter) (counter)
+#endif
+
 /* Forward declaration for use in context (fully defined inside poll abstraction) */
 struct pollfd;
 
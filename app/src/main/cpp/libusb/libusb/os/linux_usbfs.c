@@ -1849,12 +1849,72 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 		if (!urb)
 			break;
 		free(urb);
+		usbi_stats_add(usbi_iso_urb_stats.frees, 1);
 	}
 
 	free(tpriv->iso_urbs);
+	usbi_stats_add(usbi_iso_urb_stats.frees, 1);
 	tpriv->iso_urbs = NULL;
 }
 
+/* Release the URBs of a completed iso transfer, unless they are kept for
+ * the next submission (LIBUSB_TRANSFER_KEEP_ISO_URBS). */
+static void release_iso_urbs(struct libusb_transfer *transfer,
+	struct linux_transfer_priv *tpriv)
+{
+	if (!(transfer->flags & LIBUSB_TRANSFER_KEEP_ISO_URBS))
+		free_iso_urbs(tpriv);
+}
+
+/* Reinitialize the URBs kept from the previous submission of an iso transfer.
+ * Returns 0 if the packet layout changed and the URBs must be reallocated. */
+static int reuse_iso_urbs(struct usbi_transfer *itransfer, int num_urbs)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	unsigned char *urb_buffer = transfer->buffer;
+	int packet_offset = 0;
+	int i, j;
+
+	if (tpriv->num_urbs != num_urbs)
+		return 0;
+
+	/* URBs are filled greedily, thus the same packet lengths give the same
+	 * split of the packets into URBs */
+	for (i = 0; i < num_urbs; i++) {
+		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+		if (packet_offset + urb->number_of_packets > transfer->num_iso_packets)
+			return 0;
+		for (j = 0; j < urb->number_of_packets; j++)
+			if (urb->iso_frame_desc[j].length !=
+					transfer->iso_packet_desc[packet_offset + j].length)
+				return 0;
+		packet_offset += urb->number_of_packets;
+	}
+	if (packet_offset != transfer->num_iso_packets)
+		return 0;
+
+	/* only the fields written back by the kernel and the ones the user may
+	 * have changed need to be reset */
+	for (i = 0; i < num_urbs; i++) {
+		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+		urb->status = 0;
+		urb->actual_length = 0;
+		urb->start_frame = 0;
+		urb->error_count = 0;
+		urb->usercontext = itransfer;
+		urb->endpoint = transfer->endpoint;
+		urb->buffer = urb_buffer;
+		for (j = 0; j < urb->number_of_packets; j++) {
+			urb->iso_frame_desc[j].actual_length = 0;
+			urb->iso_frame_desc[j].status = 0;
+			urb_buffer += urb->iso_frame_desc[j].length;
+		}
+	}
+	return 1;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2068,15 +2128,27 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	}
 	usbi_dbg("need %d %dk URBs for transfer", num_urbs, MAX_ISO_BUFFER_LENGTH / 1024);
 
+	tpriv->num_retired = 0;
+	tpriv->reap_action = NORMAL;
+	tpriv->iso_packet_offset = 0;
+
+	if (tpriv->iso_urbs) {
+		/* URBs kept from the previous submission */
+		if (reuse_iso_urbs(itransfer, num_urbs)) {
+			usbi_stats_add(usbi_iso_urb_stats.reuses, 1);
+			urbs = tpriv->iso_urbs;
+			goto submit;
+		}
+		free_iso_urbs(tpriv);
+	}
+
 	urbs = calloc(num_urbs, sizeof(*urbs));
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
+	usbi_stats_add(usbi_iso_urb_stats.allocations, 1);
 
 	tpriv->iso_urbs = urbs;
 	tpriv->num_urbs = num_urbs;
-	tpriv->num_retired = 0;
-	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
 
 	/* allocate + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
@@ -2109,6 +2181,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			free_iso_urbs(tpriv);
 			return LIBUSB_ERROR_NO_MEM;
 		}
+		usbi_stats_add(usbi_iso_urb_stats.allocations, 1);
 		urbs[i] = urb;
 
 		/* populate packet lengths */
@@ -2127,6 +2200,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		urb->buffer = urb_buffer_orig;
 	}
 
+submit:
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
 		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
@@ -2287,7 +2361,8 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 		}
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
+		/* kept URBs are released by libusb_free_transfer() */
+		if (tpriv->iso_urbs && !(transfer->flags & LIBUSB_TRANSFER_KEEP_ISO_URBS)) {
 			free_iso_urbs(tpriv);
 			tpriv->iso_urbs = NULL;
 		}
@@ -2512,7 +2587,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg("CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			release_iso_urbs(transfer, tpriv);
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2545,7 +2620,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
 		usbi_dbg("last URB in transfer --> complete!");
-		free_iso_urbs(tpriv);
+		release_iso_urbs(transfer, tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -0,0 +1,355 @@
+#include "local_stream.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <random>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __ANDROID__
+#include <linux/ashmem.h>
+#include <sys/ioctl.h>
+#endif // __ANDROID__
+#endif // __linux__
+
+#if defined(__linux__) && ! defined(F_SEAL_FUTURE_WRITE)
+// Linux 5.1, missing from the older headers.
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// The ring starts after the header, each part aligned to a cache line.
+static constexpr size_t ALIGNMENT = 64;
+
+static size_t align_up(size_t size)
+{
+	return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+#ifdef __linux__
+
+static socklen_t abstract_address(const std::string &name, sockaddr_un &address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	// Leading zero: the abstract namespace, no file is left behind.
+	const size_t len = std::min(name.size(), sizeof(address.sun_path) - 1);
+	memcpy(address.sun_path + 1, name.data(), len);
+	return socklen_t(offsetof(sockaddr_un, sun_path) + 1 + len);
+}
+
+// Shared memory of size bytes: a memfd, sealed against resizing, or ashmem on the kernels without memfd.
+// Made read-only by seal_shared_memory() once mapped.
+static int create_shared_memory(size_t size)
+{
+#ifdef SYS_memfd_create
+	int fd = int(syscall(SYS_memfd_create, "qmx-local-stream", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+	if (fd != -1) {
+		if (ftruncate(fd, off_t(size)) != 0) {
+			::close(fd);
+			return -1;
+		}
+#ifdef F_ADD_SEALS
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#endif // F_ADD_SEALS
+		return fd;
+	}
+#endif // SYS_memfd_create
+#ifdef __ANDROID__
+	int ashmem = open("/dev/ashmem", O_RDWR | O_CLOEXEC);
+	if (ashmem != -1) {
+		ioctl(ashmem, ASHMEM_SET_NAME, "qmx-local-stream");
+		if (ioctl(ashmem, ASHMEM_SET_SIZE, size) == 0)
+			return ashmem;
+		::close(ashmem);
+	}
+#endif // __ANDROID__
+	return -1;
+}
+
+// No new writable mapping and no write from now on, the writer's mapping stays writable. The seal holds for
+// every file description of the memfd, a reopening through /proc/self/fd included. ashmem is limited to reading.
+static bool seal_shared_memory(int fd)
+{
+#ifdef F_ADD_SEALS
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == 0)
+		return true;
+#endif // F_ADD_SEALS
+#ifdef __ANDROID__
+	if (ioctl(fd, ASHMEM_SET_PROT_MASK, PROT_READ) == 0)
+		return true;
+#endif // __ANDROID__
+	return false;
+}
+
+bool LocalStreamWriter::open(const std::string &socket_name, uint32_t slot_frames, uint32_t slot_count)
+{
+	close();
+	if (socket_name.empty() || slot_frames == 0 || slot_count < 2)
+		return false;
+	const size_t stride = align_up(sizeof(LocalStreamSlot) + slot_frames * 2 * sizeof(int16_t));
+	m_size  = align_up(sizeof(LocalStreamHeader)) + stride * slot_count;
+	m_memfd = create_shared_memory(m_size);
+	if (m_memfd == -1) {
+		fprintf(stderr, "Local stream: cannot create the shared memory: %s\n", strerror(errno));
+		return false;
+	}
+	void *memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+	if (memory == MAP_FAILED) {
+		fprintf(stderr, "Local stream: cannot map the shared memory: %s\n", strerror(errno));
+		close();
+		return false;
+	}
+	memset(memory, 0, m_size);
+	m_header = new (memory) LocalStreamHeader;
+	m_header->magic       = LOCAL_STREAM_MAGIC;
+	m_header->version     = LOCAL_STREAM_VERSION;
+	m_header->slot_count  = slot_count;
+	m_header->slot_frames = slot_frames;
+	m_header->slot_stride = uint32_t(stride);
+	m_header->session     = std::random_device{}() | 1;
+	m_header->written.store(0, std::memory_order_relaxed);
+	m_header->futex.store(0, std::memory_order_relaxed);
+	m_header->closed.store(0, std::memory_order_release);
+
+	// The clients must not be able to corrupt the ring of the others: no writable handle is handed out.
+	if (! seal_shared_memory(m_memfd)) {
+		fprintf(stderr, "Local stream: cannot make the shared memory read-only: %s\n", strerror(errno));
+		close();
+		return false;
+	}
+
+	m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sockaddr_un address;
+	const socklen_t address_len = abstract_address(socket_name, address);
+	if (m_listen_fd == -1 || bind(m_listen_fd, reinterpret_cast<const sockaddr*>(&address), address_len) != 0 ||
+		listen(m_listen_fd, 8) != 0) {
+		fprintf(stderr, "Local stream: cannot listen on @%s: %s\n", socket_name.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	m_stop.store(false);
+	m_blocks = 0;
+	m_clients.store(0);
+	m_thread = std::thread(&LocalStreamWriter::accept_thread, this);
+	return true;
+}
+
+void LocalStreamWriter::close()
+{
+	if (m_thread.joinable()) {
+		m_stop.store(true);
+		m_thread.join();
+	}
+	if (m_listen_fd != -1)
+		::close(m_listen_fd);
+	m_listen_fd = -1;
+	if (m_header != nullptr) {
+		// Wake the readers up to tell them.
+		m_header->closed.store(1, std::memory_order_release);
+		m_header->futex.fetch_add(1, std::memory_order_release);
+		syscall(SYS_futex, &m_header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+		munmap(m_header, m_size);
+		m_header = nullptr;
+	}
+	if (m_memfd != -1)
+		::close(m_memfd);
+	m_memfd = -1;
+}
+
+// Hand the ring over to each client connecting, then hang up. Off the streaming thread, as accept() blocks.
+void LocalStreamWriter::accept_thread()
+{
+	while (! m_stop.load()) {
+		pollfd fd { m_listen_fd, POLLIN, 0 };
+		if (poll(&fd, 1, 200) <= 0)
+			continue;
+		const int client = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1)
+			continue;
+		char    byte = 0;
+		iovec   iov { &byte, 1 };
+		char    control[CMSG_SPACE(sizeof(int))] = { 0 };
+		msghdr  msg {};
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &m_memfd, sizeof(int));
+		if (sendmsg(client, &msg, MSG_NOSIGNAL) == 1)
+			m_clients.fetch_add(1, std::memory_order_relaxed);
+		::close(client);
+	}
+}
+
+void LocalStreamWriter::push_block(const int16_t *iq, size_t frames, uint64_t sample_index, uint64_t capture_us)
+{
+	if (m_header == nullptr)
+		return;
+	const uint64_t block = m_header->written.load(std::memory_order_relaxed);
+	LocalStreamSlot *slot = reinterpret_cast<LocalStreamSlot*>(reinterpret_cast<uint8_t*>(m_header) +
+		align_up(sizeof(LocalStreamHeader)) + size_t(block % m_header->slot_count) * m_header->slot_stride);
+	frames = std::min<size_t>(frames, m_header->slot_frames);
+	slot->seq.store(block * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->sample_index = sample_index;
+	slot->capture_us   = capture_us;
+	slot->frames       = uint32_t(frames);
+	memcpy(reinterpret_cast<uint8_t*>(slot) + sizeof(LocalStreamSlot), iq, frames * 2 * sizeof(int16_t));
+	slot->seq.store(block * 2 + 2, std::memory_order_release);
+	m_header->written.store(block + 1, std::memory_order_release);
+	m_header->futex.store(uint32_t(block + 1), std::memory_order_release);
+	// A single system call per block, cheaper than keeping track of the waiting readers in the read-only ring.
+	syscall(SYS_futex, &m_header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	++ m_blocks;
+}
+
+bool LocalStreamReader::open(const std::string &socket_name)
+{
+	close();
+	const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return false;
+	sockaddr_un address;
+	const socklen_t address_len = abstract_address(socket_name, address);
+	int fd = -1;
+	if (connect(sock, reinterpret_cast<const sockaddr*>(&address), address_len) == 0) {
+		char    byte;
+		iovec   iov { &byte, 1 };
+		char    control[CMSG_SPACE(sizeof(int))];
+		msghdr  msg {};
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1) {
+			const cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	::close(sock);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	void *memory = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(LocalStreamHeader)) {
+		m_size = size_t(st.st_size);
+		memory = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+#ifdef __ANDROID__
+	if (memory == MAP_FAILED) {
+		// ashmem reports no size through fstat.
+		const int size = ioctl(fd, ASHMEM_GET_SIZE, nullptr);
+		if (size > 0) {
+			m_size = size_t(size);
+			memory = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+	}
+#endif // __ANDROID__
+	::close(fd);
+	if (memory == MAP_FAILED)
+		return false;
+	const LocalStreamHeader *header = static_cast<const LocalStreamHeader*>(memory);
+	if (header->magic != LOCAL_STREAM_MAGIC || header->version != LOCAL_STREAM_VERSION || header->slot_count < 2 ||
+		header->slot_stride < sizeof(LocalStreamSlot) + header->slot_frames * 2 * sizeof(int16_t) ||
+		align_up(sizeof(LocalStreamHeader)) + size_t(header->slot_stride) * header->slot_count > m_size) {
+		munmap(memory, m_size);
+		return false;
+	}
+	m_header = header;
+	m_next   = m_header->written.load(std::memory_order_acquire);
+	m_stats  = Stats();
+	return true;
+}
+
+void LocalStreamReader::close()
+{
+	if (m_header != nullptr)
+		munmap(const_cast<LocalStreamHeader*>(m_header), m_size);
+	m_header = nullptr;
+}
+
+bool LocalStreamReader::wait(uint32_t timeout_us)
+{
+	if (m_header == nullptr)
+		return false;
+	// The futex value first: a block written after it was loaded makes the wait return right away.
+	const uint32_t futex = m_header->futex.load(std::memory_order_acquire);
+	if (m_header->written.load(std::memory_order_acquire) > m_next)
+		return true;
+	if (m_header->closed.load(std::memory_order_acquire))
+		return false;
+	const timespec timeout { time_t(timeout_us / 1000000), long(timeout_us % 1000000) * 1000 };
+	syscall(SYS_futex, &m_header->futex, FUTEX_WAIT, futex, &timeout, nullptr, 0);
+	return m_header->written.load(std::memory_order_acquire) > m_next;
+}
+
+#else // __linux__
+
+bool LocalStreamWriter::open(const std::string&, uint32_t, uint32_t) { return false; }
+void LocalStreamWriter::close() {}
+void LocalStreamWriter::accept_thread() {}
+void LocalStreamWriter::push_block(const int16_t*, size_t, uint64_t, uint64_t) {}
+bool LocalStreamReader::open(const std::string&) { return false; }
+void LocalStreamReader::close() {}
+bool LocalStreamReader::wait(uint32_t) { return false; }
+
+#endif // __linux__
+
+const LocalStreamSlot* LocalStreamReader::slot(uint64_t block) const
+{
+	return reinterpret_cast<const LocalStreamSlot*>(reinterpret_cast<const uint8_t*>(m_header) +
+		align_up(sizeof(LocalStreamHeader)) + size_t(block % m_header->slot_count) * m_header->slot_stride);
+}
+
+bool LocalStreamReader::read(int16_t *out, size_t &frames, uint64_t &sample_index, uint64_t &capture_us)
+{
+	if (m_header == nullptr)
+		return false;
+	for (;;) {
+		const uint64_t written = m_header->written.load(std::memory_order_acquire);
+		if (m_next >= written)
+			return false;
+		// The slot of block written - slot_count is being overwritten.
+		const uint64_t oldest = written > m_header->slot_count - 1 ? written - (m_header->slot_count - 1) : 0;
+		if (m_next < oldest) {
+			m_stats.blocks_lost += oldest - m_next;
+			m_next = oldest;
+		}
+		const LocalStreamSlot *s = slot(m_next);
+		const uint64_t expected = m_next * 2 + 2;
+		++ m_next;
+		if (s->seq.load(std::memory_order_acquire) != expected) {
+			++ m_stats.blocks_lost;
+			continue;
+		}
+		frames       = std::min<size_t>(s->frames, m_header->slot_frames);
+		sample_index = s->sample_index;
+		capture_us   = s->capture_us;
+		memcpy(out, reinterpret_cast<const uint8_t*>(s) + sizeof(LocalStreamSlot), frames * 2 * sizeof(int16_t));
+		// Lapped by the writer while copying: the copy is torn.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s->seq.load(std::memory_order_relaxed) != expected) {
+			++ m_stats.blocks_lost;
+			continue;
+		}
+		++ m_stats.blocks;
+		return true;
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// Same-host IQ transport. The server writes the native IQ blocks into a ring in shared memory, a sealed memfd
+// or ashmem on older Android kernels, the local clients map it read-only and copy the blocks straight out of it.
+// The memory is handed over by SCM_RIGHTS to whoever connects to an abstract Unix socket. The readers sleep
+// on a futex word of the ring, woken by the writer after each block. CAT stays on the ENet connection,
+// a mapped client stops its channel 0 stream by CatCommandID::LocalSubscribe.
+//
+// A slot is a seqlock: its sequence is odd while the writer fills it, then the block number times two plus two.
+// A reader copies the block and checks the sequence again, a reader lapped by the writer skips ahead.
+
+static constexpr uint32_t LOCAL_STREAM_MAGIC	= 0x51584d4c;	// "LMXQ"
+static constexpr uint32_t LOCAL_STREAM_VERSION	= 1;
+
+struct LocalStreamHeader
+{
+	uint32_t				magic;
+	uint32_t				version;
+	uint32_t				slot_count;
+	uint32_t				slot_frames;
+	// Bytes from the start of a slot to the next.
+	uint32_t				slot_stride;
+	// Random per server start.
+	uint32_t				session;
+	// Blocks written in total.
+	std::atomic<uint64_t>	written;
+	// Low 32 bits of written, the futex the readers wait on.
+	std::atomic<uint32_t>	futex;
+	// Set by the writer on close, the readers are to reconnect.
+	std::atomic<uint32_t>	closed;
+};
+
+struct LocalStreamSlot
+{
+	std::atomic<uint64_t>	seq;
+	// Index of the first IQ frame of the block since the start of streaming.
+	uint64_t				sample_index;
+	// Server monotonic time the block arrived from the radio, microseconds, see CatCommandID::ClockSyncReply.
+	uint64_t				capture_us;
+	uint32_t				frames;
+	uint32_t				reserved;
+	// Followed by slot_frames interleaved int16_t I/Q frames.
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+	"the ring is shared between processes");
+
+// Server side: owns the ring and the socket handing it out.
+class LocalStreamWriter
+{
+public:
+	struct Stats {
+		uint64_t	blocks			= 0;
+		// Clients handed the ring.
+		uint64_t	clients			= 0;
+	};
+
+	~LocalStreamWriter() { close(); }
+
+	// socket_name: abstract Unix socket name. slot_count blocks of slot_frames frames are kept.
+	bool		open(const std::string &socket_name, uint32_t slot_frames, uint32_t slot_count = 64);
+	void		close();
+	bool		is_open() const { return m_header != nullptr; }
+
+	// Streaming thread only.
+	void		push_block(const int16_t *iq, size_t frames, uint64_t sample_index, uint64_t capture_us);
+
+	Stats		stats() const { return { m_blocks, m_clients.load(std::memory_order_relaxed) }; }
+
+private:
+	void		accept_thread();
+
+	// Sealed read-only once mapped by the writer, handed to the clients.
+	int						m_memfd		= -1;
+	int						m_listen_fd	= -1;
+	LocalStreamHeader	   *m_header	= nullptr;
+	size_t					m_size		= 0;
+	std::thread				m_thread;
+	std::atomic<bool>		m_stop { false };
+	uint64_t				m_blocks	= 0;
+	std::atomic<uint64_t>	m_clients { 0 };
+};
+
+// Client side: maps the ring of a server running on the same host.
+class LocalStreamReader
+{
+public:
+	struct Stats {
+		uint64_t	blocks			= 0;
+		// Blocks overwritten before they were read.
+		uint64_t	blocks_lost		= 0;
+	};
+
+	~LocalStreamReader() { close(); }
+
+	// Connect to the socket, receive and map the ring. Reading starts at the newest block.
+	bool		open(const std::string &socket_name);
+	void		close();
+	bool		is_open() const { return m_header != nullptr; }
+	// The server closed the ring, reopen it.
+	bool		closed() const { return m_header != nullptr && m_header->closed.load(std::memory_order_acquire) != 0; }
+	uint32_t	session() const { return m_header != nullptr ? m_header->session : 0; }
+	uint32_t	max_frames() const { return m_header != nullptr ? m_header->slot_frames : 0; }
+
+	// Wait up to timeout_us for a block not read yet, true if there is one.
+	bool		wait(uint32_t timeout_us);
+	// Copy the next block to out, which holds max_frames() frames. False if there is none.
+	bool		read(int16_t *out, size_t &frames, uint64_t &sample_index, uint64_t &capture_us);
+
+	Stats		stats() const { return m_stats; }
+
+private:
+	const LocalStreamSlot* slot(uint64_t block) const;
+
+	const LocalStreamHeader *m_header	= nullptr;
+	size_t					m_size		= 0;
+	uint64_t				m_next		= 0;
+	Stats					m_stats;
+};
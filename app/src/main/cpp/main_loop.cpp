@@ -1,15 +1,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 
 #include <string>
 #include <atomic>
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
 
 #ifdef _WIN32
 // Must be before <windows.h>, which libusb.h includes, to avoid conflicts with min/max macros and to suppress inclusion of legacy winsock headers.
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #endif // _WIN32
 #include <libusb.h>
 
@@ -17,8 +29,22 @@
 #include "enet/enet.h"
 
 #include "cat.h"
+#include "slab_allocator.h"
+#include "iq_multicast.h"
+#include "stream_quality.h"
+#include "channelizer.h"
+#include "sample_rate.h"
+#include "iq_recorder.h"
+#include "time_shift.h"
+#include "name_resolver.h"
+#include "relay_upstream.h"
+#include "local_stream.h"
+#include "skimmer.h"
 
 extern std::atomic<bool> g_run;
+// Pause requested through JNI: ISO streaming is stopped, while the libusb context,
+// the claimed interfaces and the ENet hosts with their peers are kept alive.
+extern std::atomic<bool> g_pause;
 
 #define LOGD(S, ...) fprintf(stderr, (S), ##__VA_ARGS__)
 
@@ -40,117 +66,1267 @@ extern std::atomic<bool> g_run;
 // Number of isochronous packets per libusb callback.
 #define NUM_ISO_PACKETS 20 // 10
 
-//static int ipacket = 0;
+// HDSDR ExtIO buffer len, multiples of 512.
+// 5.3ms latency
+#define EXT_BLOCKLEN (512)
 
-static ENetAddress  g_address;
-static ENetHost*    g_server = nullptr;
+// Peer block lengths other than EXT_BLOCKLEN, see CatCommandID::BlockLength: EXT_BLOCKLEN >> (i + 1) frames
+// sliced out of the native blocks, EXT_BLOCKLEN << (i + 1) frames assembled of them.
+#define SLICE_LENGTHS 3
+#define AGGREGATE_LENGTHS 3
+static_assert((EXT_BLOCKLEN >> SLICE_LENGTHS) == MIN_BLOCK_FRAMES && (EXT_BLOCKLEN << AGGREGATE_LENGTHS) == MAX_BLOCK_FRAMES,
+	"block lengths");
+
+//static int ipacket = 0;
 
 // ENet client data
 struct Client
 {
+	// Unique over the server run, identifies the peer to the name resolver.
+	uint64_t	id = 0;
+	// Numeric address until the reverse DNS answers.
 	std::string name;
+	// Receives the IQ stream from the multicast group, not from ENet channel 0.
+	bool		multicast = false;
+	// Receives the IQ stream from the shared memory ring, not from ENet channel 0.
+	bool		local = false;
+	// Receives these narrowband subchannels, bit mask of (1 << subchannel), not the full band.
+	uint32_t	subchannels = 0;
+	// Receives the CW skimmer spots, with no IQ stream if spots_only.
+	bool		spots = false;
+	bool		spots_only = false;
+	StreamQuality quality;
+	// Last time the link signals were fed to quality, ENet milliseconds.
+	enet_uint32	quality_checked = 0;
+	// IQ blocks not handed over to ENet yet, oldest first, each holding a reference to its packet.
+	std::deque<ENetPacket*> iq_queue;
+	size_t		iq_queue_bytes = 0;
+	uint64_t	iq_blocks_sent = 0;
+	uint64_t	iq_blocks_dropped = 0;
+	// Arrival of the oldest datagram carrying a CAT command not dispatched yet, microseconds, zero if none.
+	uint64_t	cat_arrival_us = 0;
+	// Arrival of the last clock synchronization request, answered right away by the thread servicing the peer.
+	uint64_t	clock_sync_arrival_us = 0;
+	// Receives the unicast stream resampled to exactly SAMPLE_RATE.
+	bool		exact_rate = false;
+	// Frames per block of the plain stream, 0: EXT_BLOCKLEN. Longer blocks are received once the next one starts.
+	uint16_t	block_frames = 0;
+	bool		aggregating = false;
+	// Replaying the IQ history, the live blocks are picked up from the history until the client catches up.
+	bool		prerolling = false;
+	// Pre-roll requested by CatCommandID::Preroll, the live edge is announced once it ends.
+	bool		preroll_requested = false;
+	// Index of the next history block to send.
+	uint64_t	preroll_block = 0;
+	// Replaying the time-shift history, the live blocks are skipped until the replay catches up.
+	bool		time_shifting = false;
+	uint32_t	time_shift_session = 0;
 };
 
-// HDSDR ExtIO buffer len, multiples of 512.
-// 5.3ms latency
-#define EXT_BLOCKLEN (512)
+// IQ block posted by the streaming thread to the network threads. Each shard wraps it into an ENet packet
+// of its own without copying the samples, the block is freed together with the last of these packets.
+struct IQBlock
+{
+	std::atomic<int>	refs { 0 };
+	uint64_t			sample_index = 0;
+	// Input rate / output rate of the resampler to exactly SAMPLE_RATE, the estimate belongs to the streaming thread.
+	double				resample_ratio = 1.;
+	// Monotonic time the block arrived from the radio, microseconds.
+	uint64_t			capture_us = 0;
+	size_t				frames = 0;
+	int16_t				iq[EXT_BLOCKLEN * 2];
+};
+
+static void release_iq_block(IQBlock *block)
+{
+	if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete block;
+}
+
+// ENet hosts, one per bind address, with their peers and the IQ fan-out state, all serviced by a single thread.
+// Shard 0 is serviced by the streaming thread. With ServerConfig::network_threads > 1, the other shards are serviced
+// by threads of their own, their hosts sharing the ports of shard 0 through SO_REUSEPORT.
+struct Shard
+{
+	size_t					index = 0;
+	std::vector<ENetHost*>	hosts;
+	std::thread				thread;
+	std::atomic<bool>		stop { false };
+	// Other than shard 0: held by the shard thread while it services its hosts, and by the streaming thread
+	// while it handles the CAT commands of the shard's peers or sends to them.
+	std::mutex				mutex;
+	// Blocks posted by the streaming thread, each holding a reference, and the eventfd waking the shard thread up.
+	std::mutex				inbox_mutex;
+	std::vector<IQBlock*>	inbox;
+	int						wake_fd = -1;
+
+	// The fan-out state, touched by the thread servicing the shard only.
+	// Index of the first IQ frame of the next block, and the monotonic time the frames up to it arrived from the radio.
+	uint64_t				sample_index = 0;
+	uint64_t				capture_us = 0;
+	// Indexed by Client::exact_rate, as the decimator keeps the state of its own stream.
+	StreamTierEncoder		tier_encoders[2];
+	std::vector<uint8_t>	tier_buffer;
+	FractionalResampler		resampler;
+	std::vector<int16_t>	resampled;
+	// Run on the native blocks as long as a peer of the shard is subscribed to a subchannel.
+	PolyphaseChannelizer	channelizer;
+	// Ring of the last IQ block packets of the native stream, each holding a reference. Block b is stored at b % size.
+	std::vector<ENetPacket*> history;
+	// Blocks pushed to the history in total and blocks currently held.
+	uint64_t				history_blocks = 0;
+	size_t					history_filled = 0;
+	std::vector<int16_t>	time_shift_buffer;
+	// Blocks of EXT_BLOCKLEN << (i + 1) frames being assembled for the peers of that length, and the next frame expected.
+	ENetPacket*				aggregates[AGGREGATE_LENGTHS] = { nullptr };
+	uint64_t				aggregate_next[AGGREGATE_LENGTHS] = { 0 };
+	// Peers receiving the multicast stream, read by the streaming thread.
+	std::atomic<int>		multicast_peers { 0 };
+};
+
+static std::vector<std::unique_ptr<Shard>> g_shards;
+
+// CAT commands and new peers of the shard threads, handled by the streaming thread, which owns the radio.
+struct ControlMessage
+{
+	Shard		*shard;
+	ENetPeer	*peer;
+	// Tells the peer from a later peer reusing the same ENetPeer slot.
+	enet_uint32	connect_id;
+	// CAT command, nullptr for a new peer.
+	ENetPacket	*packet;
+};
+static std::mutex					g_control_mutex;
+static std::vector<ControlMessage>	g_control_inbox;
+static std::vector<ControlMessage>	g_control_batch;
+static int							g_control_wake_fd = -1;
+
+static IQMulticast g_multicast;
+// Same-host clients map the IQ ring instead of receiving channel 0.
+static LocalStreamWriter g_local_stream;
+// Decodes the CW signals of the band into spots for the peers subscribed by CatCommandID::SkimmerSubscribe.
+static CwSkimmer g_skimmer;
+static std::vector<CwSpot> g_spots;
+// LO the skimmer decodes at, the decoders are released when it changes.
+static int64_t g_skimmer_freq = 0;
+static_assert(EXT_BLOCKLEN == CwSkimmer::BLOCK_FRAMES, "the skimmer runs on the native blocks");
+// Reverse DNS of the peers, the lookups never run on the streaming thread.
+static NameResolver g_resolver;
+static std::vector<NameResolver::Result> g_resolved_names;
+static std::atomic<uint64_t> g_client_ids { 0 };
+// Index of the first IQ frame of the next block.
+static uint64_t    g_sample_index = 0;
+
+static StreamQualityConfig	g_stream_quality_config;
+// Period of feeding the link signals to the per peer quality controllers.
+#define STREAM_QUALITY_CHECK_MS 100
+
+// Per peer IQ queue budget, from ServerConfig.
+static size_t	g_iq_queue_max_blocks = 24;
+static size_t	g_iq_queue_max_bytes  = 256 * 1024;
+// IQ blocks dropped from the queues of all the peers of all the shards.
+static std::atomic<uint64_t> g_iq_blocks_dropped { 0 };
+// IQ blocks are handed over to ENet while it holds fewer unsent commands for the peer.
+#define IQ_HANDOFF_MAX_COMMANDS 16
+
+static uint64_t monotonic_us()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// True sample rate of the radio and the resampler to exactly SAMPLE_RATE for the clients asking for it.
+static SampleRateEstimator	g_sample_rate(SAMPLE_RATE);
+static uint64_t				g_sample_rate_published_us = 0;
+// Period of broadcasting the sample rate estimate.
+#define SAMPLE_RATE_PUBLISH_US 5000000
+
+// Local recording of the IQ stream, fed from the streaming thread without ever blocking it.
+static IQRecorder			g_recorder;
+
+// History of the IQ stream the clients seek back into, served by its own reader thread.
+static TimeShift			g_time_shift;
+static uint32_t				g_time_shift_sessions = 0;
+// The latest blocks are kept in RAM, the older ones are spilled to the time-shift file.
+#define TIME_SHIFT_RAM_SECONDS 10
+
+// Relay mode: the stream comes from another server instead of the radio.
+static RelayUpstream		g_relay;
+static std::vector<RelayUpstream::Event> g_relay_events;
+
+static uint64_t unix_time_us()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+// Tag the recording with the frequency the radio is tuned to.
+static void record_frequency()
+{
+	const CatState &state = g_relay.running() ? g_relay.state() : g_Cat.state();
+	if (g_recorder.running() && state.is_valid(CatCommandID::SetFreq))
+		g_recorder.push_frequency(state.freq, g_sample_index);
+}
+
+static void release_packet(ENetPacket *packet)
+{
+	if (-- packet->referenceCount == 0)
+		enet_packet_destroy(packet);
+}
+
+// Hand the queued IQ blocks over to ENet as long as ENet holds only a few unsent commands for the peer.
+// The IQ packets are fragmented into reliable commands, which ENet can neither drop nor send past a full
+// window, thus a slow peer backs up in its bounded queue instead of in ENet's command lists.
+static void flush_iq_queue(ENetPeer *peer, Client *client)
+{
+	if (client->iq_queue.empty())
+		return;
+	size_t pending = enet_list_size(&peer->outgoingCommands) + enet_list_size(&peer->outgoingSendReliableCommands);
+	while (! client->iq_queue.empty() && pending < IQ_HANDOFF_MAX_COMMANDS) {
+		ENetPacket *packet = client->iq_queue.front();
+		client->iq_queue.pop_front();
+		client->iq_queue_bytes -= packet->dataLength;
+		// One command per fragment.
+		const size_t refs = packet->referenceCount;
+		if (enet_peer_send(peer, 0, packet) == 0) {
+			pending += packet->referenceCount - refs;
+			++ client->iq_blocks_sent;
+		}
+		release_packet(packet);
+	}
+}
+
+// Queue an IQ block for a peer. Once the latency or byte budget is exceeded, the oldest blocks are dropped.
+// The latency budget is counted in the blocks of the peer's length.
+static void queue_iq_block(ENetPeer *peer, Client *client, ENetPacket *packet)
+{
+	++ packet->referenceCount;
+	client->iq_queue.push_back(packet);
+	client->iq_queue_bytes += packet->dataLength;
+	// A subchannel peer receives a packet per subchannel and block.
+	const size_t max_blocks = client->subchannels != 0 ? g_iq_queue_max_blocks * size_t(__builtin_popcount(client->subchannels)) :
+		client->block_frames == 0 ? g_iq_queue_max_blocks :
+		std::max<size_t>(1, g_iq_queue_max_blocks * EXT_BLOCKLEN / client->block_frames);
+	while (client->iq_queue.size() > 1 &&
+		(client->iq_queue.size() > max_blocks || client->iq_queue_bytes > g_iq_queue_max_bytes)) {
+		ENetPacket *oldest = client->iq_queue.front();
+		client->iq_queue.pop_front();
+		client->iq_queue_bytes -= oldest->dataLength;
+		release_packet(oldest);
+		++ client->iq_blocks_dropped;
+		++ g_iq_blocks_dropped;
+	}
+	flush_iq_queue(peer, client);
+}
+
+static void release_iq_queue(Client *client)
+{
+	for (ENetPacket *packet : client->iq_queue)
+		release_packet(packet);
+	client->iq_queue.clear();
+	client->iq_queue_bytes = 0;
+}
+
+static std::atomic<uint64_t> g_preroll_blocks_sent { 0 };
+// Pre-roll blocks handed to a single peer per pass, ENet further paces them by the peer's window.
+#define PREROLL_BLOCKS_PER_PASS 8
+
+static void push_history(Shard &shard, ENetPacket *packet)
+{
+	if (shard.history.empty())
+		return;
+	ENetPacket *&slot = shard.history[shard.history_blocks % shard.history.size()];
+	if (slot != nullptr)
+		release_packet(slot);
+	++ packet->referenceCount;
+	slot = packet;
+	++ shard.history_blocks;
+	shard.history_filled = std::min(shard.history_filled + 1, shard.history.size());
+}
+
+static void release_history(Shard &shard)
+{
+	for (ENetPacket *&packet : shard.history)
+		if (packet != nullptr) {
+			release_packet(packet);
+			packet = nullptr;
+		}
+	shard.history_blocks = 0;
+	shard.history_filled = 0;
+}
+
+static ENetPacket* create_preroll_status_packet(uint64_t block, bool live)
+{
+	uint8_t data[2 + 8 + 1];
+	CatCommandID   cmd          = CatCommandID::PrerollStatus;
+	const uint64_t sample_index = block * EXT_BLOCKLEN;
+	memcpy(data,     &cmd,          2);
+	memcpy(data + 2, &sample_index, 8);
+	data[10] = live;
+	return enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+}
+
+static bool preroll_allowed(const Client *client)
+{
+	return ! (client->multicast || client->local || client->quality.enabled() || client->exact_rate || client->subchannels != 0 ||
+		client->spots_only || client->time_shifting);
+}
+
+// Switch the peer to the live stream, announcing the live edge if it asked for the pre-roll.
+static void end_preroll(Shard &shard, ENetPeer *peer, Client *client)
+{
+	client->prerolling = false;
+	if (client->preroll_requested) {
+		client->preroll_requested = false;
+		enet_peer_send(peer, 1, create_preroll_status_packet(shard.history_blocks, true));
+	}
+}
+
+// Start or stop the pre-roll requested by CatCommandID::Preroll.
+static void request_preroll(Shard &shard, ENetPeer *peer, Client *client, bool enable)
+{
+	if (enable && preroll_allowed(client) && shard.history_filled > 0) {
+		// The live blocks queued meanwhile are replayed from the history.
+		release_iq_queue(client);
+		client->prerolling        = true;
+		client->preroll_requested = true;
+		client->preroll_block     = shard.history_blocks - shard.history_filled;
+		enet_peer_send(peer, 1, create_preroll_status_packet(client->preroll_block, false));
+		printf("%s pre-roll of %d ms\n", client->name.c_str(), int(shard.history_filled * EXT_BLOCKLEN * 1000 / SAMPLE_RATE));
+	} else if (! client->time_shifting) {
+		// Nothing to replay, or stopped: live from the next block on.
+		client->preroll_requested = true;
+		end_preroll(shard, peer, client);
+	}
+}
+
+// Replay the history to a peer as fast as its link allows: a block is handed over only once the previous ones
+// left the peer's queue, so that the pre-roll never causes live blocks to be dropped. Adaptive quality, the exact
+// rate, subchannels and multicast switch the peer to the live stream.
+static void feed_preroll(Shard &shard, ENetPeer *peer, Client *client)
+{
+	if (client->prerolling && ! preroll_allowed(client))
+		end_preroll(shard, peer, client);
+	for (int i = 0; client->prerolling && i < PREROLL_BLOCKS_PER_PASS && client->iq_queue.empty(); ++ i) {
+		// A peer slower than the stream skips the blocks already overwritten.
+		client->preroll_block = std::max(client->preroll_block, shard.history_blocks - shard.history_filled);
+		if (client->preroll_block == shard.history_blocks) {
+			end_preroll(shard, peer, client);
+			printf("%s pre-roll done, live\n", client->name.c_str());
+			break;
+		}
+		queue_iq_block(peer, client, shard.history[client->preroll_block ++ % shard.history.size()]);
+		++ g_preroll_blocks_sent;
+	}
+}
+
+// Radio USB connection is up. While down, the ENet peers stay connected and are notified.
+static bool g_radio_online = false;
+// Set from the libusb transfer callback when the radio stopped responding.
+static bool g_radio_lost   = false;
+
+static void send_to_shard_peers(Shard &shard, enet_uint8 channel, ENetPacket *packet)
+{
+	for (ENetHost *server : shard.hosts)
+		for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+			if (peer->state == ENET_PEER_STATE_CONNECTED)
+				enet_peer_send(peer, channel, packet);
+}
+
+// Send a packet to all the connected peers of all the hosts. Streaming thread only.
+// The reference count of a packet is not atomic, thus every other shard gets a copy of its own.
+static void broadcast_packet(enet_uint8 channel, ENetPacket *packet)
+{
+	for (size_t i = 1; i < g_shards.size(); ++ i) {
+		Shard &shard = *g_shards[i];
+		ENetPacket *copy = enet_packet_create(packet->data, packet->dataLength, packet->flags);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		send_to_shard_peers(shard, channel, copy);
+		if (copy->referenceCount == 0)
+			enet_packet_destroy(copy);
+	}
+	if (! g_shards.empty())
+		send_to_shard_peers(*g_shards.front(), channel, packet);
+	if (packet->referenceCount == 0)
+		enet_packet_destroy(packet);
+}
+
+static ENetPacket* create_radio_status_packet()
+{
+	uint8_t data[3];
+	CatCommandID cmd = CatCommandID::RadioStatus;
+	memcpy(data, &cmd, 2);
+	data[2] = g_radio_online;
+	return enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+}
+
+static void broadcast_radio_status()
+{
+	broadcast_packet(1, create_radio_status_packet());
+}
+
+// Snapshot of the CAT shadow state, so that a new client does not need to resend its settings.
+static ENetPacket* create_state_snapshot_packet()
+{
+	uint8_t data[2 + CatState::snapshot_size];
+	CatCommandID cmd = CatCommandID::StateSnapshot;
+	memcpy(data, &cmd, 2);
+	(g_relay.running() ? g_relay.state() : g_Cat.state()).write_snapshot(data + 2);
+	return enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+}
+
+// Estimated sample rate of the radio.
+static ENetPacket* create_sample_rate_packet()
+{
+	uint8_t data[2 + 1 + 8];
+	CatCommandID cmd   = CatCommandID::SampleRate;
+	double       rate  = g_relay.running() ? g_relay.sample_rate() : g_sample_rate.rate();
+	memcpy(data, &cmd, 2);
+	data[2] = g_relay.running() ? g_relay.sample_rate_valid() : g_sample_rate.valid();
+	memcpy(data + 3, &rate, 8);
+	return enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+}
+
+static ENetPacket* create_time_shift_status_packet(uint64_t block, uint8_t speed)
+{
+	uint8_t data[2 + 8 + 8 + 1];
+	CatCommandID   cmd          = CatCommandID::TimeShiftStatus;
+	const uint64_t sample_index = block * EXT_BLOCKLEN;
+	const uint64_t oldest_index = (g_time_shift.running() ? g_time_shift.oldest_block() : block) * EXT_BLOCKLEN;
+	memcpy(data,      &cmd,          2);
+	memcpy(data + 2,  &sample_index, 8);
+	memcpy(data + 10, &oldest_index, 8);
+	data[18] = speed;
+	return enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE);
+}
+
+// Seek a peer into the time-shift history, or back to live with speed 0.
+static void start_time_shift(ENetPeer *peer, Client *client, int64_t start, uint8_t speed)
+{
+	// The replay is the plain native rate stream, like the pre-roll.
+	if (! g_time_shift.running() || client->multicast || client->local || client->quality.enabled() || client->exact_rate ||
+		client->subchannels != 0 || client->spots_only)
+		speed = 0;
+	const uint64_t head = g_sample_index / EXT_BLOCKLEN;
+	if (client->time_shifting || speed != 0) {
+		// Drop the blocks queued from the previous position. The TimeShiftStatus replaces the PrerollStatus.
+		release_iq_queue(client);
+		client->prerolling        = false;
+		client->preroll_requested = false;
+	}
+	if (client->time_shifting) {
+		g_time_shift.close_session(client->time_shift_session);
+		client->time_shifting = false;
+	}
+	if (speed == 0) {
+		enet_peer_send(peer, 1, create_time_shift_status_packet(head, 0));
+		printf("%s time-shift off, live\n", client->name.c_str());
+		return;
+	}
+	uint64_t first_block = uint64_t(start) / EXT_BLOCKLEN;
+	if (start < 0) {
+		const uint64_t back = (0 - uint64_t(start)) / EXT_BLOCKLEN;
+		first_block = back < head ? head - back : 0;
+	}
+	client->time_shift_session = ++ g_time_shift_sessions;
+	client->time_shifting      = true;
+	first_block = g_time_shift.open_session(client->time_shift_session, first_block, speed);
+	enet_peer_send(peer, 1, create_time_shift_status_packet(first_block, speed));
+	printf("%s time-shift %.1f s back at %ux\n", client->name.c_str(),
+		double((head - first_block) * EXT_BLOCKLEN) / SAMPLE_RATE, unsigned(speed));
+}
+
+// The replay caught up with the live stream. The blocks pushed meanwhile are picked up from the pre-roll history.
+static void end_time_shift(Shard &shard, ENetPeer *peer, Client *client, uint64_t next_block)
+{
+	g_time_shift.close_session(client->time_shift_session);
+	client->time_shifting = false;
+	uint64_t resume_block = shard.sample_index / EXT_BLOCKLEN;
+	if (shard.history_filled > 0 && next_block < shard.history_blocks) {
+		client->prerolling    = true;
+		client->preroll_block = std::max(next_block, shard.history_blocks - shard.history_filled);
+		resume_block          = client->preroll_block;
+	}
+	enet_peer_send(peer, 1, create_time_shift_status_packet(resume_block, 0));
+	printf("%s time-shift caught up, live\n", client->name.c_str());
+}
+
+// Hand the replayed blocks over as the peer's queue empties, the reader thread paces them to the requested speed.
+static void feed_time_shift(Shard &shard, ENetPeer *peer, Client *client)
+{
+	for (int i = 0; client->time_shifting && i < PREROLL_BLOCKS_PER_PASS && client->iq_queue.empty(); ++ i) {
+		uint64_t block;
+		if (g_time_shift.take_block(client->time_shift_session, shard.time_shift_buffer, block)) {
+			queue_iq_block(peer, client, enet_packet_create(shard.time_shift_buffer.data(), shard.time_shift_buffer.size() * sizeof(int16_t), 0));
+			continue;
+		}
+		if (g_time_shift.caught_up(client->time_shift_session, block))
+			end_time_shift(shard, peer, client, block);
+		break;
+	}
+}
+
+// Feed the link signals of an adaptive quality peer to its controller, notify the peer if its tier changed.
+static void update_stream_quality(ENetPeer *peer, Client *client, enet_uint32 now)
+{
+	if (! client->quality.enabled() || ENET_TIME_DIFFERENCE(now, client->quality_checked) < STREAM_QUALITY_CHECK_MS)
+		return;
+	client->quality_checked = now;
+	const uint32_t rtt    = enet_peer_get_rtt(peer);
+	const uint32_t loss   = peer->packetLoss;
+	const uint32_t queued = uint32_t(client->iq_queue.size() + enet_list_size(&peer->outgoingCommands) + enet_list_size(&peer->outgoingSendReliableCommands));
+	if (! client->quality.update(g_stream_quality_config, now, rtt, loss, queued))
+		return;
+	printf("%s stream tier %d, rtt %u ms, loss %.1f%%, queued %u\n", client->name.c_str(), int(client->quality.tier()),
+		rtt, loss * 100. / ENET_PEER_PACKET_LOSS_SCALE, queued);
+	uint8_t data[2 + 1 + 4 + 4 + 4];
+	CatCommandID cmd = CatCommandID::StreamTierChanged;
+	memcpy(data, &cmd, 2);
+	data[2] = uint8_t(client->quality.tier());
+	memcpy(data + 3,  &rtt,    4);
+	memcpy(data + 7,  &loss,   4);
+	memcpy(data + 11, &queued, 4);
+	enet_peer_send(peer, 1, enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_RELIABLE));
+}
+
+static void ENET_CALLBACK free_slice_packet(void *packet)
+{
+	release_packet(static_cast<ENetPacket*>(static_cast<ENetPacket*>(packet)->userData));
+}
+
+// Index of a peer block length in the slices of a native block or in Shard::aggregates, -1 if none.
+static int slice_length_index(size_t frames)
+{
+	for (int i = 0; i < SLICE_LENGTHS; ++ i)
+		if (size_t(EXT_BLOCKLEN >> (i + 1)) == frames)
+			return i;
+	return -1;
+}
+
+static int aggregate_length_index(size_t frames)
+{
+	for (int i = 0; i < AGGREGATE_LENGTHS; ++ i)
+		if (size_t(EXT_BLOCKLEN << (i + 1)) == frames)
+			return i;
+	return -1;
+}
+
+// A peer of the shard receives the plain stream in blocks of frames.
+static bool shard_wants_block_frames(Shard &shard, size_t frames)
+{
+	for (ENetHost *server : shard.hosts)
+		for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+			if (peer->state == ENET_PEER_STATE_CONNECTED) {
+				const Client *client = static_cast<const Client*>(peer->data);
+				if (client->block_frames == frames && ! client->multicast && ! client->local && ! client->exact_rate &&
+					! client->quality.enabled() && client->subchannels == 0 && ! client->spots_only)
+					return true;
+			}
+	return false;
+}
+
+// Copy the native block into the longer blocks being assembled. A longer block starts at a multiple of its length
+// if a peer of the shard wants it, and is dropped on a gap in the stream.
+static void fill_aggregates(Shard &shard, const int16_t *iq, size_t frames)
+{
+	for (int i = 0; i < AGGREGATE_LENGTHS; ++ i) {
+		const size_t length = EXT_BLOCKLEN << (i + 1);
+		const size_t pos    = size_t(shard.sample_index % length);
+		ENetPacket *&aggregate = shard.aggregates[i];
+		if (aggregate != nullptr && (frames != EXT_BLOCKLEN || shard.sample_index != shard.aggregate_next[i])) {
+			release_packet(aggregate);
+			aggregate = nullptr;
+		}
+		if (frames != EXT_BLOCKLEN)
+			continue;
+		if (aggregate == nullptr && pos == 0 && shard_wants_block_frames(shard, length)) {
+			// The shard's reference, dropped once the block is complete.
+			aggregate = enet_packet_create(nullptr, length * 2 * 2, 0);
+			++ aggregate->referenceCount;
+		}
+		if (aggregate != nullptr) {
+			memcpy(aggregate->data + pos * 2 * 2, iq, frames * 2 * 2);
+			shard.aggregate_next[i] = shard.sample_index + frames;
+		}
+	}
+}
+
+// Hand the completed longer blocks over to the queues of their peers, which hold them from now on.
+static void complete_aggregates(Shard &shard)
+{
+	for (int i = 0; i < AGGREGATE_LENGTHS; ++ i) {
+		ENetPacket *&aggregate = shard.aggregates[i];
+		if (aggregate != nullptr && shard.aggregate_next[i] % (EXT_BLOCKLEN << (i + 1)) == 0) {
+			release_packet(aggregate);
+			aggregate = nullptr;
+		}
+	}
+}
+
+// Queue the native block to a plain stream peer in blocks of its length: the slices of the block, shared by the
+// peers of each shorter length and referencing the samples of the block, or the longer block assembled by
+// fill_aggregates(), once complete. Until a longer block starts, the peer receives the native blocks.
+static void queue_peer_blocks(Shard &shard, ENetPeer *peer, Client *client, ENetPacket *packet, size_t frames,
+	ENetPacket *(&slices)[SLICE_LENGTHS][EXT_BLOCKLEN / MIN_BLOCK_FRAMES])
+{
+	const size_t length = client->block_frames;
+	const int    slice  = slice_length_index(length);
+	if (frames == EXT_BLOCKLEN && slice >= 0) {
+		for (size_t s = 0; s < EXT_BLOCKLEN / length; ++ s) {
+			ENetPacket *&slice_packet = slices[slice][s];
+			if (slice_packet == nullptr) {
+				slice_packet = enet_packet_create(packet->data + s * length * 2 * 2, length * 2 * 2, ENET_PACKET_FLAG_NO_ALLOCATE);
+				slice_packet->userData     = packet;
+				slice_packet->freeCallback = free_slice_packet;
+				++ packet->referenceCount;
+				// Released at the end of the pass by fan_out_block().
+				++ slice_packet->referenceCount;
+			}
+			queue_iq_block(peer, client, slice_packet);
+		}
+		return;
+	}
+	const int   aggregate_index = aggregate_length_index(length);
+	ENetPacket *aggregate       = aggregate_index >= 0 ? shard.aggregates[aggregate_index] : nullptr;
+	if (aggregate != nullptr && shard.sample_index % length == 0)
+		client->aggregating = true;
+	if (aggregate == nullptr || ! client->aggregating) {
+		client->aggregating = false;
+		queue_iq_block(peer, client, packet);
+	} else if ((shard.sample_index + frames) % length == 0)
+		queue_iq_block(peer, client, aggregate);
+}
+
+// Push an IQ block to the peers of a shard. packet holds the native rate block, it is shared by all the plain
+// unicast peers of the shard.
+static void fan_out_block(Shard &shard, ENetPacket *packet, const int16_t *iq, size_t frames, double resample_ratio, uint64_t capture_us)
+{
+	// Stream sources: the native rate block and the block resampled to exactly SAMPLE_RATE.
+	const int16_t *sources[2] = { iq, nullptr };
+	size_t         source_frames[2] = { frames, 0 };
+	ENetPacket    *packets[2] = { packet, nullptr };
+	// Every packet of the pass holds a reference of the pass until the end, the peers' queues may drop theirs
+	// at any time.
+	++ packet->referenceCount;
+	push_history(shard, packets[0]);
+	fill_aggregates(shard, iq, frames);
+	// One packet per source and stream tier, encoded on demand and shared by the adaptive quality peers of that tier.
+	ENetPacket *tier_packets[2][size_t(StreamTier::Count)] = { { nullptr } };
+	// Slices of the native block for the peers of shorter block lengths.
+	ENetPacket *slices[SLICE_LENGTHS][EXT_BLOCKLEN / MIN_BLOCK_FRAMES] = { { nullptr } };
+	// One packet per subchannel, the block being channelized once for all the subchannel peers of the shard.
+	ENetPacket *subchannel_packets[PolyphaseChannelizer::SUBCHANNELS] = { nullptr };
+	bool        channelized = false;
+	const enet_uint32 now = enet_time_get();
+	int num_multicast = 0;
+	for (ENetHost *server : shard.hosts)
+		for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+			if (peer->state == ENET_PEER_STATE_CONNECTED) {
+				Client *client = static_cast<Client*>(peer->data);
+				if (client->multicast) {
+					++ num_multicast;
+					continue;
+				}
+				if (client->local || client->spots_only || client->time_shifting)
+					continue;
+				if (client->prerolling) {
+					// The live block went to the history, the peer picks it up from there once it catches up.
+					feed_preroll(shard, peer, client);
+					continue;
+				}
+				if (client->subchannels != 0) {
+					if (! channelized) {
+						shard.channelizer.process(iq, frames, shard.sample_index);
+						channelized = true;
+					}
+					for (size_t i = 0; i < PolyphaseChannelizer::SUBCHANNELS; ++ i)
+						if (client->subchannels & (1u << i)) {
+							if (subchannel_packets[i] == nullptr) {
+								shard.channelizer.encode(i, shard.tier_buffer);
+								subchannel_packets[i] = enet_packet_create(shard.tier_buffer.data(), shard.tier_buffer.size(), 0);
+								++ subchannel_packets[i]->referenceCount;
+							}
+							queue_iq_block(peer, client, subchannel_packets[i]);
+						}
+					continue;
+				}
+				const int source = client->exact_rate ? 1 : 0;
+				if (sources[source] == nullptr) {
+					shard.resampler.set_ratio(resample_ratio);
+					source_frames[1] = shard.resampler.process(sources[0], source_frames[0], shard.resampled);
+					sources[1] = shard.resampled.data();
+				}
+				if (client->quality.enabled()) {
+					update_stream_quality(peer, client, now);
+					ENetPacket *&tier_packet = tier_packets[source][size_t(client->quality.tier())];
+					if (tier_packet == nullptr) {
+						shard.tier_encoders[source].encode(client->quality.tier(), sources[source], source_frames[source],
+							shard.sample_index, shard.sample_index + frames, shard.tier_buffer);
+						tier_packet = enet_packet_create(shard.tier_buffer.data(), shard.tier_buffer.size(), 0);
+						++ tier_packet->referenceCount;
+					}
+					queue_iq_block(peer, client, tier_packet);
+				} else if (source == 0 && client->block_frames != 0 && client->block_frames != frames) {
+					queue_peer_blocks(shard, peer, client, packets[0], frames, slices);
+				} else {
+					if (packets[source] == nullptr) {
+						packets[source] = enet_packet_create(sources[source], source_frames[source] * 2 * 2, 0);
+						++ packets[source]->referenceCount;
+					}
+					queue_iq_block(peer, client, packets[source]);
+				}
+			}
+	complete_aggregates(shard);
+	// Drop the references of the pass, the packets not queued to any peer are destroyed.
+	for (auto &length_slices : slices)
+		for (ENetPacket *slice_packet : length_slices)
+			if (slice_packet != nullptr)
+				release_packet(slice_packet);
+	for (ENetPacket *source_packet : packets)
+		if (source_packet != nullptr)
+			release_packet(source_packet);
+	for (auto &source_tier_packets : tier_packets)
+		for (ENetPacket *tier_packet : source_tier_packets)
+			if (tier_packet != nullptr)
+				release_packet(tier_packet);
+	for (ENetPacket *subchannel_packet : subchannel_packets)
+		if (subchannel_packet != nullptr)
+			release_packet(subchannel_packet);
+	shard.multicast_peers.store(num_multicast, std::memory_order_relaxed);
+	shard.sample_index += frames;
+	shard.capture_us    = capture_us;
+}
+
+static void ENET_CALLBACK free_iq_block_packet(void *packet)
+{
+	release_iq_block(static_cast<IQBlock*>(static_cast<ENetPacket*>(packet)->userData));
+}
+
+// Post the block to the other shards, a single copy of the samples is referenced by all of them.
+static void post_iq_block(const void *iq, size_t frames, double resample_ratio, uint64_t capture_us)
+{
+	if (g_shards.size() < 2)
+		return;
+	IQBlock *block = new IQBlock;
+	block->refs.store(int(g_shards.size() - 1), std::memory_order_relaxed);
+	block->sample_index   = g_sample_index;
+	block->resample_ratio = resample_ratio;
+	block->capture_us     = capture_us;
+	block->frames         = frames;
+	memcpy(block->iq, iq, frames * 2 * sizeof(int16_t));
+	for (size_t i = 1; i < g_shards.size(); ++ i) {
+		Shard &shard = *g_shards[i];
+		{
+			std::lock_guard<std::mutex> lock(shard.inbox_mutex);
+			shard.inbox.emplace_back(block);
+		}
+#ifndef _WIN32
+		const uint64_t one = 1;
+		if (write(shard.wake_fd, &one, sizeof(one)) < 0) {}
+#endif // _WIN32
+	}
+}
+
+// Hand a block of EXT_BLOCKLEN frames over to the time-shift history, the recorder and the peers.
+// packet holds the samples, it is shared by all the plain unicast peers of shard 0. capture_us: the monotonic time
+// the block arrived, the timeline of the stream for the clock synchronization.
+static void stream_iq_block(const int16_t *iq, ENetPacket *packet, double resample_ratio, uint64_t capture_us)
+{
+	// The relayed samples live in the packet, keep it until the block went everywhere.
+	++ packet->referenceCount;
+	if (g_time_shift.running())
+		g_time_shift.push_block(iq, g_sample_index);
+	if (g_recorder.running())
+		g_recorder.push_block(iq, EXT_BLOCKLEN, g_sample_index, unix_time_us());
+	post_iq_block(iq, EXT_BLOCKLEN, resample_ratio, capture_us);
+	fan_out_block(*g_shards.front(), packet, iq, EXT_BLOCKLEN, resample_ratio, capture_us);
+	int num_multicast = 0;
+	for (const std::unique_ptr<Shard> &shard : g_shards)
+		num_multicast += shard->multicast_peers.load(std::memory_order_relaxed);
+	// Sent once for all the multicast subscribers.
+	if (num_multicast > 0)
+		g_multicast.send_block(iq, EXT_BLOCKLEN * 2 * 2, g_sample_index);
+	g_local_stream.push_block(iq, EXT_BLOCKLEN, g_sample_index, capture_us);
+	if (g_skimmer.running())
+		g_skimmer.push_block(iq, EXT_BLOCKLEN, g_sample_index);
+	g_sample_index += EXT_BLOCKLEN;
+	release_packet(packet);
+}
 
 int receive_callback(int cnt, int status, float IQoffs, void* IQdata)
 {
 	// 1) Push audio data to the clients.
 	assert(cnt == -1 || cnt == 0 || cnt == EXT_BLOCKLEN);
 	if (cnt == EXT_BLOCKLEN) {
-		// Send a big 
-		enet_host_broadcast(g_server, 0, enet_packet_create(IQdata, cnt * 2 * 2, 0));
+		const uint64_t capture_us = monotonic_us();
+		g_sample_rate.add(g_sample_index + cnt, capture_us);
+		// Send a big packet, shared by all the plain unicast peers of all the hosts of shard 0.
+		stream_iq_block(static_cast<const int16_t*>(IQdata), enet_packet_create(IQdata, cnt * 2 * 2, 0), g_sample_rate.rate() / SAMPLE_RATE,
+			capture_us);
+		if (g_sample_rate.valid() && monotonic_us() - g_sample_rate_published_us >= SAMPLE_RATE_PUBLISH_US) {
+			g_sample_rate_published_us = monotonic_us();
+			broadcast_packet(1, create_sample_rate_packet());
+			if (g_recorder.running())
+				g_recorder.push_sample_rate(g_sample_rate.rate(), g_sample_index);
+		}
 	}
 	return 0;
 }
 
-void pump_enet_packets()
+static ENetPacket* create_multicast_info_packet()
 {
-	// 2) Pump the UDP packets.
+	uint8_t data[2 + 4 + 2 + 64];
+	CatCommandID cmd     = CatCommandID::MulticastInfo;
+	uint32_t     session = g_multicast.is_open() ? g_multicast.session() : 0;
+	uint16_t     port    = g_multicast.is_open() ? uint16_t(g_multicast.port()) : 0;
+	size_t       len     = g_multicast.is_open() ? std::min(g_multicast.group().size(), size_t(64)) : 0;
+	memcpy(data,     &cmd,     2);
+	memcpy(data + 2, &session, 4);
+	memcpy(data + 6, &port,    2);
+	memcpy(data + 8, g_multicast.group().data(), len);
+	return enet_packet_create(data, 8 + len, ENET_PACKET_FLAG_RELIABLE);
+}
+
+// Resend multicast datagrams lost by a client over its ENet connection.
+static void send_multicast_repairs(ENetPeer *peer, uint32_t first_seq, uint16_t count)
+{
+	if (! g_multicast.is_open())
+		return;
+	count = std::min<uint16_t>(count, IQMulticast::MAX_NAK_COUNT);
+	for (uint32_t seq = first_seq; seq != first_seq + count; ++ seq) {
+		size_t         len;
+		const uint8_t *datagram = g_multicast.find(seq, len);
+		if (datagram == nullptr)
+			continue;
+		ENetPacket  *packet = enet_packet_create(nullptr, 2 + len, ENET_PACKET_FLAG_UNSEQUENCED);
+		CatCommandID cmd    = CatCommandID::MulticastRepair;
+		memcpy(packet->data, &cmd, 2);
+		memcpy(packet->data + 2, datagram, len);
+		if (enet_peer_send(peer, 1, packet) < 0)
+			enet_packet_destroy(packet);
+	}
+}
+
+// Persist a setting changed by a CAT command, it is sent to the radio again after a restart.
+static void store_config(ConfigField field)
+{
+	if (g_config_store.is_open() && ! g_config_store.store(g_config, field))
+		LOGD("Failed to store the config\n");
+}
+
+// Latency from the arrival of a CAT datagram to the CAT command being executed.
+static std::atomic<uint64_t> g_cat_datagrams { 0 };
+static uint64_t g_cat_latency_count   = 0;
+static uint64_t g_cat_latency_sum_us  = 0;
+static uint64_t g_cat_latency_max_us  = 0;
+
+// Called by ENet for each received datagram before it is processed. A datagram carrying a command
+// on the CAT channel stamps its arrival on the peer. The datagram is then processed by ENet as usual,
+// thus reliability and ordering of the CAT channel are kept. Clock synchronization requests are stamped
+// separately, they are not CAT commands waiting for the streaming thread.
+static int ENET_CALLBACK cat_intercept(ENetHost *host, void*)
+{
+	const enet_uint8 *data = host->receivedData;
+	const size_t      len  = host->receivedDataLength;
+	if (len < sizeof(ENetProtocolHeaderMinimal))
+		return 0;
+	enet_uint16 peer_id;
+	memcpy(&peer_id, data, 2);
+	peer_id = ENET_NET_TO_HOST_16(peer_id);
+	const enet_uint16 flags = peer_id & ENET_PROTOCOL_HEADER_FLAG_MASK;
+	peer_id &= ~(ENET_PROTOCOL_HEADER_FLAG_MASK | ENET_PROTOCOL_HEADER_SESSION_MASK);
+	if ((flags & ENET_PROTOCOL_HEADER_FLAG_COMPRESSED) || peer_id >= host->peerCount)
+		return 0;
+	ENetPeer *peer = &host->peers[peer_id];
+	if (peer->state != ENET_PEER_STATE_CONNECTED || peer->data == nullptr)
+		return 0;
+	size_t offset = (flags & ENET_PROTOCOL_HEADER_FLAG_SENT_TIME) ? sizeof(ENetProtocolHeader) : sizeof(ENetProtocolHeaderMinimal);
+	if (host->checksum != nullptr)
+		offset += sizeof(enet_uint32);
+	while (offset + sizeof(ENetProtocolCommandHeader) <= len) {
+		const ENetProtocol *command = reinterpret_cast<const ENetProtocol*>(data + offset);
+		const enet_uint8 number = command->header.command & ENET_PROTOCOL_COMMAND_MASK;
+		if (number >= ENET_PROTOCOL_COMMAND_COUNT)
+			break;
+		const size_t command_size = enet_protocol_command_size(command->header.command);
+		if (command_size == 0 || offset + command_size > len)
+			break;
+		size_t data_length = 0;
+		switch (number) {
+		case ENET_PROTOCOL_COMMAND_SEND_RELIABLE:			data_length = ENET_NET_TO_HOST_16(command->sendReliable.dataLength); break;
+		case ENET_PROTOCOL_COMMAND_SEND_UNRELIABLE:			data_length = ENET_NET_TO_HOST_16(command->sendUnreliable.dataLength); break;
+		case ENET_PROTOCOL_COMMAND_SEND_UNSEQUENCED:		data_length = ENET_NET_TO_HOST_16(command->sendUnsequenced.dataLength); break;
+		case ENET_PROTOCOL_COMMAND_SEND_FRAGMENT:
+		case ENET_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT:	data_length = ENET_NET_TO_HOST_16(command->sendFragment.dataLength); break;
+		default: break;
+		}
+		if (data_length > 0 && command->header.channelID == 1) {
+			Client *client = static_cast<Client*>(peer->data);
+			if (number == ENET_PROTOCOL_COMMAND_SEND_UNSEQUENCED && data_length >= 2 && offset + command_size + 2 <= len) {
+				CatCommandID cmd;
+				memcpy(&cmd, data + offset + command_size, 2);
+				if (cmd == CatCommandID::ClockSyncRequest) {
+					client->clock_sync_arrival_us = monotonic_us();
+					offset += command_size + data_length;
+					continue;
+				}
+			}
+			if (client->cat_arrival_us == 0)
+				client->cat_arrival_us = monotonic_us();
+			++ g_cat_datagrams;
+			break;
+		}
+		offset += command_size + data_length;
+	}
+	return 0;
+}
+
+static void account_cat_latency(Client *client)
+{
+	if (client->cat_arrival_us == 0)
+		return;
+	const uint64_t latency = monotonic_us() - client->cat_arrival_us;
+	client->cat_arrival_us = 0;
+	++ g_cat_latency_count;
+	g_cat_latency_sum_us += latency;
+	g_cat_latency_max_us = std::max(g_cat_latency_max_us, latency);
+}
+
+// The settings of a peer are persisted, thus they are applied only if Config::validate() keeps them. Otherwise the
+// next start would push another value than the one the radio acknowledged.
+static bool config_accepts(const Config &config)
+{
+	Config validated = config;
+	validated.validate();
+	return validated.serialize() == config.serialize();
+}
+
+// Apply a radio setting of a peer, returns false if the command is not one. Streaming thread only, as it owns
+// the radio and the CAT state. Blocks for the USB transfers, thus it touches no peer state, so that it runs
+// without holding the lock of the peer's shard.
+static bool apply_radio_setting(const ENetPacket *packet)
+{
+	if (packet->dataLength <= 2)
+		return false;
+	CatCommandID cmd;
+	memcpy(&cmd, packet->data, 2);
+	// Relay mode: the radio settings go to the upstream server, the rest is served locally.
+	if (g_relay.running() && g_relay.send_cat(packet->data, packet->dataLength)) {
+		if (cmd == CatCommandID::SetFreq)
+			record_frequency();
+		return true;
+	}
+	switch (cmd) {
+	case CatCommandID::SetFreq:
+		if (packet->dataLength == 10) {
+			int64_t frequency;
+			memcpy(&frequency, packet->data + 2, 8);
+			if (g_Cat.set_freq(frequency)) {
+				printf("set frequency succeeded\n");
+				record_frequency();
+			} else
+				printf("set frequency failed\n");
+		}
+		break;
+	case CatCommandID::SetCWTxFreq:
+		if (packet->dataLength == 10) {
+			int64_t frequency;
+			memcpy(&frequency, packet->data + 2, 8);
+			g_Cat.set_cw_tx_freq(frequency);
+		}
+		break;
+	case CatCommandID::SetCWKeyerSpeed:
+		if (packet->dataLength == 3) {
+			uint8_t cw_speed;
+			memcpy(&cw_speed, packet->data + 2, 1);
+			// Clamped by the Cat to the range Config::validate() accepts.
+			if (g_Cat.set_cw_keyer_speed(cw_speed)) {
+				g_config.keyer_wpm = g_Cat.state().keyer_speed;
+				store_config(ConfigField::KeyerWpm);
+			}
+		}
+		break;
+	case CatCommandID::SetKeyerMode:
+		if (packet->dataLength == 3) {
+			uint8_t keyer_mode;
+			memcpy(&keyer_mode, packet->data + 2, 1);
+			Config config = g_config;
+			config.keyer_mode = KeyerMode(keyer_mode);
+			if (! config_accepts(config))
+				printf("Rejected keyer mode %d\n", int(keyer_mode));
+			else if (g_Cat.set_cw_keyer_mode(config.keyer_mode)) {
+				g_config.keyer_mode = config.keyer_mode;
+				store_config(ConfigField::KeyerMode);
+			}
+		}
+		break;
+	case CatCommandID::SetAMPControl:
+		if (packet->dataLength == 11) {
+			bool    enabled;
+			int32_t delay, hang;
+			memcpy(&enabled, packet->data + 2, 1);
+			memcpy(&delay,   packet->data + 3, 4);
+			memcpy(&hang,    packet->data + 7, 4);
+			Config config = g_config;
+			config.amp_enabled = enabled;
+			config.tx_delay    = delay;
+			config.tx_hang     = hang;
+			if (! config_accepts(config))
+				printf("Rejected AMP control delay %d us, hang %d us\n", int(delay), int(hang));
+			else if (g_Cat.set_amp_control(enabled, delay, hang)) {
+				g_config = config;
+				store_config(ConfigField::AmpEnabled);
+				store_config(ConfigField::TxDelay);
+				store_config(ConfigField::TxHang);
+			}
+		}
+		break;
+	case CatCommandID::SetIQBalanceAndPower:
+		if (packet->dataLength == 26) {
+			double phase_balance_deg, amplitude_balance, power;
+			memcpy(&phase_balance_deg,  packet->data + 2,  8);
+			memcpy(&amplitude_balance,  packet->data + 10, 8);
+			memcpy(&power,              packet->data + 18, 8);
+			Config config = g_config;
+			config.tx_iq_balance_phase_correction     = phase_balance_deg;
+			config.tx_iq_balance_amplitude_correction = amplitude_balance;
+			config.tx_power                           = power;
+			if (! config_accepts(config))
+				printf("Rejected IQ balance %g deg, amplitude %g, power %g\n", phase_balance_deg, amplitude_balance, power);
+			else if (g_Cat.setIQBalanceAndPower(phase_balance_deg, amplitude_balance, power)) {
+				g_config = config;
+				store_config(ConfigField::TxIQBalancePhaseCorrection);
+				store_config(ConfigField::TxIQBalanceAmplitudeCorrection);
+				store_config(ConfigField::TxPower);
+			}
+		}
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// Dispatch a CAT command of a peer. Streaming thread only, as it owns the radio and the CAT state.
+static void handle_cat_packet(Shard &shard, ENetPeer *peer, Client *client, const ENetPacket *packet)
+{
+	if (apply_radio_setting(packet)) {
+		account_cat_latency(client);
+		return;
+	}
+	if (packet->dataLength > 2) {
+		CatCommandID cmd;
+		memcpy(&cmd, packet->data, 2);
+		switch (cmd) {
+		case CatCommandID::MulticastSubscribe:
+			if (packet->dataLength == 3) {
+				client->multicast = packet->data[2] != 0 && g_multicast.is_open();
+				if (packet->data[2] != 0)
+					enet_peer_send(peer, 1, create_multicast_info_packet());
+				printf("%s receives IQ by %s\n", client->name.c_str(), client->multicast ? "multicast" : "unicast");
+			}
+			break;
+		case CatCommandID::LocalSubscribe:
+			if (packet->dataLength == 3) {
+				client->local = packet->data[2] != 0 && g_local_stream.is_open();
+				printf("%s receives IQ by %s\n", client->name.c_str(), client->local ? "shared memory" : "ENet");
+			}
+			break;
+		case CatCommandID::MulticastNak:
+			if (packet->dataLength == 8) {
+				uint32_t first_seq;
+				uint16_t count;
+				memcpy(&first_seq, packet->data + 2, 4);
+				memcpy(&count,     packet->data + 6, 2);
+				send_multicast_repairs(peer, first_seq, count);
+			}
+			break;
+		case CatCommandID::ExactRate:
+			if (packet->dataLength == 3) {
+				client->exact_rate = packet->data[2] != 0;
+				printf("%s receives IQ at the %s rate\n", client->name.c_str(), client->exact_rate ? "exact nominal" : "radio");
+			}
+			break;
+		case CatCommandID::BlockLength:
+			if (packet->dataLength == 4) {
+				uint16_t frames;
+				memcpy(&frames, packet->data + 2, 2);
+				if (frames != 0 && frames != EXT_BLOCKLEN && slice_length_index(frames) < 0 && aggregate_length_index(frames) < 0)
+					break;
+				client->block_frames = frames == EXT_BLOCKLEN ? 0 : frames;
+				client->aggregating  = false;
+				frames = client->block_frames == 0 ? EXT_BLOCKLEN : client->block_frames;
+				printf("%s receives IQ in blocks of %u frames, %.1f ms\n", client->name.c_str(), unsigned(frames), frames * 1000. / SAMPLE_RATE);
+			}
+			break;
+		case CatCommandID::Preroll:
+			if (packet->dataLength == 3)
+				request_preroll(shard, peer, client, packet->data[2] != 0);
+			break;
+		case CatCommandID::TimeShift:
+			if (packet->dataLength == 11) {
+				int64_t start;
+				memcpy(&start, packet->data + 2, 8);
+				start_time_shift(peer, client, start, packet->data[10]);
+			}
+			break;
+		case CatCommandID::StreamQuality:
+			if (packet->dataLength == 4 && packet->data[3] < uint8_t(StreamTier::Count)) {
+				if (packet->data[2] != 0)
+					client->quality.enable(StreamTier(packet->data[3]), g_stream_quality_config.tiers);
+				else
+					client->quality.disable();
+				printf("%s adaptive stream quality %s\n", client->name.c_str(), client->quality.enabled() ? "enabled" : "disabled");
+			}
+			break;
+		case CatCommandID::Subchannels:
+			if (packet->dataLength == 6) {
+				uint32_t mask;
+				memcpy(&mask, packet->data + 2, 4);
+				client->subchannels = uint32_t(mask & ((uint64_t(1) << PolyphaseChannelizer::SUBCHANNELS) - 1));
+				if (client->subchannels != 0)
+					printf("%s receives subchannels %08x of %u, %.0f Hz wide\n", client->name.c_str(), client->subchannels,
+						unsigned(PolyphaseChannelizer::SUBCHANNELS), double(SAMPLE_RATE) / PolyphaseChannelizer::SUBCHANNELS);
+				else
+					printf("%s receives the full band\n", client->name.c_str());
+			}
+			break;
+		case CatCommandID::SkimmerSubscribe:
+			if (packet->dataLength == 4) {
+				client->spots      = packet->data[2] != 0 && g_skimmer.running();
+				client->spots_only = client->spots && packet->data[3] != 0;
+				if (client->spots_only)
+					release_iq_queue(client);
+				printf("%s receives %s\n", client->name.c_str(), client->spots_only ? "the CW spots only" :
+					client->spots ? "the CW spots and IQ" : "IQ");
+			}
+			break;
+		default:
+			// Server to client notifications are not accepted from clients.
+			break;
+		}
+		account_cat_latency(client);
+	}
+}
+
+// State a new peer needs before the stream. Streaming thread only.
+static void send_welcome(ENetPeer *peer)
+{
+	enet_peer_send(peer, 1, create_state_snapshot_packet());
+	if (! g_radio_online)
+		enet_peer_send(peer, 1, create_radio_status_packet());
+	if (g_sample_rate.valid())
+		enet_peer_send(peer, 1, create_sample_rate_packet());
+}
+
+// Hand a new peer or a CAT command of a shard thread over to the streaming thread.
+static void post_control_message(Shard &shard, ENetPeer *peer, ENetPacket *packet)
+{
+	{
+		std::lock_guard<std::mutex> lock(g_control_mutex);
+		g_control_inbox.push_back({ &shard, peer, peer->connectID, packet });
+	}
+#ifndef _WIN32
+	const uint64_t one = 1;
+	if (write(g_control_wake_fd, &one, sizeof(one)) < 0) {}
+#endif // _WIN32
+}
+
+// Answer a clock synchronization request right away from the thread servicing the peer, a detour through
+// the streaming thread would add to the round trip. The timeline of the stream is the shard's last block.
+static void answer_clock_sync(Shard &shard, ENetPeer *peer, Client *client, const ENetPacket *request)
+{
+	if (request->dataLength != 2 + 8)
+		return;
+	const uint64_t receive_us = client->clock_sync_arrival_us != 0 ? client->clock_sync_arrival_us : monotonic_us();
+	client->clock_sync_arrival_us = 0;
+	uint8_t      data[2 + 8 * 5];
+	CatCommandID cmd = CatCommandID::ClockSyncReply;
+	memcpy(data,      &cmd,                2);
+	memcpy(data + 2,  request->data + 2,   8);
+	memcpy(data + 10, &receive_us,         8);
+	memcpy(data + 26, &shard.sample_index, 8);
+	memcpy(data + 34, &shard.capture_us,   8);
+	const uint64_t send_us = monotonic_us();
+	memcpy(data + 18, &send_us,            8);
+	ENetPacket *packet = enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_UNSEQUENCED);
+	if (enet_peer_send(peer, 1, packet) < 0)
+		enet_packet_destroy(packet);
+}
+
+// Receive first, then refill ENet with the queued IQ blocks and send. CAT commands are thus dispatched
+// as soon as they are received, ahead of the IQ backlog enet_host_service() would send before receiving.
+// Called by the thread servicing the shard, holding the shard mutex if it is not shard 0.
+static void pump_enet_host(Shard &shard, ENetHost *server)
+{
+	bool receiving = true;
 	for (;;) {
 		ENetEvent event;
-		int eventStatus = enet_host_service(g_server, &event, 0);
-		if (eventStatus <= 0)
-			break;
+		int eventStatus = receiving ? enet_host_receive(server, &event) : enet_host_service(server, &event, 0);
+		if (eventStatus <= 0) {
+			if (! receiving)
+				break;
+			receiving = false;
+			// Refill ENet with the queued IQ blocks of the peers whose acknowledgements made room.
+			for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+				if (peer->state == ENET_PEER_STATE_CONNECTED)
+				{
+					Client *client = static_cast<Client*>(peer->data);
+					flush_iq_queue(peer, client);
+					feed_preroll(shard, peer, client);
+					feed_time_shift(shard, peer, client);
+				}
+			continue;
+		}
 		switch (event.type) {
 		case ENET_EVENT_TYPE_CONNECT:
 			event.peer->data = new Client;
 			{
-				char buf[2048];
-				if (enet_address_get_host_new(&event.peer->address, buf, 2048) == 0)
-					enet_address_get_host_ip_new(&event.peer->address, buf, sizeof(buf));
-				static_cast<Client*>(event.peer->data)->name = std::string(buf) + ":" + std::to_string(event.peer->address.port);
-			}
-			{
+				Client *client = static_cast<Client*>(event.peer->data);
 				char ip_str[256];
 				enet_address_get_host_ip_new(&event.peer->address, ip_str, sizeof(ip_str));
+				client->id   = ++ g_client_ids;
+				client->name = std::string(ip_str) + ":" + std::to_string(event.peer->address.port);
+				// Renamed by resolve_peer_names() once the reverse DNS answers.
+				g_resolver.request(client->id, ip_str);
 				printf("(Server) We got a new connection from %s\n", ip_str);
 			}
+			if (shard.index == 0)
+				send_welcome(event.peer);
+			else
+				post_control_message(shard, event.peer, nullptr);
 			break;
 		case ENET_EVENT_TYPE_RECEIVE:
-			// Decode CatCommand
-			if (event.channelID == 1 && event.packet->dataLength > 2) {
-				CatCommandID cmd;
-				memcpy(&cmd, event.packet->data, 2);
-				switch (cmd) {
-				case CatCommandID::SetFreq:
-					if (event.packet->dataLength == 10) {
-						int64_t frequency;
-						memcpy(&frequency, event.packet->data + 2, 8);
-						if (g_Cat.set_freq(frequency))
-				printf("set frequency succeeded\n");
-			else
-				printf("set frequency failed\n");
-					}
-					break;
-				case CatCommandID::SetCWTxFreq:
-					if (event.packet->dataLength == 10) {
-						int64_t frequency;
-						memcpy(&frequency, event.packet->data + 2, 8);
-						g_Cat.set_cw_tx_freq(frequency);
-					}
-					break;
-				case CatCommandID::SetCWKeyerSpeed:
-					if (event.packet->dataLength == 3) {
-						uint8_t cw_speed;
-						memcpy(&cw_speed, event.packet->data + 2, 1);
-						g_Cat.set_cw_keyer_speed(cw_speed);
-					}
-					break;
-				case CatCommandID::SetKeyerMode:
-					if (event.packet->dataLength == 3) {
-						uint8_t keyer_mode;
-						memcpy(&keyer_mode, event.packet->data + 2, 1);
-						g_Cat.set_cw_keyer_mode(KeyerMode(keyer_mode));
-					}
-					break;
-				case CatCommandID::SetAMPControl:
-					if (event.packet->dataLength == 11) {
-						bool    enabled;
-						int32_t delay, hang;
-						memcpy(&enabled, event.packet->data + 2, 1);
-						memcpy(&delay,   event.packet->data + 3, 4);
-						memcpy(&hang,    event.packet->data + 7, 4);
-						g_Cat.set_amp_control(enabled, delay, hang);
-					}
+			// Decode CatCommand
+			if (event.channelID == 1 && event.packet->dataLength > 2) {
+				CatCommandID cmd;
+				memcpy(&cmd, event.packet->data, 2);
+				if (cmd == CatCommandID::ClockSyncRequest) {
+					answer_clock_sync(shard, event.peer, static_cast<Client*>(event.peer->data), event.packet);
+					enet_packet_destroy(event.packet);
 					break;
-				case CatCommandID::SetIQBalanceAndPower:
-					if (event.packet->dataLength == 26) {
-						double phase_balance_deg, amplitude_balance, power;
-						memcpy(&phase_balance_deg,  event.packet->data + 2,  8);
-						memcpy(&amplitude_balance,  event.packet->data + 10, 8);
-						memcpy(&power,              event.packet->data + 18, 8);
-						g_Cat.setIQBalanceAndPower(phase_balance_deg, amplitude_balance, power);
-					}
+				}
+				if (shard.index != 0) {
+					// Destroyed by the streaming thread.
+					post_control_message(shard, event.peer, event.packet);
 					break;
 				}
+				handle_cat_packet(shard, event.peer, static_cast<Client*>(event.peer->data), event.packet);
 			}
 			enet_packet_destroy(event.packet);
 			break;
 		case ENET_EVENT_TYPE_DISCONNECT:
-			printf("%s disconnected.\n", static_cast<const Client*>(event.peer->data)->name.c_str());
+		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+		{
+			Client *client = static_cast<Client*>(event.peer->data);
+			printf("%s disconnected.\n", client->name.c_str());
+			printf("%s IQ blocks: %llu sent, %llu dropped by the queue budget\n", client->name.c_str(),
+				(unsigned long long)client->iq_blocks_sent, (unsigned long long)client->iq_blocks_dropped);
+			release_iq_queue(client);
+			if (client->time_shifting)
+				g_time_shift.close_session(client->time_shift_session);
+			if (client->quality.enabled())
+				printf("%s stream tier degraded %u times, recovered %u times\n", client->name.c_str(),
+					client->quality.degrades(), client->quality.recovers());
+		}
 			// Reset client's information.
 			delete static_cast<const Client*>(event.peer->data);
 			event.peer->data = nullptr;
@@ -161,15 +1337,323 @@ void pump_enet_packets()
 	}
 }
 
+// Attach the names resolved meanwhile to their peers. A peer gone meanwhile is not found by its id.
+static void resolve_peer_names()
+{
+	g_resolved_names.clear();
+	g_resolver.poll(g_resolved_names);
+	for (const NameResolver::Result &result : g_resolved_names) {
+		if (result.name.empty())
+			continue;
+		for (const std::unique_ptr<Shard> &shard : g_shards) {
+			std::unique_lock<std::mutex> lock(shard->mutex, std::defer_lock);
+			if (shard->index != 0)
+				lock.lock();
+			for (ENetHost *server : shard->hosts)
+				for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer) {
+					Client *client = static_cast<Client*>(peer->data);
+					if (peer->state == ENET_PEER_STATE_CONNECTED && client != nullptr && client->id == result.token) {
+						const std::string name = result.name + ":" + std::to_string(peer->address.port);
+						printf("%s is %s\n", client->name.c_str(), name.c_str());
+						client->name = name;
+					}
+				}
+		}
+	}
+}
+
+// Handle the new peers and the CAT commands posted by the shard threads, in the order they arrived.
+// A peer gone meanwhile, or its slot reused by another peer, is recognized by its state and connect id.
+static void handle_control_messages()
+{
+	if (g_control_wake_fd == -1)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(g_control_mutex);
+		g_control_batch.swap(g_control_inbox);
+	}
+	for (const ControlMessage &message : g_control_batch) {
+		// The radio settings wait for the USB transfers. Applied outside of the lock of the shard, which would stall
+		// its host thread for the round trip, the lock is taken only to touch the peer.
+		const bool radio_setting = message.packet != nullptr && apply_radio_setting(message.packet);
+		{
+			std::lock_guard<std::mutex> lock(message.shard->mutex);
+			ENetPeer *peer = message.peer;
+			if (peer->state == ENET_PEER_STATE_CONNECTED && peer->data != nullptr && peer->connectID == message.connect_id) {
+				if (message.packet == nullptr)
+					send_welcome(peer);
+				else if (radio_setting)
+					account_cat_latency(static_cast<Client*>(peer->data));
+				else
+					handle_cat_packet(*message.shard, peer, static_cast<Client*>(peer->data), message.packet);
+			}
+		}
+		if (message.packet != nullptr)
+			enet_packet_destroy(message.packet);
+	}
+	g_control_batch.clear();
+}
+
+static ENetPacket* create_cw_spot_packet(const CwSpot &spot, int64_t lo_freq)
+{
+	std::vector<uint8_t> data(2 + 8 + 2 + 1 + 1 + 8 + spot.text.size());
+	CatCommandID cmd       = CatCommandID::CwSpot;
+	const int16_t offset   = int16_t(std::lround(spot.offset_hz));
+	const int64_t frequency = lo_freq == 0 ? 0 : lo_freq + offset;
+	memcpy(data.data(),      &cmd,               2);
+	memcpy(data.data() + 2,  &frequency,         8);
+	memcpy(data.data() + 10, &offset,            2);
+	data[12] = spot.wpm;
+	memcpy(data.data() + 13, &spot.snr_db,       1);
+	memcpy(data.data() + 14, &spot.sample_index, 8);
+	memcpy(data.data() + 22, spot.text.data(),   spot.text.size());
+	return enet_packet_create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE);
+}
+
+static void send_to_spot_peers(Shard &shard, ENetPacket *packet)
+{
+	for (ENetHost *server : shard.hosts)
+		for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+			if (peer->state == ENET_PEER_STATE_CONNECTED && static_cast<const Client*>(peer->data)->spots)
+				enet_peer_send(peer, 1, packet);
+}
+
+// Retune the skimmer along with the LO and send its spots to the subscribed peers of all the shards.
+static void publish_spots()
+{
+	if (! g_skimmer.running())
+		return;
+	const CatState &state = g_relay.running() ? g_relay.state() : g_Cat.state();
+	const int64_t   freq  = state.is_valid(CatCommandID::SetFreq) ? state.freq : 0;
+	if (freq != g_skimmer_freq) {
+		g_skimmer_freq = freq;
+		g_skimmer.retune();
+	}
+	g_spots.clear();
+	g_skimmer.poll(g_spots);
+	for (const CwSpot &spot : g_spots) {
+		// Like broadcast_packet(), a copy per shard.
+		ENetPacket *packet = create_cw_spot_packet(spot, freq);
+		for (size_t i = 1; i < g_shards.size(); ++ i) {
+			Shard &shard = *g_shards[i];
+			ENetPacket *copy = enet_packet_create(packet->data, packet->dataLength, packet->flags);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			send_to_spot_peers(shard, copy);
+			if (copy->referenceCount == 0)
+				enet_packet_destroy(copy);
+		}
+		send_to_spot_peers(*g_shards.front(), packet);
+		if (packet->referenceCount == 0)
+			enet_packet_destroy(packet);
+	}
+}
+
+void pump_enet_packets()
+{
+	// 2) Pump the UDP packets.
+	for (ENetHost *server : g_shards.front()->hosts)
+		pump_enet_host(*g_shards.front(), server);
+	handle_control_messages();
+	resolve_peer_names();
+	publish_spots();
+}
+
+#ifndef _WIN32
+// Service the hosts of a shard other than 0: wait for a datagram or for the streaming thread posting IQ blocks,
+// fan the blocks out to the shard's peers, then pump the hosts.
+static void shard_thread(Shard *shard)
+{
+	std::vector<pollfd>   fds;
+	std::vector<IQBlock*> blocks;
+	for (ENetHost *server : shard->hosts)
+		fds.push_back({ server->socket, POLLIN, 0 });
+	fds.push_back({ shard->wake_fd, POLLIN, 0 });
+	while (! shard->stop.load(std::memory_order_acquire)) {
+		// The timeout keeps the ENet retransmissions and pings going while the stream is paused.
+		if (poll(fds.data(), nfds_t(fds.size()), 5) < 0 && errno != EINTR)
+			break;
+		if (fds.back().revents & POLLIN) {
+			uint64_t count;
+			if (read(shard->wake_fd, &count, sizeof(count)) < 0) {}
+		}
+		{
+			std::lock_guard<std::mutex> lock(shard->inbox_mutex);
+			blocks.swap(shard->inbox);
+		}
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		for (IQBlock *block : blocks) {
+			// The packet wraps the samples of the block and holds a reference to it, taken over by the ENet
+			// packet's free callback. The shard's own reference is dropped once the fan-out is done.
+			block->refs.fetch_add(1, std::memory_order_relaxed);
+			ENetPacket *packet = enet_packet_create(block->iq, block->frames * 2 * sizeof(int16_t), ENET_PACKET_FLAG_NO_ALLOCATE);
+			packet->userData     = block;
+			packet->freeCallback = free_iq_block_packet;
+			// Blocks are not lost on the way, yet the stream position comes from the streaming thread.
+			shard->sample_index = block->sample_index;
+			fan_out_block(*shard, packet, block->iq, block->frames, block->resample_ratio, block->capture_us);
+			release_iq_block(block);
+		}
+		blocks.clear();
+		for (ENetHost *server : shard->hosts)
+			pump_enet_host(*shard, server);
+	}
+}
+#endif // _WIN32
+
+// Close the hosts of a shard and release its peers.
+static void destroy_shard(Shard &shard)
+{
+	release_history(shard);
+	for (ENetPacket *&aggregate : shard.aggregates)
+		if (aggregate != nullptr) {
+			release_packet(aggregate);
+			aggregate = nullptr;
+		}
+	for (ENetHost *server : shard.hosts) {
+		for (ENetPeer *peer = server->peers; peer < server->peers + server->peerCount; ++ peer)
+			if (peer->data != nullptr) {
+				release_iq_queue(static_cast<Client*>(peer->data));
+				delete static_cast<Client*>(peer->data);
+				peer->data = nullptr;
+			}
+		// With sendmmsg / recvmmsg batching, many datagrams share a single system call.
+		printf("ENet host %zu: %u datagrams sent in %u calls, %u received in %u calls\n", shard.index,
+			server->totalSentPackets, server->totalSendCalls, server->totalReceivedPackets, server->totalReceiveCalls);
+		enet_host_destroy(server);
+	}
+	shard.hosts.clear();
+	for (IQBlock *block : shard.inbox)
+		release_iq_block(block);
+	shard.inbox.clear();
+#ifndef _WIN32
+	if (shard.wake_fd != -1)
+		close(shard.wake_fd);
+#endif // _WIN32
+	shard.wake_fd = -1;
+}
+
+// Create one ENet host per configured bind address for the shard. The hosts of shard 0 bind first,
+// the hosts of the other shards share their ports, the kernel spreading the peers over the shards by address.
+// Hosts that fail to bind are reported and skipped, returns false if no host could be created.
+static bool create_enet_hosts(Shard &shard, const ServerConfig &server_config, bool shared_port)
+{
+	std::vector<std::string> bind_addresses = server_config.bind_addresses;
+	if (bind_addresses.empty())
+		bind_addresses.emplace_back();
+	const int max_peers    = std::max(1, std::min(server_config.max_peers, int(ENET_PROTOCOL_MAXIMUM_PEER_ID)));
+	const int max_channels = std::max(2, std::min(server_config.max_channels, int(ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT)));
+	for (const std::string &bind_address : bind_addresses) {
+		ENetAddress address {};
+		address.host = ENET_HOST_ANY;
+		address.port = enet_uint16(server_config.port);
+		if (! bind_address.empty() && bind_address != "*" && enet_address_set_host_ip_new(&address, bind_address.c_str()) != 0) {
+			LOGD("Invalid bind address %s\n", bind_address.c_str());
+			continue;
+		}
+		ENetHost *server = shared_port ?
+			enet_host_create_shared_port(&address, max_peers, max_channels, 0, 0) :
+			enet_host_create(&address, max_peers, max_channels, 0, 0);
+		if (server == nullptr) {
+			LOGD("An error occured while trying to create an ENet server host on %s:%d\n",
+				bind_address.empty() ? "*" : bind_address.c_str(), server_config.port);
+			continue;
+		}
+		printf("Listening on %s:%d, %d peers, %d channels, network thread %zu\n",
+			bind_address.empty() ? "*" : bind_address.c_str(), server_config.port, max_peers, max_channels, shard.index);
+		enet_host_set_intercept(server, cat_intercept);
+		shard.hosts.emplace_back(server);
+	}
+	return ! shard.hosts.empty();
+}
+
+// Shard 0 and network_threads - 1 shards with threads of their own. A shard whose hosts cannot be created
+// is left out, the peers then spread over the others.
+static bool create_shards(const ServerConfig &server_config)
+{
+	int network_threads = std::max(1, server_config.network_threads);
+#if defined(_WIN32) || ! defined(SO_REUSEPORT)
+	network_threads = 1;
+#endif
+	const size_t history_size = size_t(std::max(0, server_config.preroll_ms)) * SAMPLE_RATE / (1000 * EXT_BLOCKLEN);
+	for (int i = 0; i < network_threads; ++ i) {
+		std::unique_ptr<Shard> shard(new Shard);
+		shard->index = g_shards.size();
+		shard->history.assign(history_size, nullptr);
+		if (! create_enet_hosts(*shard, server_config, network_threads > 1)) {
+			destroy_shard(*shard);
+			if (i == 0)
+				return false;
+			continue;
+		}
+#ifndef _WIN32
+		if (shard->index > 0 && (shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			LOGD("Failed to create an eventfd: %s\n", strerror(errno));
+			destroy_shard(*shard);
+			continue;
+		}
+#endif // _WIN32
+		g_shards.emplace_back(std::move(shard));
+	}
+#ifndef _WIN32
+	if (g_shards.size() > 1) {
+		if ((g_control_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			LOGD("Failed to create an eventfd: %s\n", strerror(errno));
+			while (g_shards.size() > 1) {
+				destroy_shard(*g_shards.back());
+				g_shards.pop_back();
+			}
+			return true;
+		}
+		for (size_t i = 1; i < g_shards.size(); ++ i)
+			g_shards[i]->thread = std::thread(shard_thread, g_shards[i].get());
+		printf("%zu network threads\n", g_shards.size());
+	}
+#endif // _WIN32
+	return true;
+}
+
+static void destroy_shards()
+{
+	for (const std::unique_ptr<Shard> &shard : g_shards) {
+		shard->stop.store(true, std::memory_order_release);
+		if (shard->thread.joinable())
+			shard->thread.join();
+	}
+	// The shard threads are gone, the posted CAT commands are dropped.
+	for (const ControlMessage &message : g_control_inbox)
+		if (message.packet != nullptr)
+			enet_packet_destroy(message.packet);
+	g_control_inbox.clear();
+	for (const std::unique_ptr<Shard> &shard : g_shards)
+		destroy_shard(*shard);
+	g_shards.clear();
+#ifndef _WIN32
+	if (g_control_wake_fd != -1)
+		close(g_control_wake_fd);
+#endif // _WIN32
+	g_control_wake_fd = -1;
+}
+
 // Stereo 16-bit samples, interleaved I/Q, little-endian, LSB first
 static uint8_t g_data_buffer[EXT_BLOCKLEN * 2 * 2];
 static int     g_data_buffer_len = 0;
 
+// ISO transfers are resubmitted from the callback as long as streaming is active.
+static bool	g_streaming = false;
+// Number of ISO transfers submitted to libusb and not yet returned through the callback.
+static int	g_transfers_in_flight = 0;
+
 static void libusb_transfer_callback(struct libusb_transfer *xfr)
 {
+	if (xfr->status == LIBUSB_TRANSFER_CANCELLED) {
+		-- g_transfers_in_flight;
+		return; // do not resubmit
+	}
 	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		LOGD("Transfer not completed (status %d: %s), stopping.\n", xfr->status, libusb_error_name(xfr->status));
-		g_run.store(false);
+		// USB glitch or radio unplugged, the main loop reconnects.
+		LOGD("Transfer not completed (status %d: %s), reconnecting.\n", xfr->status, libusb_error_name(xfr->status));
+		-- g_transfers_in_flight;
+		g_radio_lost = true;
 		return; // do not resubmit
 	}
 
@@ -239,19 +1723,23 @@ static void libusb_transfer_callback(struct libusb_transfer *xfr)
 	#endif
 	}
 
-	if (g_run.load()) {
+	if (g_streaming && g_run.load()) {
 		if (int err = libusb_submit_transfer(xfr); err < 0) {
-			LOGD("error re-submitting URB: %d\n", err);
-			g_run.store(false);
+			LOGD("error re-submitting URB: %d, reconnecting\n", err);
+			-- g_transfers_in_flight;
+			g_radio_lost = true;
 		}
-	}
+	} else
+		-- g_transfers_in_flight;
 }
 
 static uint8_t 					g_transfer_bufs[NUM_ISO_TRANSFERS][ISO_PACKET_SIZE * NUM_ISO_PACKETS];
 static struct libusb_transfer  *g_xfr[NUM_ISO_TRANSFERS] = { nullptr };
 
+// Allocate the ISO transfers once per session, they are reused for each pause / resume cycle.
 static bool prepare_libusb_isochronous_in_transfer(libusb_device_handle *devh, uint8_t ep)
 {
+	g_transfers_in_flight = 0;
     for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i) {
 	    g_xfr[i] = libusb_alloc_transfer(NUM_ISO_PACKETS);
 	    if (! g_xfr[i]) {
@@ -260,75 +1748,186 @@ static bool prepare_libusb_isochronous_in_transfer(libusb_device_handle *devh, u
 	    }
 		libusb_fill_iso_transfer(g_xfr[i], devh, ep, g_transfer_bufs[i], sizeof(g_transfer_bufs[i]), 
 			NUM_ISO_PACKETS, libusb_transfer_callback, NULL, 1000);
+		// Resubmitting from the callback reuses the usbfs URBs instead of allocating them again.
+		g_xfr[i]->flags |= LIBUSB_TRANSFER_KEEP_ISO_URBS;
+	}
+	return true;
+}
+
+// In steady state streaming only the reuses counter grows.
+static void log_iso_urb_stats()
+{
+	libusb_iso_urb_stats stats;
+	libusb_get_iso_urb_stats(&stats);
+	printf("ISO URB allocations: %llu, frees: %llu, reuses: %llu\n",
+		(unsigned long long)stats.allocations, (unsigned long long)stats.frees, (unsigned long long)stats.reuses);
+}
+
+static bool submit_libusb_isochronous_in_transfers()
+{
+	g_data_buffer_len = 0; // reset stale data from any previous session or pause
+	g_streaming = true;
+	for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i) {
 		libusb_set_iso_packet_lengths(g_xfr[i], ISO_PACKET_SIZE);
 		int r = libusb_submit_transfer(g_xfr[i]);
 		if (r < 0) {
 			LOGD("error submitting URB %d: %d\n", i, r);
 			return false;
 		}
+		++ g_transfers_in_flight;
+	}
+	return true;
+}
+
+// Cancel the in-flight ISO transfers and wait until libusb returns each of them through the callback.
+// Returns false if some transfers did not complete within the timeout, then they must not be freed.
+static bool cancel_libusb_isochronous_in_transfers(libusb_context *context)
+{
+	static constexpr int timeout_ms = 2000;
+	g_streaming = false;
+	for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i)
+		if (g_xfr[i])
+			// Fails with LIBUSB_ERROR_NOT_FOUND for transfers, which are not in flight.
+			libusb_cancel_transfer(g_xfr[i]);
+	for (int waited_ms = 0; g_transfers_in_flight > 0 && waited_ms < timeout_ms; waited_ms += 10) {
+		// Returns as soon as a transfer completes, the timeout only guards against a stuck device.
+		struct timeval tv = { 0, 10000 };
+		libusb_handle_events_timeout_completed(context, &tv, nullptr);
+	}
+	if (g_transfers_in_flight > 0) {
+		LOGD("%d ISO transfers did not complete after cancellation\n", g_transfers_in_flight);
+		return false;
 	}
 	return true;
 }
 
+static void free_libusb_isochronous_in_transfers()
+{
+	for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i)
+		if (g_xfr[i]) {
+			libusb_free_transfer(g_xfr[i]);
+			g_xfr[i] = nullptr;
+		}
+}
+
 #define LIBUSB_ANDROID
 
-int main_loop(int fd, const std::string &device_path)
-{ 
-	libusb_context *context;
-	libusb_device_handle * dev_handle;
-	libusb_device *device;
-	struct libusb_device_descriptor desc;
-	unsigned char buffer[256];
-	
-	int rc = libusb_init(&context);
-	if (rc < 0) {
-		LOGD("Error initializing libusb: %s\n", libusb_error_name(rc));
-		return 1;
+// Radio hot-plug notifications posted by the Android service through JNI.
+static std::mutex				g_hotplug_mutex;
+static std::condition_variable	g_hotplug_cv;
+// Radio detached, its USB file descriptor is going to be closed by the Android service.
+static bool						g_hotplug_detached = false;
+// The libusb handle on the current USB file descriptor has been closed.
+static bool						g_radio_released = true;
+// New USB file descriptor and device path of a reattached radio.
+static int						g_hotplug_fd = -1;
+static std::string				g_hotplug_device_path;
+#ifndef LIBUSB_ANDROID
+// Set by the libusb hotplug callback to retry opening the radio immediately.
+static bool						g_hotplug_arrived = false;
+#endif // LIBUSB_ANDROID
+
+// Called by the Android service on USB detach before it closes the USB file descriptor.
+// Blocks until the streaming thread released the libusb handle using that file descriptor.
+bool radio_detached(int timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(g_hotplug_mutex);
+	g_hotplug_detached = true;
+	g_hotplug_fd = -1;
+	return g_hotplug_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), []{ return g_radio_released || ! g_run.load(); });
+}
+
+// Called by the Android service once the radio was reattached and reopened.
+void radio_attached(int fd, const std::string &device_path)
+{
+	std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+	g_hotplug_detached    = false;
+	g_hotplug_fd          = fd;
+	g_hotplug_device_path = device_path;
+}
+
+#ifndef LIBUSB_ANDROID
+static int LIBUSB_CALL hotplug_arrived_callback(libusb_context*, libusb_device*, libusb_hotplug_event, void*)
+{
+	g_hotplug_arrived = true;
+	return 0; // keep the callback registered
+}
+#endif // LIBUSB_ANDROID
+
+static const UsbDeviceDescriptor g_descriptor = UsbDevQrpLabs; // UsbDevPeaberry;
+
+static void close_radio(libusb_device_handle *dev_handle)
+{
+	// Offline CAT writes only update the shadow state from now on.
+	g_Cat.close();
+	// Release claimed interfaces, fails silently if the device is gone.
+	for (int iface : { 0, 1, 2, 3, 4 })
+		libusb_release_interface(dev_handle, iface);
+	libusb_close(dev_handle);
+	{
+		std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+		g_radio_released = true;
 	}
+	g_hotplug_cv.notify_all();
+}
 
-	const UsbDeviceDescriptor descriptor = UsbDevQrpLabs; // UsbDevPeaberry;
-	UsbDeviceDetected		  detected;
+// Open the radio, claim its interfaces and switch the audio interface to the streaming alt setting.
+// On Android, the radio is opened through the USB file descriptor provided by the Android USB manager,
+// otherwise the radio with the given serial number (any if empty) is searched for.
+// serial_number is updated with the serial number of the radio opened.
+// Returns nullptr on failure.
+static libusb_device_handle* open_radio(libusb_context *context, int fd, const std::string &device_path, std::string &serial_number)
+{
+	libusb_device_handle	*dev_handle = nullptr;
+	UsbDeviceDetected		 detected;
+	int 					 rc = 0;
 
 #ifdef LIBUSB_ANDROID
 #if 0
 	rc = libusb_wrap_sys_device(context, (intptr_t)fd, &dev_handle);
 #else
-    device = libusb_get_device2(context, device_path.c_str());
+    libusb_device *device = libusb_get_device2(context, device_path.c_str());
     if (! device) {
         LOGD("Error opening Android USB device %s: %s\n", device_path.c_str(), libusb_error_name(rc));
-        return 1;
+        return nullptr;
     }
     rc = libusb_open2(device, &dev_handle, (intptr_t)fd);
 #endif
 	if (rc < 0) {
 		LOGD("Error opening Android USB file handle %d: %s\n", (int)fd, libusb_error_name(rc));
-		return 1;
+		return nullptr;
 	}
 	try {
-		detected = match_libusb_descriptor(dev_handle, descriptor);
+		detected = match_libusb_descriptor(dev_handle, g_descriptor);
 	} catch (const std::exception& e) {
 		printf("match_libusb_descriptor(): %s\n", e.what());
 	}
 #else // LIBUSB_ANDROID
 	try {
-		std::vector<UsbDeviceDetected> detected_all = find_libusb_devices(context, descriptor);
+		std::vector<UsbDeviceDetected> detected_all = find_libusb_devices(context, g_descriptor, serial_number, true);
 		if (detected_all.empty()) {
 			LOGD("USB device was not found\n");
-			return 1;
+			return nullptr;
 		}
 		detected = detected_all.front();
 		dev_handle = detected.handle;
 	} catch (const std::exception& e) {
 		LOGD("find_libusb_devices(): %s\n", e.what());
-		return 1;
+		return nullptr;
 	}
 #endif // LIBUSB_ANDROID
 
-	printf("Vendor ID: %04x\n",  descriptor.vendor_id);
-	printf("Product ID: %04x\n", descriptor.product_id);
-	printf("Vendor: %s\n",       descriptor.vendor_name);
+	{
+		std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+		g_radio_released = false;
+	}
+
+	printf("Vendor ID: %04x\n",  g_descriptor.vendor_id);
+	printf("Product ID: %04x\n", g_descriptor.product_id);
+	printf("Vendor: %s\n",       g_descriptor.vendor_name);
 	printf("Product Name: %s\n", std::string(detected.product_name).c_str());
 	printf("Serial No: %s\n",	 detected.serial_number.c_str());
+	serial_number = detected.serial_number;
 
     // 1: CDC
     // 2: Audio control
@@ -339,14 +1938,16 @@ int main_loop(int fd, const std::string &device_path)
 		rc = libusb_kernel_driver_active(dev_handle, iface);
 		if (rc < 0) {
 			LOGD("libusb_kernel_driver_active failed: %s\n", libusb_error_name(rc));
-			return 1;
+			close_radio(dev_handle);
+			return nullptr;
 		}
 		if (rc == 1) {
 			printf("Detaching kernel driver\n");
 			rc = libusb_detach_kernel_driver(dev_handle, iface);
 			if (rc < 0) {
 				LOGD("Could not detach kernel driver: %s\n", libusb_error_name(rc));
-				return 1;
+				close_radio(dev_handle);
+				return nullptr;
 			}
 		}
 #endif // _WIN32
@@ -354,40 +1955,425 @@ int main_loop(int fd, const std::string &device_path)
 		rc = libusb_claim_interface(dev_handle, iface);
 		if (rc < 0) {
 			LOGD("Error claiming interface: %s\n", libusb_error_name(rc));
-			return 1;
+			close_radio(dev_handle);
+			return nullptr;
 		}
 	}
 
 	rc = libusb_set_interface_alt_setting(dev_handle, IFACE_NUM, 1);
 	if (rc < 0) {
 		LOGD("Error setting alt setting: %s\n", libusb_error_name(rc));
-		return 1;
+		close_radio(dev_handle);
+		return nullptr;
+	}
+
+	return dev_handle;
+}
+
+// Wait for the libusb file descriptors, the libusb timeouts and the ENet sockets, then handle the libusb events.
+#ifndef _WIN32
+// Append the sockets serviced by the streaming thread and the wake-up of the control messages to fds,
+// then wait for any of them. Returns false on a poll() error.
+static bool poll_network(std::vector<pollfd> &fds, int timeout_ms)
+{
+	for (ENetHost *server : g_shards.front()->hosts)
+		fds.push_back({ server->socket, POLLIN, 0 });
+	if (g_relay.running())
+		fds.push_back({ g_relay.socket(), POLLIN, 0 });
+	if (g_control_wake_fd != -1)
+		fds.push_back({ g_control_wake_fd, POLLIN, 0 });
+	if (poll(fds.data(), nfds_t(fds.size()), timeout_ms) < 0 && errno != EINTR)
+		return false;
+	if (g_control_wake_fd != -1 && (fds.back().revents & POLLIN)) {
+		uint64_t count;
+		if (read(g_control_wake_fd, &count, sizeof(count)) < 0) {}
+	}
+	return true;
+}
+#endif // _WIN32
+
+// The ENet sockets wake the loop up, thus a CAT command is handled as soon as it arrives, not after
+// the next ISO completion. Falls back to waiting for libusb only where libusb does not expose its descriptors.
+static int handle_events(libusb_context *context, int timeout_ms)
+{
+#ifndef _WIN32
+	if (const libusb_pollfd **usb_fds = libusb_get_pollfds(context); usb_fds != nullptr) {
+		static std::vector<pollfd> fds;
+		fds.clear();
+		for (const libusb_pollfd **usb_fd = usb_fds; *usb_fd != nullptr; ++ usb_fd)
+			fds.push_back({ (*usb_fd)->fd, (*usb_fd)->events, 0 });
+		libusb_free_pollfds(usb_fds);
+		struct timeval tv;
+		if (libusb_get_next_timeout(context, &tv) == 1)
+			timeout_ms = std::min<int>(timeout_ms, int(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000));
+		if (! poll_network(fds, timeout_ms))
+			return LIBUSB_ERROR_IO;
+		struct timeval zero = { 0, 0 };
+		return libusb_handle_events_timeout_completed(context, &zero, nullptr);
 	}
+#endif // _WIN32
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	return libusb_handle_events_timeout_completed(context, &tv, nullptr);
+}
 
-    if (enet_initialize() != 0) {
+// Network side of the server, common to the radio and the relay mode.
+static bool start_server(const ServerConfig &server_config)
+{
+	// ENet allocates packets and commands for every IQ block, serve them from thread local slabs.
+	ENetCallbacks enet_callbacks = {};
+	enet_callbacks.malloc = slab_malloc;
+	enet_callbacks.free   = slab_free;
+	if (enet_initialize_with_callbacks(ENET_VERSION, &enet_callbacks) != 0) {
 		LOGD("An error occured while initializing ENet.\n");
+		return false;
+	}
+	g_stream_quality_config = server_config.stream_quality;
+	g_iq_queue_max_blocks   = std::max<size_t>(1, size_t(server_config.iq_queue_max_ms) * SAMPLE_RATE / (1000 * EXT_BLOCKLEN));
+	g_iq_queue_max_bytes    = size_t(std::max(0, server_config.iq_queue_max_bytes));
+	if (! create_shards(server_config)) {
+		LOGD("No ENet server host could be created\n");
+		enet_deinitialize();
+		return false;
+	}
+	g_resolver.start();
+	g_sample_index = 0;
+	if (! server_config.multicast_group.empty()) {
+		int multicast_port = server_config.multicast_port > 0 ? server_config.multicast_port : server_config.port + 1;
+		std::string multicast_interface = server_config.multicast_interface;
+		for (const std::string &bind_address : server_config.bind_addresses)
+			if (multicast_interface.empty() && bind_address != "*")
+				multicast_interface = bind_address;
+		if (g_multicast.open(server_config.multicast_group, multicast_port, server_config.multicast_ttl, multicast_interface))
+			printf("IQ multicast to %s port %d\n", server_config.multicast_group.c_str(), multicast_port);
+		else
+			LOGD("IQ multicast disabled\n");
+	}
+	if (! server_config.local_socket.empty()) {
+		if (g_local_stream.open(server_config.local_socket, EXT_BLOCKLEN))
+			printf("IQ shared memory ring on @%s\n", server_config.local_socket.c_str());
+		else
+			LOGD("IQ shared memory ring disabled\n");
+	}
+	if (server_config.skimmer_signals > 0) {
+		g_skimmer_freq = 0;
+		if (g_skimmer.start(size_t(server_config.skimmer_signals), SAMPLE_RATE))
+			printf("CW skimmer decoding up to %d signals\n", server_config.skimmer_signals);
+		else
+			LOGD("CW skimmer disabled\n");
+	}
+	return true;
+}
+
+// Recording and time-shift history of the stream, started once the CAT state is known.
+static void start_capture(const ServerConfig &server_config)
+{
+	if (! server_config.record_dir.empty()) {
+		RecorderConfig recorder_config;
+		recorder_config.directory      = server_config.record_dir;
+		recorder_config.rotate_bytes   = uint64_t(std::max(1, server_config.record_rotate_mb)) << 20;
+		recorder_config.rotate_seconds = uint32_t(std::max(1, server_config.record_rotate_minutes)) * 60;
+		recorder_config.nominal_rate   = SAMPLE_RATE;
+		if (g_recorder.start(recorder_config))
+			record_frequency();
+		else
+			LOGD("IQ recording disabled\n");
+	}
+	if (server_config.time_shift_minutes > 0) {
+		const size_t history_blocks = size_t(server_config.time_shift_minutes) * 60 * SAMPLE_RATE / EXT_BLOCKLEN;
+		TimeShiftConfig time_shift_config;
+		time_shift_config.path         = server_config.time_shift_path;
+		time_shift_config.block_frames = EXT_BLOCKLEN;
+		time_shift_config.ram_blocks   = server_config.time_shift_path.empty() ? history_blocks :
+			std::min<size_t>(history_blocks, TIME_SHIFT_RAM_SECONDS * SAMPLE_RATE / EXT_BLOCKLEN);
+		time_shift_config.file_blocks  = server_config.time_shift_path.empty() ? 0 : history_blocks;
+		time_shift_config.nominal_rate = SAMPLE_RATE;
+		if (! g_time_shift.start(time_shift_config))
+			LOGD("Time-shift disabled\n");
+	}
+}
+
+static void stop_capture()
+{
+	if (g_recorder.running()) {
+		g_recorder.stop();
+		const RecorderStats stats = g_recorder.stats();
+		printf("Recorder: %llu blocks recorded, %llu dropped, %llu bytes in %u files, %llu write errors\n",
+			(unsigned long long)stats.blocks_recorded, (unsigned long long)stats.blocks_dropped,
+			(unsigned long long)stats.bytes_written, stats.files, (unsigned long long)stats.write_errors);
+		if (stats.blocks_recorded + stats.blocks_dropped > 0)
+			printf("Recorder: push %llu ns average, %llu ns maximum, ring high water %zu of %zu bytes\n",
+				(unsigned long long)(stats.push_ns_total / (stats.blocks_recorded + stats.blocks_dropped)),
+				(unsigned long long)stats.push_ns_max, stats.ring_high_water, stats.ring_capacity);
+	}
+
+	if (g_time_shift.running()) {
+		g_time_shift.stop();
+		const TimeShiftStats stats = g_time_shift.stats();
+		printf("Time-shift: %llu sessions, %llu blocks replayed, %llu spilled, %llu spill overruns\n",
+			(unsigned long long)stats.sessions, (unsigned long long)stats.blocks_served,
+			(unsigned long long)stats.blocks_spilled, (unsigned long long)stats.spill_overruns);
+		if (stats.blocks_pushed > 0)
+			printf("Time-shift: push %llu ns average, %llu ns maximum\n",
+				(unsigned long long)(stats.push_ns_total / stats.blocks_pushed), (unsigned long long)stats.push_ns_max);
+	}
+}
+
+static void stop_server()
+{
+	// Tear down ENet
+	destroy_shards();
+	printf("Pre-roll: %llu history blocks sent\n", (unsigned long long)g_preroll_blocks_sent);
+	printf("IQ blocks dropped by the per peer queue budget: %llu\n", (unsigned long long)g_iq_blocks_dropped);
+	if (g_cat_latency_count > 0)
+		printf("CAT: %llu datagrams, %llu commands executed %llu us average, %llu us maximum after arrival\n",
+			(unsigned long long)g_cat_datagrams.load(), (unsigned long long)g_cat_latency_count,
+			(unsigned long long)(g_cat_latency_sum_us / g_cat_latency_count), (unsigned long long)g_cat_latency_max_us);
+	enet_deinitialize();
+	{
+		const NameResolver::Stats stats = g_resolver.stats();
+		printf("Name resolver: %llu requests, %llu cached, %llu lookups, %llu failed, %llu timed out, longest %llu ms\n",
+			(unsigned long long)stats.requests, (unsigned long long)stats.cache_hits, (unsigned long long)stats.lookups,
+			(unsigned long long)stats.failures, (unsigned long long)stats.timeouts, (unsigned long long)stats.lookup_ms_max);
+		g_resolver.stop();
+	}
+	if (g_multicast.is_open()) {
+		printf("IQ multicast: %llu datagrams sent, %llu send errors\n",
+			(unsigned long long)g_multicast.datagrams_sent(), (unsigned long long)g_multicast.send_errors());
+		g_multicast.close();
+	}
+	if (g_local_stream.is_open()) {
+		const LocalStreamWriter::Stats stats = g_local_stream.stats();
+		printf("IQ shared memory ring: %llu blocks written, handed to %llu clients\n",
+			(unsigned long long)stats.blocks, (unsigned long long)stats.clients);
+		g_local_stream.close();
+	}
+	if (g_skimmer.running()) {
+		const SkimmerStats stats = g_skimmer.stats();
+		printf("CW skimmer: %llu blocks, %llu dropped, %llu spots, %u signals at most, %llu refused, %.1f us per block, "
+			"%.2f us per signal and block\n", (unsigned long long)stats.blocks, (unsigned long long)stats.blocks_dropped,
+			(unsigned long long)stats.spots, unsigned(stats.signals_max), (unsigned long long)stats.signals_refused,
+			stats.blocks != 0 ? stats.process_ns_total * 1e-3 / double(stats.blocks) : 0.,
+			stats.signal_blocks != 0 ? stats.decode_ns_total * 1e-3 / double(stats.signal_blocks) : 0.);
+		g_skimmer.stop();
+	}
+	// Summed over the streaming thread and the joined shard threads: nothing should be left in use
+	// once the hosts are destroyed.
+	slab_log_stats();
+}
+
+// Relay mode: serve the stream of an upstream server instead of the radio. The IQ packets received from upstream
+// are forwarded to the local peers of shard 0 as they are, the radio settings are proxied upstream.
+static int relay_loop(const ServerConfig &server_config, const std::string &server_name, int server_port)
+{
+	if (! start_server(server_config))
 		return 1;
+	if (! g_relay.start(server_name, server_port)) {
+		LOGD("Invalid relay upstream server %s:%d\n", server_name.c_str(), server_port);
+		stop_server();
+		return 1;
+	}
+	printf("Relaying %s:%d\n", server_name.c_str(), server_port);
+	g_radio_online = false;
+	start_capture(server_config);
+	while (g_run.load()) {
+#ifndef _WIN32
+		static std::vector<pollfd> fds;
+		fds.clear();
+		if (! poll_network(fds, 10))
+			break;
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif // _WIN32
+		g_relay_events.clear();
+		g_relay.service(g_relay_events);
+		for (const RelayUpstream::Event &event : g_relay_events)
+			switch (event.type) {
+			case RelayUpstream::Event::IQ:
+				// Paused: the upstream stream keeps coming, it is not forwarded.
+				if (event.packet->dataLength == EXT_BLOCKLEN * 2 * 2 && ! g_pause.load())
+					stream_iq_block(reinterpret_cast<const int16_t*>(event.packet->data), event.packet,
+						g_relay.sample_rate_valid() ? g_relay.sample_rate() / SAMPLE_RATE : 1., monotonic_us());
+				else
+					enet_packet_destroy(event.packet);
+				break;
+			case RelayUpstream::Event::StateSnapshot:
+				broadcast_packet(1, create_state_snapshot_packet());
+				record_frequency();
+				break;
+			case RelayUpstream::Event::SampleRate:
+				broadcast_packet(1, create_sample_rate_packet());
+				if (g_recorder.running() && g_relay.sample_rate_valid())
+					g_recorder.push_sample_rate(g_relay.sample_rate(), g_sample_index);
+				break;
+			case RelayUpstream::Event::Connected:
+			case RelayUpstream::Event::Disconnected:
+			case RelayUpstream::Event::RadioStatus:
+				// The local peers see the upstream radio offline while the upstream connection is down.
+				if (g_relay.radio_online() != g_radio_online) {
+					g_radio_online = g_relay.radio_online();
+					broadcast_radio_status();
+				}
+				break;
+			}
+		pump_enet_packets();
 	}
-	g_address.host = ENET_HOST_ANY;
-	g_address.port = 1234;
+	stop_capture();
 	{
-		static const int max_clients = 32;
-		static const int max_channels = 2;
-        g_server = enet_host_create(&g_address, max_clients, max_channels, 0, 0);
+		const RelayUpstream::Stats stats = g_relay.stats();
+		printf("Relay: %llu connects, %llu IQ packets, %llu notifications, CAT %llu writes, %llu coalesced, %llu sent\n",
+			(unsigned long long)stats.connects, (unsigned long long)stats.iq_packets, (unsigned long long)stats.notifications,
+			(unsigned long long)stats.cat_writes, (unsigned long long)stats.cat_coalesced, (unsigned long long)stats.cat_sent);
 	}
-    if (g_server == nullptr) {
-		LOGD("An error occured while trying to create an ENet server host\n");
+	g_relay.stop();
+	stop_server();
+	return 0;
+}
+
+int main_loop(int fd, const std::string &device_path, const ServerConfig &server_config)
+{ 
+	if (! server_config.config_path.empty() && ! g_config_store.open(server_config.config_path, g_config))
+		LOGD("Failed to open the config file %s, settings will not be persisted\n", server_config.config_path.c_str());
+
+	// Relay mode, requested by the service or persisted in the config.
+	if (! server_config.relay_server.empty() || g_config.network_client) {
+		const bool persisted = server_config.relay_server.empty();
+		const int  rc = relay_loop(server_config, persisted ? g_config.network_server_name : server_config.relay_server,
+			persisted ? g_config.network_server_port : server_config.relay_port);
+		g_config_store.close();
+		return rc;
+	}
+
+	libusb_context *context;
+	
+	int rc = libusb_init(&context);
+	if (rc < 0) {
+		LOGD("Error initializing libusb: %s\n", libusb_error_name(rc));
 		return 1;
 	}
 
-	g_Cat.init(dev_handle);
+	{
+		std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+		g_hotplug_detached = false;
+		g_hotplug_fd       = -1;
+	}
+
+	// Reopen the same radio after a USB glitch.
+	std::string           serial_number;
+	std::string           radio_device_path = device_path;
+	libusb_device_handle *dev_handle = open_radio(context, fd, radio_device_path, serial_number);
+	if (dev_handle == nullptr)
+		return 1;
+
+#ifndef LIBUSB_ANDROID
+	// Android apps are not allowed to listen to the kernel netlink hot-plug events,
+	// there the reattached radio is reported by the Android service through JNI.
+	libusb_hotplug_callback_handle hotplug_handle = 0;
+	g_hotplug_arrived = false;
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+			g_descriptor.vendor_id, g_descriptor.product_id, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_arrived_callback, nullptr, &hotplug_handle);
+#endif // LIBUSB_ANDROID
+
+	if (! start_server(server_config))
+		return 1;
 
-	g_data_buffer_len = 0; // reset stale data from any previous session
+	g_Cat.init(context, dev_handle);
+	// Push the persisted settings in a single batch before streaming starts.
+	if (! g_Cat.apply_config(g_config, g_config_store))
+		LOGD("Failed to apply the config to the radio\n");
+	start_capture(server_config);
+	g_radio_online = true;
+	g_radio_lost   = false;
 
-	if (prepare_libusb_isochronous_in_transfer(dev_handle, EP_ISO_IN)) {
+	if (prepare_libusb_isochronous_in_transfer(dev_handle, EP_ISO_IN) && submit_libusb_isochronous_in_transfers()) {
+		bool paused = false;
+		// Retry period of reopening the radio, if no hot-plug notification arrives.
+		static constexpr auto reconnect_period = std::chrono::seconds(1);
+		auto next_reconnect = std::chrono::steady_clock::now();
 		while (g_run.load()) {
-			struct timeval tv = { 0, 100000 }; // 100ms timeout so we recheck g_run
-			rc = libusb_handle_events_timeout_completed(context, &tv, nullptr);
+			if (g_radio_online) {
+				bool detached;
+				{
+					std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+					detached = g_hotplug_detached;
+				}
+				if (g_radio_lost || detached) {
+					// Radio went away: keep the ENet peers connected and let them know.
+					printf("Radio disconnected, waiting for it to come back\n");
+					if (! cancel_libusb_isochronous_in_transfers(context)) {
+						g_run.store(false);
+						break;
+					}
+					free_libusb_isochronous_in_transfers();
+					close_radio(dev_handle);
+					dev_handle = nullptr;
+					g_radio_online = false;
+					broadcast_radio_status();
+					next_reconnect = std::chrono::steady_clock::now() + reconnect_period;
+				}
+			} else {
+				bool detached;
+				{
+					std::lock_guard<std::mutex> lock(g_hotplug_mutex);
+					detached = g_hotplug_detached;
+					if (g_hotplug_fd != -1) {
+						// The Android service reopened the reattached radio.
+						fd                = g_hotplug_fd;
+						radio_device_path = g_hotplug_device_path;
+						g_hotplug_fd      = -1;
+						next_reconnect    = std::chrono::steady_clock::now();
+					}
+				}
+#ifndef LIBUSB_ANDROID
+				if (g_hotplug_arrived) {
+					g_hotplug_arrived = false;
+					next_reconnect = std::chrono::steady_clock::now();
+				}
+#endif // LIBUSB_ANDROID
+				// While detached the old file descriptor is invalid, wait for the new one.
+				if (! detached && std::chrono::steady_clock::now() >= next_reconnect) {
+					dev_handle = open_radio(context, fd, radio_device_path, serial_number);
+					if (dev_handle != nullptr) {
+						printf("Radio reconnected\n");
+						g_Cat.init(context, dev_handle);
+						if (! g_Cat.restore_state())
+							LOGD("Failed to restore the CAT state\n");
+						record_frequency();
+						g_radio_lost = false;
+						if (! prepare_libusb_isochronous_in_transfer(dev_handle, EP_ISO_IN) ||
+							(! paused && ! submit_libusb_isochronous_in_transfers())) {
+							g_run.store(false);
+							break;
+						}
+						g_radio_online = true;
+						broadcast_radio_status();
+					} else
+						next_reconnect = std::chrono::steady_clock::now() + reconnect_period;
+				}
+			}
+			if (bool pause = g_pause.load(); pause != paused) {
+				// Pause / resume only stops / restarts the ISO transfers, ENet peers stay connected.
+				// While the radio is offline, the pause state is applied once it reconnects.
+				if (g_radio_online) {
+					if (pause) {
+						printf("Pausing streaming\n");
+						if (! cancel_libusb_isochronous_in_transfers(context)) {
+							g_run.store(false);
+							break;
+						}
+						log_iso_urb_stats();
+					} else {
+						printf("Resuming streaming\n");
+						if (! submit_libusb_isochronous_in_transfers()) {
+							g_run.store(false);
+							break;
+						}
+					}
+				}
+				paused = pause;
+			}
+			// 100ms timeout so we recheck g_run, shorter while paused or offline as there are no ISO completions to wake us up.
+			rc = handle_events(context, (paused || ! g_radio_online) ? 10 : 100);
 			if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_TIMEOUT)
 				break;
 			pump_enet_packets();
@@ -396,38 +2382,27 @@ int main_loop(int fd, const std::string &device_path)
 		g_run.store(false);
 
 	// Cancel and free in-flight transfers
-	bool canceled = false;
-	for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i)
-		if (g_xfr[i]) {
-			canceled = true;
-			libusb_cancel_transfer(g_xfr[i]);
-		}
-	// Let libusb process the cancellations
-	if (canceled) {
-		for (int i = 0; i < 50; ++ i) {
-			struct timeval tv = { 0, 50000 };
-			libusb_handle_events_timeout_completed(context, &tv, nullptr);
-		}
-		for (int i = 0; i < NUM_ISO_TRANSFERS; ++ i)
-			if (g_xfr[i]) {
-				libusb_free_transfer(g_xfr[i]);
-				g_xfr[i] = nullptr;
-			}
-	}
+	if (cancel_libusb_isochronous_in_transfers(context))
+		free_libusb_isochronous_in_transfers();
+	log_iso_urb_stats();
 
-	// Release claimed interfaces
-	for (int iface : { 0, 1, 2, 3, 4 })
-		libusb_release_interface(dev_handle, iface);
+	if (dev_handle != nullptr)
+		close_radio(dev_handle);
+	// Unblock a pending radio_detached() call.
+	g_hotplug_cv.notify_all();
 
-	libusb_close(dev_handle);
+#ifndef LIBUSB_ANDROID
+	if (hotplug_handle != 0)
+		libusb_hotplug_deregister_callback(context, hotplug_handle);
+#endif // LIBUSB_ANDROID
 
-	// Tear down ENet
-	if (g_server) {
-		enet_host_destroy(g_server);
-		g_server = nullptr;
-	}
-	enet_deinitialize();
+	printf("Sample rate %s %.3f Hz, %.1f ppm\n", g_sample_rate.valid() ? "estimated" : "not estimated, nominal",
+		g_sample_rate.rate(), g_sample_rate.ppm());
+
+	stop_capture();
+	stop_server();
 
+	g_config_store.close();
 	libusb_exit(context);
 	return 0;
 }
@@ -0,0 +1,189 @@
+#include "name_resolver.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+bool NameResolver::system_lookup(const std::string &ip, std::string &name)
+{
+	sockaddr_storage addr {};
+	socklen_t        addr_len;
+	sockaddr_in     *addr4 = reinterpret_cast<sockaddr_in*>(&addr);
+	sockaddr_in6    *addr6 = reinterpret_cast<sockaddr_in6*>(&addr);
+	if (inet_pton(AF_INET, ip.c_str(), &addr4->sin_addr) == 1) {
+		addr4->sin_family = AF_INET;
+		addr_len = sizeof(sockaddr_in);
+	} else if (inet_pton(AF_INET6, ip.c_str(), &addr6->sin6_addr) == 1) {
+		addr6->sin6_family = AF_INET6;
+		addr_len = sizeof(sockaddr_in6);
+	} else
+		return false;
+	char host[NI_MAXHOST];
+	if (getnameinfo(reinterpret_cast<sockaddr*>(&addr), addr_len, host, sizeof(host), nullptr, 0, NI_NAMEREQD) != 0)
+		return false;
+	name = host;
+	return true;
+}
+
+bool NameResolver::address_lookup(const std::string &host, std::string &ip)
+{
+	addrinfo hints {};
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo *result  = nullptr;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr)
+		return false;
+	char numeric[NI_MAXHOST];
+	const bool ok = getnameinfo(result->ai_addr, result->ai_addrlen, numeric, sizeof(numeric), nullptr, 0, NI_NUMERICHOST) == 0;
+	freeaddrinfo(result);
+	if (ok)
+		ip = numeric;
+	return ok;
+}
+
+bool NameResolver::start(Lookup lookup, uint32_t timeout_ms, uint32_t cache_seconds, uint32_t negative_cache_seconds)
+{
+	stop();
+	if (! lookup)
+		return false;
+	m_state = std::make_shared<State>();
+	m_state->lookup       = std::move(lookup);
+	m_state->timeout      = std::chrono::milliseconds(timeout_ms);
+	m_state->cache_ttl    = std::chrono::seconds(cache_seconds);
+	m_state->negative_ttl = std::chrono::seconds(negative_cache_seconds);
+	m_state->workers      = WORKERS;
+	for (size_t i = 0; i < WORKERS; ++ i)
+		m_threads.emplace_back(&NameResolver::worker_thread, m_state);
+	return true;
+}
+
+void NameResolver::stop()
+{
+	if (m_state == nullptr)
+		return;
+	bool exited;
+	{
+		std::unique_lock<std::mutex> lock(m_state->mutex);
+		m_state->stop = true;
+		m_state->cv.notify_all();
+		// getnameinfo() has no cancellation, a worker waiting for a DNS server not answering is left behind.
+		exited = m_state->exited_cv.wait_for(lock, STOP_WAIT, [this]{ return m_state->workers == 0; });
+	}
+	for (std::thread &thread : m_threads)
+		if (exited)
+			thread.join();
+		else
+			thread.detach();
+	m_threads.clear();
+	m_state.reset();
+}
+
+void NameResolver::State::complete(const std::string &ip, const std::string &name)
+{
+	auto range = pending.equal_range(ip);
+	for (auto req = range.first; req != range.second; ++ req)
+		done.push_back({ req->second.token, ip, name });
+	pending.erase(range.first, range.second);
+}
+
+bool NameResolver::State::complete_from_cache(const std::string &ip, Clock::time_point now)
+{
+	auto it = cache.find(ip);
+	if (it == cache.end() || it->second.expires <= now)
+		return false;
+	complete(ip, it->second.name);
+	return true;
+}
+
+void NameResolver::request(uint64_t token, const std::string &ip)
+{
+	if (m_state == nullptr)
+		return;
+	State &state = *m_state;
+	const Clock::time_point now = Clock::now();
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		++ state.stats.requests;
+		state.pending.insert({ ip, Request { token, now + state.timeout } });
+		if (state.complete_from_cache(ip, now))
+			++ state.stats.cache_hits;
+		else if (state.in_flight.insert(ip).second) {
+			// Otherwise a lookup of the same address already on its way serves this request too.
+			state.queue.emplace_back(ip);
+			queued = true;
+		}
+	}
+	if (queued)
+		state.cv.notify_one();
+}
+
+void NameResolver::poll(std::vector<Result> &results)
+{
+	if (m_state == nullptr)
+		return;
+	State &state = *m_state;
+	const Clock::time_point now = Clock::now();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	for (Result &result : state.done)
+		results.emplace_back(std::move(result));
+	state.done.clear();
+	// The lookup keeps running, only the requester stops waiting for it.
+	for (auto it = state.pending.begin(); it != state.pending.end();)
+		if (it->second.deadline <= now) {
+			results.push_back({ it->second.token, it->first, std::string() });
+			++ state.stats.timeouts;
+			it = state.pending.erase(it);
+		} else
+			++ it;
+}
+
+NameResolver::Stats NameResolver::stats() const
+{
+	if (m_state == nullptr)
+		return Stats();
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	return m_state->stats;
+}
+
+void NameResolver::worker_thread(std::shared_ptr<State> shared)
+{
+	State &state = *shared;
+	std::unique_lock<std::mutex> lock(state.mutex);
+	for (;;) {
+		state.cv.wait(lock, [&state]{ return state.stop || ! state.queue.empty(); });
+		if (state.stop)
+			break;
+		const std::string ip = std::move(state.queue.front());
+		state.queue.pop_front();
+		lock.unlock();
+		std::string name;
+		const Clock::time_point start = Clock::now();
+		const bool found = state.lookup(ip, name);
+		const Clock::time_point now = Clock::now();
+		lock.lock();
+		state.in_flight.erase(ip);
+		++ state.stats.lookups;
+		if (! found) {
+			++ state.stats.failures;
+			name.clear();
+		}
+		state.stats.lookup_ms_max = std::max<uint64_t>(state.stats.lookup_ms_max,
+			uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count()));
+		if (state.cache.size() >= MAX_CACHE) {
+			for (auto it = state.cache.begin(); it != state.cache.end();)
+				it = it->second.expires <= now ? state.cache.erase(it) : std::next(it);
+			if (state.cache.size() >= MAX_CACHE)
+				state.cache.erase(state.cache.begin());
+		}
+		state.cache[ip] = CacheEntry { name, now + (found ? state.cache_ttl : state.negative_ttl) };
+		// Not from the cache, which may keep nothing.
+		state.complete(ip, name);
+	}
+	-- state.workers;
+	state.exited_cv.notify_all();
+}
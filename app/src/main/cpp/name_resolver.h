@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reverse DNS of the peer addresses off the streaming thread. A lookup blocks for as long as the DNS server
+// takes to answer or to time out, thus the lookups run on worker threads, the streaming thread only posts
+// the requests and polls for the results. A request not answered within the timeout completes without a name,
+// the late answer still goes to the cache. Both the names and the failures are cached for a while.
+// Started with address_lookup, it resolves the other way, host names to numeric addresses.
+class NameResolver
+{
+public:
+	// Blocking lookup of a numeric address, returns false if it has no name. Replaceable for testing.
+	using Lookup = std::function<bool(const std::string &ip, std::string &name)>;
+
+	struct Result {
+		uint64_t	token;
+		std::string	ip;
+		// Empty if the lookup failed or timed out.
+		std::string	name;
+	};
+
+	struct Stats {
+		uint64_t	requests		= 0;
+		uint64_t	cache_hits		= 0;
+		uint64_t	lookups			= 0;
+		uint64_t	failures		= 0;
+		uint64_t	timeouts		= 0;
+		// Longest lookup seen by the worker, milliseconds.
+		uint64_t	lookup_ms_max	= 0;
+	};
+
+	// getnameinfo() without a numeric fallback.
+	static bool	system_lookup(const std::string &ip, std::string &name);
+	// getaddrinfo() of a host name, the first address returned in the numeric form.
+	static bool	address_lookup(const std::string &host, std::string &ip);
+
+	// Time stop() waits for the lookups in progress, the workers still blocked are detached then.
+	static constexpr auto	STOP_WAIT	= std::chrono::milliseconds(200);
+
+	NameResolver() = default;
+	~NameResolver() { stop(); }
+
+	bool		start(Lookup lookup = system_lookup, uint32_t timeout_ms = 2000, uint32_t cache_seconds = 600,
+					uint32_t negative_cache_seconds = 60);
+	// Waits up to STOP_WAIT for the lookups in progress to finish.
+	void		stop();
+	bool		running() const { return m_state != nullptr; }
+
+	// Non-blocking. token identifies the requester in the result.
+	void		request(uint64_t token, const std::string &ip);
+	// Non-blocking. Appends the completed and the timed out requests to results.
+	void		poll(std::vector<Result> &results);
+
+	Stats		stats() const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Request {
+		uint64_t			token;
+		Clock::time_point	deadline;
+	};
+	struct CacheEntry {
+		std::string			name;
+		Clock::time_point	expires;
+	};
+	// Shared with the workers, so that a worker detached by stop() while blocked in a lookup
+	// still has it when the lookup returns.
+	struct State {
+		Lookup					lookup;
+		Clock::duration			timeout {};
+		Clock::duration			cache_ttl {};
+		Clock::duration			negative_ttl {};
+
+		std::mutex				mutex;
+		std::condition_variable	cv;
+		// Signaled by an exiting worker.
+		std::condition_variable	exited_cv;
+		bool					stop			= false;
+		size_t					workers			= 0;
+		// Requests waiting for a lookup, by address, and the addresses queued for the workers.
+		std::multimap<std::string, Request>	pending;
+		std::deque<std::string>	queue;
+		// Addresses queued or being looked up, a request for one of them waits for that lookup,
+		// even if the requests which started it timed out.
+		std::set<std::string>	in_flight;
+		std::map<std::string, CacheEntry>	cache;
+		std::vector<Result>		done;
+		Stats					stats;
+
+		// Under the lock: complete the requests for ip.
+		void	complete(const std::string &ip, const std::string &name);
+		// Under the lock: complete the requests for ip from the cache, returns false if ip is not cached.
+		bool	complete_from_cache(const std::string &ip, Clock::time_point now);
+	};
+
+	static void	worker_thread(std::shared_ptr<State> state);
+
+	// Cache entries kept at most, the expired ones are evicted first.
+	static constexpr size_t	MAX_CACHE	= 256;
+	// A few lookups in parallel, so that an address without an answer does not hold up the others.
+	static constexpr size_t	WORKERS		= 3;
+
+	std::shared_ptr<State>	m_state;
+	std::vector<std::thread> m_threads;
+};
@@ -3,25 +3,46 @@
 #include <atomic>
 #include <thread>
 #include <string>
+#include <vector>
 
 #include <libusb.h>
 
+#include "Config.h"
+
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, "QMXServer", __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, "QMXServer", __VA_ARGS__)
 
 std::atomic<bool> g_run{false};
+std::atomic<bool> g_pause{false};
 static std::thread g_thread;
 
-int main_loop(int fd, const std::string &device_path);
+int main_loop(int fd, const std::string &device_path, const ServerConfig &server_config);
+bool radio_detached(int timeout_ms);
+void radio_attached(int fd, const std::string &device_path);
 
-static void worker(int usbFd, int vid, int pid, std::string deviceName, std::string host, int port) {
-    LOGI("worker start: fd=%d vid=%04x pid=%04x device=%s udp=%s:%d", usbFd, vid, pid, deviceName.c_str(), host.c_str(), port);
+// Split a comma or whitespace separated list of bind addresses.
+static std::vector<std::string> parse_bind_addresses(const std::string &list) {
+    std::vector<std::string> out;
+    size_t begin = 0;
+    for (;;) {
+        size_t end = list.find_first_of(", \t", begin);
+        std::string address = list.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        if (! address.empty())
+            out.emplace_back(std::move(address));
+        if (end == std::string::npos)
+            break;
+        begin = end + 1;
+    }
+    return out;
+}
 
-    // TODO:
-    // 1) Initialize libusb (compiled for Android) OR do I/O via Java and pass buffers into native.
-    // 2) Read from USB and send to UDP.
+static void worker(int usbFd, int vid, int pid, std::string deviceName, ServerConfig serverConfig) {
+    LOGI("worker start: fd=%d vid=%04x pid=%04x device=%s port=%d peers=%d channels=%d",
+         usbFd, vid, pid, deviceName.c_str(), serverConfig.port, serverConfig.max_peers, serverConfig.max_channels);
+    for (const std::string &address : serverConfig.bind_addresses)
+        LOGI("bind address: %s", address.c_str());
 
-    main_loop(usbFd, deviceName);
+    main_loop(usbFd, deviceName, serverConfig);
 
     LOGI("worker stop");
 }
@@ -30,22 +51,65 @@ extern "C" JNIEXPORT jint JNICALL
 Java_com_ok1iak_qmxserver_NativeBridge_startStreaming(
         JNIEnv* env, jobject /*thiz*/,
         jint usbFd, jint vid, jint pid,
-        jstring deviceName, jstring udpHost, jint udpPort) {
+        jstring deviceName, jstring bindAddresses, jint port, jint maxPeers, jint maxChannels,
+        jstring configPath, jstring multicastGroup, jint multicastPort, jint multicastTtl, jstring multicastInterface,
+        jstring recordDir, jstring timeShiftPath, jint timeShiftMinutes, jint networkThreads,
+        jstring relayServer, jint relayPort, jstring localSocket, jint skimmerSignals) {
 
     if (g_run.exchange(true)) {
         LOGE("Already running");
         return -1;
     }
+    g_pause.store(false);
 
     const char* deviceNameC = env->GetStringUTFChars(deviceName, nullptr);
     std::string deviceNameStr(deviceNameC ? deviceNameC : "");
     env->ReleaseStringUTFChars(deviceName, deviceNameC);
 
-    const char* hostC = env->GetStringUTFChars(udpHost, nullptr);
-    std::string host(hostC ? hostC : "");
-    env->ReleaseStringUTFChars(udpHost, hostC);
+    const char* bindAddressesC = env->GetStringUTFChars(bindAddresses, nullptr);
+    ServerConfig serverConfig;
+    serverConfig.bind_addresses = parse_bind_addresses(bindAddressesC ? bindAddressesC : "");
+    env->ReleaseStringUTFChars(bindAddresses, bindAddressesC);
+    serverConfig.port         = (int)port;
+    serverConfig.max_peers    = (int)maxPeers;
+    serverConfig.max_channels = (int)maxChannels;
+
+    const char* configPathC = env->GetStringUTFChars(configPath, nullptr);
+    serverConfig.config_path = configPathC ? configPathC : "";
+    env->ReleaseStringUTFChars(configPath, configPathC);
+
+    const char* multicastGroupC = env->GetStringUTFChars(multicastGroup, nullptr);
+    serverConfig.multicast_group = multicastGroupC ? multicastGroupC : "";
+    env->ReleaseStringUTFChars(multicastGroup, multicastGroupC);
+    serverConfig.multicast_port = (int)multicastPort;
+    serverConfig.multicast_ttl = (int)multicastTtl;
+    const char* multicastInterfaceC = env->GetStringUTFChars(multicastInterface, nullptr);
+    serverConfig.multicast_interface = multicastInterfaceC ? multicastInterfaceC : "";
+    env->ReleaseStringUTFChars(multicastInterface, multicastInterfaceC);
+    const char* recordDirC = env->GetStringUTFChars(recordDir, nullptr);
+    serverConfig.record_dir = recordDirC ? recordDirC : "";
+    env->ReleaseStringUTFChars(recordDir, recordDirC);
+    const char* timeShiftPathC = env->GetStringUTFChars(timeShiftPath, nullptr);
+    serverConfig.time_shift_path = timeShiftPathC ? timeShiftPathC : "";
+    env->ReleaseStringUTFChars(timeShiftPath, timeShiftPathC);
+    serverConfig.time_shift_minutes = (int)timeShiftMinutes;
+    serverConfig.network_threads = (int)networkThreads;
+    const char* relayServerC = env->GetStringUTFChars(relayServer, nullptr);
+    serverConfig.relay_server = relayServerC ? relayServerC : "";
+    env->ReleaseStringUTFChars(relayServer, relayServerC);
+    serverConfig.relay_port = (int)relayPort;
+    const char* localSocketC = env->GetStringUTFChars(localSocket, nullptr);
+    serverConfig.local_socket = localSocketC ? localSocketC : "";
+    env->ReleaseStringUTFChars(localSocket, localSocketC);
+    serverConfig.skimmer_signals = (int)skimmerSignals;
+
+    if (serverConfig.port <= 0 || serverConfig.port > 65535) {
+        LOGE("Invalid port %d", serverConfig.port);
+        g_run.store(false);
+        return -1;
+    }
 
-    g_thread = std::thread(worker, (int)usbFd, (int)vid, (int)pid, deviceNameStr, host, (int)udpPort);
+    g_thread = std::thread(worker, (int)usbFd, (int)vid, (int)pid, deviceNameStr, std::move(serverConfig));
     return 0;
 }
 
@@ -56,3 +120,43 @@ Java_com_ok1iak_qmxserver_NativeBridge_stopStreaming(
     if (!g_run.exchange(false)) return;
     if (g_thread.joinable()) g_thread.join();
 }
+
+// Stop the IQ stream without tearing down libusb and ENet, clients stay connected.
+extern "C" JNIEXPORT void JNICALL
+Java_com_ok1iak_qmxserver_NativeBridge_pauseStreaming(
+        JNIEnv*, jobject /*thiz*/) {
+
+    if (g_run.load()) g_pause.store(true);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_ok1iak_qmxserver_NativeBridge_resumeStreaming(
+        JNIEnv*, jobject /*thiz*/) {
+
+    g_pause.store(false);
+}
+
+// The radio was unplugged. Network clients stay connected, while the streaming thread
+// releases the USB device. Returns once the USB file descriptor may be closed.
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_ok1iak_qmxserver_NativeBridge_notifyDeviceDetached(
+        JNIEnv*, jobject /*thiz*/) {
+
+    if (!g_run.load()) return JNI_TRUE;
+    bool released = radio_detached(3000);
+    if (!released) LOGE("USB device not released in time");
+    return released ? JNI_TRUE : JNI_FALSE;
+}
+
+// The radio was plugged back in and reopened by the Android USB manager.
+extern "C" JNIEXPORT void JNICALL
+Java_com_ok1iak_qmxserver_NativeBridge_notifyDeviceAttached(
+        JNIEnv* env, jobject /*thiz*/, jint usbFd, jstring deviceName) {
+
+    const char* deviceNameC = env->GetStringUTFChars(deviceName, nullptr);
+    std::string deviceNameStr(deviceNameC ? deviceNameC : "");
+    env->ReleaseStringUTFChars(deviceName, deviceNameC);
+
+    LOGI("device attached: fd=%d device=%s", (int)usbFd, deviceNameStr.c_str());
+    radio_attached((int)usbFd, deviceNameStr);
+}
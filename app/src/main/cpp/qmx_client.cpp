@@ -0,0 +1,367 @@
+// The client library is linked without the server, thus it carries the ENet implementation of its own.
+#define ENET_IMPLEMENTATION
+#include "qmx_client.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static uint64_t monotonic_us()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+bool QmxClient::start(const std::string &server_name, int port, const JitterBufferConfig &jitter, Callbacks callbacks)
+{
+	stop();
+	if (server_name.empty() || port <= 0 || port > 65535)
+		return false;
+	if (enet_initialize() != 0)
+		return false;
+	// A single peer, the IQ stream and CAT channels.
+	m_host = enet_host_create(nullptr, 1, 2, 0, 0);
+	if (m_host == nullptr) {
+		enet_deinitialize();
+		return false;
+	}
+	m_server_name   = server_name;
+	m_port          = port;
+	m_callbacks     = std::move(callbacks);
+	m_address_valid = false;
+	m_connected     = false;
+	m_next_connect  = Clock::now();
+	m_state         = CatState();
+	m_radio_online  = true;
+	m_stats         = Stats();
+	m_sample_rate   = SAMPLE_RATE;
+	m_jitter.reset(jitter);
+	return true;
+}
+
+void QmxClient::stop()
+{
+	if (m_host == nullptr)
+		return;
+	if (m_peer != nullptr) {
+		enet_peer_disconnect_now(m_peer, 0);
+		m_peer = nullptr;
+	}
+	enet_host_destroy(m_host);
+	enet_deinitialize();
+	m_host      = nullptr;
+	m_connected = false;
+	close_local_stream();
+}
+
+bool QmxClient::open_local_stream(const std::string &socket_name)
+{
+	m_local_socket = socket_name;
+	if (! m_local.open(socket_name))
+		// Retried on the next connection, the server may not be running yet.
+		return false;
+	m_local_block.assign(size_t(m_local.max_frames()) * 2, 0);
+	const uint8_t enable = 1;
+	send_cat(CatCommandID::LocalSubscribe, &enable, 1);
+	return true;
+}
+
+void QmxClient::close_local_stream()
+{
+	if (m_local.is_open()) {
+		const uint8_t enable = 0;
+		send_cat(CatCommandID::LocalSubscribe, &enable, 1);
+	}
+	m_local.close();
+	m_local_socket.clear();
+}
+
+void QmxClient::read_local_stream()
+{
+	size_t   frames;
+	uint64_t sample_index, capture_us;
+	while (m_local.read(m_local_block.data(), frames, sample_index, capture_us))
+		m_jitter.push(m_local_block.data(), frames, monotonic_us());
+}
+
+void QmxClient::connect()
+{
+	m_next_connect = Clock::now() + RECONNECT_PERIOD;
+	if (! m_address_valid) {
+		if (enet_address_set_host_new(&m_address, m_server_name.c_str()) != 0) {
+			fprintf(stderr, "Cannot resolve %s\n", m_server_name.c_str());
+			return;
+		}
+		m_address.port  = enet_uint16(m_port);
+		m_address_valid = true;
+	}
+	m_peer = enet_host_connect(m_host, &m_address, 2, 0);
+}
+
+void QmxClient::service(int timeout_ms)
+{
+	if (m_host == nullptr)
+		return;
+	if (m_peer == nullptr && Clock::now() >= m_next_connect)
+		connect();
+	ENetEvent event;
+	for (int rc = enet_host_service(m_host, &event, enet_uint32(std::max(0, timeout_ms))); rc > 0;
+		rc = enet_host_service(m_host, &event, 0)) {
+		switch (event.type) {
+		case ENET_EVENT_TYPE_CONNECT:
+			m_connected = true;
+			++ m_stats.connects;
+			// Possibly another server run, synchronize anew.
+			m_clock.reset();
+			m_next_clock_sync_us = 0;
+			m_anchor_time_us     = 0;
+			// A restarted server has a new ring.
+			if (! m_local_socket.empty() && (! m_local.is_open() || m_local.closed())) {
+				m_local.close();
+				if (m_local.open(m_local_socket))
+					m_local_block.assign(size_t(m_local.max_frames()) * 2, 0);
+			}
+			if (m_local.is_open()) {
+				const uint8_t enable = 1;
+				send_cat(CatCommandID::LocalSubscribe, &enable, 1);
+			}
+			if (m_callbacks.connection)
+				m_callbacks.connection(true);
+			break;
+		case ENET_EVENT_TYPE_RECEIVE:
+			if (event.channelID == 0) {
+				// Plain interleaved int16_t I/Q, a varying number of frames with the exact rate enabled.
+				++ m_stats.iq_packets;
+				if (event.packet->dataLength % 4 == 0)
+					m_jitter.push(reinterpret_cast<const int16_t*>(event.packet->data), event.packet->dataLength / 4, monotonic_us());
+				else
+					++ m_stats.iq_packets_invalid;
+			} else
+				handle_notification(event.packet);
+			enet_packet_destroy(event.packet);
+			break;
+		case ENET_EVENT_TYPE_DISCONNECT:
+		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+		{
+			const bool was_connected = m_connected;
+			m_peer         = nullptr;
+			m_connected    = false;
+			m_next_connect = Clock::now() + RECONNECT_PERIOD;
+			if (was_connected && m_callbacks.connection)
+				m_callbacks.connection(false);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	if (m_local.is_open())
+		read_local_stream();
+	if (m_connected && monotonic_us() >= m_next_clock_sync_us)
+		send_clock_sync();
+}
+
+void QmxClient::send_clock_sync()
+{
+	m_next_clock_sync_us = monotonic_us() + m_clock.period_us();
+	uint8_t      data[2 + 8];
+	CatCommandID cmd     = CatCommandID::ClockSyncRequest;
+	// Stamped last, right before the packet is handed over to ENet.
+	const uint64_t send_us = monotonic_us();
+	memcpy(data,     &cmd,     2);
+	memcpy(data + 2, &send_us, 8);
+	ENetPacket *packet = enet_packet_create(data, sizeof(data), ENET_PACKET_FLAG_UNSEQUENCED);
+	if (enet_peer_send(m_peer, 1, packet) < 0) {
+		enet_packet_destroy(packet);
+		return;
+	}
+	enet_host_flush(m_host);
+}
+
+bool QmxClient::sample_time_us(uint64_t sample_index, uint64_t &local_us) const
+{
+	if (! m_clock.valid() || m_anchor_time_us == 0)
+		return false;
+	const double frames = double(int64_t(sample_index - m_anchor_sample_index));
+	local_us = m_clock.to_local(uint64_t(int64_t(m_anchor_time_us) + int64_t(std::llround(frames * 1e6 / m_sample_rate))));
+	return true;
+}
+
+void QmxClient::handle_notification(const ENetPacket *packet)
+{
+	if (packet->dataLength < 2)
+		return;
+	CatCommandID cmd;
+	memcpy(&cmd, packet->data, 2);
+	const uint8_t *data = packet->data + 2;
+	const size_t   len  = packet->dataLength - 2;
+	switch (cmd) {
+	case CatCommandID::StateSnapshot:
+		if (! m_state.read_snapshot(data, len))
+			return;
+		if (m_callbacks.state)
+			m_callbacks.state(m_state);
+		break;
+	case CatCommandID::RadioStatus:
+		if (len != 1)
+			return;
+		m_radio_online = data[0] != 0;
+		if (m_callbacks.radio_status)
+			m_callbacks.radio_status(m_radio_online);
+		break;
+	case CatCommandID::SampleRate:
+	{
+		if (len != 1 + 8)
+			return;
+		double rate;
+		memcpy(&rate, data + 1, 8);
+		if (data[0] != 0 && rate > 0.)
+			m_sample_rate = rate;
+		if (m_callbacks.sample_rate)
+			m_callbacks.sample_rate(data[0] != 0, rate);
+		break;
+	}
+	case CatCommandID::TimeShiftStatus:
+		if (len != 8 + 8 + 1)
+			return;
+		if (m_callbacks.time_shift_status) {
+			uint64_t sample_index, oldest_sample_index;
+			memcpy(&sample_index,        data,     8);
+			memcpy(&oldest_sample_index, data + 8, 8);
+			m_callbacks.time_shift_status(sample_index, oldest_sample_index, data[16]);
+		}
+		break;
+	case CatCommandID::PrerollStatus:
+		if (len != 8 + 1)
+			return;
+		if (m_callbacks.preroll_status) {
+			uint64_t sample_index;
+			memcpy(&sample_index, data, 8);
+			m_callbacks.preroll_status(sample_index, data[8] != 0);
+		}
+		break;
+	case CatCommandID::CwSpot:
+		if (len < 8 + 2 + 1 + 1 + 8)
+			return;
+		if (m_callbacks.cw_spot) {
+			int64_t  frequency;
+			int16_t  offset_hz;
+			int8_t   snr_db;
+			uint64_t sample_index;
+			memcpy(&frequency,    data,      8);
+			memcpy(&offset_hz,    data + 8,  2);
+			memcpy(&snr_db,       data + 11, 1);
+			memcpy(&sample_index, data + 12, 8);
+			m_callbacks.cw_spot(frequency, offset_hz, data[10], snr_db, sample_index,
+				std::string(reinterpret_cast<const char*>(data + 20), len - 20));
+		}
+		break;
+	case CatCommandID::ClockSyncReply:
+	{
+		if (len != 8 * 5)
+			return;
+		const uint64_t receive_us = monotonic_us();
+		uint64_t t[5];
+		memcpy(t, data, sizeof(t));
+		// The smoothed ENet round trip bounds the round trip of a reply that did not wait in a queue.
+		m_clock.add(t[0], t[1], t[2], receive_us, uint64_t(enet_peer_get_rtt(m_peer)) * 1000);
+		if (t[4] != 0) {
+			m_anchor_sample_index = t[3];
+			m_anchor_time_us      = t[4];
+		}
+		break;
+	}
+	default:
+		// Notifications of the features the client does not request.
+		return;
+	}
+	++ m_stats.notifications;
+}
+
+bool QmxClient::send_cat(CatCommandID cmd, const void *payload, size_t len)
+{
+	if (! m_connected)
+		return false;
+	ENetPacket *packet = enet_packet_create(nullptr, 2 + len, ENET_PACKET_FLAG_RELIABLE);
+	memcpy(packet->data, &cmd, 2);
+	memcpy(packet->data + 2, payload, len);
+	if (enet_peer_send(m_peer, 1, packet) < 0) {
+		enet_packet_destroy(packet);
+		return false;
+	}
+	++ m_stats.cat_sent;
+	// Sent right away, not with the next service() call.
+	enet_host_flush(m_host);
+	return true;
+}
+
+bool QmxClient::set_freq(int64_t frequency)
+{
+	return send_cat(CatCommandID::SetFreq, &frequency, 8);
+}
+
+bool QmxClient::set_cw_tx_freq(int64_t frequency)
+{
+	return send_cat(CatCommandID::SetCWTxFreq, &frequency, 8);
+}
+
+bool QmxClient::set_cw_keyer_speed(uint8_t wpm)
+{
+	return send_cat(CatCommandID::SetCWKeyerSpeed, &wpm, 1);
+}
+
+bool QmxClient::set_keyer_mode(KeyerMode mode)
+{
+	const uint8_t data = uint8_t(mode);
+	return send_cat(CatCommandID::SetKeyerMode, &data, 1);
+}
+
+bool QmxClient::set_amp_control(bool enabled, int32_t delay_us, int32_t hang_us)
+{
+	uint8_t data[1 + 4 + 4];
+	data[0] = enabled;
+	memcpy(data + 1, &delay_us, 4);
+	memcpy(data + 5, &hang_us,  4);
+	return send_cat(CatCommandID::SetAMPControl, data, sizeof(data));
+}
+
+bool QmxClient::set_iq_balance_and_power(double phase_balance_deg, double amplitude_balance, double power)
+{
+	uint8_t data[8 + 8 + 8];
+	memcpy(data,      &phase_balance_deg, 8);
+	memcpy(data + 8,  &amplitude_balance, 8);
+	memcpy(data + 16, &power,             8);
+	return send_cat(CatCommandID::SetIQBalanceAndPower, data, sizeof(data));
+}
+
+bool QmxClient::set_exact_rate(bool enable)
+{
+	const uint8_t data = enable;
+	return send_cat(CatCommandID::ExactRate, &data, 1);
+}
+
+bool QmxClient::set_block_length(uint16_t frames)
+{
+	return send_cat(CatCommandID::BlockLength, &frames, 2);
+}
+
+bool QmxClient::set_preroll(bool enable)
+{
+	const uint8_t data = enable;
+	return send_cat(CatCommandID::Preroll, &data, 1);
+}
+
+bool QmxClient::time_shift(int64_t start_sample_index, uint8_t speed)
+{
+	uint8_t data[8 + 1];
+	memcpy(data, &start_sample_index, 8);
+	data[8] = speed;
+	return send_cat(CatCommandID::TimeShift, data, sizeof(data));
+}
+
+bool QmxClient::set_skimmer(bool enable, bool spots_only)
+{
+	const uint8_t data[2] = { uint8_t(enable), uint8_t(spots_only) };
+	return send_cat(CatCommandID::SkimmerSubscribe, data, sizeof(data));
+}
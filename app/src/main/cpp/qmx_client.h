@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cat_protocol.h"
+#include "clock_sync.h"
+#include "enet/enet.h"
+#include "jitter_buffer.h"
+#include "local_stream.h"
+
+// Client of the server, for the applications receiving the stream: the ENet connection with reconnection,
+// the IQ stream of channel 0 played out through an adaptive jitter buffer, and a typed API of the CAT commands
+// and notifications of channel 1, see cat_protocol.h.
+//
+// service() runs the connection and invokes the callbacks, from a single thread. read_iq() may be called
+// from another thread, usually the audio callback, which pulls the frames at the nominal rate.
+//
+// The client keeps the clock of the server synchronized to its own monotonic clock, std::chrono::steady_clock
+// in microseconds, to place the stream, TX keying and logging on a common timeline.
+class QmxClient
+{
+public:
+	struct Callbacks {
+		std::function<void(bool connected)>		connection;
+		// Settings of the radio, on connect.
+		std::function<void(const CatState &state)>	state;
+		std::function<void(bool online)>		radio_status;
+		std::function<void(bool valid, double rate_hz)>	sample_rate;
+		std::function<void(uint64_t sample_index, uint64_t oldest_sample_index, uint8_t speed)> time_shift_status;
+		// live: the stream reached the live edge at sample_index, see CatCommandID::PrerollStatus.
+		std::function<void(uint64_t sample_index, bool live)> preroll_status;
+		// A word decoded by the CW skimmer of the server, see CatCommandID::CwSpot.
+		std::function<void(int64_t frequency, int offset_hz, unsigned wpm, int snr_db, uint64_t sample_index,
+			const std::string &text)> cw_spot;
+	};
+
+	struct Stats {
+		uint64_t	connects				= 0;
+		uint64_t	iq_packets				= 0;
+		// Channel 0 packets not a whole number of frames, or of a stream tier the client did not request.
+		uint64_t	iq_packets_invalid		= 0;
+		uint64_t	notifications			= 0;
+		uint64_t	cat_sent				= 0;
+	};
+
+	static constexpr auto	RECONNECT_PERIOD	= std::chrono::seconds(2);
+
+	QmxClient() = default;
+	~QmxClient() { stop(); }
+
+	// The server name is resolved on the first connection attempt, which is made by the first service() call.
+	bool		start(const std::string &server_name, int port, const JitterBufferConfig &jitter = JitterBufferConfig(),
+					Callbacks callbacks = Callbacks());
+	void		stop();
+	bool		running() const { return m_host != nullptr; }
+	bool		connected() const { return m_connected; }
+
+	// Wait up to timeout_ms for the network, then handle everything received. Reconnects a lost connection.
+	void		service(int timeout_ms);
+	// Receive the IQ stream from the shared memory ring of a server on the same host, ServerConfig::local_socket,
+	// instead of ENet. CAT stays on the ENet connection. Reopened after the server restarts.
+	bool		open_local_stream(const std::string &socket_name);
+	void		close_local_stream();
+	bool		local_stream() const { return m_local.is_open(); }
+	// Playout: always fills frames interleaved I/Q frames, concealing what did not arrive in time.
+	void		read_iq(int16_t *out, size_t frames) { m_jitter.pop(out, frames); }
+
+	// CAT commands, false if not connected. The server applies the settings to the radio.
+	bool		set_freq(int64_t frequency);
+	bool		set_cw_tx_freq(int64_t frequency);
+	bool		set_cw_keyer_speed(uint8_t wpm);
+	bool		set_keyer_mode(KeyerMode mode);
+	bool		set_amp_control(bool enabled, int32_t delay_us, int32_t hang_us);
+	bool		set_iq_balance_and_power(double phase_balance_deg, double amplitude_balance, double power);
+	// Stream resampled to exactly the nominal rate by the server.
+	bool		set_exact_rate(bool enable);
+	// Frames per block of the plain stream, MIN_BLOCK_FRAMES to MAX_BLOCK_FRAMES, 0: the native blocks.
+	bool		set_block_length(uint16_t frames);
+	// Replay from start_sample_index, negative: frames back from live, at speed times real time, 0: live.
+	bool		time_shift(int64_t start_sample_index, uint8_t speed);
+	// Replay the last ServerConfig::preroll_ms ahead of the live stream, best right after connecting.
+	bool		set_preroll(bool enable);
+	// Receive the CW skimmer spots, with no IQ stream if spots_only.
+	bool		set_skimmer(bool enable, bool spots_only);
+
+	// Radio state as last reported by the server.
+	const CatState&	state() const { return m_state; }
+	bool		radio_online() const { return m_connected && m_radio_online; }
+
+	// Server clock, valid a few exchanges after connecting.
+	bool		clock_synced() const { return m_clock.valid(); }
+	uint64_t	server_to_local_us(uint64_t server_us) const { return m_clock.to_local(server_us); }
+	uint64_t	local_to_server_us(uint64_t local_us) const { return m_clock.to_remote(local_us); }
+	// Local time the frame sample_index of the stream arrived at the server from the radio, as numbered by
+	// the multicast headers and the time-shift notifications. False until synchronized and streaming.
+	bool		sample_time_us(uint64_t sample_index, uint64_t &local_us) const;
+	ClockSyncStats clock_stats() const { return m_clock.stats(); }
+
+	Stats		stats() const { return m_stats; }
+	JitterBufferStats jitter_stats() const { return m_jitter.stats(); }
+	LocalStreamReader::Stats local_stream_stats() const { return m_local.stats(); }
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	void		connect();
+	void		handle_notification(const ENetPacket *packet);
+	void		send_clock_sync();
+	void		read_local_stream();
+	bool		send_cat(CatCommandID cmd, const void *payload, size_t len);
+
+	std::string				m_server_name;
+	int						m_port				= 0;
+	Callbacks				m_callbacks;
+	bool					m_address_valid		= false;
+	ENetAddress				m_address {};
+	ENetHost			   *m_host				= nullptr;
+	ENetPeer			   *m_peer				= nullptr;
+	bool					m_connected			= false;
+	Clock::time_point		m_next_connect;
+
+	IQJitterBuffer			m_jitter;
+	CatState				m_state;
+	bool					m_radio_online		= true;
+	ClockSync				m_clock;
+	uint64_t				m_next_clock_sync_us	= 0;
+	// Timeline of the stream from the last clock sync reply, server clock, and the radio rate against it.
+	uint64_t				m_anchor_sample_index	= 0;
+	uint64_t				m_anchor_time_us	= 0;
+	double					m_sample_rate		= SAMPLE_RATE;
+	// Shared memory ring, m_local_socket empty if not requested.
+	std::string				m_local_socket;
+	LocalStreamReader		m_local;
+	std::vector<int16_t>	m_local_block;
+	Stats					m_stats;
+};
@@ -0,0 +1,234 @@
+#include "relay_upstream.h"
+
+#include <cstdio>
+#include <cstring>
+
+// Length of a CAT write proxied upstream, including the CatCommandID. Zero: not a radio setting.
+static size_t cat_write_length(CatCommandID cmd)
+{
+	switch (cmd) {
+	case CatCommandID::SetFreq:					return 2 + 8;
+	case CatCommandID::SetCWTxFreq:				return 2 + 8;
+	case CatCommandID::SetCWKeyerSpeed:			return 2 + 1;
+	case CatCommandID::SetKeyerMode:			return 2 + 1;
+	case CatCommandID::SetAMPControl:			return 2 + 1 + 4 + 4;
+	case CatCommandID::SetIQBalanceAndPower:	return 2 + 8 + 8 + 8;
+	default:									return 0;
+	}
+}
+
+bool RelayUpstream::start(const std::string &server_name, int port)
+{
+	stop();
+	if (server_name.empty() || port <= 0 || port > 65535)
+		return false;
+	// A single peer, the IQ stream and CAT channels.
+	m_host = enet_host_create(nullptr, 1, 2, 0, 0);
+	if (m_host == nullptr)
+		return false;
+	// A DNS server not answering gives up after its own timeout, mostly shorter.
+	m_resolver.start(NameResolver::address_lookup, 10000, 0, 0);
+	m_server_name       = server_name;
+	m_port              = port;
+	m_resolving         = false;
+	m_connected         = false;
+	m_next_connect      = Clock::now();
+	m_state             = CatState();
+	m_radio_online      = false;
+	m_sample_rate_valid = false;
+	m_pending_cat.clear();
+	m_stats             = Stats();
+	return true;
+}
+
+void RelayUpstream::stop()
+{
+	if (m_host == nullptr)
+		return;
+	if (m_peer != nullptr) {
+		enet_peer_disconnect_now(m_peer, 0);
+		m_peer = nullptr;
+	}
+	enet_host_destroy(m_host);
+	m_host      = nullptr;
+	m_connected = false;
+	m_resolver.stop();
+}
+
+int RelayUpstream::socket() const
+{
+	return m_host != nullptr ? int(m_host->socket) : -1;
+}
+
+void RelayUpstream::connect()
+{
+	m_next_connect = Clock::now() + RECONNECT_PERIOD;
+	m_resolving    = true;
+	m_resolver.request(0, m_server_name);
+}
+
+void RelayUpstream::connect_resolved()
+{
+	m_resolved.clear();
+	m_resolver.poll(m_resolved);
+	for (const NameResolver::Result &result : m_resolved) {
+		m_resolving = false;
+		// The name of a forward lookup result is the numeric address.
+		if (result.name.empty() || enet_address_set_host_ip_new(&m_address, result.name.c_str()) != 0) {
+			fprintf(stderr, "Relay: cannot resolve %s\n", m_server_name.c_str());
+			m_next_connect = Clock::now() + RECONNECT_PERIOD;
+			continue;
+		}
+		m_address.port = enet_uint16(m_port);
+		m_peer = enet_host_connect(m_host, &m_address, 2, 0);
+		if (m_peer == nullptr)
+			fprintf(stderr, "Relay: cannot connect to %s:%d\n", m_server_name.c_str(), m_port);
+	}
+}
+
+void RelayUpstream::service(std::vector<Event> &events)
+{
+	if (m_host == nullptr)
+		return;
+	if (m_peer == nullptr && ! m_resolving && Clock::now() >= m_next_connect)
+		connect();
+	if (m_resolving)
+		connect_resolved();
+	ENetEvent event;
+	while (enet_host_service(m_host, &event, 0) > 0) {
+		switch (event.type) {
+		case ENET_EVENT_TYPE_CONNECT:
+			m_connected = true;
+			++ m_stats.connects;
+			printf("Relay: connected to %s:%d\n", m_server_name.c_str(), m_port);
+			events.push_back({ Event::Connected, nullptr });
+			break;
+		case ENET_EVENT_TYPE_RECEIVE:
+			if (event.channelID == 0) {
+				// Forwarded as the plain unreliable stream it was sent as, not as the reliable fragments it arrived in.
+				event.packet->flags = 0;
+				++ m_stats.iq_packets;
+				events.push_back({ Event::IQ, event.packet });
+			} else {
+				handle_notification(event.packet, events);
+				enet_packet_destroy(event.packet);
+			}
+			break;
+		case ENET_EVENT_TYPE_DISCONNECT:
+		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+			if (m_connected) {
+				printf("Relay: connection to %s:%d lost, reconnecting\n", m_server_name.c_str(), m_port);
+				events.push_back({ Event::Disconnected, nullptr });
+			}
+			m_peer         = nullptr;
+			m_connected    = false;
+			m_next_connect = Clock::now() + RECONNECT_PERIOD;
+			break;
+		default:
+			break;
+		}
+	}
+	flush_cat();
+}
+
+void RelayUpstream::handle_notification(ENetPacket *packet, std::vector<Event> &events)
+{
+	if (packet->dataLength < 2)
+		return;
+	CatCommandID cmd;
+	memcpy(&cmd, packet->data, 2);
+	switch (cmd) {
+	case CatCommandID::StateSnapshot:
+		if (m_state.read_snapshot(packet->data + 2, packet->dataLength - 2)) {
+			// The writes still queued are newer than the snapshot.
+			for (const std::vector<uint8_t> &write : m_pending_cat)
+				apply_cat_write(write.data());
+			events.push_back({ Event::StateSnapshot, nullptr });
+		}
+		break;
+	case CatCommandID::RadioStatus:
+		if (packet->dataLength == 3) {
+			m_radio_online = packet->data[2] != 0;
+			events.push_back({ Event::RadioStatus, nullptr });
+		}
+		break;
+	case CatCommandID::SampleRate:
+		if (packet->dataLength == 11) {
+			m_sample_rate_valid = packet->data[2] != 0;
+			memcpy(&m_sample_rate, packet->data + 3, 8);
+			events.push_back({ Event::SampleRate, nullptr });
+		}
+		break;
+	default:
+		// Replies to the commands of other peers' features, not requested by the relay.
+		return;
+	}
+	++ m_stats.notifications;
+}
+
+bool RelayUpstream::send_cat(const uint8_t *data, size_t len)
+{
+	CatCommandID cmd;
+	if (len < 2)
+		return false;
+	memcpy(&cmd, data, 2);
+	const size_t expected = cat_write_length(cmd);
+	if (expected == 0 || len != expected)
+		return false;
+	++ m_stats.cat_writes;
+	apply_cat_write(data);
+	for (std::vector<uint8_t> &write : m_pending_cat)
+		if (memcmp(write.data(), data, 2) == 0) {
+			write.assign(data, data + len);
+			++ m_stats.cat_coalesced;
+			return true;
+		}
+	m_pending_cat.emplace_back(data, data + len);
+	return true;
+}
+
+void RelayUpstream::apply_cat_write(const uint8_t *data)
+{
+	CatCommandID cmd;
+	memcpy(&cmd, data, 2);
+	switch (cmd) {
+	case CatCommandID::SetFreq:			memcpy(&m_state.freq, data + 2, 8); break;
+	case CatCommandID::SetCWTxFreq:		memcpy(&m_state.cw_tx_freq, data + 2, 8); break;
+	case CatCommandID::SetCWKeyerSpeed:	m_state.keyer_speed = data[2]; break;
+	case CatCommandID::SetKeyerMode:	m_state.keyer_mode = KeyerMode(data[2]); break;
+	case CatCommandID::SetAMPControl:
+	{
+		int32_t delay, hang;
+		memcpy(&delay, data + 3, 4);
+		memcpy(&hang,  data + 7, 4);
+		m_state.amp_enabled = data[2] != 0;
+		m_state.amp_delay   = delay;
+		m_state.amp_hang    = hang;
+		break;
+	}
+	case CatCommandID::SetIQBalanceAndPower:
+		memcpy(&m_state.phase_balance_deg, data + 2,  8);
+		memcpy(&m_state.amplitude_balance, data + 10, 8);
+		memcpy(&m_state.power,             data + 18, 8);
+		break;
+	default:
+		return;
+	}
+	m_state.set_valid(cmd);
+}
+
+void RelayUpstream::flush_cat()
+{
+	// The previous batch is still in flight, the writes meanwhile coalesce in the queue.
+	if (! m_connected || m_pending_cat.empty() || m_peer->reliableDataInTransit > 0)
+		return;
+	for (const std::vector<uint8_t> &write : m_pending_cat) {
+		ENetPacket *packet = enet_packet_create(write.data(), write.size(), ENET_PACKET_FLAG_RELIABLE);
+		if (enet_peer_send(m_peer, 1, packet) < 0)
+			enet_packet_destroy(packet);
+		else
+			++ m_stats.cat_sent;
+	}
+	m_pending_cat.clear();
+	enet_host_flush(m_host);
+}
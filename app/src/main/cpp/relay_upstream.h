@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cat_protocol.h"
+#include "enet/enet.h"
+#include "name_resolver.h"
+
+// Relay mode: the server connects to another qmxserver as a plain client and re-broadcasts its stream to
+// peers of its own, so that a station behind a thin uplink sends the stream once to a well connected relay.
+// The IQ packets received from upstream are handed over as they are, to be forwarded to the local peers without
+// copying. The CAT settings are tracked from the upstream snapshot and the writes proxied since. The local peers'
+// writes are queued and coalesced: a write replaces the queued write of the same setting, and the queue is sent
+// upstream only once the previous batch was acknowledged, thus a burst of tuning steps costs one round trip.
+//
+// Streaming thread only, the ENet host of the upstream connection is serviced by the caller's thread.
+class RelayUpstream
+{
+public:
+	struct Event {
+		enum Type {
+			Connected,
+			// Upstream connection lost, reconnecting.
+			Disconnected,
+			// IQ block of the native stream, the packet is handed over to the caller.
+			IQ,
+			// The settings, the radio status or the sample rate of the upstream radio changed.
+			StateSnapshot,
+			RadioStatus,
+			SampleRate,
+		};
+		Type		type;
+		ENetPacket *packet;
+	};
+
+	struct Stats {
+		uint64_t	connects			= 0;
+		uint64_t	iq_packets			= 0;
+		uint64_t	notifications		= 0;
+		// CAT writes queued by the local peers, replaced by a later write of the same setting, sent upstream.
+		uint64_t	cat_writes			= 0;
+		uint64_t	cat_coalesced		= 0;
+		uint64_t	cat_sent			= 0;
+	};
+
+	// Reconnect period after the upstream connection failed or was lost.
+	static constexpr auto	RECONNECT_PERIOD	= std::chrono::seconds(2);
+
+	RelayUpstream() = default;
+	~RelayUpstream() { stop(); }
+
+	// The server name is resolved on every connection attempt, so that a changed address is picked up.
+	bool		start(const std::string &server_name, int port);
+	void		stop();
+	bool		running() const { return m_host != nullptr; }
+	bool		connected() const { return m_connected; }
+	// Socket of the upstream connection, for the caller to wait on.
+	int			socket() const;
+
+	// Non-blocking, the server name is looked up by a worker thread. Receives from upstream, appends the events
+	// to events, and sends the queued CAT writes.
+	void		service(std::vector<Event> &events);
+	// Queue a CAT write of a local peer. Returns false if the command is not a radio setting or is malformed.
+	bool		send_cat(const uint8_t *data, size_t len);
+
+	// Upstream radio settings, status and sample rate, as last reported.
+	const CatState&	state() const { return m_state; }
+	bool		radio_online() const { return m_connected && m_radio_online; }
+	bool		sample_rate_valid() const { return m_sample_rate_valid; }
+	double		sample_rate() const { return m_sample_rate; }
+
+	Stats		stats() const { return m_stats; }
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	void		connect();
+	// Connect once the lookup of the server name answered.
+	void		connect_resolved();
+	void		handle_notification(ENetPacket *packet, std::vector<Event> &events);
+	// Track a validated CAT write in the state.
+	void		apply_cat_write(const uint8_t *data);
+	void		flush_cat();
+
+	std::string				m_server_name;
+	int						m_port				= 0;
+	// Forward lookups of m_server_name, nothing cached.
+	NameResolver			m_resolver;
+	bool					m_resolving			= false;
+	std::vector<NameResolver::Result> m_resolved;
+	ENetAddress				m_address {};
+	ENetHost			   *m_host				= nullptr;
+	ENetPeer			   *m_peer				= nullptr;
+	bool					m_connected			= false;
+	Clock::time_point		m_next_connect;
+
+	CatState				m_state;
+	bool					m_radio_online		= false;
+	bool					m_sample_rate_valid	= false;
+	double					m_sample_rate		= 0.;
+	// CAT writes not sent yet, in the order of the first write of each setting.
+	std::vector<std::vector<uint8_t>> m_pending_cat;
+	Stats					m_stats;
+};
@@ -0,0 +1,190 @@
+#include "sample_rate.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Restart the estimate after a gap in streaming longer than this, the frame count does not cover the gap.
+static constexpr uint64_t MAX_GAP_US	= 200000;
+// Estimates further off the nominal rate are taken for a disturbance, not for a crystal offset.
+static constexpr double   MAX_PPM		= 2000.;
+
+void SampleRateEstimator::reset()
+{
+	m_rate     = m_nominal_rate;
+	m_valid    = false;
+	m_started  = false;
+	m_has_best = false;
+	m_points.clear();
+}
+
+void SampleRateEstimator::add(uint64_t frames, uint64_t time_us)
+{
+	if (m_started && time_us > m_last_time + MAX_GAP_US) {
+		// Keep the estimate published, start collecting the points anew.
+		m_started  = false;
+		m_has_best = false;
+		m_points.clear();
+	}
+	m_last_time = time_us;
+	if (! m_started) {
+		m_started       = true;
+		m_origin_time   = time_us;
+		m_origin_frames = frames;
+		m_interval_end  = time_us + INTERVAL_US;
+	}
+	const Point  point { double(time_us - m_origin_time) * 1e-6, double(frames - m_origin_frames) };
+	// Delay against the nominal clock, up to an offset and a slope common to all the points.
+	const double delay = point.time - point.frames / m_nominal_rate;
+	if (! m_has_best || delay < m_best_delay) {
+		m_best       = point;
+		m_best_delay = delay;
+		m_has_best   = true;
+	}
+	if (time_us >= m_interval_end) {
+		m_points.push_back(m_best);
+		if (m_points.size() > WINDOW)
+			m_points.pop_front();
+		m_has_best     = false;
+		m_interval_end = time_us + INTERVAL_US;
+		fit();
+	}
+}
+
+void SampleRateEstimator::fit()
+{
+	if (m_points.size() < MIN_POINTS)
+		return;
+	// Least squares fit of frames = a + rate * time, refitted once without the outliers.
+	double a = 0, b = 0;
+	double threshold = -1.;
+	for (int pass = 0; pass < 2; ++ pass) {
+		double st = 0, sf = 0, n = 0;
+		for (const Point &p : m_points)
+			if (threshold < 0 || std::abs(p.frames - a - b * p.time) <= threshold) {
+				st += p.time;
+				sf += p.frames;
+				n  += 1;
+			}
+		if (n < MIN_POINTS / 2)
+			return;
+		const double mt = st / n, mf = sf / n;
+		double stt = 0, stf = 0;
+		for (const Point &p : m_points)
+			if (threshold < 0 || std::abs(p.frames - a - b * p.time) <= threshold) {
+				stt += (p.time - mt) * (p.time - mt);
+				stf += (p.time - mt) * (p.frames - mf);
+			}
+		if (stt <= 0)
+			return;
+		const double b_new = stf / stt;
+		const double a_new = mf - b_new * mt;
+		if (pass == 0) {
+			// Outliers are points further than 4 median absolute deviations, at least one frame, from the fit.
+			std::vector<double> residuals;
+			residuals.reserve(m_points.size());
+			for (const Point &p : m_points)
+				residuals.emplace_back(std::abs(p.frames - a_new - b_new * p.time));
+			std::nth_element(residuals.begin(), residuals.begin() + residuals.size() / 2, residuals.end());
+			threshold = std::max(1., 4. * residuals[residuals.size() / 2]);
+		}
+		a = a_new;
+		b = b_new;
+	}
+	if (std::abs(b / m_nominal_rate - 1.) * 1e6 > MAX_PPM)
+		return;
+	m_rate  = b;
+	m_valid = true;
+}
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+static double bessel_i0(double x)
+{
+	double sum = 1., term = 1.;
+	for (int k = 1; k < 32; ++ k) {
+		term *= (x / (2. * k)) * (x / (2. * k));
+		sum  += term;
+	}
+	return sum;
+}
+
+FractionalResampler::FractionalResampler()
+{
+	// Pass band up to 0.45 of the input rate, Kaiser window.
+	const double fc   = 0.45;
+	const double beta = 8.;
+	const double half = TAPS / 2;
+	m_filter.resize((PHASES + 1) * TAPS);
+	for (int p = 0; p <= PHASES; ++ p) {
+		float *h = &m_filter[p * TAPS];
+		double sum = 0;
+		for (int k = 0; k < TAPS; ++ k) {
+			// Distance of tap k from the output position at fraction p / PHASES.
+			const double d    = k - (TAPS / 2 - 1) - double(p) / PHASES;
+			const double sinc = d == 0 ? 2. * fc : sin(2. * M_PI * fc * d) / (M_PI * d);
+			const double r    = d / half;
+			const double w    = r * r < 1. ? bessel_i0(beta * sqrt(1. - r * r)) / bessel_i0(beta) : 0.;
+			h[k] = float(sinc * w);
+			sum += h[k];
+		}
+		for (int k = 0; k < TAPS; ++ k)
+			h[k] = float(h[k] / sum);
+	}
+	m_coefs.resize(TAPS);
+	reset();
+}
+
+void FractionalResampler::reset()
+{
+	m_i.assign(TAPS, 0.f);
+	m_q.assign(TAPS, 0.f);
+	m_pos = TAPS / 2 - 1;
+}
+
+size_t FractionalResampler::process(const int16_t *in, size_t frames, std::vector<int16_t> &out)
+{
+	const size_t hist = m_i.size();
+	m_i.resize(hist + frames);
+	m_q.resize(hist + frames);
+	for (size_t f = 0; f < frames; ++ f) {
+		m_i[hist + f] = float(in[f * 2]);
+		m_q[hist + f] = float(in[f * 2 + 1]);
+	}
+	out.clear();
+	const size_t size = m_i.size();
+	// The output at m_pos convolves the input frames floor(m_pos) - TAPS / 2 + 1 .. floor(m_pos) + TAPS / 2.
+	for (;;) {
+		const size_t n = size_t(m_pos);
+		if (n + TAPS / 2 >= size)
+			break;
+		const double phase = (m_pos - double(n)) * PHASES;
+		const int    ip    = std::min(int(phase), PHASES - 1);
+		const float  alpha = float(phase - ip);
+		const float *h0    = &m_filter[ip * TAPS];
+		const float *h1    = h0 + TAPS;
+		for (int k = 0; k < TAPS; ++ k)
+			m_coefs[k] = h0[k] + alpha * (h1[k] - h0[k]);
+		// Eight independent partial sums, vectorizable without reassociating the floating point sum.
+		const float *xi = &m_i[n + 1 - TAPS / 2];
+		const float *xq = &m_q[n + 1 - TAPS / 2];
+		float acc_i[8] = { 0 }, acc_q[8] = { 0 };
+		for (int k = 0; k < TAPS; k += 8)
+			for (int j = 0; j < 8; ++ j) {
+				acc_i[j] += m_coefs[k + j] * xi[k + j];
+				acc_q[j] += m_coefs[k + j] * xq[k + j];
+			}
+		float sum_i = 0.f, sum_q = 0.f;
+		for (int j = 0; j < 8; ++ j) {
+			sum_i += acc_i[j];
+			sum_q += acc_q[j];
+		}
+		out.emplace_back(int16_t(std::max(-32768.f, std::min(32767.f, std::round(sum_i)))));
+		out.emplace_back(int16_t(std::max(-32768.f, std::min(32767.f, std::round(sum_q)))));
+		m_pos += m_step;
+	}
+	// Keep the last TAPS input frames for the next block.
+	const size_t drop = size - TAPS;
+	m_i.erase(m_i.begin(), m_i.begin() + drop);
+	m_q.erase(m_q.begin(), m_q.begin() + drop);
+	m_pos -= double(drop);
+	return out.size() / 2;
+}
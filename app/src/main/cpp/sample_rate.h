@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Estimates the true sample rate of the radio from the number of IQ frames received versus the host
+// monotonic clock. The radio crystal drifts against the sound card of a client, a long running
+// client either adapts its buffers to the published rate or asks for the resampled exact rate stream.
+class SampleRateEstimator
+{
+public:
+	explicit SampleRateEstimator(double nominal_rate) : m_nominal_rate(nominal_rate), m_rate(nominal_rate) {}
+
+	// Forget the history, to be called after a gap in streaming.
+	void		reset();
+	// Frames received in total at time_us.
+	void		add(uint64_t frames, uint64_t time_us);
+
+	// Enough history for the estimate to be meaningful.
+	bool		valid() const { return m_valid; }
+	double		nominal_rate() const { return m_nominal_rate; }
+	// Estimated rate in Hz, the nominal rate if not valid.
+	double		rate() const { return m_rate; }
+	double		ppm() const { return (m_rate / m_nominal_rate - 1.) * 1e6; }
+
+private:
+	// One point per interval, a regression over the window of points.
+	static constexpr uint64_t	INTERVAL_US	= 500000;
+	static constexpr size_t		WINDOW		= 240;
+	static constexpr size_t		MIN_POINTS	= 20;
+
+	void		fit();
+
+	struct Point {
+		// Seconds and frames relative to the first point.
+		double	time;
+		double	frames;
+	};
+
+	double		m_nominal_rate;
+	double		m_rate;
+	bool		m_valid			= false;
+	bool		m_started		= false;
+	uint64_t	m_origin_time	= 0;
+	uint64_t	m_origin_frames	= 0;
+	uint64_t	m_interval_end	= 0;
+	uint64_t	m_last_time		= 0;
+	// Earliest point of the current interval relative to the nominal rate. The USB completions
+	// and the thread scheduling only delay the time stamps, thus the earliest point is the least disturbed.
+	bool		m_has_best		= false;
+	Point		m_best;
+	double		m_best_delay	= 0;
+	std::deque<Point>	m_points;
+};
+
+// Windowed sinc fractional resampler of interleaved int16_t I/Q with a slowly varying ratio.
+// The filter coefficients of a fractional position are interpolated between PHASES precomputed phases,
+// the inner loops run over planar float buffers for the compiler to vectorize them.
+class FractionalResampler
+{
+public:
+	static constexpr int	TAPS	= 32;
+	static constexpr int	PHASES	= 256;
+
+	FractionalResampler();
+
+	void		reset();
+	// Input frames consumed per output frame, that is input rate / output rate.
+	void		set_ratio(double ratio) { m_step = ratio; }
+	double		ratio() const { return m_step; }
+
+	// Resample frames of interleaved I/Q, replacing the content of out. Returns the number of output frames.
+	size_t		process(const int16_t *in, size_t frames, std::vector<int16_t> &out);
+
+private:
+	// (PHASES + 1) * TAPS coefficients, the extra phase simplifies the interpolation.
+	std::vector<float>	m_filter;
+	// Planar input, the last TAPS frames of the previous block followed by the new block.
+	std::vector<float>	m_i;
+	std::vector<float>	m_q;
+	std::vector<float>	m_coefs;
+	// Position of the next output frame in m_i / m_q, in input frames.
+	double				m_pos	= TAPS / 2 - 1;
+	double				m_step	= 1.;
+};
@@ -0,0 +1,449 @@
+#include "skimmer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "fft.h"
+
+// Spectra a peak has to stand out in, about 30 ms.
+static constexpr uint8_t	PEAK_SPECTRA		= 3;
+// Smoothing of the power per bin over the spectra.
+static constexpr float		POWER_SMOOTHING		= 0.3f;
+// Bins of the noise floor estimate, the median of the smoothed power over each segment. The median of the smoothed
+// power is about 0.88 of its mean.
+static constexpr size_t		NOISE_SEGMENT		= 64;
+static constexpr float		NOISE_MEDIAN_TO_MEAN	= 1.f / 0.88f;
+// A decoder is not allocated to a peak this close to another decoder.
+static constexpr float		GUARD_HZ			= 150.f;
+// Bins around DC not searched, the LO leaks there, and the edges of the band in the anti-aliasing roll-off.
+static constexpr size_t		DC_BINS				= 3;
+static constexpr double		BAND_EDGE			= 0.9;
+// Envelope peak tracker: attack and release per millisecond.
+static constexpr float		PEAK_ATTACK			= 0.2f;
+static constexpr float		PEAK_RELEASE		= 0.0005f;
+// Key down and up thresholds around the geometric mean of the peak and the noise.
+static constexpr float		KEY_HYSTERESIS		= 1.5f;
+// Dit length bounds, 60 to 8 WPM. Marks shorter than MIN_MARK_MS are glitches, longer than MAX_MARK_MS a carrier.
+static constexpr float		MIN_DIT_MS			= 20.f;
+static constexpr float		MAX_DIT_MS			= 150.f;
+static constexpr float		MIN_MARK_MS			= 8.f;
+static constexpr float		MAX_MARK_MS			= 1000.f;
+// Marks shorter than this part of a dit are glitches, spaces shorter are dropouts within a mark.
+static constexpr float		GLITCH_DITS			= 0.3f;
+static constexpr size_t		MAX_ELEMENTS		= 7;
+static constexpr size_t		MAX_WORD			= 24;
+
+static const struct { const char *code; char c; } MORSE[] = {
+	{ ".-", 'A' }, { "-...", 'B' }, { "-.-.", 'C' }, { "-..", 'D' }, { ".", 'E' }, { "..-.", 'F' }, { "--.", 'G' },
+	{ "....", 'H' }, { "..", 'I' }, { ".---", 'J' }, { "-.-", 'K' }, { ".-..", 'L' }, { "--", 'M' }, { "-.", 'N' },
+	{ "---", 'O' }, { ".--.", 'P' }, { "--.-", 'Q' }, { ".-.", 'R' }, { "...", 'S' }, { "-", 'T' }, { "..-", 'U' },
+	{ "...-", 'V' }, { ".--", 'W' }, { "-..-", 'X' }, { "-.--", 'Y' }, { "--..", 'Z' },
+	{ "-----", '0' }, { ".----", '1' }, { "..---", '2' }, { "...--", '3' }, { "....-", '4' },
+	{ ".....", '5' }, { "-....", '6' }, { "--...", '7' }, { "---..", '8' }, { "----.", '9' },
+	{ "-..-.", '/' }, { "..--..", '?' }, { ".-.-.-", '.' }, { "--..--", ',' }, { "-...-", '=' },
+};
+
+bool CwSkimmer::start(size_t max_signals, double sample_rate, double min_snr_db)
+{
+	stop();
+	if (max_signals == 0 || sample_rate <= 0.)
+		return false;
+	m_sample_rate = sample_rate;
+	m_min_snr     = float(pow(10., min_snr_db / 10.));
+	m_max_signals = std::min(MAX_SIGNALS, (max_signals + LANES - 1) / LANES * LANES);
+	m_dump_ms     = float(DUMP_FRAMES * 1000. / sample_rate);
+
+	m_queue.assign(QUEUE_BLOCKS * BLOCK_FRAMES * 2, 0);
+	m_head  = 0;
+	m_tail  = 0;
+	m_spots.clear();
+	m_stats = SkimmerStats();
+
+	m_block.assign(BLOCK_FRAMES * 2, 0.f);
+	m_frames.assign(FFT_SIZE, 0.f);
+	m_window.resize(FFT_SIZE);
+	double window_power = 0;
+	for (size_t i = 0; i < FFT_SIZE; ++ i) {
+		m_window[i] = float(0.5 - 0.5 * cos(2. * M_PI * i / FFT_SIZE));
+		window_power += double(m_window[i]) * m_window[i];
+	}
+	// White noise of variance s per frame: s * window_power in a bin, s * DUMP_FRAMES * COHERENT_DUMPS in an envelope.
+	m_noise_scale = float(DUMP_FRAMES * COHERENT_DUMPS / window_power);
+	m_twiddles.resize(FFT_SIZE / 2);
+	fft_twiddles(m_twiddles.data(), FFT_SIZE, false);
+	m_fft.resize(FFT_SIZE);
+	m_power.assign(FFT_SIZE, 0.f);
+	m_sorted.resize(NOISE_SEGMENT);
+	m_hits.assign(FFT_SIZE, 0);
+	m_batches.assign(m_max_signals / LANES, Batch());
+	m_keyers.assign(m_max_signals, Keyer());
+	m_signals    = 0;
+	m_dump_phase = 0;
+	reset_signals();
+
+	m_stop.store(false);
+	m_retune.store(false);
+	m_thread = std::thread(&CwSkimmer::worker_thread, this);
+	return true;
+}
+
+void CwSkimmer::stop()
+{
+	if (! m_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop.store(true);
+	}
+	m_cv.notify_all();
+	m_thread.join();
+}
+
+void CwSkimmer::push_block(const int16_t *iq, size_t frames, uint64_t sample_index)
+{
+	if (frames != BLOCK_FRAMES || ! running())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_head - m_tail == QUEUE_BLOCKS) {
+			++ m_stats.blocks_dropped;
+			return;
+		}
+		memcpy(m_queue.data() + (m_head % QUEUE_BLOCKS) * BLOCK_FRAMES * 2, iq, BLOCK_FRAMES * 2 * sizeof(int16_t));
+		m_queue_index[m_head % QUEUE_BLOCKS] = sample_index;
+		++ m_head;
+	}
+	m_cv.notify_one();
+}
+
+void CwSkimmer::poll(std::vector<CwSpot> &spots)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_spots.empty())
+		return;
+	std::move(m_spots.begin(), m_spots.end(), std::back_inserter(spots));
+	m_spots.clear();
+}
+
+SkimmerStats CwSkimmer::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void CwSkimmer::worker_thread()
+{
+	std::vector<int16_t> block(BLOCK_FRAMES * 2);
+	for (;;) {
+		uint64_t sample_index;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this] { return m_stop.load() || m_head != m_tail; });
+			if (m_stop.load())
+				return;
+			memcpy(block.data(), m_queue.data() + (m_tail % QUEUE_BLOCKS) * BLOCK_FRAMES * 2, BLOCK_FRAMES * 2 * sizeof(int16_t));
+			sample_index = m_queue_index[m_tail % QUEUE_BLOCKS];
+			++ m_tail;
+		}
+		const auto start = std::chrono::steady_clock::now();
+		process_block(block.data(), sample_index);
+		const uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++ m_stats.blocks;
+		m_stats.process_ns_total += ns;
+		m_stats.process_ns_max    = std::max(m_stats.process_ns_max, ns);
+		m_stats.decode_ns_total  += m_block_decode_ns;
+		m_stats.signal_blocks    += m_block_signals;
+		m_stats.signals           = uint32_t(m_signals);
+		m_stats.signals_max       = std::max(m_stats.signals_max, uint32_t(m_signals));
+		m_stats.signals_refused  += m_block_refused;
+		m_stats.spots            += m_new_spots.size();
+		std::move(m_new_spots.begin(), m_new_spots.end(), std::back_inserter(m_spots));
+		m_new_spots.clear();
+		m_block_refused = 0;
+	}
+}
+
+void CwSkimmer::process_block(const int16_t *iq, uint64_t sample_index)
+{
+	if (m_retune.exchange(false, std::memory_order_relaxed))
+		reset_signals();
+	for (size_t i = 0; i < BLOCK_FRAMES * 2; ++ i)
+		m_block[i] = float(iq[i]);
+	update_spectrum(m_block.data());
+	m_block_signals = m_signals;
+	const auto start = std::chrono::steady_clock::now();
+	decode(m_block.data(), sample_index);
+	m_block_decode_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+void CwSkimmer::reset_signals()
+{
+	for (size_t s = 0; s < m_max_signals; ++ s)
+		release(s);
+	std::fill(m_power.begin(), m_power.end(), 0.f);
+	std::fill(m_hits.begin(), m_hits.end(), 0);
+}
+
+void CwSkimmer::update_spectrum(const float *x)
+{
+	// The last FFT_SIZE frames, overlapping the previous spectrum by half.
+	std::move(m_frames.begin() + BLOCK_FRAMES, m_frames.end(), m_frames.begin());
+	for (size_t i = 0; i < BLOCK_FRAMES; ++ i)
+		m_frames[FFT_SIZE - BLOCK_FRAMES + i] = std::complex<float>(x[i * 2], x[i * 2 + 1]);
+	for (size_t i = 0; i < FFT_SIZE; ++ i)
+		m_fft[i] = m_frames[i] * m_window[i];
+	fft_bit_reverse(m_fft.data(), FFT_SIZE);
+	fft_radix2(m_fft.data(), FFT_SIZE, m_twiddles.data());
+	for (size_t k = 0; k < FFT_SIZE; ++ k)
+		m_power[k] += POWER_SMOOTHING * (std::norm(m_fft[k]) - m_power[k]);
+
+	float noise[FFT_SIZE / NOISE_SEGMENT];
+	for (size_t s = 0; s < FFT_SIZE / NOISE_SEGMENT; ++ s) {
+		std::copy(m_power.begin() + ptrdiff_t(s * NOISE_SEGMENT), m_power.begin() + ptrdiff_t((s + 1) * NOISE_SEGMENT), m_sorted.begin());
+		std::nth_element(m_sorted.begin(), m_sorted.begin() + NOISE_SEGMENT / 2, m_sorted.end());
+		noise[s] = m_sorted[NOISE_SEGMENT / 2] * NOISE_MEDIAN_TO_MEAN;
+	}
+	for (size_t s = 0; s < m_max_signals; ++ s)
+		if (m_batches[s / LANES].active & (1u << (s % LANES)))
+			m_keyers[s].noise = noise[m_keyers[s].bin / NOISE_SEGMENT] * m_noise_scale;
+
+	// Peaks: local maxima over the guard, over the noise by the minimum SNR, for PEAK_SPECTRA spectra in a row.
+	const size_t mask  = FFT_SIZE - 1;
+	const size_t guard = size_t(std::ceil(GUARD_HZ * FFT_SIZE / m_sample_rate));
+	const size_t edge  = size_t(BAND_EDGE * FFT_SIZE / 2);
+	for (size_t k = 0; k < FFT_SIZE; ++ k) {
+		const ptrdiff_t bin = k < FFT_SIZE / 2 ? ptrdiff_t(k) : ptrdiff_t(k) - ptrdiff_t(FFT_SIZE);
+		const float     p   = m_power[k];
+		bool peak = size_t(std::abs(bin)) >= DC_BINS && size_t(std::abs(bin)) <= edge && p > noise[k / NOISE_SEGMENT] * m_min_snr;
+		for (size_t d = 1; peak && d <= guard; ++ d)
+			peak = p >= m_power[(k - d) & mask] && p > m_power[(k + d) & mask];
+		if (! peak) {
+			m_hits[k] = 0;
+			continue;
+		}
+		if (++ m_hits[k] < PEAK_SPECTRA)
+			continue;
+		m_hits[k] = 0;
+		// Parabolic interpolation of the peak over the neighbouring bins, on the log scale.
+		const float l   = std::log(m_power[(k - 1) & mask] + 1e-20f);
+		const float c   = std::log(p);
+		const float r   = std::log(m_power[(k + 1) & mask] + 1e-20f);
+		const float den = l - 2.f * c + r;
+		const float offset_hz = float((double(bin) + (den < 0.f ? 0.5f * (l - r) / den : 0.f)) * m_sample_rate / FFT_SIZE);
+		bool taken = false;
+		for (size_t s = 0; ! taken && s < m_max_signals; ++ s)
+			taken = (m_batches[s / LANES].active & (1u << (s % LANES))) && std::fabs(m_keyers[s].offset_hz - offset_hz) < GUARD_HZ;
+		if (! taken && ! allocate(offset_hz, noise[k / NOISE_SEGMENT] * m_noise_scale))
+			++ m_block_refused;
+	}
+}
+
+bool CwSkimmer::allocate(float offset_hz, float noise)
+{
+	for (size_t s = 0; s < m_max_signals; ++ s) {
+		Batch &batch = m_batches[s / LANES];
+		const size_t lane = s % LANES;
+		if (batch.active & (1u << lane))
+			continue;
+		// Mixed down by exp(-2 pi j f n / fs).
+		const double w = -2. * M_PI * offset_hz / m_sample_rate;
+		batch.active      |= 1u << lane;
+		batch.nco_re[lane] = 1.f;
+		batch.nco_im[lane] = 0.f;
+		batch.rot_re[lane] = float(cos(w));
+		batch.rot_im[lane] = float(sin(w));
+		batch.acc_re[lane] = 0.f;
+		batch.acc_im[lane] = 0.f;
+		Keyer &keyer    = m_keyers[s];
+		keyer           = Keyer();
+		keyer.offset_hz = offset_hz;
+		keyer.noise     = noise;
+		keyer.bin       = size_t(std::lround(offset_hz * FFT_SIZE / m_sample_rate)) & (FFT_SIZE - 1);
+		++ m_signals;
+		return true;
+	}
+	return false;
+}
+
+void CwSkimmer::release(size_t signal)
+{
+	Batch &batch = m_batches[signal / LANES];
+	const size_t lane = signal % LANES;
+	if (batch.active & (1u << lane))
+		-- m_signals;
+	// An idle lane of an active batch keeps being mixed, at zero.
+	batch.active      &= ~(1u << lane);
+	batch.nco_re[lane] = 0.f;
+	batch.nco_im[lane] = 0.f;
+	batch.rot_re[lane] = 1.f;
+	batch.rot_im[lane] = 0.f;
+	batch.acc_re[lane] = 0.f;
+	batch.acc_im[lane] = 0.f;
+}
+
+void CwSkimmer::decode(const float *x, uint64_t sample_index)
+{
+	for (size_t n = 0; n < BLOCK_FRAMES; ) {
+		const size_t len = std::min(BLOCK_FRAMES - n, DUMP_FRAMES - m_dump_phase);
+		for (Batch &batch : m_batches) {
+			if (batch.active == 0)
+				continue;
+			// In locals, which the compiler keeps in vector registers, the frame broadcast to all the lanes.
+			float nco_re[LANES], nco_im[LANES], rot_re[LANES], rot_im[LANES], acc_re[LANES], acc_im[LANES];
+			memcpy(nco_re, batch.nco_re, sizeof(nco_re));
+			memcpy(nco_im, batch.nco_im, sizeof(nco_im));
+			memcpy(rot_re, batch.rot_re, sizeof(rot_re));
+			memcpy(rot_im, batch.rot_im, sizeof(rot_im));
+			memcpy(acc_re, batch.acc_re, sizeof(acc_re));
+			memcpy(acc_im, batch.acc_im, sizeof(acc_im));
+			const float *src = x + n * 2;
+			for (size_t i = 0; i < len; ++ i) {
+				const float re = src[i * 2], im = src[i * 2 + 1];
+				for (size_t l = 0; l < LANES; ++ l) {
+					acc_re[l] += re * nco_re[l] - im * nco_im[l];
+					acc_im[l] += re * nco_im[l] + im * nco_re[l];
+					const float t = nco_re[l] * rot_re[l] - nco_im[l] * rot_im[l];
+					nco_im[l] = nco_re[l] * rot_im[l] + nco_im[l] * rot_re[l];
+					nco_re[l] = t;
+				}
+			}
+			memcpy(batch.nco_re, nco_re, sizeof(nco_re));
+			memcpy(batch.nco_im, nco_im, sizeof(nco_im));
+			memcpy(batch.acc_re, acc_re, sizeof(acc_re));
+			memcpy(batch.acc_im, acc_im, sizeof(acc_im));
+		}
+		n            += len;
+		m_dump_phase += len;
+		if (m_dump_phase < DUMP_FRAMES)
+			continue;
+		m_dump_phase = 0;
+		for (size_t b = 0; b < m_batches.size(); ++ b) {
+			Batch &batch = m_batches[b];
+			for (size_t l = 0; l < LANES; ++ l) {
+				// key() may release the lane.
+				if (batch.active & (1u << l))
+					key(b * LANES + l, std::complex<float>(batch.acc_re[l], batch.acc_im[l]), sample_index + n);
+				batch.acc_re[l] = 0.f;
+				batch.acc_im[l] = 0.f;
+			}
+		}
+	}
+	// The rounding errors of the rotations accumulate, renormalize the NCOs.
+	for (Batch &batch : m_batches)
+		for (size_t l = 0; l < LANES; ++ l)
+			if (batch.active & (1u << l)) {
+				const float mag = std::sqrt(batch.nco_re[l] * batch.nco_re[l] + batch.nco_im[l] * batch.nco_im[l]);
+				batch.nco_re[l] /= mag;
+				batch.nco_im[l] /= mag;
+			}
+}
+
+void CwSkimmer::key(size_t signal, std::complex<float> dump, uint64_t sample_index)
+{
+	Keyer &keyer = m_keyers[signal];
+	keyer.dumps[keyer.dump_count ++ % COHERENT_DUMPS] = dump;
+	if (keyer.dump_count < COHERENT_DUMPS)
+		return;
+	std::complex<float> sum = 0.f;
+	for (const std::complex<float> &d : keyer.dumps)
+		sum += d;
+	const float env = std::norm(sum);
+	keyer.peak += (env > keyer.peak ? PEAK_ATTACK : PEAK_RELEASE) * m_dump_ms * (env - keyer.peak);
+
+	// Keyed between the marks and the noise, once the marks stand out of it.
+	const float threshold = std::sqrt(keyer.peak * keyer.noise);
+	const bool  key = keyer.peak > keyer.noise * m_min_snr &&
+		env > (keyer.key ? threshold / KEY_HYSTERESIS : threshold * KEY_HYSTERESIS);
+	if (key == keyer.key) {
+		keyer.run_ms += m_dump_ms;
+		if (key) {
+			if (keyer.run_ms > MAX_MARK_MS) {
+				// Tuning or a carrier.
+				keyer.elements.clear();
+				keyer.word.clear();
+			}
+			return;
+		}
+		keyer.idle_ms += m_dump_ms;
+		if (keyer.mark_ms > 0.f && keyer.run_ms > GLITCH_DITS * keyer.dit_ms) {
+			mark(keyer, keyer.mark_ms);
+			keyer.mark_ms = 0.f;
+		}
+		// The gaps end the character and the word on time, not with the next mark.
+		if (! keyer.elements.empty() && keyer.run_ms > 2.f * keyer.dit_ms)
+			end_char(keyer);
+		if (! keyer.word.empty() && keyer.run_ms > 5.f * keyer.dit_ms)
+			end_word(keyer, sample_index);
+		if (keyer.idle_ms >= float(IDLE_MS))
+			release(signal);
+		return;
+	}
+	if (keyer.key) {
+		// Held until the space is long enough not to be a dropout.
+		keyer.mark_ms = keyer.run_ms;
+		keyer.run_ms  = m_dump_ms;
+	} else {
+		// After a dropout, the mark goes on.
+		keyer.idle_ms = 0.f;
+		keyer.run_ms  = keyer.mark_ms > 0.f ? keyer.mark_ms + keyer.run_ms + m_dump_ms : m_dump_ms;
+		keyer.mark_ms = 0.f;
+	}
+	keyer.key = key;
+}
+
+void CwSkimmer::mark(Keyer &keyer, float ms)
+{
+	if (ms < std::max(MIN_MARK_MS, GLITCH_DITS * keyer.dit_ms) || ms > MAX_MARK_MS)
+		return;
+	// Two clusters, the dah at two to four dits.
+	const bool dah = ms > (keyer.dit_ms + keyer.dah_ms) * 0.5f;
+	if (dah) {
+		keyer.dah_ms += 0.25f * (ms - keyer.dah_ms);
+		keyer.dit_ms  = std::min(keyer.dit_ms, keyer.dah_ms * 0.5f);
+	} else {
+		keyer.dit_ms += 0.25f * (ms - keyer.dit_ms);
+		keyer.dah_ms  = std::max(keyer.dah_ms, keyer.dit_ms * 2.f);
+	}
+	keyer.dit_ms = std::max(MIN_DIT_MS, std::min(MAX_DIT_MS, keyer.dit_ms));
+	keyer.dah_ms = std::max(keyer.dit_ms * 2.f, std::min(keyer.dit_ms * 4.f, keyer.dah_ms));
+	// Too long for a character, not decoded.
+	if (keyer.elements.size() <= MAX_ELEMENTS)
+		keyer.elements += dah ? '-' : '.';
+}
+
+void CwSkimmer::end_char(Keyer &keyer)
+{
+	for (const auto &m : MORSE)
+		if (keyer.elements == m.code) {
+			keyer.word += m.c;
+			break;
+		}
+	// Characters running together: the dits are shorter than estimated, faster than the two clusters adapt
+	// from the start of a fast signal.
+	if (keyer.elements.size() > MAX_ELEMENTS) {
+		keyer.dit_ms = std::max(MIN_DIT_MS, keyer.dit_ms * 0.7f);
+		keyer.dah_ms = keyer.dit_ms * 3.f;
+	}
+	keyer.elements.clear();
+	if (keyer.word.size() >= MAX_WORD)
+		keyer.word.clear();
+}
+
+void CwSkimmer::end_word(Keyer &keyer, uint64_t sample_index)
+{
+	// Single characters are mostly noise.
+	if (keyer.word.size() >= 2) {
+		CwSpot spot;
+		spot.offset_hz    = keyer.offset_hz;
+		spot.wpm          = uint8_t(std::lround(1200.f / keyer.dit_ms));
+		spot.snr_db       = int8_t(std::max(-128.f, std::min(127.f, std::round(10.f * std::log10(keyer.peak / keyer.noise)))));
+		spot.sample_index = sample_index;
+		spot.text         = std::move(keyer.word);
+		m_new_spots.emplace_back(std::move(spot));
+	}
+	keyer.word.clear();
+}
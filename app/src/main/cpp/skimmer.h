@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <complex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// CW skimmer: decodes all the CW signals of the band on the server and reports the decoded words as spots,
+// so that a client only interested in the spots needs no IQ stream, see CatCommandID::SkimmerSubscribe.
+//
+// The streaming thread copies the blocks into a bounded queue and never waits, a block not fitting is dropped.
+// The skimmer thread runs a FFT_SIZE point spectrum every block, and allocates a decoder to every peak standing
+// out of the noise for a few spectra, up to the configured number of signals. A decoder mixes its signal down
+// by an NCO, integrates it over DUMP_FRAMES and keys on the envelope of the last COHERENT_DUMPS integrals,
+// about 125 Hz wide, against the noise floor of the spectrum around it. The mixers run in batches of LANES
+// decoders laid out as arrays of each variable, so that the compiler vectorizes a batch, thus the cost
+// of a signal is a fixed number of operations per frame.
+// The keying is timed by a two cluster estimate of the dit and the dah lengths, from 8 to 60 WPM.
+// A decoder silent for IDLE_MS is released.
+
+struct CwSpot
+{
+	// Off the LO, Hz.
+	float		offset_hz		= 0.f;
+	uint8_t		wpm				= 0;
+	int8_t		snr_db			= 0;
+	// Input frame the word ended at.
+	uint64_t	sample_index	= 0;
+	// A decoded word.
+	std::string	text;
+};
+
+struct SkimmerStats
+{
+	uint64_t	blocks				= 0;
+	// Dropped by the streaming thread because the queue was full.
+	uint64_t	blocks_dropped		= 0;
+	uint64_t	spots				= 0;
+	// Decoders active now and at most, peaks not decoded because all the decoders were busy.
+	uint32_t	signals				= 0;
+	uint32_t	signals_max			= 0;
+	uint64_t	signals_refused		= 0;
+	// Time of processing a block, all of it and the decoders only, and the active decoders summed over the blocks:
+	// decode_ns_total / signal_blocks is the cost of a signal per block.
+	uint64_t	process_ns_total	= 0;
+	uint64_t	process_ns_max		= 0;
+	uint64_t	decode_ns_total		= 0;
+	uint64_t	signal_blocks		= 0;
+};
+
+class CwSkimmer
+{
+public:
+	static constexpr size_t		BLOCK_FRAMES	= 512;
+	static constexpr size_t		FFT_SIZE		= 1024;
+	static constexpr size_t		LANES			= 8;
+	static constexpr size_t		MAX_SIGNALS		= 64;
+	// 1 ms at 48 kHz, the keying resolution.
+	static constexpr size_t		DUMP_FRAMES		= 48;
+	static constexpr size_t		COHERENT_DUMPS	= 8;
+	// About 0.7 seconds of blocks.
+	static constexpr size_t		QUEUE_BLOCKS	= 64;
+	static constexpr uint32_t	IDLE_MS			= 10000;
+
+	CwSkimmer() = default;
+	~CwSkimmer() { stop(); }
+
+	// max_signals: decoders running at once, rounded up to LANES, at most MAX_SIGNALS.
+	// min_snr_db: a peak over the noise by less is not decoded.
+	bool		start(size_t max_signals, double sample_rate, double min_snr_db = 10.);
+	void		stop();
+	bool		running() const { return m_thread.joinable(); }
+
+	// Streaming thread only. Blocks of other than BLOCK_FRAMES frames are ignored.
+	void		push_block(const int16_t *iq, size_t frames, uint64_t sample_index);
+	// The LO moved and all the signals with it, the decoders are released.
+	void		retune() { m_retune.store(true, std::memory_order_relaxed); }
+	// Non-blocking. Appends the spots decoded meanwhile.
+	void		poll(std::vector<CwSpot> &spots);
+
+	SkimmerStats stats() const;
+
+private:
+	// Mixers of a batch of decoders.
+	struct alignas(32) Batch {
+		float		nco_re[LANES];
+		float		nco_im[LANES];
+		float		rot_re[LANES];
+		float		rot_im[LANES];
+		float		acc_re[LANES];
+		float		acc_im[LANES];
+		// Bit mask of the active lanes.
+		uint32_t	active;
+	};
+	// Keying state of a decoder, run at the dump rate.
+	struct Keyer {
+		float		offset_hz		= 0.f;
+		// Spectrum bin of the signal.
+		size_t		bin				= 0;
+		std::complex<float> dumps[COHERENT_DUMPS];
+		uint32_t	dump_count		= 0;
+		// Envelope power of the marks, tracked fast up and slowly down, and of the noise in the decoder bandwidth.
+		float		peak			= 0.f;
+		float		noise			= 0.f;
+		bool		key				= false;
+		// Length of the current mark or space, and since the last mark.
+		float		run_ms			= 0.f;
+		float		idle_ms			= 0.f;
+		// Mark ended by a space too short yet to tell it from a dropout, zero if none.
+		float		mark_ms			= 0.f;
+		// Two cluster estimate of the mark lengths, 20 WPM to start with.
+		float		dit_ms			= 60.f;
+		float		dah_ms			= 180.f;
+		std::string	elements;
+		std::string	word;
+	};
+
+	void		worker_thread();
+	void		process_block(const int16_t *iq, uint64_t sample_index);
+	void		reset_signals();
+	void		update_spectrum(const float *x);
+	// noise: of the envelope, see Keyer.
+	bool		allocate(float offset_hz, float noise);
+	void		release(size_t signal);
+	void		decode(const float *x, uint64_t sample_index);
+	// A dump of a decoder, the keying runs on it.
+	void		key(size_t signal, std::complex<float> dump, uint64_t sample_index);
+	void		mark(Keyer &keyer, float ms);
+	void		end_char(Keyer &keyer);
+	void		end_word(Keyer &keyer, uint64_t sample_index);
+
+	double					m_sample_rate		= 48000.;
+	// Power ratio.
+	float					m_min_snr			= 10.f;
+	size_t					m_max_signals		= 0;
+	float					m_dump_ms			= 1.f;
+	// Noise power of a spectrum bin to the noise power of the envelope of a decoder.
+	float					m_noise_scale		= 1.f;
+
+	std::thread				m_thread;
+	std::atomic<bool>		m_stop { false };
+	std::atomic<bool>		m_retune { false };
+
+	// Queue of QUEUE_BLOCKS blocks, m_head and m_tail count the blocks pushed and popped.
+	mutable std::mutex		m_mutex;
+	std::condition_variable	m_cv;
+	std::vector<int16_t>	m_queue;
+	uint64_t				m_queue_index[QUEUE_BLOCKS] = { 0 };
+	uint64_t				m_head				= 0;
+	uint64_t				m_tail				= 0;
+	std::vector<CwSpot>		m_spots;
+	SkimmerStats			m_stats;
+
+	// Skimmer thread state.
+	std::vector<float>		m_block;
+	// The last FFT_SIZE frames, the window, the transform and the smoothed power per bin, DC at bin 0.
+	std::vector<std::complex<float>>	m_frames;
+	std::vector<float>		m_window;
+	std::vector<std::complex<float>>	m_twiddles;
+	std::vector<std::complex<float>>	m_fft;
+	std::vector<float>		m_power;
+	std::vector<float>		m_sorted;
+	// Spectra a bin was a peak in a row.
+	std::vector<uint8_t>	m_hits;
+	std::vector<Batch>		m_batches;
+	std::vector<Keyer>		m_keyers;
+	size_t					m_signals			= 0;
+	// Frames integrated into the current dumps.
+	size_t					m_dump_phase		= 0;
+	// Results of the last block, for the statistics.
+	std::vector<CwSpot>		m_new_spots;
+	uint64_t				m_block_decode_ns	= 0;
+	size_t					m_block_signals		= 0;
+	uint64_t				m_block_refused		= 0;
+};
@@ -0,0 +1,243 @@
+#include "slab_allocator.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+// Block sizes, without the block header.
+static constexpr size_t g_class_sizes[] = {
+	32,		// fragment bitmaps
+	64,		// ENetPacket without data, short CAT packets
+	96,		// ENetOutgoingCommand, ENetIncomingCommand, ENetAcknowledgement
+	128,	// CAT packets
+	256,
+	512,
+	1024,
+	2112,	// ENetPacket with a 2048 bytes IQ block
+	4160,	// ENetPacket with up to 4096 bytes of data
+};
+static constexpr size_t NUM_CLASSES = sizeof(g_class_sizes) / sizeof(g_class_sizes[0]);
+static constexpr uint32_t LARGE_CLASS = NUM_CLASSES;
+// Each refill carves at least this many bytes from the heap.
+static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+struct SlabHeap;
+
+// Counters of a size class of a heap, read by slab_stats() of any thread. A free is counted on the heap
+// the block was allocated from, by whichever thread frees it, thus frees and in_use are updated atomically.
+// The rest is written by the owner thread only, by plain relaxed loads and stores.
+struct HeapClassCounters
+{
+	std::atomic<uint64_t>	allocations		{ 0 };
+	std::atomic<uint64_t>	frees			{ 0 };
+	std::atomic<int64_t>	in_use			{ 0 };
+	std::atomic<int64_t>	peak_in_use		{ 0 };
+	std::atomic<uint64_t>	blocks_reserved	{ 0 };
+};
+
+template<typename T>
+static void add(std::atomic<T> &counter, T value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Precedes every block, keeps the user data 16 bytes aligned.
+struct alignas(16) BlockHeader
+{
+	// Heap the block was carved for, or allocated by for the malloc() fall through.
+	SlabHeap	*heap;
+	uint32_t	size_class;
+};
+
+struct FreeBlock
+{
+	FreeBlock  *next;
+};
+
+// Blocks of a thread. A block always returns to the heap it was carved for: freed by another thread,
+// it is pushed to the remote list of its heap, which the owner takes over whole once its own list runs out.
+// Thus blocks passed from thread to thread, like the packets of the shards, do not pile up at the freeing thread
+// while the allocating one keeps carving new chunks. A heap outlives its thread, as other threads may still
+// hold its blocks, and is adopted by the next thread started.
+struct SlabHeap
+{
+	FreeBlock				*free_lists[NUM_CLASSES] = { nullptr };
+	// Lock-free stack of the blocks freed by other threads: pushed by them, taken whole by the owner.
+	std::atomic<FreeBlock*>	 remote_frees[NUM_CLASSES];
+	HeapClassCounters		 counters[NUM_CLASSES + 1];
+	// All the heaps, under g_heaps_mutex.
+	SlabHeap				*next	= nullptr;
+	bool					 owned	= false;
+
+	SlabHeap()
+	{
+		for (size_t i = 0; i < NUM_CLASSES; ++ i)
+			remote_frees[i].store(nullptr, std::memory_order_relaxed);
+	}
+
+	bool refill(uint32_t size_class)
+	{
+		free_lists[size_class] = remote_frees[size_class].exchange(nullptr, std::memory_order_acquire);
+		if (free_lists[size_class] != nullptr)
+			return true;
+		const size_t block_size = sizeof(BlockHeader) + g_class_sizes[size_class];
+		size_t num_blocks = CHUNK_SIZE / block_size;
+		if (num_blocks < 8)
+			num_blocks = 8;
+		char *chunk = static_cast<char*>(std::malloc(num_blocks * block_size));
+		if (chunk == nullptr)
+			return false;
+		for (size_t i = 0; i < num_blocks; ++ i) {
+			BlockHeader *header = reinterpret_cast<BlockHeader*>(chunk + i * block_size);
+			header->heap       = this;
+			header->size_class = size_class;
+			FreeBlock *block = reinterpret_cast<FreeBlock*>(header + 1);
+			block->next = free_lists[size_class];
+			free_lists[size_class] = block;
+		}
+		add<uint64_t>(counters[size_class].blocks_reserved, num_blocks);
+		return true;
+	}
+};
+
+static std::mutex	g_heaps_mutex;
+static SlabHeap	   *g_heaps = nullptr;
+
+static SlabHeap* acquire_heap()
+{
+	std::lock_guard<std::mutex> lock(g_heaps_mutex);
+	for (SlabHeap *heap = g_heaps; heap != nullptr; heap = heap->next)
+		if (! heap->owned) {
+			heap->owned = true;
+			return heap;
+		}
+	SlabHeap *heap = new SlabHeap;
+	heap->owned = true;
+	heap->next  = g_heaps;
+	g_heaps     = heap;
+	return heap;
+}
+
+static thread_local SlabHeap *t_heap = nullptr;
+
+// Hands the heap of an exiting thread over to the next thread.
+struct HeapRelease
+{
+	~HeapRelease()
+	{
+		if (t_heap == nullptr)
+			return;
+		std::lock_guard<std::mutex> lock(g_heaps_mutex);
+		t_heap->owned = false;
+		t_heap = nullptr;
+	}
+};
+static thread_local HeapRelease t_heap_release;
+
+static SlabHeap& this_heap()
+{
+	if (t_heap == nullptr) {
+		// The first use registers the release at the thread exit.
+		static_cast<void>(&t_heap_release);
+		t_heap = acquire_heap();
+	}
+	return *t_heap;
+}
+
+static uint32_t size_class_of(size_t size)
+{
+	for (uint32_t i = 0; i < NUM_CLASSES; ++ i)
+		if (size <= g_class_sizes[i])
+			return i;
+	return LARGE_CLASS;
+}
+
+static void count_allocation(HeapClassCounters &counters)
+{
+	add<uint64_t>(counters.allocations, 1);
+	const int64_t in_use = counters.in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (in_use > counters.peak_in_use.load(std::memory_order_relaxed))
+		counters.peak_in_use.store(in_use, std::memory_order_relaxed);
+}
+
+void* slab_malloc(size_t size)
+{
+	SlabHeap &heap = this_heap();
+	const uint32_t size_class = size_class_of(size);
+	BlockHeader *header;
+	if (size_class == LARGE_CLASS) {
+		header = static_cast<BlockHeader*>(std::malloc(sizeof(BlockHeader) + size));
+		if (header == nullptr)
+			return nullptr;
+		header->heap       = &heap;
+		header->size_class = LARGE_CLASS;
+	} else {
+		if (heap.free_lists[size_class] == nullptr && ! heap.refill(size_class))
+			return nullptr;
+		FreeBlock *block = heap.free_lists[size_class];
+		heap.free_lists[size_class] = block->next;
+		header = reinterpret_cast<BlockHeader*>(block) - 1;
+	}
+	count_allocation(heap.counters[size_class]);
+	return header + 1;
+}
+
+void slab_free(void *ptr)
+{
+	if (ptr == nullptr)
+		return;
+	SlabHeap &heap = this_heap();
+	BlockHeader *header = static_cast<BlockHeader*>(ptr) - 1;
+	const uint32_t size_class = header->size_class;
+	// Charged to the heap which counted the allocation, so that its in_use and peak_in_use stay meaningful.
+	HeapClassCounters &counters = header->heap->counters[size_class];
+	counters.frees.fetch_add(1, std::memory_order_relaxed);
+	counters.in_use.fetch_sub(1, std::memory_order_relaxed);
+	FreeBlock *block = static_cast<FreeBlock*>(ptr);
+	if (size_class == LARGE_CLASS) {
+		std::free(header);
+	} else if (header->heap == &heap) {
+		block->next = heap.free_lists[size_class];
+		heap.free_lists[size_class] = block;
+	} else {
+		// Back to the heap of the block. Only pushed to, never popped but whole, thus no ABA problem.
+		std::atomic<FreeBlock*> &remote = header->heap->remote_frees[size_class];
+		block->next = remote.load(std::memory_order_relaxed);
+		while (! remote.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+}
+
+std::vector<SlabClassStats> slab_stats()
+{
+	std::vector<SlabClassStats> stats(NUM_CLASSES + 1);
+	for (size_t i = 0; i < NUM_CLASSES; ++ i)
+		stats[i].block_size = g_class_sizes[i];
+	std::lock_guard<std::mutex> lock(g_heaps_mutex);
+	for (const SlabHeap *heap = g_heaps; heap != nullptr; heap = heap->next)
+		for (size_t i = 0; i <= NUM_CLASSES; ++ i) {
+			const HeapClassCounters &counters = heap->counters[i];
+			stats[i].allocations     += counters.allocations.load(std::memory_order_relaxed);
+			stats[i].frees           += counters.frees.load(std::memory_order_relaxed);
+			stats[i].in_use          += counters.in_use.load(std::memory_order_relaxed);
+			stats[i].peak_in_use     += counters.peak_in_use.load(std::memory_order_relaxed);
+			stats[i].blocks_reserved += counters.blocks_reserved.load(std::memory_order_relaxed);
+		}
+	return stats;
+}
+
+void slab_log_stats()
+{
+	for (const SlabClassStats &stats : slab_stats()) {
+		if (stats.allocations == 0 && stats.frees == 0)
+			continue;
+		if (stats.block_size == 0)
+			printf("slab malloc(): ");
+		else
+			printf("slab %4zu bytes: ", stats.block_size);
+		printf("%llu allocations, %llu frees, %lld in use, peak %lld, %llu blocks reserved\n",
+			(unsigned long long)stats.allocations, (unsigned long long)stats.frees,
+			(long long)stats.in_use, (long long)stats.peak_in_use, (unsigned long long)stats.blocks_reserved);
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Thread local slab allocator plugged into ENet through enet_initialize_with_callbacks().
+// The size classes fit the objects ENet allocates on the streaming path: packets, outgoing
+// and incoming commands, acknowledgements, fragment bitmaps and the IQ block packets.
+// Larger requests fall through to malloc(). A block freed by another thread is returned to the thread
+// which allocated it, see SlabHeap in slab_allocator.cpp.
+
+void*	slab_malloc(size_t size);
+void	slab_free(void *ptr);
+
+struct SlabClassStats
+{
+	// Largest block served by this class, 0 for the malloc() fall through.
+	size_t		block_size		= 0;
+	uint64_t	allocations		= 0;
+	uint64_t	frees			= 0;
+	// Blocks currently allocated.
+	int64_t		in_use			= 0;
+	// Sum of the peaks of the threads, each of the blocks it allocated and not freed yet by any thread.
+	// An upper bound of the peak of the process.
+	int64_t		peak_in_use		= 0;
+	// Blocks carved from the heap, they are never returned to the heap.
+	uint64_t	blocks_reserved	= 0;
+};
+
+// Statistics of all the threads, the exited ones included, one entry per size class followed by
+// the malloc() fall through.
+std::vector<SlabClassStats> slab_stats();
+void slab_log_stats();
@@ -0,0 +1,187 @@
+#include "stream_quality.h"
+#include "fft.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Same as ENET_PEER_PACKET_LOSS_SCALE.
+static constexpr uint64_t PACKET_LOSS_SCALE = 1 << 16;
+
+void StreamQuality::enable(StreamTier lowest_tier, uint32_t tiers)
+{
+	m_enabled    = true;
+	m_tiers      = (tiers & ((2u << uint32_t(lowest_tier)) - 1)) | 1;
+	m_tier       = StreamTier::FullIQ;
+	m_bad_since  = 0;
+	m_good_since = 0;
+}
+
+bool StreamQuality::update(const StreamQualityConfig &config, uint32_t now_ms, uint32_t rtt_ms, uint32_t loss, uint32_t queued_packets)
+{
+	if (! m_enabled)
+		return false;
+	// Zero marks an idle timer.
+	now_ms |= 1;
+	const uint64_t loss_percent_scaled = uint64_t(loss) * 100;
+	const bool bad  = rtt_ms > config.rtt_degrade_ms || loss_percent_scaled > config.loss_degrade_percent * PACKET_LOSS_SCALE ||
+		queued_packets > config.queue_degrade_packets;
+	const bool good = rtt_ms < config.rtt_recover_ms && loss_percent_scaled < config.loss_recover_percent * PACKET_LOSS_SCALE &&
+		queued_packets < config.queue_recover_packets;
+	m_bad_since  = bad  ? (m_bad_since  ? m_bad_since  : now_ms) : 0;
+	m_good_since = good ? (m_good_since ? m_good_since : now_ms) : 0;
+
+	int next = -1;
+	if (m_bad_since && now_ms - m_bad_since >= config.degrade_hold_ms) {
+		for (int t = int(m_tier) + 1; t < int(StreamTier::Count); ++ t)
+			if (m_tiers & (1u << t)) {
+				next = t;
+				++ m_degrades;
+				break;
+			}
+	} else if (m_good_since && now_ms - m_good_since >= config.recover_hold_ms) {
+		for (int t = int(m_tier) - 1; t >= 0; -- t)
+			if (m_tiers & (1u << t)) {
+				next = t;
+				++ m_recovers;
+				break;
+			}
+	}
+	if (next == -1)
+		return false;
+	m_tier = StreamTier(next);
+	// Each step needs a full hold period of its own.
+	m_bad_since  = 0;
+	m_good_since = 0;
+	return true;
+}
+
+StreamTierEncoder::StreamTierEncoder()
+{
+	// Windowed sinc low pass, 5 kHz cut off at 48 kHz, below the 6 kHz Nyquist of the decimated stream.
+	const int    num_taps = 48;
+	const double fc       = 5000. / 48000.;
+	m_taps.resize(num_taps);
+	double sum = 0;
+	for (int i = 0; i < num_taps; ++ i) {
+		const double x      = i - (num_taps - 1) * 0.5;
+		const double sinc   = x == 0 ? 2. * fc : sin(2. * M_PI * fc * x) / (M_PI * x);
+		const double window = 0.42 - 0.5 * cos(2. * M_PI * i / (num_taps - 1)) + 0.08 * cos(4. * M_PI * i / (num_taps - 1));
+		m_taps[i] = float(sinc * window);
+		sum += m_taps[i];
+	}
+	for (float &t : m_taps)
+		t = float(t / sum);
+	m_history.assign((num_taps - 1) * 2, 0.f);
+
+	m_window.resize(FFT_SIZE);
+	for (size_t i = 0; i < FFT_SIZE; ++ i)
+		m_window[i] = float(0.5 - 0.5 * cos(2. * M_PI * i / FFT_SIZE));
+	m_twiddles.resize(FFT_SIZE / 2);
+	fft_twiddles(m_twiddles.data(), FFT_SIZE, false);
+	m_fft.resize(FFT_SIZE);
+}
+
+void StreamTierEncoder::encode(StreamTier tier, const int16_t *iq, size_t frames, uint64_t sample_index,
+	uint64_t next_sample_index, std::vector<uint8_t> &out)
+{
+	out.clear();
+	switch (tier) {
+	case StreamTier::ReducedIQ:		encode_reduced(iq, frames, out); break;
+	case StreamTier::DecimatedIQ:
+		// No peer was in the tier for the last blocks, the history would be filtered into the first output frames.
+		if (sample_index != m_next_sample_index) {
+			std::fill(m_history.begin(), m_history.end(), 0.f);
+			m_phase = 0;
+		}
+		m_next_sample_index = next_sample_index;
+		encode_decimated(iq, frames, out);
+		break;
+	case StreamTier::Spectrum:		encode_spectrum(iq, frames, out); break;
+	default:
+	{
+		StreamTierHeader header { uint8_t(StreamTier::FullIQ), 0, uint16_t(frames) };
+		out.resize(sizeof(header) + frames * 4);
+		memcpy(out.data(), &header, sizeof(header));
+		memcpy(out.data() + sizeof(header), iq, frames * 4);
+		break;
+	}
+	}
+}
+
+void StreamTierEncoder::encode_reduced(const int16_t *iq, size_t frames, std::vector<uint8_t> &out)
+{
+	// Shift by the number of bits the block peak needs above 7 bits plus sign.
+	int peak = 0;
+	for (size_t i = 0; i < frames * 2; ++ i)
+		peak = std::max(peak, std::abs(int(iq[i])));
+	uint8_t shift = 0;
+	while ((peak >> shift) > 127)
+		++ shift;
+	StreamTierHeader header { uint8_t(StreamTier::ReducedIQ), shift, uint16_t(frames) };
+	out.resize(sizeof(header) + frames * 2);
+	memcpy(out.data(), &header, sizeof(header));
+	int8_t *dst = reinterpret_cast<int8_t*>(out.data() + sizeof(header));
+	const int round = shift ? 1 << (shift - 1) : 0;
+	for (size_t i = 0; i < frames * 2; ++ i)
+		dst[i] = int8_t(std::max(-128, std::min(127, (int(iq[i]) + round) >> shift)));
+}
+
+void StreamTierEncoder::encode_decimated(const int16_t *iq, size_t frames, std::vector<uint8_t> &out)
+{
+	const size_t num_taps = m_taps.size();
+	const size_t hist     = num_taps - 1;
+	// History followed by the new block, interleaved I/Q.
+	std::vector<float> &x = m_history;
+	x.resize((hist + frames) * 2);
+	for (size_t i = 0; i < frames * 2; ++ i)
+		x[hist * 2 + i] = float(iq[i]);
+
+	const size_t out_frames = m_phase < frames ? (frames - m_phase + DECIMATION - 1) / DECIMATION : 0;
+	StreamTierHeader header { uint8_t(StreamTier::DecimatedIQ), uint8_t(DECIMATION), uint16_t(out_frames) };
+	out.resize(sizeof(header) + out_frames * 4);
+	memcpy(out.data(), &header, sizeof(header));
+	int16_t *dst = reinterpret_cast<int16_t*>(out.data() + sizeof(header));
+	size_t p = m_phase;
+	for (size_t n = 0; n < out_frames; ++ n, p += DECIMATION) {
+		// Output aligned with input frame p, convolving the frames p - num_taps + 1 .. p.
+		const float *src = x.data() + p * 2;
+		float acc_i = 0.f, acc_q = 0.f;
+		for (size_t k = 0; k < num_taps; ++ k) {
+			acc_i += m_taps[k] * src[k * 2];
+			acc_q += m_taps[k] * src[k * 2 + 1];
+		}
+		dst[n * 2]     = int16_t(std::max(-32768.f, std::min(32767.f, std::round(acc_i))));
+		dst[n * 2 + 1] = int16_t(std::max(-32768.f, std::min(32767.f, std::round(acc_q))));
+	}
+	m_phase = p - frames;
+	// Keep the last hist frames for the next block.
+	memmove(x.data(), x.data() + frames * 2, hist * 2 * sizeof(float));
+	x.resize(hist * 2);
+}
+
+void StreamTierEncoder::encode_spectrum(const int16_t *iq, size_t frames, std::vector<uint8_t> &out)
+{
+	const size_t n = std::min(frames, FFT_SIZE);
+	for (size_t i = 0; i < FFT_SIZE; ++ i)
+		m_fft[i] = i < n ? std::complex<float>(iq[i * 2], iq[i * 2 + 1]) * m_window[i] : 0.f;
+
+	fft_bit_reverse(m_fft.data(), FFT_SIZE);
+	fft_radix2(m_fft.data(), FFT_SIZE, m_twiddles.data());
+
+	StreamTierHeader header { uint8_t(StreamTier::Spectrum), 0, uint16_t(SPECTRUM_BINS) };
+	out.resize(sizeof(header) + SPECTRUM_BINS);
+	memcpy(out.data(), &header, sizeof(header));
+	uint8_t *dst = out.data() + sizeof(header);
+	// A full scale complex tone through the Hann window peaks at 32768 * FFT_SIZE / 2.
+	const float  full_scale = 32768.f * FFT_SIZE / 2;
+	const float  norm       = 1.f / (full_scale * full_scale);
+	const size_t merge      = FFT_SIZE / SPECTRUM_BINS;
+	for (size_t b = 0; b < SPECTRUM_BINS; ++ b) {
+		float power = 0.f;
+		for (size_t k = 0; k < merge; ++ k)
+			power += std::norm(m_fft[(b * merge + k + FFT_SIZE / 2) % FFT_SIZE]);
+		const float db = 10.f * std::log10(power * norm / merge + 1e-20f);
+		dst[b] = uint8_t(std::max(0.f, std::min(255.f, 255.f + std::round(db * 2.f))));
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Config.h"
+
+// Per peer adaptive stream quality. A client opting in by CatCommandID::StreamQuality receives
+// the stream in one of the tiers below, each channel 0 packet prefixed by StreamTierHeader.
+// The server steps the peer through the tiers based on its round trip time, packet loss
+// and send queue depth, so that a marginal link degrades gracefully instead of backing up.
+enum class StreamTier : uint8_t {
+	// 48 kHz int16_t I/Q.
+	FullIQ,
+	// 48 kHz int8_t I/Q, block floating point: sample = int8_t << header.param.
+	ReducedIQ,
+	// 12 kHz int16_t I/Q, low pass filtered and decimated by DECIMATION.
+	DecimatedIQ,
+	// uint8_t power spectrum of the block, DC in the middle, 0.5 dB per step, 255 is 0 dBFS.
+	Spectrum,
+	Count
+};
+
+#pragma pack(push, 1)
+struct StreamTierHeader
+{
+	// StreamTier
+	uint8_t		tier;
+	// ReducedIQ: left shift restoring the 16-bit scale. DecimatedIQ: decimation factor.
+	uint8_t		param;
+	// Number of IQ frames or spectrum bins following the header.
+	uint16_t	count;
+};
+#pragma pack(pop)
+
+// Tier of a single peer, stepped one tier at a time with hysteresis.
+class StreamQuality
+{
+public:
+	// lowest_tier: the lowest quality accepted by the client. The enabled tiers are intersected with config.tiers.
+	void		enable(StreamTier lowest_tier, uint32_t tiers);
+	void		disable() { m_enabled = false; m_tier = StreamTier::FullIQ; }
+	bool		enabled() const { return m_enabled; }
+	StreamTier	tier() const { return m_tier; }
+
+	// Feed the link signals, returns true if the tier changed.
+	// loss is a ratio to ENET_PEER_PACKET_LOSS_SCALE.
+	bool		update(const StreamQualityConfig &config, uint32_t now_ms, uint32_t rtt_ms, uint32_t loss, uint32_t queued_packets);
+
+	uint32_t	degrades() const { return m_degrades; }
+	uint32_t	recovers() const { return m_recovers; }
+
+private:
+	bool		m_enabled		= false;
+	StreamTier	m_tier			= StreamTier::FullIQ;
+	// Bit mask of (1 << StreamTier) usable for this peer.
+	uint32_t	m_tiers			= 1;
+	// Time the signals first went bad or good, zero if not.
+	uint32_t	m_bad_since		= 0;
+	uint32_t	m_good_since	= 0;
+	uint32_t	m_degrades		= 0;
+	uint32_t	m_recovers		= 0;
+};
+
+// Encodes an IQ block into the reduced tiers. One encoded packet is shared by all the peers of a tier,
+// the decimation filter state is carried over the consecutive blocks.
+class StreamTierEncoder
+{
+public:
+	static constexpr int	DECIMATION		= 4;
+	static constexpr size_t	FFT_SIZE		= 512;
+	static constexpr size_t	SPECTRUM_BINS	= 128;
+
+	StreamTierEncoder();
+
+	// Encode frames of interleaved int16_t I/Q into out, header included. sample_index and next_sample_index: native
+	// stream index of the block's first frame and of the frame following the block. The decimator restarts from
+	// silence if the block does not follow the block it decimated last.
+	void	encode(StreamTier tier, const int16_t *iq, size_t frames, uint64_t sample_index, uint64_t next_sample_index,
+				std::vector<uint8_t> &out);
+
+private:
+	void	encode_reduced(const int16_t *iq, size_t frames, std::vector<uint8_t> &out);
+	void	encode_decimated(const int16_t *iq, size_t frames, std::vector<uint8_t> &out);
+	void	encode_spectrum(const int16_t *iq, size_t frames, std::vector<uint8_t> &out);
+
+	// Low pass FIR of the decimator and the last taps - 1 input frames.
+	std::vector<float>	m_taps;
+	std::vector<float>	m_history;
+	// Phase of the decimator relative to the start of the next block.
+	size_t				m_phase		= 0;
+	// Native stream index of the block expected to be decimated next.
+	uint64_t			m_next_sample_index	= 0;
+
+	std::vector<float>					m_window;
+	std::vector<std::complex<float>>	m_twiddles;
+	std::vector<std::complex<float>>	m_fft;
+};
@@ -0,0 +1,320 @@
+#include "time_shift.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Poll period of the reader thread, the streaming thread never signals it.
+static constexpr auto READER_POLL_PERIOD = std::chrono::milliseconds(5);
+
+static uint64_t steady_us()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+bool TimeShift::start(const TimeShiftConfig &config)
+{
+	stop();
+	if (config.block_frames == 0 || config.ram_blocks == 0 || config.nominal_rate <= 0)
+		return false;
+	m_config        = config;
+	m_block_samples = config.block_frames * 2;
+	m_block_us      = uint64_t(double(config.block_frames) * 1e6 / config.nominal_rate);
+	m_ram.assign(config.ram_blocks * m_block_samples, 0);
+	m_ram_tags.reset(new std::atomic<uint64_t>[config.ram_blocks]);
+	for (size_t i = 0; i < config.ram_blocks; ++ i)
+		m_ram_tags[i].store(0);
+	m_head.store(0);
+
+	m_file       = nullptr;
+	m_file_bytes = 0;
+	m_file_tags.clear();
+	m_spilled    = 0;
+	m_file_oldest.store(0);
+	if (! config.path.empty() && config.file_blocks > 0) {
+		const size_t bytes = config.file_blocks * m_block_samples * sizeof(int16_t);
+		int fd = open(config.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd >= 0) {
+			// Unlinked right away, the history does not outlive the mapping.
+			unlink(config.path.c_str());
+			// Allocated up front, a sparse file would fault with SIGBUS once the storage fills up.
+			int err = posix_fallocate(fd, 0, off_t(bytes));
+			if (err == 0) {
+				void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (map != MAP_FAILED) {
+					m_file       = static_cast<int16_t*>(map);
+					m_file_bytes = bytes;
+					m_file_tags.assign(config.file_blocks, 0);
+				} else
+					err = errno;
+			}
+			close(fd);
+			if (m_file == nullptr)
+				printf("Time-shift file %s of %zu bytes: %s\n", config.path.c_str(), bytes, strerror(err));
+		} else
+			printf("Time-shift file %s: %s\n", config.path.c_str(), strerror(errno));
+		if (m_file == nullptr)
+			printf("Time-shift history limited to RAM\n");
+	}
+
+	m_sessions.clear();
+	m_free.clear();
+	m_blocks_pushed.store(0);
+	m_push_ns_max.store(0);
+	m_push_ns_total.store(0);
+	m_blocks_spilled.store(0);
+	m_spill_overruns.store(0);
+	m_blocks_served.store(0);
+	m_sessions_opened.store(0);
+	m_stop.store(false);
+	m_thread = std::thread(&TimeShift::reader_thread, this);
+	const size_t blocks = m_file != nullptr ? config.file_blocks : config.ram_blocks;
+	printf("Time-shift history of %.1f s\n", double(blocks * config.block_frames) / config.nominal_rate);
+	return true;
+}
+
+void TimeShift::stop()
+{
+	if (! m_thread.joinable())
+		return;
+	m_stop.store(true, std::memory_order_release);
+	m_cv.notify_all();
+	m_thread.join();
+	if (m_file != nullptr) {
+		munmap(m_file, m_file_bytes);
+		m_file = nullptr;
+	}
+	m_file_tags.clear();
+	m_sessions.clear();
+	m_free.clear();
+	m_ram.clear();
+	m_ram_tags.reset();
+}
+
+void TimeShift::push_block(const int16_t *iq, uint64_t sample_index)
+{
+	if (! running())
+		return;
+	const auto t0 = std::chrono::steady_clock::now();
+	const uint64_t block = sample_index / m_config.block_frames;
+	const size_t   slot  = size_t(block % m_config.ram_blocks);
+	// Sequence lock: a reader copying the slot meanwhile sees the tag changed and discards its copy.
+	std::atomic<uint64_t> &tag = m_ram_tags[slot];
+	tag.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&m_ram[slot * m_block_samples], iq, m_block_samples * sizeof(int16_t));
+	tag.store(block + 1, std::memory_order_release);
+	m_head.store(block + 1, std::memory_order_release);
+	// Single producer, a plain load and store is enough.
+	m_blocks_pushed.store(m_blocks_pushed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	const uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+	m_push_ns_total.store(m_push_ns_total.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	if (ns > m_push_ns_max.load(std::memory_order_relaxed))
+		m_push_ns_max.store(ns, std::memory_order_relaxed);
+}
+
+uint64_t TimeShift::oldest_block() const
+{
+	const uint64_t head       = head_block();
+	const uint64_t ram_oldest = head > m_config.ram_blocks ? head - m_config.ram_blocks : 0;
+	return m_file != nullptr ? std::min(ram_oldest, m_file_oldest.load(std::memory_order_acquire)) : ram_oldest;
+}
+
+uint64_t TimeShift::open_session(uint32_t session, uint64_t first_block, uint32_t speed)
+{
+	const uint64_t block = std::min(std::max(first_block, oldest_block()), head_block());
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Session &s   = m_sessions[session];
+		s.generation = ++ m_generation;
+		s.next_block = block;
+		s.speed      = std::max<uint32_t>(1, std::min(speed, MAX_SPEED));
+		s.due_us     = steady_us();
+		s.caught_up  = false;
+		s.in_flight  = 0;
+		for (Session::Ready &ready : s.ready)
+			m_free.emplace_back(std::move(ready.iq));
+		s.ready.clear();
+	}
+	m_sessions_opened.fetch_add(1, std::memory_order_relaxed);
+	m_cv.notify_all();
+	return block;
+}
+
+void TimeShift::close_session(uint32_t session)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_sessions.find(session);
+	if (it == m_sessions.end())
+		return;
+	for (Session::Ready &ready : it->second.ready)
+		m_free.emplace_back(std::move(ready.iq));
+	m_sessions.erase(it);
+}
+
+bool TimeShift::take_block(uint32_t session, std::vector<int16_t> &iq, uint64_t &block)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_sessions.find(session);
+	if (it == m_sessions.end() || it->second.ready.empty())
+		return false;
+	Session::Ready &ready = it->second.ready.front();
+	block = ready.block;
+	iq.swap(ready.iq);
+	// The buffer swapped out is reused for a later read.
+	if (ready.iq.size() == m_block_samples)
+		m_free.emplace_back(std::move(ready.iq));
+	it->second.ready.pop_front();
+	return true;
+}
+
+bool TimeShift::caught_up(uint32_t session, uint64_t &next_block)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_sessions.find(session);
+	if (it == m_sessions.end())
+		return false;
+	const Session &s = it->second;
+	next_block = s.next_block;
+	return s.caught_up && s.ready.empty() && s.in_flight == 0;
+}
+
+TimeShiftStats TimeShift::stats() const
+{
+	TimeShiftStats stats;
+	stats.blocks_pushed  = m_blocks_pushed.load();
+	stats.blocks_spilled = m_blocks_spilled.load();
+	stats.spill_overruns = m_spill_overruns.load();
+	stats.blocks_served  = m_blocks_served.load();
+	stats.sessions       = m_sessions_opened.load();
+	stats.push_ns_max    = m_push_ns_max.load();
+	stats.push_ns_total  = m_push_ns_total.load();
+	return stats;
+}
+
+bool TimeShift::read_ram(uint64_t block, int16_t *dst) const
+{
+	const uint64_t head = head_block();
+	if (block >= head || head - block > m_config.ram_blocks)
+		return false;
+	const size_t slot = size_t(block % m_config.ram_blocks);
+	const uint64_t tag = m_ram_tags[slot].load(std::memory_order_acquire);
+	if (tag != block + 1)
+		return false;
+	memcpy(dst, &m_ram[slot * m_block_samples], m_block_samples * sizeof(int16_t));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return m_ram_tags[slot].load(std::memory_order_relaxed) == tag;
+}
+
+// Reader thread only, the file is not shared.
+bool TimeShift::read_block(uint64_t block, int16_t *dst) const
+{
+	if (read_ram(block, dst))
+		return true;
+	if (m_file == nullptr)
+		return false;
+	const size_t slot = size_t(block % m_config.file_blocks);
+	if (m_file_tags[slot] != block + 1)
+		return false;
+	memcpy(dst, m_file + slot * m_block_samples, m_block_samples * sizeof(int16_t));
+	return true;
+}
+
+// Copy the blocks pushed since the last pass from the RAM ring to the file.
+void TimeShift::spill()
+{
+	if (m_file == nullptr)
+		return;
+	const uint64_t head = head_block();
+	if (head - m_spilled > m_config.ram_blocks) {
+		m_spill_overruns.fetch_add(head - m_config.ram_blocks - m_spilled, std::memory_order_relaxed);
+		m_spilled = head - m_config.ram_blocks;
+	}
+	for (; m_spilled < head; ++ m_spilled) {
+		const size_t slot = size_t(m_spilled % m_config.file_blocks);
+		m_file_tags[slot] = 0;
+		if (read_ram(m_spilled, m_file + slot * m_block_samples)) {
+			m_file_tags[slot] = m_spilled + 1;
+			m_blocks_spilled.fetch_add(1, std::memory_order_relaxed);
+		} else
+			m_spill_overruns.fetch_add(1, std::memory_order_relaxed);
+	}
+	m_file_oldest.store(m_spilled > m_config.file_blocks ? m_spilled - m_config.file_blocks : 0, std::memory_order_release);
+}
+
+// Read the blocks due for the sessions. The reads are planned and handed over under the lock,
+// the copying itself, possibly faulting in the pages of the file, runs without it.
+void TimeShift::serve(uint64_t now_us)
+{
+	struct Read {
+		uint32_t				session;
+		uint64_t				generation;
+		uint64_t				block;
+		std::vector<int16_t>	iq;
+	};
+	std::vector<Read> reads;
+	const uint64_t head   = head_block();
+	const uint64_t oldest = oldest_block();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto &[id, s] : m_sessions) {
+			if (s.caught_up)
+				continue;
+			const uint64_t period = std::max<uint64_t>(1, m_block_us / s.speed);
+			// A session held up by its peer does not burst more than the read ahead afterwards.
+			if (now_us > s.due_us + period * READ_AHEAD)
+				s.due_us = now_us - period * READ_AHEAD;
+			// A session slower than the history skips the blocks already overwritten.
+			s.next_block = std::max(s.next_block, oldest);
+			while (s.ready.size() + s.in_flight < READ_AHEAD && s.due_us <= now_us && s.next_block < head) {
+				std::vector<int16_t> iq;
+				if (! m_free.empty()) {
+					iq = std::move(m_free.back());
+					m_free.pop_back();
+				}
+				iq.resize(m_block_samples);
+				reads.push_back({ id, s.generation, s.next_block ++, std::move(iq) });
+				++ s.in_flight;
+				s.due_us += period;
+			}
+			s.caught_up = s.next_block >= head;
+		}
+	}
+	if (reads.empty())
+		return;
+	std::vector<bool> valid(reads.size());
+	for (size_t i = 0; i < reads.size(); ++ i)
+		valid[i] = read_block(reads[i].block, reads[i].iq.data());
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < reads.size(); ++ i) {
+		Read &read = reads[i];
+		auto it = m_sessions.find(read.session);
+		if (it != m_sessions.end() && it->second.generation != read.generation)
+			it = m_sessions.end();
+		if (it != m_sessions.end())
+			-- it->second.in_flight;
+		// A block missing from the history, overwritten or never spilled, is skipped.
+		if (it == m_sessions.end() || ! valid[i]) {
+			m_free.emplace_back(std::move(read.iq));
+			continue;
+		}
+		it->second.ready.push_back({ read.block, std::move(read.iq) });
+		m_blocks_served.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void TimeShift::reader_thread()
+{
+	while (! m_stop.load(std::memory_order_acquire)) {
+		spill();
+		serve(steady_us());
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait_for(lock, READER_POLL_PERIOD);
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Time-shift: history of the IQ stream reaching minutes back, for the clients to seek into and replay.
+// The streaming thread copies each block into a RAM ring and never waits. A reader thread spills the RAM ring
+// into a memory-mapped file holding the long history and reads the blocks of the playback sessions from both,
+// thus the page faults and the storage I/O stay off the streaming thread.
+//
+// Blocks are numbered by sample_index / block_frames, the numbering of the live stream.
+
+struct TimeShiftConfig
+{
+	// History file, created and unlinked on start. Empty: the history is limited to the RAM ring.
+	std::string	path;
+	size_t		block_frames		= 512;
+	size_t		ram_blocks			= 1024;
+	size_t		file_blocks			= 0;
+	double		nominal_rate		= 48000.;
+};
+
+struct TimeShiftStats
+{
+	uint64_t	blocks_pushed		= 0;
+	uint64_t	blocks_spilled		= 0;
+	// Blocks overwritten in the RAM ring before the reader spilled them to the file.
+	uint64_t	spill_overruns		= 0;
+	uint64_t	blocks_served		= 0;
+	uint64_t	sessions			= 0;
+	// Time spent by the streaming thread in push_block().
+	uint64_t	push_ns_max			= 0;
+	uint64_t	push_ns_total		= 0;
+};
+
+class TimeShift
+{
+public:
+	static constexpr uint32_t	MAX_SPEED		= 8;
+	// Blocks read ahead for a single session.
+	static constexpr size_t		READ_AHEAD		= 8;
+
+	TimeShift() = default;
+	~TimeShift() { stop(); }
+
+	bool		start(const TimeShiftConfig &config);
+	void		stop();
+	bool		running() const { return m_thread.joinable(); }
+
+	// Streaming thread only. sample_index is the index of the first frame of a block of block_frames.
+	void		push_block(const int16_t *iq, uint64_t sample_index);
+
+	// Range of the blocks available, [oldest_block(), head_block()).
+	uint64_t	head_block() const { return m_head.load(std::memory_order_acquire); }
+	uint64_t	oldest_block() const;
+
+	// Replay from first_block, clamped to the history, at speed times real time. Returns the first block replayed.
+	uint64_t	open_session(uint32_t session, uint64_t first_block, uint32_t speed);
+	void		close_session(uint32_t session);
+	// Take the next block read for the session, swapping its frames into iq. False if no block is ready.
+	bool		take_block(uint32_t session, std::vector<int16_t> &iq, uint64_t &block);
+	// The session read all the blocks up to the live stream and all of them were taken.
+	// next_block: the first block not replayed.
+	bool		caught_up(uint32_t session, uint64_t &next_block);
+
+	TimeShiftStats stats() const;
+
+private:
+	struct Session {
+		// Tells the reads of a reopened session from the stale ones.
+		uint64_t	generation		= 0;
+		// Next block to read.
+		uint64_t	next_block		= 0;
+		uint32_t	speed			= 1;
+		// Monotonic time the next block is due to be read, microseconds.
+		uint64_t	due_us			= 0;
+		bool		caught_up		= false;
+		// Blocks being read without the lock held.
+		size_t		in_flight		= 0;
+		// Read blocks not taken yet.
+		struct Ready {
+			uint64_t				block;
+			std::vector<int16_t>	iq;
+		};
+		std::deque<Ready>	ready;
+	};
+
+	bool		read_ram(uint64_t block, int16_t *dst) const;
+	bool		read_block(uint64_t block, int16_t *dst) const;
+	void		spill();
+	void		serve(uint64_t now_us);
+	void		reader_thread();
+
+	TimeShiftConfig			m_config;
+	size_t					m_block_samples		= 0;
+	uint64_t				m_block_us			= 0;
+	std::thread				m_thread;
+	std::atomic<bool>		m_stop { false };
+
+	// RAM ring of the latest blocks. A slot is tagged by its block + 1 once written, 0 while being written.
+	std::vector<int16_t>	m_ram;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_ram_tags;
+	alignas(64) std::atomic<uint64_t> m_head { 0 };
+
+	// Reader thread: the memory-mapped file of the older blocks, the file slots tagged by block + 1.
+	int16_t				   *m_file				= nullptr;
+	size_t					m_file_bytes		= 0;
+	std::vector<uint64_t>	m_file_tags;
+	// Next block to spill to the file.
+	uint64_t				m_spilled			= 0;
+	// Oldest block in the file, published for oldest_block().
+	std::atomic<uint64_t>	m_file_oldest { 0 };
+
+	mutable std::mutex		m_mutex;
+	std::condition_variable	m_cv;
+	std::map<uint32_t, Session>	m_sessions;
+	uint64_t				m_generation		= 0;
+	// Buffers of the blocks taken, reused for the next reads.
+	std::vector<std::vector<int16_t>> m_free;
+
+	std::atomic<uint64_t>	m_blocks_pushed { 0 };
+	std::atomic<uint64_t>	m_push_ns_max { 0 };
+	std::atomic<uint64_t>	m_push_ns_total { 0 };
+	std::atomic<uint64_t>	m_blocks_spilled { 0 };
+	std::atomic<uint64_t>	m_spill_overruns { 0 };
+	std::atomic<uint64_t>	m_blocks_served { 0 };
+	std::atomic<uint64_t>	m_sessions_opened { 0 };
+};
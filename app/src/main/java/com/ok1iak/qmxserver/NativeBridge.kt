@@ -10,9 +10,49 @@ object NativeBridge {
         vid: Int,
         pid: Int,
         deviceName: String,
-        udpHost: String,
-        udpPort: Int
+        // Comma separated list of local addresses to listen on, empty to listen on all interfaces.
+        bindAddresses: String,
+        port: Int,
+        maxPeers: Int,
+        maxChannels: Int,
+        // Radio settings persisted across restarts, empty to not persist them.
+        configPath: String,
+        // Numeric multicast address for the LAN IQ fan-out, empty to disable it.
+        multicastGroup: String,
+        // Zero: port + 1.
+        multicastPort: Int,
+        // 1 keeps the multicast on the local network.
+        multicastTtl: Int,
+        // Name or local IPv4 address of the interface to send the multicast from, empty for the Wi-Fi one.
+        multicastInterface: String,
+        // Directory to record the IQ stream to, empty to not record.
+        recordDir: String,
+        // File the time-shift history is spilled to, empty to keep it in RAM.
+        timeShiftPath: String,
+        // Length of the time-shift history, zero to disable it.
+        timeShiftMinutes: Int,
+        // Threads servicing the peers, 1 services them on the streaming thread.
+        networkThreads: Int,
+        // Upstream server to relay instead of streaming the radio, empty for the radio.
+        relayServer: String,
+        relayPort: Int,
+        // Abstract Unix socket handing the IQ ring to the apps on the same device, empty to disable it.
+        localSocket: String,
+        // Signals the CW skimmer decodes at once, 0 to disable it.
+        skimmerSignals: Int
     ): Int
 
     external fun stopStreaming()
+
+    // Stop / restart the IQ stream while keeping the USB device claimed and the network clients connected.
+    external fun pauseStreaming()
+
+    external fun resumeStreaming()
+
+    // The radio was unplugged: network clients stay connected while the native side waits for the radio.
+    // Returns when the USB file descriptor may be closed.
+    external fun notifyDeviceDetached(): Boolean
+
+    // The radio was plugged back in and reopened, streaming resumes with the last CAT settings.
+    external fun notifyDeviceAttached(usbFd: Int, deviceName: String)
 }
@@ -12,12 +12,43 @@ import android.hardware.usb.UsbDeviceConnection
 import android.hardware.usb.UsbManager
 import android.os.Build
 import android.os.IBinder
+import android.util.Log
 import androidx.core.app.NotificationCompat
+import java.io.File
+import java.util.concurrent.ExecutorService
+import java.util.concurrent.Executors
 
 class UsbForegroundService : Service() {
 
     companion object {
         const val ACTION_SERVICE_STOPPED = "com.ok1iak.qmxserver.SERVICE_STOPPED"
+        const val ACTION_PAUSE = "com.ok1iak.qmxserver.PAUSE"
+        const val ACTION_RESUME = "com.ok1iak.qmxserver.RESUME"
+        const val EXTRA_BIND_ADDRESSES = "com.ok1iak.qmxserver.BIND_ADDRESSES"
+        const val EXTRA_PORT = "com.ok1iak.qmxserver.PORT"
+        const val EXTRA_MAX_PEERS = "com.ok1iak.qmxserver.MAX_PEERS"
+        const val EXTRA_MAX_CHANNELS = "com.ok1iak.qmxserver.MAX_CHANNELS"
+        const val EXTRA_MULTICAST_GROUP = "com.ok1iak.qmxserver.MULTICAST_GROUP"
+        const val EXTRA_MULTICAST_PORT = "com.ok1iak.qmxserver.MULTICAST_PORT"
+        const val EXTRA_MULTICAST_TTL = "com.ok1iak.qmxserver.MULTICAST_TTL"
+        const val EXTRA_MULTICAST_INTERFACE = "com.ok1iak.qmxserver.MULTICAST_INTERFACE"
+        const val EXTRA_RECORD = "com.ok1iak.qmxserver.RECORD"
+        const val EXTRA_TIME_SHIFT_MINUTES = "com.ok1iak.qmxserver.TIME_SHIFT_MINUTES"
+        const val EXTRA_NETWORK_THREADS = "com.ok1iak.qmxserver.NETWORK_THREADS"
+        // Relay mode: re-broadcast the stream of another server, no radio is needed.
+        const val EXTRA_RELAY_SERVER = "com.ok1iak.qmxserver.RELAY_SERVER"
+        const val EXTRA_RELAY_PORT = "com.ok1iak.qmxserver.RELAY_PORT"
+        // Shared memory IQ ring for the SDR apps on the same device.
+        const val EXTRA_LOCAL_SOCKET = "com.ok1iak.qmxserver.LOCAL_SOCKET"
+        // CW skimmer spots for the band map clients, the number of signals decoded at once.
+        const val EXTRA_SKIMMER_SIGNALS = "com.ok1iak.qmxserver.SKIMMER_SIGNALS"
+
+        const val DEFAULT_PORT = 1234
+        const val DEFAULT_MAX_PEERS = 32
+        const val DEFAULT_MAX_CHANNELS = 2
+        const val CONFIG_FILE_NAME = "qmxserver.cfg"
+        const val RECORDINGS_DIR_NAME = "recordings"
+        const val TIME_SHIFT_FILE_NAME = "timeshift.iq"
     }
 
     private val channelId = "usb_streamer"
@@ -25,22 +56,58 @@ class UsbForegroundService : Service() {
     private var connection: UsbDeviceConnection? = null
     private var currentDevice: UsbDevice? = null
     private var detachReceiverRegistered = false
+    private var relaying = false
+
+    // Radio unplugged while streaming: the native server keeps the network clients connected
+    // and resumes streaming once the same radio is plugged back in.
+    private var radioDetached = false
+    // The native detach notification blocks until the streaming thread released the device, it must not run
+    // on the main thread. Single threaded, so that a reattach is never handled before the detach.
+    private val usbExecutor: ExecutorService = Executors.newSingleThreadExecutor()
 
     private val detachReceiver = object : BroadcastReceiver() {
         override fun onReceive(context: android.content.Context, intent: Intent) {
-            if (intent.action != UsbManager.ACTION_USB_DEVICE_DETACHED) return
-            val detachedDevice = if (Build.VERSION.SDK_INT >= 33) {
+            val device = if (Build.VERSION.SDK_INT >= 33) {
                 intent.getParcelableExtra(UsbManager.EXTRA_DEVICE, UsbDevice::class.java)
             } else {
                 @Suppress("DEPRECATION")
                 intent.getParcelableExtra(UsbManager.EXTRA_DEVICE)
-            }
-            if (detachedDevice != null && detachedDevice == currentDevice) {
-                stopSelf()
+            } ?: return
+            when (intent.action) {
+                UsbManager.ACTION_USB_DEVICE_DETACHED -> if (device == currentDevice && !radioDetached) {
+                    radioDetached = true
+                    val detached = connection
+                    connection = null
+                    usbExecutor.execute {
+                        // Wait for the native side to release the device before closing its file descriptor.
+                        NativeBridge.notifyDeviceDetached()
+                        detached?.close()
+                    }
+                }
+                UsbManager.ACTION_USB_DEVICE_ATTACHED -> if (radioDetached) {
+                    val previous = currentDevice ?: return
+                    if (device.vendorId != previous.vendorId || device.productId != previous.productId) return
+                    reattach(device)
+                }
             }
         }
     }
 
+    private fun reattach(device: UsbDevice) {
+        val usbManager = getSystemService(UsbManager::class.java)
+        if (!usbManager.hasPermission(device)) {
+            Log.w("QMXServer", "No permission to reopen the reattached radio")
+            return
+        }
+        val connection = usbManager.openDevice(device) ?: return
+        this.connection = connection
+        currentDevice = device
+        radioDetached = false
+        val fd = connection.fileDescriptor
+        val deviceName = device.deviceName
+        usbExecutor.execute { NativeBridge.notifyDeviceAttached(fd, deviceName) }
+    }
+
     override fun onCreate() {
         super.onCreate()
         createNotificationChannel()
@@ -53,6 +120,18 @@ class UsbForegroundService : Service() {
     }
 
     override fun onStartCommand(intent: Intent?, flags: Int, startId: Int): Int {
+        // Pause / resume a running session without reopening the device.
+        when (intent?.action) {
+            ACTION_PAUSE -> {
+                if (currentDevice != null || relaying) NativeBridge.pauseStreaming()
+                return START_NOT_STICKY
+            }
+            ACTION_RESUME -> {
+                if (currentDevice != null || relaying) NativeBridge.resumeStreaming()
+                return START_NOT_STICKY
+            }
+        }
+
         val usbManager = getSystemService(UsbManager::class.java)
         val device = if (Build.VERSION.SDK_INT >= 33) {
             intent?.getParcelableExtra(UsbManager.EXTRA_DEVICE, UsbDevice::class.java)
@@ -61,7 +140,22 @@ class UsbForegroundService : Service() {
             intent?.getParcelableExtra(UsbManager.EXTRA_DEVICE)
         }
         if (device == null) {
-            stopSelf()
+            val relayServer = intent?.getStringExtra(EXTRA_RELAY_SERVER) ?: ""
+            if (relayServer.isEmpty()) {
+                stopSelf()
+            } else if (!relaying && connection == null) {
+                relaying = true
+                if (!startNative(intent, -1, 0, 0, "")) stopSelf()
+            }
+            return START_NOT_STICKY
+        }
+        if (relaying) {
+            return START_NOT_STICKY
+        }
+
+        if (radioDetached) {
+            // Reattached radio handed over by the activity, after the user granted the permission.
+            reattach(device)
             return START_NOT_STICKY
         }
 
@@ -72,7 +166,9 @@ class UsbForegroundService : Service() {
         currentDevice = device
 
         if (!detachReceiverRegistered) {
-            val filter = IntentFilter(UsbManager.ACTION_USB_DEVICE_DETACHED)
+            val filter = IntentFilter(UsbManager.ACTION_USB_DEVICE_DETACHED).apply {
+                addAction(UsbManager.ACTION_USB_DEVICE_ATTACHED)
+            }
             if (Build.VERSION.SDK_INT >= 33) {
                 registerReceiver(detachReceiver, filter, Context.RECEIVER_NOT_EXPORTED)
             } else {
@@ -93,10 +189,7 @@ class UsbForegroundService : Service() {
         val vid = device.vendorId
         val pid = device.productId
         val deviceName = device.deviceName
-
-        // TODO: choose your UDP destination
-        val rc = NativeBridge.startStreaming(fd, vid, pid, deviceName, "notused", 9000)
-        if (rc < 0) {
+        if (!startNative(intent, fd, vid, pid, deviceName)) {
             stopSelf()
             return START_NOT_STICKY
         }
@@ -105,11 +198,48 @@ class UsbForegroundService : Service() {
         return START_NOT_STICKY
     }
 
+    private fun startNative(intent: Intent?, fd: Int, vid: Int, pid: Int, deviceName: String): Boolean {
+        // Empty bind address list: listen on all interfaces.
+        val bindAddresses = intent?.getStringExtra(EXTRA_BIND_ADDRESSES) ?: ""
+        val port = intent?.getIntExtra(EXTRA_PORT, DEFAULT_PORT) ?: DEFAULT_PORT
+        val maxPeers = intent?.getIntExtra(EXTRA_MAX_PEERS, DEFAULT_MAX_PEERS) ?: DEFAULT_MAX_PEERS
+        val maxChannels = intent?.getIntExtra(EXTRA_MAX_CHANNELS, DEFAULT_MAX_CHANNELS) ?: DEFAULT_MAX_CHANNELS
+
+        // Empty multicast group: IQ is only streamed over ENet.
+        val multicastGroup = intent?.getStringExtra(EXTRA_MULTICAST_GROUP) ?: ""
+        val multicastPort = intent?.getIntExtra(EXTRA_MULTICAST_PORT, 0) ?: 0
+        val multicastTtl = intent?.getIntExtra(EXTRA_MULTICAST_TTL, 1) ?: 1
+        // Empty: the first bind address if any, else the Wi-Fi interface.
+        val multicastInterface = intent?.getStringExtra(EXTRA_MULTICAST_INTERFACE) ?: ""
+        val configPath = File(filesDir, CONFIG_FILE_NAME).absolutePath
+        // Recordings go to the app specific external storage, readable over USB.
+        val recordDir = if (intent?.getBooleanExtra(EXTRA_RECORD, false) == true)
+            File(getExternalFilesDir(null) ?: filesDir, RECORDINGS_DIR_NAME).apply { mkdirs() }.absolutePath
+        else ""
+        // Zero: no time-shift. The history file is scratch space, it is unlinked once mapped.
+        val timeShiftMinutes = intent?.getIntExtra(EXTRA_TIME_SHIFT_MINUTES, 0) ?: 0
+        val timeShiftPath = File(cacheDir, TIME_SHIFT_FILE_NAME).absolutePath
+        val networkThreads = intent?.getIntExtra(EXTRA_NETWORK_THREADS, 1) ?: 1
+        val relayServer = intent?.getStringExtra(EXTRA_RELAY_SERVER) ?: ""
+        val relayPort = intent?.getIntExtra(EXTRA_RELAY_PORT, DEFAULT_PORT) ?: DEFAULT_PORT
+        val localSocket = intent?.getStringExtra(EXTRA_LOCAL_SOCKET) ?: ""
+        val skimmerSignals = intent?.getIntExtra(EXTRA_SKIMMER_SIGNALS, 0) ?: 0
+
+        val rc = NativeBridge.startStreaming(fd, vid, pid, deviceName, bindAddresses, port, maxPeers, maxChannels, configPath,
+            multicastGroup, multicastPort, multicastTtl, multicastInterface, recordDir, timeShiftPath, timeShiftMinutes,
+            networkThreads, relayServer, relayPort, localSocket, skimmerSignals)
+        return rc >= 0
+    }
+
     override fun onDestroy() {
         NativeBridge.stopStreaming()
+        // A pending detach returns once the native server stopped.
+        usbExecutor.shutdown()
         connection?.close()
         connection = null
         currentDevice = null
+        relaying = false
+        radioDetached = false
         if (detachReceiverRegistered) {
             try {
                 unregisterReceiver(detachReceiver)
@@ -0,0 +1,185 @@
+// ConfigStore round trips, the fields reported as stored, and the ranges of Config::validate().
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "Config.h"
+
+static int g_failures = 0;
+
+#define CHECK(COND) do { if (! (COND)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #COND); ++ g_failures; } } while (0)
+
+static std::string temp_path()
+{
+	return "/tmp/config_store_test." + std::to_string(getpid());
+}
+
+static void test_validate_ranges()
+{
+	const Config defaults;
+	Config config;
+	config.keyer_wpm = 5;
+	config.tx_delay  = 15000;
+	config.tx_hang   = 10000000;
+	config.tx_power  = 0.;
+	config.tx_iq_balance_amplitude_correction = 1.2;
+	config.tx_iq_balance_phase_correction     = -15.;
+	config.validate();
+	CHECK(config.keyer_wpm == 5);
+	CHECK(config.tx_delay == 15000);
+	CHECK(config.tx_hang == 10000000);
+	CHECK(config.tx_power == 0.);
+	CHECK(config.tx_iq_balance_amplitude_correction == 1.2);
+	CHECK(config.tx_iq_balance_phase_correction == -15.);
+
+	config.keyer_wpm  = 46;
+	config.keyer_mode = KeyerMode(3);
+	config.tx_delay   = 15001;
+	config.tx_hang    = -1;
+	config.tx_power   = NAN;
+	config.tx_iq_balance_amplitude_correction = 0.79;
+	config.tx_iq_balance_phase_correction     = 15.5;
+	config.network_server_port = 0;
+	config.validate();
+	CHECK(config.keyer_wpm == defaults.keyer_wpm);
+	CHECK(config.keyer_mode == defaults.keyer_mode);
+	CHECK(config.tx_delay == defaults.tx_delay);
+	CHECK(config.tx_hang == defaults.tx_hang);
+	CHECK(config.tx_power == defaults.tx_power);
+	CHECK(config.tx_iq_balance_amplitude_correction == defaults.tx_iq_balance_amplitude_correction);
+	CHECK(config.tx_iq_balance_phase_correction == defaults.tx_iq_balance_phase_correction);
+	CHECK(config.network_server_port == defaults.network_server_port);
+}
+
+static void test_serialize_exact()
+{
+	Config config;
+	config.tx_iq_balance_amplitude_correction = 0.1 + 0.9;
+	config.tx_iq_balance_phase_correction     = 1. / 3.;
+	config.tx_power                           = 0.1 + 0.2;
+	config.keyer_wpm                          = 33;
+	config.network_server_name                = "relay.example.org";
+	Config copy;
+	copy.deserialize(config.serialize().c_str());
+	CHECK(copy.tx_iq_balance_amplitude_correction == config.tx_iq_balance_amplitude_correction);
+	CHECK(copy.tx_iq_balance_phase_correction == config.tx_iq_balance_phase_correction);
+	CHECK(copy.tx_power == config.tx_power);
+	CHECK(copy.keyer_wpm == 33);
+	CHECK(copy.network_server_name == config.network_server_name);
+}
+
+// A new file holds no settings, neither when created nor when reopened, only the fields stored since.
+static void test_stored_fields()
+{
+	const std::string path = temp_path();
+	unlink(path.c_str());
+	{
+		ConfigStore store;
+		CHECK(! store.stored(ConfigField::KeyerWpm));
+		Config config;
+		CHECK(store.open(path, config));
+		CHECK(! store.stored(ConfigField::KeyerWpm));
+		CHECK(! store.stored(ConfigField::TxPower));
+	}
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		CHECK(! store.stored(ConfigField::KeyerWpm));
+		config.keyer_wpm = 25;
+		config.tx_power  = 1. / 3.;
+		CHECK(store.store(config, ConfigField::KeyerWpm));
+		CHECK(store.store(config, ConfigField::TxPower));
+		CHECK(store.stored(ConfigField::KeyerWpm));
+	}
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		CHECK(store.stored(ConfigField::KeyerWpm));
+		CHECK(store.stored(ConfigField::TxPower));
+		CHECK(! store.stored(ConfigField::KeyerMode));
+		CHECK(! store.stored(ConfigField::AmpEnabled));
+		CHECK(config.keyer_wpm == 25);
+		CHECK(config.tx_power == 1. / 3.);
+		store.close();
+		CHECK(! store.stored(ConfigField::KeyerWpm));
+	}
+	unlink(path.c_str());
+}
+
+// A stored value validate() replaces is loaded as the default and not reported as stored.
+static void test_invalid_value()
+{
+	const std::string path = temp_path();
+	unlink(path.c_str());
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		config.tx_delay = 20000;
+		config.tx_hang  = 1000;
+		CHECK(store.store(config, ConfigField::TxDelay));
+		CHECK(store.store(config, ConfigField::TxHang));
+	}
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		CHECK(config.tx_delay == Config().tx_delay);
+		CHECK(! store.stored(ConfigField::TxDelay));
+		CHECK(config.tx_hang == 1000);
+		CHECK(store.stored(ConfigField::TxHang));
+	}
+	unlink(path.c_str());
+}
+
+// A slot with a bad checksum keeps its default, the other slots load.
+static void test_torn_slot()
+{
+	const std::string path = temp_path();
+	unlink(path.c_str());
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		config.tx_iq_balance_amplitude_correction = 1.1;
+		config.keyer_wpm = 30;
+		CHECK(store.store(config, ConfigField::TxIQBalanceAmplitudeCorrection));
+		CHECK(store.store(config, ConfigField::KeyerWpm));
+	}
+	// The first slot follows the 8 byte header, its payload the 4 byte slot header.
+	if (std::FILE *f = fopen(path.c_str(), "r+b"); f != nullptr) {
+		fseek(f, 8 + 4, SEEK_SET);
+		fputc(0x55, f);
+		fclose(f);
+	}
+	{
+		ConfigStore store;
+		Config config;
+		CHECK(store.open(path, config));
+		CHECK(! store.stored(ConfigField::TxIQBalanceAmplitudeCorrection));
+		CHECK(config.tx_iq_balance_amplitude_correction == Config().tx_iq_balance_amplitude_correction);
+		CHECK(store.stored(ConfigField::KeyerWpm));
+		CHECK(config.keyer_wpm == 30);
+	}
+	unlink(path.c_str());
+}
+
+int main()
+{
+	test_validate_ranges();
+	test_serialize_exact();
+	test_stored_fields();
+	test_invalid_value();
+	test_torn_slot();
+	if (g_failures != 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,176 @@
+// System calls and time per datagram of an ENet server host with the sendmmsg()/recvmmsg() batches and without,
+// over loopback. Every pass the server broadcasts a packet to all the peers and each peer sends a packet back,
+// as the IQ stream and the CAT traffic of the peers do. Only the service of the server host is timed.
+//
+//   enet_batching_bench [peers] [passes] [packet bytes]
+
+#define ENET_IMPLEMENTATION
+#include "enet/enet.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct Result
+{
+	uint64_t	send_calls			= 0;
+	uint64_t	sent				= 0;
+	uint64_t	receive_calls		= 0;
+	uint64_t	received			= 0;
+	double		seconds				= 0.;
+};
+
+// Make the host send and receive with one system call per datagram, before any traffic.
+static void disable_batches(ENetHost *host)
+{
+#if ENET_ENABLE_SENDMMSG
+	enet_socket_batch_destroy(host->sendBatch);
+	enet_socket_batch_destroy(host->receiveBatch);
+	host->sendBatch = nullptr;
+	host->receiveBatch = nullptr;
+#else
+	(void)host;
+#endif
+}
+
+// Receive all the datagrams waiting on the host's socket.
+static void drain(ENetHost *host)
+{
+	ENetEvent event;
+	while (enet_host_service(host, &event, 0) > 0)
+		if (event.type == ENET_EVENT_TYPE_RECEIVE)
+			enet_packet_destroy(event.packet);
+}
+
+static bool run(bool batched, int num_peers, int passes, size_t packet_size, Result &result)
+{
+	using Clock = std::chrono::steady_clock;
+
+	ENetAddress address {};
+	enet_address_set_host_ip_new(&address, "127.0.0.1");
+	address.port = 0;
+	ENetHost *server = enet_host_create(&address, num_peers, 1, 0, 0);
+	if (server == nullptr) {
+		fprintf(stderr, "Failed to create the server host\n");
+		return false;
+	}
+	if (! batched)
+		disable_batches(server);
+
+	std::vector<ENetHost*> clients;
+	std::vector<ENetPeer*> peers;
+	bool ok = true;
+	for (int i = 0; i < num_peers && ok; ++ i) {
+		ENetHost *client = enet_host_create(nullptr, 1, 1, 0, 0);
+		ENetPeer *peer = client ? enet_host_connect(client, &server->address, 1, 0) : nullptr;
+		if (peer == nullptr) {
+			fprintf(stderr, "Failed to create the client host %d\n", i);
+			if (client)
+				enet_host_destroy(client);
+			ok = false;
+			break;
+		}
+		clients.push_back(client);
+		peers.push_back(peer);
+	}
+
+	// Handshake.
+	const auto deadline = Clock::now() + std::chrono::seconds(5);
+	while (ok) {
+		int connected = 0;
+		for (ENetPeer *peer : peers)
+			connected += peer->state == ENET_PEER_STATE_CONNECTED;
+		if (connected == num_peers)
+			break;
+		if (Clock::now() > deadline) {
+			fprintf(stderr, "Only %d of %d peers connected\n", connected, num_peers);
+			ok = false;
+			break;
+		}
+		for (ENetHost *client : clients)
+			drain(client);
+		ENetEvent event;
+		if (enet_host_service(server, &event, 1) > 0 && event.type == ENET_EVENT_TYPE_RECEIVE)
+			enet_packet_destroy(event.packet);
+	}
+
+	if (ok) {
+		std::vector<uint8_t> payload(packet_size, 0x5a);
+		server->totalSendCalls = 0;
+		server->totalReceiveCalls = 0;
+		server->totalSentPackets = 0;
+		server->totalReceivedPackets = 0;
+		Clock::duration elapsed {};
+		for (int pass = 0; pass < passes; ++ pass) {
+			auto start = Clock::now();
+			enet_host_broadcast(server, 0, enet_packet_create(payload.data(), payload.size(), 0));
+			enet_host_flush(server);
+			elapsed += Clock::now() - start;
+
+			for (size_t i = 0; i < clients.size(); ++ i) {
+				enet_peer_send(peers[i], 0, enet_packet_create(payload.data(), payload.size(), 0));
+				enet_host_flush(clients[i]);
+			}
+
+			start = Clock::now();
+			drain(server);
+			elapsed += Clock::now() - start;
+
+			for (ENetHost *client : clients)
+				drain(client);
+		}
+		result.send_calls = server->totalSendCalls;
+		result.sent = server->totalSentPackets;
+		result.receive_calls = server->totalReceiveCalls;
+		result.received = server->totalReceivedPackets;
+		result.seconds = std::chrono::duration<double>(elapsed).count();
+	}
+
+	for (ENetHost *client : clients)
+		enet_host_destroy(client);
+	enet_host_destroy(server);
+	return ok;
+}
+
+static void print(const char *name, const Result &result)
+{
+	const uint64_t datagrams = result.sent + result.received;
+	printf("%-10s %10llu %10llu %9.3f %10llu %10llu %9.3f %9.2f\n", name,
+		(unsigned long long)result.sent, (unsigned long long)result.send_calls,
+		result.sent ? double(result.send_calls) / result.sent : 0.,
+		(unsigned long long)result.received, (unsigned long long)result.receive_calls,
+		result.received ? double(result.receive_calls) / result.received : 0.,
+		datagrams ? result.seconds * 1e6 / datagrams : 0.);
+}
+
+int main(int argc, char **argv)
+{
+	const int num_peers = argc > 1 ? atoi(argv[1]) : 20;
+	const int passes = argc > 2 ? atoi(argv[2]) : 3000;
+	const size_t packet_size = argc > 3 ? size_t(atoi(argv[3])) : 1024;
+	if (num_peers <= 0 || passes <= 0 || packet_size == 0) {
+		fprintf(stderr, "Usage: %s [peers] [passes] [packet bytes]\n", argv[0]);
+		return 1;
+	}
+	if (enet_initialize() != 0) {
+		fprintf(stderr, "Failed to initialize ENet\n");
+		return 1;
+	}
+#if ! ENET_ENABLE_SENDMMSG
+	printf("Built without ENET_ENABLE_SENDMMSG, both runs are unbatched\n");
+#endif
+
+	printf("%d peers, %d passes of %zu byte packets, server host over loopback\n", num_peers, passes, packet_size);
+	printf("%-10s %10s %10s %9s %10s %10s %9s %9s\n", "", "sent", "sendmsg", "calls/dg", "received", "recvmsg",
+		"calls/dg", "us/dg");
+	Result unbatched, batched;
+	const bool ok = run(false, num_peers, passes, packet_size, unbatched) &&
+		run(true, num_peers, passes, packet_size, batched);
+	if (ok) {
+		print("unbatched", unbatched);
+		print("batched", batched);
+	}
+	enet_deinitialize();
+	return ok ? 0 : 1;
+}
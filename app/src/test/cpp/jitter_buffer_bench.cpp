@@ -0,0 +1,95 @@
+// Latency against underruns of IQJitterBuffer over a simulated network: the blocks are sent at the nominal rate
+// and arrive after an exponentially distributed jitter, some of them lost or held back behind the next ones,
+// while the player pops at the nominal rate. Simulated time, thus deterministic and faster than real time.
+//
+//   jitter_buffer_bench [seconds]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "jitter_buffer.h"
+
+struct Scenario
+{
+	const char	*name;
+	double		jitter_ms;
+	// Probability of a block lost, and of a block held back by reorder_blocks block periods.
+	double		loss;
+	double		reorder;
+	int			reorder_blocks;
+	double		jitter_factor;
+};
+
+static const Scenario g_scenarios[] = {
+	{ "jitter 2 ms",                    2., 0.,   0.,   0, 4. },
+	{ "jitter 10 ms, 1% loss",         10., 0.01, 0.,   0, 4. },
+	{ "jitter 10 ms, 2% reordered",    10., 0.,   0.02, 2, 4. },
+	{ "jitter 30 ms",                  30., 0.,   0.,   0, 4. },
+	{ "jitter 30 ms, factor 8",        30., 0.,   0.,   0, 8. },
+	{ "jitter 30 ms, 1% loss, 1% reordered, factor 8", 30., 0.01, 0.01, 3, 8. },
+};
+
+// Frames per block sent and per pop of the player.
+static constexpr size_t	BLOCK_FRAMES	= 1024;
+static constexpr size_t	POP_FRAMES		= 256;
+// One way delay before the jitter.
+static constexpr double	BASE_DELAY_MS	= 5.;
+
+static void run(const Scenario &scenario, double seconds)
+{
+	JitterBufferConfig config;
+	config.jitter_factor = scenario.jitter_factor;
+	IQJitterBuffer buffer;
+	buffer.reset(config);
+
+	// Arrival times of the blocks not lost, in the order they arrive.
+	std::mt19937_64 rng(12345);
+	std::exponential_distribution<double> jitter(1. / scenario.jitter_ms);
+	std::uniform_real_distribution<double> uniform(0., 1.);
+	const double block_us = BLOCK_FRAMES * 1e6 / config.nominal_rate;
+	const size_t num_blocks = size_t(seconds * 1e6 / block_us);
+	std::vector<double> arrivals;
+	for (size_t i = 0; i < num_blocks; ++ i) {
+		if (uniform(rng) < scenario.loss)
+			continue;
+		double arrival = i * block_us + (BASE_DELAY_MS + jitter(rng)) * 1e3;
+		if (uniform(rng) < scenario.reorder)
+			arrival += scenario.reorder_blocks * block_us;
+		arrivals.push_back(arrival);
+	}
+	std::sort(arrivals.begin(), arrivals.end());
+
+	// The player starts with the first block and pops at the nominal rate.
+	std::vector<int16_t> block(BLOCK_FRAMES * 2, 1000), out(POP_FRAMES * 2);
+	const double pop_us = POP_FRAMES * 1e6 / config.nominal_rate;
+	double next_pop = arrivals.empty() ? 0. : arrivals.front();
+	const double end = num_blocks * block_us;
+	for (size_t i = 0; i < arrivals.size() || next_pop < end;) {
+		if (i < arrivals.size() && arrivals[i] <= next_pop) {
+			buffer.push(block.data(), BLOCK_FRAMES, uint64_t(arrivals[i]) + 1);
+			++ i;
+		} else {
+			buffer.pop(out.data(), POP_FRAMES);
+			next_pop += pop_us;
+		}
+	}
+
+	const JitterBufferStats stats = buffer.stats();
+	const double minutes = seconds / 60.;
+	printf("%-48s %8.1f %8.1f %10.1f %10.2f %9.2f\n", scenario.name, stats.mean_delay_ms, stats.jitter_ms,
+		stats.underruns / minutes, stats.frames_played != 0 ? 100. * stats.frames_concealed / stats.frames_played : 0.,
+		stats.frames_received != 0 ? 100. * stats.frames_dropped / stats.frames_received : 0.);
+}
+
+int main(int argc, char **argv)
+{
+	const double seconds = argc > 1 ? atof(argv[1]) : 120.;
+	printf("%.0f s of %zu frame blocks, exponential jitter, %.0f ms base delay\n", seconds, BLOCK_FRAMES, BASE_DELAY_MS);
+	printf("%-48s %8s %8s %10s %10s %9s\n", "scenario", "delay ms", "jitter", "underrun/m", "concealed%", "dropped%");
+	for (const Scenario &scenario : g_scenarios)
+		run(scenario, seconds);
+	return 0;
+}
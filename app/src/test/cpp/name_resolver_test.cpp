@@ -0,0 +1,128 @@
+// NameResolver with a lookup that blocks like a DNS server not answering: the streaming thread must never wait for it.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "name_resolver.h"
+
+using Clock = std::chrono::steady_clock;
+
+static int g_failures = 0;
+
+#define CHECK(COND) do { if (! (COND)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #COND); ++ g_failures; } } while (0)
+
+// Static, a worker detached by stop() may still run it after the test returned.
+static std::atomic<int> g_lookups { 0 };
+
+static NameResolver::Lookup sleeping_lookup(std::chrono::milliseconds delay)
+{
+	return [delay](const std::string &ip, std::string &name) {
+		++ g_lookups;
+		std::this_thread::sleep_for(delay);
+		name = "host-" + ip;
+		return true;
+	};
+}
+
+static double elapsed_ms(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Poll until a result arrives or timeout_ms passes, the longest poll() call goes to poll_ms_max.
+static bool wait_result(NameResolver &resolver, NameResolver::Result &result, double timeout_ms, double &poll_ms_max)
+{
+	const Clock::time_point start = Clock::now();
+	std::vector<NameResolver::Result> results;
+	while (elapsed_ms(start) < timeout_ms) {
+		const Clock::time_point poll_start = Clock::now();
+		resolver.poll(results);
+		poll_ms_max = std::max(poll_ms_max, elapsed_ms(poll_start));
+		if (! results.empty()) {
+			result = results.front();
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	return false;
+}
+
+// request() and poll() return at once while the lookup blocks, the requester gets an empty name at its timeout.
+static void test_never_blocks()
+{
+	NameResolver resolver;
+	resolver.start(sleeping_lookup(std::chrono::milliseconds(1500)), 300);
+	const Clock::time_point start = Clock::now();
+	resolver.request(1, "192.0.2.1");
+	const double request_ms = elapsed_ms(start);
+	double poll_ms_max = 0;
+	NameResolver::Result result;
+	CHECK(wait_result(resolver, result, 1000, poll_ms_max));
+	const double result_ms = elapsed_ms(start);
+	printf("request %.3f ms, poll at most %.3f ms, timed out after %.0f ms\n", request_ms, poll_ms_max, result_ms);
+	CHECK(request_ms < 20);
+	CHECK(poll_ms_max < 20);
+	CHECK(result.token == 1 && result.name.empty());
+	CHECK(result_ms >= 300 && result_ms < 600);
+	CHECK(resolver.stats().timeouts == 1);
+}
+
+// A request for an address still being looked up after the earlier requests timed out waits for that lookup.
+static void test_no_duplicate_lookup()
+{
+	g_lookups = 0;
+	NameResolver resolver;
+	resolver.start(sleeping_lookup(std::chrono::milliseconds(800)), 500);
+	resolver.request(1, "192.0.2.2");
+	double poll_ms_max = 0;
+	NameResolver::Result result;
+	CHECK(wait_result(resolver, result, 700, poll_ms_max));
+	CHECK(result.token == 1 && result.name.empty());
+	resolver.request(2, "192.0.2.2");
+	CHECK(wait_result(resolver, result, 700, poll_ms_max));
+	CHECK(result.token == 2 && result.name == "host-192.0.2.2");
+	CHECK(g_lookups == 1);
+	// Served from the cache.
+	resolver.request(3, "192.0.2.2");
+	CHECK(wait_result(resolver, result, 100, poll_ms_max));
+	CHECK(result.token == 3 && result.name == "host-192.0.2.2");
+	CHECK(g_lookups == 1);
+	CHECK(resolver.stats().cache_hits == 1);
+}
+
+// stop() gives up on a worker blocked in a lookup.
+static void test_stop_bounded()
+{
+	NameResolver resolver;
+	resolver.start(sleeping_lookup(std::chrono::milliseconds(3000)));
+	resolver.request(1, "192.0.2.3");
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	const Clock::time_point start = Clock::now();
+	resolver.stop();
+	const double stop_ms = elapsed_ms(start);
+	printf("stop with a blocked lookup %.0f ms\n", stop_ms);
+	CHECK(stop_ms < 500);
+	CHECK(! resolver.running());
+	// Restartable while the detached worker still runs.
+	CHECK(resolver.start(sleeping_lookup(std::chrono::milliseconds(1))));
+	resolver.request(2, "192.0.2.4");
+	double poll_ms_max = 0;
+	NameResolver::Result result;
+	CHECK(wait_result(resolver, result, 1000, poll_ms_max));
+	CHECK(result.token == 2 && result.name == "host-192.0.2.4");
+}
+
+int main()
+{
+	test_never_blocks();
+	test_no_duplicate_lookup();
+	test_stop_bounded();
+	if (g_failures != 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}